@@ -0,0 +1,337 @@
+#!/usr/bin/python3
+'''
+スタック使用量の最悪値を見積もる
+
+gcc -fstack-usage が出力する .su ファイル（関数ごとのスタック使用量）と cflow によるコールグラフから、
+main と各割り込みハンドラを根とする呼び出し経路のスタック使用量の最大値を求め、
+割り込みの多重化（ネスト）を考慮した合計を表示する。
+
+使い方（各プロジェクトのディレクトリで実行する）:
+  ../calc-stack-amount.py [-v] [-a 注釈ファイル] [--budget バイト数 | --elf ELF ファイル] [--su .su ファイル]... [ソースファイル...]
+
+- ソースファイルを省略するとカレントディレクトリの *.c を使う。ch32fun.c は常に加える。
+- .su ファイルを省略すると /tmp/<ディレクトリ名>.*.su のうち最新のものを使う。
+  （ch32fun.mk は全ソースを 1 回の gcc でビルドするので、.su は /tmp の一時ファイル名で出力される）
+- 見積もりが予算を超えたら終了コード 1 を返す。予算は --budget、--elf、注釈ファイルの budget の順に優先する。
+  --elf を指定すると、ch32fun のリンカスクリプトが定義する _ebss から _eusrstack まで（静的変数の後の RAM）を予算とする。
+
+注釈ファイルは 1 行 1 項目で、# 以降はコメント。
+  calls <呼び出し元> <呼び出し先>...  関数ポインタ経由の呼び出しを追加する（呼び出し先は * などのワイルドカード可）
+  stack <関数> <バイト数>             .su に無い関数（アセンブラやライブラリ）のスタック使用量
+  root <関数>                         根とする関数を追加する（名前が *_IRQHandler, *_Handler の関数は自動で根にする）
+  priority <関数> <優先度>            割り込みハンドラの優先度（NVIC_SetPriority の値。小さいほど優先。既定は 0）
+  nest <段数>                         同時に実行され得る割り込みハンドラの最大数（既定は 2）
+  budget <バイト数>                   スタックに使える RAM のバイト数
+  cpp <オプション>...                 cflow に --cpp で前処理させる（-I や -D を続けて書く。マクロで名前を付けた関数用）
+                                      ch32fun.h のディレクトリは自動で -I に加える
+
+割り込みは、優先度が異なるハンドラ同士でだけネストするものとする（同じ優先度なら後から来た方は待たされる）。
+したがって最悪値は「main の最大値 + 優先度ごとの最大値のうち大きい方から nest 個の和」になる。
+'''
+
+import argparse
+import collections
+from dataclasses import dataclass, field
+import datetime
+import fnmatch
+from pathlib import Path
+import re
+import subprocess
+import sys
+
+# それぞれの関数の情報を表す型
+@dataclass
+class FuncInfo:
+    name: str
+    stack_usage: int
+    calls: set = field(default_factory=set)
+    stack_total: int = None
+    # 最大値を与える呼び出し先（ツリー表示用）
+    worst_call: str = None
+
+SU_LINE_PAT = re.compile(r'^[^:]+:\d+:\d+:(?P<id>\S+)\s+(?P<su>\d+)\s+(?P<type>[\w,]+)')
+CFLOW_LINE_PAT = re.compile(r'^(?P<indent>\s*)(?P<id>[_0-9a-zA-Z]+)\(\).*$')
+# 最適化で作られる関数のクローン（SendToMSMP.constprop.0 など）
+CLONE_SUFFIX_PAT = re.compile(r'\.(constprop|isra|part|lto_priv|cold)\.\d+')
+ROOT_PATS = ['*_IRQHandler', '*_Handler']
+
+SCRIPT_DIR = Path(__file__).resolve().parent
+ECHO_CH32FUN_C_MK = f'''
+include {SCRIPT_DIR}/env.mk
+all:
+	@echo $(CH32V003FUN)/ch32fun/ch32fun.c
+'''
+
+verbose = False
+
+@dataclass
+class Annotations:
+    calls: list = field(default_factory=list) # [(呼び出し元, 呼び出し先パターン)]
+    stack: dict = field(default_factory=dict)
+    roots: list = field(default_factory=list)
+    priority: dict = field(default_factory=dict)
+    nest: int = 2
+    budget: int = None
+    cpp: list = None
+
+def read_annotations(path):
+    annot = Annotations()
+    if path is None:
+        return annot
+    with open(path) as f:
+        for lineno, line in enumerate(f, 1):
+            words = line.split('#', 1)[0].split()
+            if not words:
+                continue
+            try:
+                key, args = words[0], words[1:]
+                if key == 'calls' and len(args) >= 2:
+                    annot.calls += [(args[0], callee) for callee in args[1:]]
+                elif key == 'stack' and len(args) == 2:
+                    annot.stack[args[0]] = int(args[1], 0)
+                elif key == 'root' and args:
+                    annot.roots += args
+                elif key == 'priority' and len(args) == 2:
+                    annot.priority[args[0]] = int(args[1], 0)
+                elif key == 'nest' and len(args) == 1:
+                    annot.nest = int(args[0], 0)
+                elif key == 'budget' and len(args) == 1:
+                    annot.budget = int(args[0], 0)
+                elif key == 'cpp':
+                    annot.cpp = args
+                else:
+                    raise ValueError
+            except ValueError:
+                raise ValueError(f'{path}:{lineno}: invalid annotation: {line.strip()}')
+    return annot
+
+def read_latest_su_lines(target):
+    su_list = list(Path('/tmp').glob(f'{target}.*.su'))
+    if not su_list:
+        raise FileNotFoundError(f'No /tmp/{target}.*.su found. Build with -fstack-usage first.')
+    latest_su = max(su_list, key=lambda x: x.stat().st_mtime)
+    latest_su_dt = datetime.datetime.fromtimestamp(latest_su.stat().st_mtime)
+    print(f'Reading stack usage from {latest_su} (mtime={latest_su_dt})')
+    with open(latest_su) as f:
+        return f.readlines()
+
+def read_su_lines(paths):
+    lines = []
+    for path in paths:
+        print(f'Reading stack usage from {path}')
+        with open(path) as f:
+            lines += f.readlines()
+    return lines
+
+def get_stack_usage(su_lines):
+    '''各行は次の形式
+    msmpdbg.c:330:6:StartTransmit   0       static
+    '''
+    stack_usage = {}
+    for line in su_lines:
+        m = SU_LINE_PAT.match(line)
+        if not m:
+            raise ValueError(f'Invalid line format: {line}')
+        name = CLONE_SUFFIX_PAT.sub('', m.group('id'))
+        su = int(m.group('su'))
+        if m.group('type') != 'static':
+            # alloca や可変長配列。bounded でも値は上限ではないので注意を促す
+            print(f'Warning: {name} uses {m.group("type")} stack ({su} bytes + dynamic part)')
+        if name in stack_usage:
+            # クローンや同名の static 関数は大きい方を使う
+            su = max(su, stack_usage[name].stack_usage)
+        stack_usage[name] = FuncInfo(name, su)
+    return stack_usage
+
+def get_ch32fun_path():
+    # env.mk に含まれる ch32fun.c のパスを取得
+    ch32fun_path = subprocess.run(['make', '-f', '-', 'all'], input=ECHO_CH32FUN_C_MK, capture_output=True, text=True)
+    if ch32fun_path.returncode != 0:
+        raise RuntimeError('Failed to get ch32fun.c path')
+    return ch32fun_path.stdout.strip()
+
+def generate_cflow_lines(target_cfiles, cpp_args):
+    ch32fun_path = get_ch32fun_path()
+    # --all で main から辿れない関数（割り込みハンドラ）のグラフも出力させる
+    args = ['--all'] + target_cfiles + [ch32fun_path]
+    if cpp_args is not None:
+        args = ['--cpp'] + cpp_args + ['-I', str(Path(ch32fun_path).parent)] + args
+    print('Generating cflow by using', ' '.join(args))
+    cflow = subprocess.run(['cflow'] + args, capture_output=True, text=True)
+    if cflow.returncode != 0:
+        raise RuntimeError(f'cflow failed: {cflow.stderr}')
+    return cflow.stdout.splitlines()
+
+# cflow の出力からコールグラフを構築する
+def get_call_graph(funcs, cflow_lines):
+    call_stack = []
+    indent_width = None
+    funcs_not_found = []
+    for line in cflow_lines:
+        '''各行は次の形式（根の関数が複数ある）
+        Funcname() <void FuncName (int arg1, int arg2) at src.c:123>:
+            Callee() <...>:
+        '''
+        m = CFLOW_LINE_PAT.match(line)
+        if not m:
+            raise ValueError(f'Invalid line format: {line}')
+
+        func_name = m.group('id')
+        if func_name not in funcs:
+            funcs[func_name] = FuncInfo(func_name, None)
+            funcs_not_found.append(func_name)
+
+        indent = len(m.group('indent'))
+        if indent > 0 and indent_width is None:
+            indent_width = indent
+        depth = 0 if indent == 0 else indent // indent_width
+        del call_stack[depth:]
+        if call_stack:
+            funcs[call_stack[-1]].calls.add(func_name)
+        call_stack.append(func_name)
+
+    if verbose and funcs_not_found:
+        print('Functions without stack usage info (assumed to be 0):')
+        print('  ' + '\n  '.join(sorted(funcs_not_found)))
+
+def add_annotated_calls(funcs, annot):
+    for caller, pattern in annot.calls:
+        callees = fnmatch.filter(funcs.keys(), pattern)
+        if caller not in funcs or not callees:
+            print(f'Warning: annotation "calls {caller} {pattern}" matches no function')
+            continue
+        funcs[caller].calls.update(callees)
+    for name, su in annot.stack.items():
+        if name not in funcs:
+            funcs[name] = FuncInfo(name, su)
+        elif funcs[name].stack_usage is None:
+            funcs[name].stack_usage = su
+
+def calc_stack_total(func_name, funcs, visiting=None):
+    if visiting is None:
+        visiting = set()
+    func = funcs[func_name]
+    if func.stack_total is not None:
+        return func.stack_total
+    if func_name in visiting:
+        # 再帰。深さは分からないので 1 回分だけ数える
+        print(f'Warning: recursive call to {func_name}; counted only once')
+        return 0
+
+    visiting.add(func_name)
+    sub_stack_max = 0
+    for call in sorted(func.calls):
+        sub = calc_stack_total(call, funcs, visiting)
+        if sub > sub_stack_max:
+            sub_stack_max = sub
+            func.worst_call = call
+    visiting.discard(func_name)
+    func.stack_total = (0 if func.stack_usage is None else func.stack_usage) + sub_stack_max
+    return func.stack_total
+
+def print_worst_path(func_name, funcs):
+    indent = 0
+    while func_name is not None:
+        func = funcs[func_name]
+        print(f'    {"  " * indent}{func_name} [{func.stack_usage} total={func.stack_total}]')
+        func_name = func.worst_call
+        indent += 1
+
+def print_stack_usage_tree(func_name, funcs, indent, visited):
+    func = funcs[func_name]
+    print(f'{"  " * indent}{func_name}  [{func.stack_usage} total={func.stack_total}]')
+    if func_name in visited:
+        return
+    visited.add(func_name)
+    for call in sorted(func.calls):
+        print_stack_usage_tree(call, funcs, indent + 1, visited)
+
+def find_roots(funcs, annot):
+    roots = [name for name in funcs
+             if any(fnmatch.fnmatchcase(name, p) for p in ROOT_PATS)]
+    # 呼ばれる側の関数（ベクタテーブルに載らないもの）は除く
+    called = set().union(*(f.calls for f in funcs.values()))
+    roots = [name for name in roots if name not in called]
+    roots += [name for name in annot.roots if name not in roots]
+    return sorted(roots)
+
+def get_budget_from_elf(elf, nm):
+    '''静的変数（.bss）の終わりから RAM の終わりまでのバイト数を返す'''
+    result = subprocess.run([nm, elf], capture_output=True, text=True)
+    if result.returncode != 0:
+        raise RuntimeError(f'{nm} failed: {result.stderr}')
+    symbols = {}
+    for line in result.stdout.splitlines():
+        words = line.split()
+        if len(words) == 3:
+            symbols[words[2]] = int(words[0], 16)
+    if '_ebss' not in symbols or '_eusrstack' not in symbols:
+        raise ValueError(f'{elf} has no _ebss or _eusrstack symbol')
+    return symbols['_eusrstack'] - symbols['_ebss']
+
+def main():
+    global verbose
+    parser = argparse.ArgumentParser(description='Estimate the worst-case stack usage including interrupt nesting.')
+    parser.add_argument('sources', nargs='*', help='C source files (default: *.c)')
+    parser.add_argument('-v', '--verbose', action='store_true', help='print call trees')
+    parser.add_argument('-a', '--annotations', help='annotation file')
+    parser.add_argument('--su', action='append', help='.su file; may be repeated (default: the latest /tmp/<target>.*.su)')
+    parser.add_argument('--target', default=Path.cwd().name, help='target name (default: current directory name)')
+    parser.add_argument('--budget', type=int, help='stack budget in bytes')
+    parser.add_argument('--elf', help='ELF file to take the budget from (RAM after .bss)')
+    parser.add_argument('--nm', default='nm', help='nm command for --elf (e.g. riscv64-unknown-elf-nm)')
+    args = parser.parse_args()
+    verbose = args.verbose
+
+    annot = read_annotations(args.annotations)
+    su_lines = read_su_lines(args.su) if args.su else read_latest_su_lines(args.target)
+    funcs = get_stack_usage(su_lines)
+    sources = args.sources or sorted(str(p) for p in Path('.').glob('*.c'))
+    get_call_graph(funcs, generate_cflow_lines(sources, annot.cpp))
+    add_annotated_calls(funcs, annot)
+
+    if 'main' not in funcs:
+        raise ValueError('main not found in the call graph')
+    main_total = calc_stack_total('main', funcs)
+    print(f'main: {main_total} bytes')
+    if verbose:
+        print_worst_path('main', funcs)
+
+    # 優先度ごとに最もスタックを使う割り込みハンドラ
+    worst_by_prio = collections.defaultdict(lambda: (0, None))
+    for root in find_roots(funcs, annot):
+        total = calc_stack_total(root, funcs)
+        prio = annot.priority.get(root, 0)
+        print(f'{root} (priority {prio}): {total} bytes')
+        if verbose:
+            print_worst_path(root, funcs)
+        if total > worst_by_prio[prio][0]:
+            worst_by_prio[prio] = (total, root)
+    for name in annot.priority:
+        if name not in funcs:
+            print(f'Warning: annotation "priority {name}" matches no function')
+
+    nested = sorted(worst_by_prio.values(), reverse=True)[:annot.nest]
+    isr_total = sum(total for total, _ in nested)
+    chain = ' + '.join(f'{name}({total})' for total, name in nested)
+    print(f'Worst interrupt nesting (up to {annot.nest} levels): {chain or "none"} = {isr_total} bytes')
+    worst = main_total + isr_total
+    print(f'Estimated total stack usage: {worst} bytes')
+
+    if verbose:
+        for root in ['main'] + find_roots(funcs, annot):
+            print_stack_usage_tree(root, funcs, 0, set())
+
+    budget = args.budget
+    if budget is None and args.elf:
+        budget = get_budget_from_elf(args.elf, args.nm)
+    if budget is None:
+        budget = annot.budget
+    if budget is not None:
+        if worst > budget:
+            print(f'Error: exceeds the stack budget of {budget} bytes by {worst - budget} bytes')
+            sys.exit(1)
+        print(f'Within the stack budget of {budget} bytes ({budget - worst} bytes left)')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,244 @@
+/*
+ * i2c_master.c のテスト
+ *
+ * 模擬バス（i2c_mock.c）のスレーブを相手に転送し、バス上の出来事の列（mock_trace）、
+ * 読み書きしたデータ、エラー、キューの動作、タイムアウト時のバス回復を確認する。
+ * 最後に、割り込み駆動の転送でメインループが使う CPU 時間を、転送が終わるまで
+ * レジスタを読み続ける方式（バス上の時間すべて）と比べて表示する。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "i2c_master.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+    ++failures; \
+  } \
+} while (0)
+
+// 完了の通知はストップコンディションを出し終える前に来るので、バスが落ち着くまで進めてから比べる
+#define CHECK_TRACE(expected) do { \
+  MockI2cRun(2 * MOCK_BIT_TICKS); \
+  if (strcmp(mock_trace, (expected)) != 0) { \
+    printf("%s:%d: trace\n  expected: %s\n  actual:   %s\n", \
+           __FILE__, __LINE__, (expected), mock_trace); \
+    ++failures; \
+  } \
+} while (0)
+
+#define DEV_ADDR 0x18
+
+static struct MockI2cDevice *Setup(void) {
+  MockI2cReset();
+  struct MockI2cDevice *dev = MockI2cAddDevice(DEV_ADDR);
+  for (int i = 0; i < 256; i++) {
+    dev->regs[i] = i ^ 0xa5;
+  }
+  I2cSetup();
+  return dev;
+}
+
+static void TestWrite(void) {
+  struct MockI2cDevice *dev = Setup();
+  const uint8_t data[] = {0x10, 0x11, 0x22, 0x33};
+  CHECK(I2cWrite(DEV_ADDR, data, sizeof(data)) == 0);
+  CHECK_TRACE("S 30+ 10+ 11+ 22+ 33+ P");
+  CHECK(dev->regs[0x10] == 0x11 && dev->regs[0x11] == 0x22 && dev->regs[0x12] == 0x33);
+  CHECK(mock_stats.violations == 0);
+}
+
+// 受信の長さごとに、ACK/NACK の位置とストップが正しいこと
+static void TestReadLengths(void) {
+  static const char *const expected[] = {
+    NULL,
+    "S 31+ a5- P",
+    "S 31+ a5+ a4- P",
+    "S 31+ a5+ a4+ a7- P",
+    "S 31+ a5+ a4+ a7+ a6- P",
+    "S 31+ a5+ a4+ a7+ a6+ a1- P",
+    "S 31+ a5+ a4+ a7+ a6+ a1+ a0- P",
+  };
+  for (int len = 1; len <= 6; len++) {
+    Setup();
+    uint8_t buf[8] = {0};
+    CHECK(I2cRead(DEV_ADDR, buf, len) == 0);
+    CHECK_TRACE(expected[len]);
+    for (int i = 0; i < len; i++) {
+      CHECK(buf[i] == (i ^ 0xa5));
+    }
+    CHECK(mock_stats.violations == 0);
+  }
+}
+
+// レジスタ番号を書いてからリピーテッドスタートで読む
+static void TestWriteRead(void) {
+  Setup();
+  const uint8_t reg = 0x40;
+  uint8_t buf[3];
+  CHECK(I2cWriteRead(DEV_ADDR, &reg, 1, buf, sizeof(buf)) == 0);
+  CHECK_TRACE("S 30+ 40+ Sr 31+ e5+ e4+ e7- P");
+  CHECK(buf[0] == 0xe5 && buf[1] == 0xe4 && buf[2] == 0xe7);
+  CHECK(mock_stats.violations == 0);
+}
+
+// アドレスだけの転送と、存在しないデバイス
+static void TestProbeAndNack(void) {
+  Setup();
+  CHECK(I2cWrite(DEV_ADDR, NULL, 0) == 0);
+  CHECK_TRACE("S 30+ P");
+
+  MockI2cClearTrace();
+  struct I2cReq req = {.addr = 0x20, .rlen = 1, .rdata = (uint8_t[1]){0}};
+  CHECK(I2cSubmit(&req) == 0);
+  CHECK(I2cWait(&req) == 1);
+  CHECK(req.err == I2CERR_NACK);
+  CHECK_TRACE("S 41- P");
+
+  // NACK の後も続けて使える
+  MockI2cClearTrace();
+  uint8_t c;
+  CHECK(I2cRead(DEV_ADDR, &c, 1) == 0);
+  CHECK_TRACE("S 31+ a5- P");
+}
+
+static int done_order[8];
+static int done_count;
+
+static void RecordDone(struct I2cReq *req) {
+  done_order[done_count++] = (int)(intptr_t)req->user;
+}
+
+// 積んだ順に転送され、完了が通知されること。満杯なら積めないこと
+static void TestQueue(void) {
+  Setup();
+  done_count = 0;
+  uint8_t bufs[I2C_QUEUE_LEN][2];
+  uint8_t regs[I2C_QUEUE_LEN];
+  struct I2cReq reqs[I2C_QUEUE_LEN];
+  for (int i = 0; i < I2C_QUEUE_LEN; i++) {
+    regs[i] = 0x20 + i;
+    reqs[i] = (struct I2cReq){
+      .addr = DEV_ADDR, .wlen = 1, .wdata = &regs[i], .rlen = 2, .rdata = bufs[i],
+      .done = RecordDone, .user = (void *)(intptr_t)i,
+    };
+  }
+  for (int i = 0; i < I2C_QUEUE_LEN - 1; i++) {
+    CHECK(I2cSubmit(&reqs[i]) == 0);
+  }
+  CHECK(I2cSubmit(&reqs[I2C_QUEUE_LEN - 1]) == 1);
+  CHECK(reqs[0].status == I2CREQ_BUSY);
+  CHECK(reqs[1].status == I2CREQ_QUEUED);
+
+  // 待っている間、メインループはレジスタに触らない
+  const uint32_t main_accesses = mock_stats.main_accesses;
+  MockI2cRun(I2C_QUEUE_LEN * 600 * MOCK_TICKS_PER_US);
+  CHECK(mock_stats.main_accesses == main_accesses);
+
+  CHECK(done_count == I2C_QUEUE_LEN - 1);
+  for (int i = 0; i < I2C_QUEUE_LEN - 1; i++) {
+    CHECK(done_order[i] == i);
+    CHECK(reqs[i].status == I2CREQ_DONE);
+    CHECK(bufs[i][0] == ((0x20 + i) ^ 0xa5) && bufs[i][1] == ((0x21 + i) ^ 0xa5));
+  }
+  CHECK(mock_stats.violations == 0);
+}
+
+// スレーブが SDA を握ったまま止まっても、その要求だけエラーにしてバスを回復すること
+static void TestTimeoutRecovery(void) {
+  struct MockI2cDevice *dev = Setup();
+  dev->hang_after = 1;
+  dev->hang_clocks = 3;
+  uint8_t buf1[2], buf2[2];
+  struct I2cReq req1 = {.addr = DEV_ADDR, .rlen = 2, .rdata = buf1};
+  struct I2cReq req2 = {.addr = DEV_ADDR, .rlen = 2, .rdata = buf2};
+  CHECK(I2cSubmit(&req1) == 0);
+  CHECK(I2cSubmit(&req2) == 0);
+
+  const uint32_t start = mock_now;
+  CHECK(I2cWait(&req1) == 1);
+  CHECK(req1.err == I2CERR_TIMEOUT);
+  CHECK(mock_now - start >= I2C_TICKS_FROM_MS(I2C_TIMEOUT_MS));
+  CHECK(!dev->hung);
+
+  CHECK(I2cWait(&req2) == 0);
+  CHECK(buf2[0] == (0x01 ^ 0xa5) && buf2[1] == (0x02 ^ 0xa5));
+  CHECK_TRACE("S 31+ a5+ C C C P S 31+ a4+ a7- P");
+}
+
+// 長さとレジスタ番号を変えながら書き込みと読み出しを繰り返し、模擬デバイスの内容と照合する
+static void TestRandom(void) {
+  struct MockI2cDevice *dev = Setup();
+  uint8_t model[256];
+  memcpy(model, dev->regs, sizeof(model));
+  srand(1);
+  for (int n = 0; n < 2000; n++) {
+    uint8_t wbuf[9], rbuf[8];
+    const uint8_t reg = rand();
+    if (rand() & 1) {
+      const int len = rand() % 8;
+      wbuf[0] = reg;
+      for (int i = 0; i < len; i++) {
+        wbuf[1 + i] = rand();
+        model[(uint8_t)(reg + i)] = wbuf[1 + i];
+      }
+      CHECK(I2cWrite(DEV_ADDR, wbuf, 1 + len) == 0);
+    } else {
+      const int len = 1 + rand() % 8;
+      CHECK(I2cWriteRead(DEV_ADDR, &reg, 1, rbuf, len) == 0);
+      for (int i = 0; i < len; i++) {
+        CHECK(rbuf[i] == model[(uint8_t)(reg + i)]);
+      }
+    }
+    MockI2cClearTrace();
+  }
+  CHECK(mock_stats.violations == 0);
+}
+
+// 1 回の組み合わせ読み出しで、CPU がレジスタに触る回数と割り込みの回数を表示する
+static void ReportOverhead(void) {
+  Setup();
+  const uint8_t reg = 0;
+  uint8_t buf[2];
+  struct I2cReq req = {.addr = DEV_ADDR, .wlen = 1, .wdata = &reg, .rlen = 2, .rdata = buf};
+  memset(&mock_stats, 0, sizeof(mock_stats));
+  const uint32_t start = mock_now;
+  CHECK(I2cSubmit(&req) == 0);
+  const uint32_t submit_accesses = mock_stats.main_accesses;
+  while (req.status != I2CREQ_DONE) {
+    MockI2cRun(1);
+  }
+  const uint32_t bus_ticks = mock_now - start;
+  const uint32_t cpu_ticks = (submit_accesses + mock_stats.isr_accesses) * MOCK_TICKS_PER_ACCESS;
+  printf("write 1 + read 2 bytes: %u.%u us on the bus, %u interrupts, "
+         "%u register accesses (~%u.%u us of CPU; polling would spend the whole transfer)\n",
+         bus_ticks / MOCK_TICKS_PER_US, bus_ticks % MOCK_TICKS_PER_US,
+         mock_stats.ev_irqs + mock_stats.er_irqs, submit_accesses + mock_stats.isr_accesses,
+         cpu_ticks / MOCK_TICKS_PER_US, cpu_ticks % MOCK_TICKS_PER_US);
+  CHECK(cpu_ticks * 10 < bus_ticks);
+}
+
+int main(int argc, char **argv) {
+  TestWrite();
+  TestReadLengths();
+  TestWriteRead();
+  TestProbeAndNack();
+  TestQueue();
+  TestTimeoutRecovery();
+  TestRandom();
+  if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+    ReportOverhead();
+  }
+
+  if (failures) {
+    printf("%d failure(s)\n", failures);
+    return 1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}
@@ -0,0 +1,512 @@
+/*
+ * I2C マスタの模擬バス（i2c_mock.h を参照）
+ *
+ * I2C モジュールの動作は CH32V003 のリファレンスマニュアルのマスタモードの記述に沿って、
+ * ドライバが頼っている範囲だけを再現する。
+ *   - SB は STAR1 を読んでから DATAR に書くとクリアされ、アドレスの送出が始まる
+ *   - ADDR は STAR1 に続けて STAR2 を読むとクリアされ、送信なら TXE、受信なら 1 バイト目の受信が始まる
+ *   - 受信したバイトは DATAR が空なら RXNE、埋まっていればシフトレジスタに残して BTF にし、
+ *     DATAR が読まれるまで SCL を止める
+ *   - 受信したバイトに返す ACK は、POS=0 ならそのバイトの受信完了時の ACK ビット、
+ *     POS=1 ならそのバイトの受信開始時の ACK ビット（次のバイトへの予約）
+ *   - STOP/START はシフト中なら今のバイトの後に、そうでなければすぐ出す
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "i2c_master.h"
+
+uint32_t mock_now;
+char mock_trace[4096];
+struct MockI2cStats mock_stats;
+
+static struct MockI2cDevice devices[MOCK_MAX_DEVICES];
+
+// I2C モジュールから見たバスの状態
+enum MockBusState {
+  BUS_IDLE,      // バスは開放されている
+  BUS_START,     // スタートコンディションの送出中（終わると SB）
+  BUS_WAIT_ADDR, // SB を立て、アドレスの書き込みを待っている
+  BUS_ADDR,      // アドレスの送出中（終わると ADDR か AF）
+  BUS_ADDR_DONE, // ADDR を立て、STAR2 の読み出しを待っている
+  BUS_TX,        // 送信段（busy ならバイトの送出中）
+  BUS_RX,        // 受信段（busy ならバイトの受信中）
+  BUS_HOLD,      // NACK を受け、ストップかスタートを待っている
+  BUS_STOP,      // ストップコンディションの送出中
+  BUS_HUNG,      // スレーブが SDA を L にしたまま止まっている
+};
+
+static struct {
+  uint16_t ctlr1, ctlr2, star1, star2, ckcfgr;
+  uint8_t datar;        // 受信したバイト（RXNE）
+  uint8_t shift;        // 受信を終えて DATAR が空くのを待っているバイト（BTF）
+  bool shift_full;
+  uint8_t tx_dr;        // 送信待ちのバイト（TXE=0）
+  bool tx_dr_full;
+  enum MockBusState state;
+  bool busy;            // バイトを送受信中
+  uint32_t event_at;    // state の今の動作が終わる時刻（has_event なら有効）
+  bool has_event;
+  bool star1_read;      // STAR1 を読んでから、SB/ADDR をクリアするアクセスをまだしていない
+  bool ack_latch;       // POS=1 のとき、受信中のバイトに返す ACK
+  bool last_acked;      // 受信段で最後に受信したバイトに ACK を返した
+  int tx_count;         // 今の送信段で送ったバイト数
+  int rx_count;         // 今の受信段で受信したバイト数
+  struct MockI2cDevice *dev;
+  // GPIO
+  bool pins_gpio;
+  int scl_out, sda_out;
+  // 割り込み
+  bool irq_enabled;
+  bool in_isr;
+} m;
+
+static void Trace(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void Trace(const char *fmt, ...) {
+  size_t len = strlen(mock_trace);
+  if (len + 8 >= sizeof(mock_trace)) {
+    return;
+  }
+  if (len > 0) {
+    mock_trace[len++] = ' ';
+  }
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(mock_trace + len, sizeof(mock_trace) - len, fmt, ap);
+  va_end(ap);
+}
+
+static void Violation(void) {
+  Trace("!");
+  mock_stats.violations++;
+}
+
+static void Schedule(uint32_t ticks) {
+  m.event_at = mock_now + ticks;
+  m.has_event = true;
+}
+
+static struct MockI2cDevice *FindDevice(uint8_t addr) {
+  for (int i = 0; i < MOCK_MAX_DEVICES; i++) {
+    if (devices[i].addr != 0 && devices[i].addr == addr) {
+      return &devices[i];
+    }
+  }
+  return NULL;
+}
+
+// スレーブが SDA を L に保っているか
+static bool SdaHeld(void) {
+  for (int i = 0; i < MOCK_MAX_DEVICES; i++) {
+    if (devices[i].hung) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// I2C モジュールの状態を初期化する（スレーブの状態は変えない）
+static void ResetPeripheral(void) {
+  m.ctlr1 = m.ctlr2 = m.star1 = m.star2 = m.ckcfgr = 0;
+  m.shift_full = m.tx_dr_full = false;
+  m.state = SdaHeld() ? BUS_HUNG : BUS_IDLE;
+  m.busy = false;
+  m.has_event = false;
+  m.star1_read = false;
+  m.dev = NULL;
+}
+
+static void StartRxByte(void) {
+  struct MockI2cDevice *dev = m.dev;
+  if (dev->hang_after >= 0 && m.rx_count == dev->hang_after) {
+    // スレーブが 0 のビットを出している途中で止まる
+    dev->hung = true;
+    dev->hang_after = -1;
+    m.state = BUS_HUNG;
+    m.busy = false;
+    m.has_event = false;
+    return;
+  }
+  m.busy = true;
+  m.ack_latch = (m.ctlr1 & I2C_CTLR1_ACK) != 0;
+  Schedule(9 * MOCK_BIT_TICKS);
+}
+
+static void StartTxByte(uint8_t c) {
+  m.shift = c;
+  m.busy = true;
+  m.star1 &= ~I2C_STAR1_BTF;
+  Schedule(9 * MOCK_BIT_TICKS);
+}
+
+// 要求されているストップかスタートを、出せる状態なら出し始める
+static void TryStopOrStart(void) {
+  const bool between_bytes = (m.state == BUS_TX || m.state == BUS_RX) && !m.busy;
+  if (!(between_bytes || m.state == BUS_HOLD)) {
+    return;
+  }
+  if (m.ctlr1 & (I2C_CTLR1_STOP | I2C_CTLR1_START)) {
+    if (m.state == BUS_RX && m.last_acked) {
+      // ACK を返したのでスレーブは次のビットを出そうとしている
+      Violation();
+    }
+    m.star1 &= ~I2C_STAR1_BTF;
+    m.busy = false;
+  }
+  if (m.ctlr1 & I2C_CTLR1_STOP) {
+    m.state = BUS_STOP;
+    Schedule(MOCK_BIT_TICKS);
+  } else if (m.ctlr1 & I2C_CTLR1_START) {
+    Trace("Sr");
+    m.state = BUS_START;
+    Schedule(MOCK_BIT_TICKS);
+  }
+}
+
+static void RequestStart(void) {
+  if (m.state == BUS_IDLE) {
+    Trace("S");
+    m.state = BUS_START;
+    Schedule(MOCK_BIT_TICKS);
+  } else {
+    TryStopOrStart();
+  }
+}
+
+// state の今の動作が終わったときの処理
+static void Complete(void) {
+  m.has_event = false;
+  switch (m.state) {
+  case BUS_START:
+    m.ctlr1 &= ~I2C_CTLR1_START;
+    m.star1 = (m.star1 & ~(I2C_STAR1_TXE | I2C_STAR1_BTF)) | I2C_STAR1_SB;
+    m.star2 |= I2C_STAR2_MSL | I2C_STAR2_BUSY;
+    m.state = BUS_WAIT_ADDR;
+    break;
+
+  case BUS_ADDR: {
+    const uint8_t addr = m.shift;
+    m.busy = false;
+    m.dev = FindDevice(addr >> 1);
+    if (m.dev == NULL) {
+      Trace("%02x-", addr);
+      m.star1 |= I2C_STAR1_AF;
+      m.state = BUS_HOLD;
+      break;
+    }
+    Trace("%02x+", addr);
+    m.star1 |= I2C_STAR1_ADDR;
+    if (addr & 1) {
+      m.star2 &= ~I2C_STAR2_TRA;
+    } else {
+      m.star2 |= I2C_STAR2_TRA;
+    }
+    m.state = BUS_ADDR_DONE;
+    break;
+  }
+
+  case BUS_TX: {
+    const uint8_t c = m.shift;
+    struct MockI2cDevice *dev = m.dev;
+    Trace("%02x+", c);
+    if (m.tx_count++ == 0) {
+      dev->ptr = c;
+    } else {
+      dev->regs[dev->ptr++] = c;
+    }
+    m.busy = false;
+    if (m.tx_dr_full) {
+      m.tx_dr_full = false;
+      m.star1 |= I2C_STAR1_TXE;
+      StartTxByte(m.tx_dr);
+    } else {
+      m.star1 |= I2C_STAR1_BTF;
+    }
+    break;
+  }
+
+  case BUS_RX: {
+    struct MockI2cDevice *dev = m.dev;
+    const uint8_t c = dev->regs[dev->ptr++];
+    const bool ack = (m.ctlr1 & I2C_CTLR1_POS) ? m.ack_latch : (m.ctlr1 & I2C_CTLR1_ACK) != 0;
+    Trace("%02x%c", c, ack ? '+' : '-');
+    m.rx_count++;
+    m.last_acked = ack;
+    m.busy = false;
+    if (!(m.star1 & I2C_STAR1_RXNE)) {
+      m.datar = c;
+      m.star1 |= I2C_STAR1_RXNE;
+      if (ack) {
+        StartRxByte();
+      }
+    } else {
+      m.shift = c;
+      m.shift_full = true;
+      m.star1 |= I2C_STAR1_BTF;
+    }
+    break;
+  }
+
+  case BUS_STOP:
+    Trace("P");
+    m.ctlr1 &= ~I2C_CTLR1_STOP;
+    m.star1 &= ~(I2C_STAR1_TXE | I2C_STAR1_BTF);
+    m.star2 &= ~(I2C_STAR2_MSL | I2C_STAR2_BUSY | I2C_STAR2_TRA);
+    m.state = BUS_IDLE;
+    m.dev = NULL;
+    if (m.ctlr1 & I2C_CTLR1_START) {
+      RequestStart();
+    }
+    return;
+
+  default:
+    return;
+  }
+  TryStopOrStart();
+}
+
+static void Advance(uint32_t ticks) {
+  mock_now += ticks;
+  while (m.has_event && (int32_t)(mock_now - m.event_at) >= 0) {
+    Complete();
+  }
+}
+
+// 割り込み条件が成立している間、割り込みハンドラを呼ぶ
+static void Deliver(void) {
+  if (m.in_isr || !m.irq_enabled) {
+    return;
+  }
+  for (int n = 0; ; n++) {
+    const uint16_t err = m.star1 & (I2C_STAR1_BERR | I2C_STAR1_ARLO | I2C_STAR1_AF | I2C_STAR1_OVR);
+    const bool er = (m.ctlr2 & I2C_CTLR2_ITERREN) && err;
+    const bool ev = (m.ctlr2 & I2C_CTLR2_ITEVTEN)
+      && ((m.star1 & (I2C_STAR1_SB | I2C_STAR1_ADDR | I2C_STAR1_BTF))
+          || ((m.ctlr2 & I2C_CTLR2_ITBUFEN) && (m.star1 & (I2C_STAR1_RXNE | I2C_STAR1_TXE))));
+    if (!er && !ev) {
+      return;
+    }
+    if (n >= 1000) {
+      fprintf(stderr, "i2c_mock: interrupt storm (STAR1=%04x CTLR2=%04x state=%d)\n  trace: %s\n",
+              m.star1, m.ctlr2, m.state, mock_trace);
+      abort();
+    }
+    m.in_isr = true;
+    if (er) {
+      mock_stats.er_irqs++;
+      I2C1_ER_IRQHandler();
+    } else {
+      mock_stats.ev_irqs++;
+      I2C1_EV_IRQHandler();
+    }
+    m.in_isr = false;
+  }
+}
+
+static void Access(void) {
+  if (m.in_isr) {
+    mock_stats.isr_accesses++;
+  } else {
+    mock_stats.main_accesses++;
+  }
+  Advance(MOCK_TICKS_PER_ACCESS);
+}
+
+uint16_t MockI2cRead(enum MockI2cReg reg) {
+  uint16_t v = 0;
+  Access();
+  switch (reg) {
+  case MOCK_I2C_CTLR1:
+    v = m.ctlr1;
+    break;
+  case MOCK_I2C_CTLR2:
+    v = m.ctlr2;
+    break;
+  case MOCK_I2C_CKCFGR:
+    v = m.ckcfgr;
+    break;
+  case MOCK_I2C_STAR1:
+    v = m.star1;
+    m.star1_read = true;
+    break;
+  case MOCK_I2C_STAR2:
+    v = m.star2;
+    if (m.star1_read && (m.star1 & I2C_STAR1_ADDR)) {
+      m.star1 &= ~I2C_STAR1_ADDR;
+      if (m.star2 & I2C_STAR2_TRA) {
+        m.state = BUS_TX;
+        m.tx_count = 0;
+        m.star1 |= I2C_STAR1_TXE;
+      } else {
+        m.state = BUS_RX;
+        m.rx_count = 0;
+        StartRxByte();
+      }
+      TryStopOrStart();
+    }
+    m.star1_read = false;
+    break;
+  case MOCK_I2C_DATAR:
+    v = m.datar;
+    if (m.star1 & I2C_STAR1_RXNE) {
+      m.star1 &= ~I2C_STAR1_RXNE;
+      if (m.shift_full) {
+        // シフトレジスタのバイトを DATAR へ移し、止めていた SCL を再開する
+        m.datar = m.shift;
+        m.shift_full = false;
+        m.star1 |= I2C_STAR1_RXNE;
+        m.star1 &= ~I2C_STAR1_BTF;
+        if (m.last_acked && m.state == BUS_RX) {
+          StartRxByte();
+        }
+      }
+    }
+    break;
+  }
+  Deliver();
+  return v;
+}
+
+void MockI2cWrite(enum MockI2cReg reg, uint16_t v) {
+  Access();
+  switch (reg) {
+  case MOCK_I2C_CTLR1: {
+    const uint16_t old = m.ctlr1;
+    if (v & I2C_CTLR1_SWRST) {
+      ResetPeripheral();
+      m.ctlr1 = v;
+      break;
+    }
+    m.ctlr1 = v;
+    if (!(v & I2C_CTLR1_PE)) {
+      // 無効化すると転送を放棄する
+      const uint16_t keep = m.ctlr1;
+      ResetPeripheral();
+      m.ctlr1 = keep & ~(I2C_CTLR1_START | I2C_CTLR1_STOP);
+      break;
+    }
+    if ((v & I2C_CTLR1_START) && !(old & I2C_CTLR1_START)) {
+      RequestStart();
+    }
+    if ((v & I2C_CTLR1_STOP) && !(old & I2C_CTLR1_STOP)) {
+      TryStopOrStart();
+    }
+    break;
+  }
+  case MOCK_I2C_CTLR2:
+    m.ctlr2 = v;
+    break;
+  case MOCK_I2C_CKCFGR:
+    m.ckcfgr = v;
+    break;
+  case MOCK_I2C_STAR1:
+    // エラーフラグは 0 を書いたものだけクリアされる
+    m.star1 &= v | ~(I2C_STAR1_BERR | I2C_STAR1_ARLO | I2C_STAR1_AF | I2C_STAR1_OVR);
+    break;
+  case MOCK_I2C_STAR2:
+    break;
+  case MOCK_I2C_DATAR:
+    if (m.state == BUS_WAIT_ADDR && (m.star1 & I2C_STAR1_SB) && m.star1_read) {
+      m.star1 &= ~I2C_STAR1_SB;
+      m.shift = v;
+      m.state = BUS_ADDR;
+      m.busy = true;
+      Schedule(9 * MOCK_BIT_TICKS);
+    } else if (m.state == BUS_TX && !m.busy) {
+      StartTxByte(v);
+    } else if (m.state == BUS_TX && !m.tx_dr_full) {
+      m.tx_dr = v;
+      m.tx_dr_full = true;
+      m.star1 &= ~I2C_STAR1_TXE;
+    } else {
+      Violation();
+    }
+    m.star1_read = false;
+    break;
+  }
+  Deliver();
+}
+
+uint32_t I2cPortNow(void) {
+  Advance(1);
+  Deliver();
+  return mock_now;
+}
+
+void I2cPortIrq(int enable) {
+  m.irq_enabled = enable;
+  Deliver();
+}
+
+void I2cPortClocks(void) {
+  ResetPeripheral();
+}
+
+void I2cPortPins(int af) {
+  m.pins_gpio = !af;
+}
+
+void I2cPortScl(int level) {
+  if (m.pins_gpio && !m.scl_out && level && m.sda_out) {
+    // SDA を放したまま SCL を上げた（止まっているスレーブのビットを進める）
+    Trace("C");
+    for (int i = 0; i < MOCK_MAX_DEVICES; i++) {
+      if (devices[i].hung && --devices[i].hang_clocks <= 0) {
+        devices[i].hung = false;
+      }
+    }
+  }
+  m.scl_out = level;
+}
+
+void I2cPortSda(int level) {
+  if (m.pins_gpio && m.scl_out && !m.sda_out && level && !SdaHeld()) {
+    // SCL が H の間に SDA が上がった
+    Trace("P");
+    if (m.state == BUS_HUNG) {
+      m.state = BUS_IDLE;
+    }
+  }
+  m.sda_out = level;
+}
+
+int I2cPortSdaIn(void) {
+  return m.sda_out && !SdaHeld();
+}
+
+void I2cPortDelay(void) {
+  Advance(MOCK_BIT_TICKS / 2);
+}
+
+void MockI2cReset(void) {
+  memset(devices, 0, sizeof(devices));
+  memset(&mock_stats, 0, sizeof(mock_stats));
+  memset(&m, 0, sizeof(m));
+  m.scl_out = m.sda_out = 1;
+  mock_trace[0] = '\0';
+}
+
+struct MockI2cDevice *MockI2cAddDevice(uint8_t addr) {
+  for (int i = 0; i < MOCK_MAX_DEVICES; i++) {
+    if (devices[i].addr == 0) {
+      devices[i].addr = addr;
+      devices[i].hang_after = -1;
+      return &devices[i];
+    }
+  }
+  return NULL;
+}
+
+void MockI2cClearTrace(void) {
+  mock_trace[0] = '\0';
+}
+
+void MockI2cRun(uint32_t ticks) {
+  for (uint32_t i = 0; i < ticks; i++) {
+    Advance(1);
+    Deliver();
+  }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+/*
+ * I2C マスタの模擬バス（ホスト（Linux）上のテスト用）
+ *
+ * I2C1 のレジスタ、SDA/SCL の GPIO、SysTick、割り込みの許可を模擬し、仮想時刻を進めながら
+ * バス上のスレーブ（レジスタファイル型のデバイス）とのやりとりを再現する。
+ *
+ * ドライバのレジスタアクセス（I2C_RD/I2C_WR）は 1 回ごとに仮想時刻を MOCK_TICKS_PER_ACCESS 進める。
+ * 割り込み条件が成立していれば、割り込みハンドラの外でのアクセスの直後に
+ * I2C1_EV_IRQHandler / I2C1_ER_IRQHandler を呼ぶ（割り込みは入れ子にならない）。
+ *
+ * バス上の出来事は mock_trace に空白区切りで記録する。
+ *   S / Sr   スタート / リピーテッドスタート
+ *   30+ 5a-  バイト（アドレスは R/W ビット込みの 8 ビット）と、受け手が返した ACK(+) / NACK(-)
+ *   P        ストップ
+ *   C        バス回復で SCL を叩いたパルス（SDA を放している間のもの）
+ *   !        プロトコル違反（ACK を返した直後のストップなど）。mock_stats.violations も増える
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// 仮想時刻の単位は 0.1us、I2C は 100kHz
+#define MOCK_TICKS_PER_US 10
+#define MOCK_BIT_TICKS 100
+#define MOCK_TICKS_PER_ACCESS 1
+
+#define FUNCONF_SYSTEM_CORE_CLOCK 48000000
+#define I2C_TICKS_FROM_MS(n) ((n) * 1000 * MOCK_TICKS_PER_US)
+
+// CH32V003 の I2C レジスタのビット
+#define I2C_CTLR1_PE     0x0001
+#define I2C_CTLR1_START  0x0100
+#define I2C_CTLR1_STOP   0x0200
+#define I2C_CTLR1_ACK    0x0400
+#define I2C_CTLR1_POS    0x0800
+#define I2C_CTLR1_SWRST  0x8000
+#define I2C_CTLR2_FREQ   0x003f
+#define I2C_CTLR2_ITERREN 0x0100
+#define I2C_CTLR2_ITEVTEN 0x0200
+#define I2C_CTLR2_ITBUFEN 0x0400
+#define I2C_STAR1_SB     0x0001
+#define I2C_STAR1_ADDR   0x0002
+#define I2C_STAR1_BTF    0x0004
+#define I2C_STAR1_RXNE   0x0040
+#define I2C_STAR1_TXE    0x0080
+#define I2C_STAR1_BERR   0x0100
+#define I2C_STAR1_ARLO   0x0200
+#define I2C_STAR1_AF     0x0400
+#define I2C_STAR1_OVR    0x0800
+#define I2C_STAR2_MSL    0x0001
+#define I2C_STAR2_BUSY   0x0002
+#define I2C_STAR2_TRA    0x0004
+#define I2C_CKCFGR_CCR   0x0fff
+#define I2C_CKCFGR_DUTY  0x4000
+#define I2C_CKCFGR_FS    0x8000
+
+enum MockI2cReg {
+  MOCK_I2C_CTLR1,
+  MOCK_I2C_CTLR2,
+  MOCK_I2C_DATAR,
+  MOCK_I2C_STAR1,
+  MOCK_I2C_STAR2,
+  MOCK_I2C_CKCFGR,
+};
+
+uint16_t MockI2cRead(enum MockI2cReg reg);
+void MockI2cWrite(enum MockI2cReg reg, uint16_t v);
+#define I2C_RD(reg) MockI2cRead(MOCK_I2C_##reg)
+#define I2C_WR(reg, v) MockI2cWrite(MOCK_I2C_##reg, (v))
+
+// i2c_master.c が使う、ハードウェア依存の処理
+uint32_t I2cPortNow(void);
+void I2cPortIrq(int enable);
+void I2cPortClocks(void);
+void I2cPortPins(int af);
+void I2cPortScl(int level);
+void I2cPortSda(int level);
+int I2cPortSdaIn(void);
+void I2cPortDelay(void);
+
+// バス上のスレーブ
+// 書き込みの 1 バイト目でレジスタ番号を設定し、以降はそこから順に読み書きする
+struct MockI2cDevice {
+  uint8_t addr; // 7 ビットアドレス（0 なら未使用）
+  uint8_t regs[256];
+  uint8_t ptr;
+  int hang_after;  // 0 以上なら、受信でこのバイト数を送った後に SDA を L のまま止まる（1 回限り）
+  int hang_clocks; // 止まった後、SDA を放すまでに要る SCL のパルス数
+  bool hung;
+};
+
+struct MockI2cStats {
+  uint32_t ev_irqs;       // イベント割り込みの回数
+  uint32_t er_irqs;       // エラー割り込みの回数
+  uint32_t isr_accesses;  // 割り込みハンドラ内のレジスタアクセス数
+  uint32_t main_accesses; // 割り込みハンドラ外のレジスタアクセス数
+  uint32_t violations;    // プロトコル違反の数
+};
+
+#define MOCK_MAX_DEVICES 4
+
+extern uint32_t mock_now;
+extern char mock_trace[4096];
+extern struct MockI2cStats mock_stats;
+
+// 模擬バスを初期状態に戻す（デバイスも取り除く）
+void MockI2cReset(void);
+// デバイスを追加する（hang_after は -1）
+struct MockI2cDevice *MockI2cAddDevice(uint8_t addr);
+void MockI2cClearTrace(void);
+// 割り込みハンドラの外で時刻を進める（その間の割り込みも処理する）
+void MockI2cRun(uint32_t ticks);
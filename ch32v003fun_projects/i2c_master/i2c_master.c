@@ -0,0 +1,376 @@
+#include "i2c_master.h"
+
+#ifndef I2C_MASTER_MOCK
+
+// ハードウェアへのアクセス（I2C_MASTER_MOCK の場合は i2c_mock.h が模擬バスにつなぐ）
+#define I2C_RD(reg) (I2C1->reg)
+#define I2C_WR(reg, v) (I2C1->reg = (v))
+#define I2C_TICKS_FROM_MS(n) Ticks_from_Ms(n)
+
+static inline uint32_t I2cPortNow(void) {
+  return SysTick->CNT;
+}
+
+static inline void I2cPortIrq(int enable) {
+  if (enable) {
+    NVIC_EnableIRQ(I2C1_EV_IRQn);
+    NVIC_EnableIRQ(I2C1_ER_IRQn);
+  } else {
+    NVIC_DisableIRQ(I2C1_EV_IRQn);
+    NVIC_DisableIRQ(I2C1_ER_IRQn);
+  }
+}
+
+// GPIO ポートと I2C モジュールのクロックを有効化し、I2C モジュールをリセットする
+static void I2cPortClocks(void) {
+  RCC->APB2PCENR |= I2C_GPIO_RCC;
+  RCC->APB1PCENR |= RCC_APB1Periph_I2C1;
+  RCC->APB1PRSTR |= RCC_APB1Periph_I2C1;
+  RCC->APB1PRSTR &= ~RCC_APB1Periph_I2C1;
+}
+
+// SDA と SCL を I2C モジュールにつなぐ（af=1）か、GPIO のオープンドレイン出力にする（af=0）
+static void I2cPortPins(int af) {
+  const uint32_t cfg = GPIO_Speed_10MHz | (af ? GPIO_CNF_OUT_OD_AF : GPIO_CNF_OUT_OD);
+  I2C_GPIO->CFGLR = (I2C_GPIO->CFGLR & ~((0xf << (4*I2C_SDA_PIN)) | (0xf << (4*I2C_SCL_PIN))))
+                  | (cfg << (4*I2C_SDA_PIN)) | (cfg << (4*I2C_SCL_PIN));
+}
+
+static inline void I2cPortScl(int level) {
+  I2C_GPIO->BSHR = (1 << I2C_SCL_PIN) << (level ? 0 : 16);
+}
+
+static inline void I2cPortSda(int level) {
+  I2C_GPIO->BSHR = (1 << I2C_SDA_PIN) << (level ? 0 : 16);
+}
+
+static inline int I2cPortSdaIn(void) {
+  return (I2C_GPIO->INDR >> I2C_SDA_PIN) & 1;
+}
+
+// バス回復で SCL を叩くときの半周期
+static inline void I2cPortDelay(void) {
+  Delay_Us(500000 / I2C_CLKRATE + 1);
+}
+
+#endif
+
+static const char *const i2c_error_strings[] = {
+  "none",
+  "timeout",
+  "nack",
+  "arbitration lost",
+  "bus error",
+  "overrun",
+};
+
+const char *I2cErrorString(enum I2cErrors err) {
+  return i2c_error_strings[err];
+}
+
+// 転送要求のキュー
+// メインループが i2c_q_head に積み、割り込みハンドラが i2c_q_tail から取り出す
+static struct I2cReq *i2c_queue[I2C_QUEUE_LEN];
+static volatile uint8_t i2c_q_head;
+static volatile uint8_t i2c_q_tail;
+static struct I2cReq *volatile i2c_cur; // 転送中の要求（NULL なら停止中）
+static uint8_t i2c_pos;     // i2c_cur の今の段の転送済みバイト数
+static uint8_t i2c_reading; // i2c_cur が受信段なら 1
+static volatile uint32_t i2c_last_event; // 最後に転送が進んだ時刻（I2cPoll のタイムアウト判定用）
+
+// 前の転送のストップコンディション送出を待つ回数の上限
+#define I2C_STOP_WAIT_MAX 1000
+
+// I2C モジュールのレジスタを設定して有効化する
+static void I2cSetupRegs(void) {
+  uint16_t tempreg;
+
+  // I2C モジュールのクロックを設定
+  I2C_WR(CTLR2, (FUNCONF_SYSTEM_CORE_CLOCK/I2C_PRERATE) & I2C_CTLR2_FREQ);
+
+  // I2C 通信速度を設定
+#if (I2C_CLKRATE <= 100000)
+  // 標準モード（<=100kHz）
+  tempreg = (FUNCONF_SYSTEM_CORE_CLOCK/(2*I2C_CLKRATE)) & I2C_CKCFGR_CCR;
+#else
+  // 高速モード（>100kHz）
+#  ifdef I2C_DUTY_16_9
+  tempreg = (FUNCONF_SYSTEM_CORE_CLOCK/(25*I2C_CLKRATE)) & I2C_CKCFGR_CCR;
+  tempreg |= I2C_CKCFGR_DUTY;
+#  else
+  // 33.3% duty cycle
+  tempreg = (FUNCONF_SYSTEM_CORE_CLOCK/(3*I2C_CLKRATE)) & I2C_CKCFGR_CCR;
+#  endif
+  tempreg |= I2C_CKCFGR_FS;
+#endif
+  I2C_WR(CKCFGR, tempreg);
+
+  // I2C1 モジュールを有効化
+  I2C_WR(CTLR1, I2C_RD(CTLR1) | I2C_CTLR1_PE);
+
+  // ACK 応答を有効化（PE=1 にした後に設定しなければならない）
+  I2C_WR(CTLR1, I2C_RD(CTLR1) | I2C_CTLR1_ACK);
+}
+
+void I2cSetup(void) {
+  I2cPortClocks();
+  I2cPortPins(1);
+  I2cSetupRegs();
+  I2cPortIrq(1);
+}
+
+// 受信段の ACK を設定する（アドレスを送る前に呼ぶ）
+// 2 バイトの場合は POS を立て、1 バイト目を受信しながら 2 バイト目への NACK を予約できるようにする
+static void I2cPrepareRead(uint8_t len) {
+  if (len == 2) {
+    I2C_WR(CTLR1, I2C_RD(CTLR1) | I2C_CTLR1_POS | I2C_CTLR1_ACK);
+  } else {
+    I2C_WR(CTLR1, (I2C_RD(CTLR1) & ~I2C_CTLR1_POS) | I2C_CTLR1_ACK);
+  }
+}
+
+// キューの先頭の要求の転送を始める（I2C 割り込みを禁止した状態か、割り込みハンドラから呼ぶ）
+static void I2cStartNext(void) {
+  if (i2c_cur != NULL || i2c_q_tail == i2c_q_head) {
+    return;
+  }
+  // 前の転送のストップコンディションが出終わるまで、スタートを要求できない
+  for (int i = 0; i < I2C_STOP_WAIT_MAX && (I2C_RD(CTLR1) & I2C_CTLR1_STOP); i++);
+
+  struct I2cReq *req = i2c_queue[i2c_q_tail];
+  i2c_cur = req;
+  i2c_pos = 0;
+  i2c_reading = req->wlen == 0 && req->rlen > 0;
+  req->status = I2CREQ_BUSY;
+  i2c_last_event = I2cPortNow();
+  I2C_WR(CTLR2, (I2C_RD(CTLR2) & ~I2C_CTLR2_ITBUFEN) | I2C_CTLR2_ITEVTEN | I2C_CTLR2_ITERREN);
+  I2C_WR(CTLR1, I2C_RD(CTLR1) | I2C_CTLR1_START);
+}
+
+// 転送中の要求を終え、次の要求を始める（割り込みハンドラか、割り込みを禁止した状態で呼ぶ）
+static void I2cFinish(enum I2cErrors err) {
+  struct I2cReq *req = i2c_cur;
+  I2C_WR(CTLR2, I2C_RD(CTLR2) & ~I2C_CTLR2_ITBUFEN);
+  I2C_WR(CTLR1, I2C_RD(CTLR1) & ~I2C_CTLR1_POS);
+  req->err = err;
+  i2c_cur = NULL;
+  i2c_q_tail = (i2c_q_tail + 1) & (I2C_QUEUE_LEN - 1);
+  req->status = err == I2CERR_NONE ? I2CREQ_DONE : I2CREQ_ERROR;
+  if (req->done) {
+    req->done(req);
+  }
+  I2cStartNext();
+}
+
+// 受信段のイベント
+static void I2cEventRead(struct I2cReq *req, uint16_t star1) {
+  const uint8_t left = req->rlen - i2c_pos;
+  if ((I2C_RD(CTLR2) & I2C_CTLR2_ITBUFEN) && (star1 & I2C_STAR1_RXNE)) {
+    // 残りが 3 バイトになるまでは 1 バイトずつ読む
+    req->rdata[i2c_pos++] = I2C_RD(DATAR);
+    if (left == 1) {
+      I2cFinish(I2CERR_NONE);
+    } else if (left - 1 == 3) {
+      I2C_WR(CTLR2, I2C_RD(CTLR2) & ~I2C_CTLR2_ITBUFEN);
+    }
+  } else if (star1 & I2C_STAR1_BTF) {
+    if (left == 3) {
+      // N-2 バイト目を読むと N-1 バイト目の受信が進むので、その前に NACK を予約する
+      I2C_WR(CTLR1, I2C_RD(CTLR1) & ~I2C_CTLR1_ACK);
+      req->rdata[i2c_pos++] = I2C_RD(DATAR);
+    } else if (left == 2) {
+      I2C_WR(CTLR1, I2C_RD(CTLR1) | I2C_CTLR1_STOP);
+      req->rdata[i2c_pos++] = I2C_RD(DATAR);
+      req->rdata[i2c_pos++] = I2C_RD(DATAR);
+      I2cFinish(I2CERR_NONE);
+    }
+  }
+}
+
+// 送信段のイベント
+static void I2cEventWrite(struct I2cReq *req, uint16_t star1) {
+  if (i2c_pos < req->wlen && (star1 & I2C_STAR1_TXE)) {
+    I2C_WR(DATAR, req->wdata[i2c_pos++]);
+    if (i2c_pos == req->wlen) {
+      // 最後のバイトの送信完了（BTF）を待つ
+      I2C_WR(CTLR2, I2C_RD(CTLR2) & ~I2C_CTLR2_ITBUFEN);
+    }
+  } else if (i2c_pos == req->wlen && (star1 & I2C_STAR1_BTF)) {
+    if (req->rlen > 0) {
+      // ストップを挟まずに受信段へ（リピーテッドスタート）
+      i2c_reading = 1;
+      i2c_pos = 0;
+      I2C_WR(CTLR1, I2C_RD(CTLR1) | I2C_CTLR1_START);
+    } else {
+      I2C_WR(CTLR1, I2C_RD(CTLR1) | I2C_CTLR1_STOP);
+      I2cFinish(I2CERR_NONE);
+    }
+  }
+}
+
+void I2C1_EV_IRQHandler(void) {
+  const uint16_t star1 = I2C_RD(STAR1);
+  struct I2cReq *req = i2c_cur;
+  if (req == NULL) {
+    // 転送中でなければ何もしない
+    I2C_WR(CTLR2, I2C_RD(CTLR2) & ~(I2C_CTLR2_ITEVTEN | I2C_CTLR2_ITBUFEN));
+    return;
+  }
+  i2c_last_event = I2cPortNow();
+
+  if (star1 & I2C_STAR1_SB) {
+    // スタートコンディションを送ったので、7 ビットアドレスと R/W フラグを送る
+    if (i2c_reading) {
+      I2cPrepareRead(req->rlen);
+    }
+    I2C_WR(DATAR, req->addr << 1 | i2c_reading);
+    return;
+  }
+
+  if (star1 & I2C_STAR1_ADDR) {
+    // STAR1 に続けて STAR2 を読むと ADDR がクリアされる。
+    // 受信の最後のバイトに NACK を返すため、ACK と STOP の設定は読む順序が決まっている。
+    if (i2c_reading && req->rlen == 1) {
+      I2C_WR(CTLR1, I2C_RD(CTLR1) & ~I2C_CTLR1_ACK);
+      (void)I2C_RD(STAR2);
+      I2C_WR(CTLR1, I2C_RD(CTLR1) | I2C_CTLR1_STOP);
+      I2C_WR(CTLR2, I2C_RD(CTLR2) | I2C_CTLR2_ITBUFEN);
+    } else if (i2c_reading && req->rlen == 2) {
+      (void)I2C_RD(STAR2);
+      I2C_WR(CTLR1, I2C_RD(CTLR1) & ~I2C_CTLR1_ACK);
+      // 2 バイト揃う（BTF）まで待つ
+    } else if (i2c_reading) {
+      (void)I2C_RD(STAR2);
+      if (req->rlen > 3) {
+        I2C_WR(CTLR2, I2C_RD(CTLR2) | I2C_CTLR2_ITBUFEN);
+      }
+    } else if (req->wlen == 0) {
+      // アドレスだけの転送
+      (void)I2C_RD(STAR2);
+      I2C_WR(CTLR1, I2C_RD(CTLR1) | I2C_CTLR1_STOP);
+      I2cFinish(I2CERR_NONE);
+    } else {
+      (void)I2C_RD(STAR2);
+      I2C_WR(CTLR2, I2C_RD(CTLR2) | I2C_CTLR2_ITBUFEN);
+    }
+    return;
+  }
+
+  if (i2c_reading) {
+    I2cEventRead(req, star1);
+  } else {
+    I2cEventWrite(req, star1);
+  }
+}
+
+void I2C1_ER_IRQHandler(void) {
+  const uint16_t star1 = I2C_RD(STAR1);
+  // エラーフラグは 0 を書いてクリアする
+  I2C_WR(STAR1, ~(star1 & (I2C_STAR1_BERR | I2C_STAR1_ARLO | I2C_STAR1_AF | I2C_STAR1_OVR)));
+
+  enum I2cErrors err = I2CERR_BUS;
+  if (star1 & I2C_STAR1_AF) {
+    // NACK を受けたら、マスタがストップコンディションを送る
+    I2C_WR(CTLR1, I2C_RD(CTLR1) | I2C_CTLR1_STOP);
+    err = I2CERR_NACK;
+  } else if (star1 & I2C_STAR1_ARLO) {
+    err = I2CERR_ARBITRATION_LOST;
+  } else if (star1 & I2C_STAR1_OVR) {
+    err = I2CERR_OVERRUN;
+  }
+  if (i2c_cur != NULL) {
+    I2cFinish(err);
+  }
+}
+
+int I2cSubmit(struct I2cReq *req) {
+  const uint8_t head = i2c_q_head;
+  const uint8_t next = (head + 1) & (I2C_QUEUE_LEN - 1);
+  if (next == i2c_q_tail) {
+    return 1;
+  }
+  req->status = I2CREQ_QUEUED;
+  req->err = I2CERR_NONE;
+  i2c_queue[head] = req;
+
+  I2cPortIrq(0);
+  i2c_q_head = next;
+  I2cStartNext();
+  I2cPortIrq(1);
+  return 0;
+}
+
+/*
+ * バスを回復する（I2C 割り込みを禁止した状態で呼ぶ）
+ *
+ * 受信の途中でマスタが止まると、スレーブは次のビットを出そうと SDA を L に保ったままになり、
+ * I2C モジュールをリセットしてもスタートコンディションを出せない。
+ * そこで端子を GPIO に切り替え、SDA が放されるまで SCL を最大 9 回叩いてから
+ * ストップコンディションを出し、I2C モジュールをソフトウェアリセットして設定し直す。
+ */
+static void I2cRecoverBus(void) {
+  I2C_WR(CTLR1, 0);
+  I2cPortSda(1);
+  I2cPortScl(1);
+  I2cPortPins(0);
+  I2cPortDelay();
+  for (int i = 0; i < 9 && !I2cPortSdaIn(); i++) {
+    I2cPortScl(0);
+    I2cPortDelay();
+    I2cPortScl(1);
+    I2cPortDelay();
+  }
+  // SCL が H の間に SDA を L から H にする
+  I2cPortScl(0);
+  I2cPortDelay();
+  I2cPortSda(0);
+  I2cPortDelay();
+  I2cPortScl(1);
+  I2cPortDelay();
+  I2cPortSda(1);
+  I2cPortDelay();
+  I2cPortPins(1);
+
+  I2C_WR(CTLR1, I2C_CTLR1_SWRST);
+  I2C_WR(CTLR1, 0);
+  I2cSetupRegs();
+}
+
+void I2cPoll(void) {
+  const uint32_t timeout = I2C_TICKS_FROM_MS(I2C_TIMEOUT_MS);
+  if (i2c_cur == NULL || I2cPortNow() - i2c_last_event <= timeout) {
+    return;
+  }
+  I2cPortIrq(0);
+  // 割り込みを禁止する直前に進んだかもしれないので、確かめ直す
+  if (i2c_cur != NULL && I2cPortNow() - i2c_last_event > timeout) {
+    I2cRecoverBus();
+    I2cFinish(I2CERR_TIMEOUT);
+  }
+  I2cPortIrq(1);
+}
+
+int I2cWait(struct I2cReq *req) {
+  while (req->status == I2CREQ_QUEUED || req->status == I2CREQ_BUSY) {
+    I2cPoll();
+  }
+  return req->status == I2CREQ_ERROR;
+}
+
+int I2cWriteRead(uint8_t addr, const uint8_t *wdata, uint8_t wlen, uint8_t *rdata, uint8_t rlen) {
+  struct I2cReq req = {
+    .addr = addr, .wlen = wlen, .rlen = rlen, .wdata = wdata, .rdata = rdata,
+  };
+  if (I2cSubmit(&req)) {
+    return 1;
+  }
+  return I2cWait(&req);
+}
+
+int I2cWrite(uint8_t addr, const uint8_t *data, uint8_t len) {
+  return I2cWriteRead(addr, data, len, NULL, 0);
+}
+
+int I2cRead(uint8_t addr, uint8_t *data, uint8_t len) {
+  return I2cWriteRead(addr, NULL, 0, data, len);
+}
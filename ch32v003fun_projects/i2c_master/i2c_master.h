@@ -0,0 +1,157 @@
+#pragma once
+
+/*
+ * I2C マスタ（I2C1、割り込み駆動、非同期の要求キュー付き）
+ *
+ * 転送要求（struct I2cReq）をキューに積むと、割り込みハンドラが順に転送し、完了を通知する。
+ * 1 つの要求は「送信 → リピーテッドスタート → 受信」の組み合わせトランザクションにできるので、
+ * レジスタアドレスを書いてから読む、という典型的な読み出しがストップを挟まずに済む。
+ *
+ * 転送が I2C_TIMEOUT_MS 進まなければ、I2cPoll がバスを回復する（SCL を最大 9 回叩いて
+ * スレーブが握っている SDA を放させ、ストップコンディションを出す）。
+ * エラーになるのはその要求だけで、キューの残りはそのまま続く。
+ *
+ * 使い方（プロジェクトの Makefile）:
+ *   ADDITIONAL_C_FILES:=../i2c_master/i2c_master.c
+ *   EXTRA_CFLAGS:=-I../i2c_master
+ * 設定は funconfig.h で下記のマクロを定義して変える。
+ *
+ * I2C_MASTER_MOCK を定義すると、ハードウェアの代わりに host/i2c_mock.c の模擬バスを使う
+ * （ホスト（Linux）上のテスト用）。
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef I2C_MASTER_MOCK
+#include "i2c_mock.h"
+#else
+#include "ch32fun.h"
+#endif
+
+// I2C 通信速度（I2C モジュールのクロック周波数より低くなければならない）
+#ifndef I2C_CLKRATE
+#define I2C_CLKRATE 100000
+#endif
+
+// I2C モジュールのクロック周波数（2～36MHz で、通信速度より高くなければならない）
+#ifndef I2C_PRERATE
+#define I2C_PRERATE 2000000
+#endif
+
+// 高速クロックの際に 36% デューティにする場合は I2C_DUTY_16_9 を定義する（デフォルトは 33%）
+
+// 転送が進まないとみなしてバスを回復するまでの時間（ミリ秒）
+#ifndef I2C_TIMEOUT_MS
+#define I2C_TIMEOUT_MS 10
+#endif
+
+// 転送要求のキューの長さ（2 の冪。積めるのは I2C_QUEUE_LEN - 1 個）
+#ifndef I2C_QUEUE_LEN
+#define I2C_QUEUE_LEN 4
+#endif
+
+// SDA と SCL の端子（同じポートの 0～7 番）
+#ifndef I2C_GPIO
+#  if defined(CH32V003)
+#    define I2C_GPIO GPIOC
+#    define I2C_GPIO_RCC RCC_APB2Periph_GPIOC
+#    define I2C_SDA_PIN 1
+#    define I2C_SCL_PIN 2
+#  else
+#    define I2C_GPIO GPIOB
+#    define I2C_GPIO_RCC RCC_APB2Periph_GPIOB
+#    define I2C_SDA_PIN 7
+#    define I2C_SCL_PIN 6
+#  endif
+#endif
+
+// I2C エラー定義
+enum I2cErrors {
+  I2CERR_NONE,
+  I2CERR_TIMEOUT,
+  I2CERR_NACK,
+  I2CERR_ARBITRATION_LOST,
+  I2CERR_BUS,
+  I2CERR_OVERRUN,
+};
+
+// I2C 転送要求の状態
+enum I2cReqStatus {
+  I2CREQ_QUEUED, // キューで順番を待っている
+  I2CREQ_BUSY,   // 転送中
+  I2CREQ_DONE,   // 正常に完了した
+  I2CREQ_ERROR,  // エラーで終わった（原因は err）
+};
+
+struct I2cReq;
+
+/*
+ * 転送完了時に呼ばれる
+ *
+ * 通常は I2C 割り込みハンドラから、タイムアウトの場合は I2cPoll の呼び出し元から呼ばれる。
+ * 時間のかかる処理はしないこと。
+ */
+typedef void (*I2cDoneFunc)(struct I2cReq *req);
+
+/*
+ * I2C 転送要求（完了するまで呼び出し側が保持する）
+ *
+ * wlen バイトを送信してから、リピーテッドスタートで rlen バイトを受信する。
+ * どちらかが 0 ならその段は省き、両方 0 ならアドレスだけ送る（デバイスの有無の確認）。
+ */
+struct I2cReq {
+  uint8_t addr;  // 7 ビットアドレス
+  uint8_t wlen;  // 送信するバイト数
+  uint8_t rlen;  // 受信するバイト数
+  const uint8_t *wdata;
+  uint8_t *rdata;
+  I2cDoneFunc done; // NULL なら呼ばない
+  void *user;       // 呼び出し側が自由に使える
+  volatile enum I2cReqStatus status;
+  enum I2cErrors err;
+};
+
+// I2C モジュールと端子を初期化し、割り込みを有効化する
+void I2cSetup(void);
+
+/*
+ * 転送要求をキューに積み、I2C が停止中なら転送を始める
+ *
+ * 完了すると req->status が I2CREQ_DONE か I2CREQ_ERROR になり、req->done が呼ばれる。
+ * 割り込みハンドラ（req->done を含む）からは呼ばないこと。
+ * ただし、メインループが積まない間は、I2C 割り込みと同じ優先度（入れ子にならない）の
+ * 割り込みハンドラ 1 つから呼んでよい。
+ * @return  積めたら 0、キューが満杯なら 1
+ */
+int I2cSubmit(struct I2cReq *req);
+
+/*
+ * 転送中の要求が I2C_TIMEOUT_MS 以上進んでいなければ、バスを回復してその要求をエラーで終える
+ *
+ * 完了を待たずに要求を積む場合は、メインループから定期的に呼ぶこと（I2cWait は自分で呼ぶ）。
+ */
+void I2cPoll(void);
+
+/*
+ * 要求の完了を待つ
+ *
+ * @return  正常に完了したら 0、エラーなら 1（原因は req->err）
+ */
+int I2cWait(struct I2cReq *req);
+
+// 完了を待つ転送（@return  正常に完了したら 0、エラーなら 1）
+int I2cWrite(uint8_t addr, const uint8_t *data, uint8_t len);
+int I2cRead(uint8_t addr, uint8_t *data, uint8_t len);
+int I2cWriteRead(uint8_t addr, const uint8_t *wdata, uint8_t wlen, uint8_t *rdata, uint8_t rlen);
+
+// エラーの名前
+const char *I2cErrorString(enum I2cErrors err);
+
+#ifdef I2C_MASTER_MOCK
+void I2C1_EV_IRQHandler(void);
+void I2C1_ER_IRQHandler(void);
+#else
+void I2C1_EV_IRQHandler(void) __attribute__((interrupt));
+void I2C1_ER_IRQHandler(void) __attribute__((interrupt));
+#endif
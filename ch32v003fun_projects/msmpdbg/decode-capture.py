@@ -0,0 +1,489 @@
+#!/usr/bin/python3
+
+'''msmpdbg の "dump rec bin" または "stream rec" の出力をデコードする
+
+使い方:
+    # msmpdbg に直接接続して取り込む
+    $ ./decode-capture.py --port /dev/ttyACM0 --vcd rec.vcd --csv rec.csv
+    # 保存しておいたバイト列をデコードする
+    $ ./decode-capture.py rec.bin --vcd rec.vcd
+    # ストリーミングで取り込み続け、受信したバイト列をファイルへ書く（Ctrl-C で終了）
+    $ ./decode-capture.py --port /dev/ttyACM0 --stream --save stream.bin --vcd stream.vcd
+
+フレーム形式は msmpdbg.h の DumpRecordBinary のコメントを参照。
+'''
+
+import argparse
+from dataclasses import dataclass, field
+import os
+import struct
+import sys
+import termios
+import time
+
+MAGIC = b'\xA5\x5A'
+FRAME_HEADER = 1
+FRAME_SIG = 2
+FRAME_MSG = 3
+FRAME_END = 4
+FRAME_STREAM = 5
+
+SIG_DELTA_CONT = 0x8000
+SIG_DELTA_MASK = 0x7fff
+SIG_DELTA_BITS = 15
+
+verbose = False
+
+def crc16(data, crc=0xffff):
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xffff
+    return crc
+
+@dataclass
+class Capture:
+    baudrate: int = 0
+    rate: int = 0
+    start_tick: int = 0
+    last_tick: int = 0
+    edges: int = 0
+    trig_tick: int = None
+    sig_words: list = field(default_factory=list)
+    messages: list = field(default_factory=list)
+    frames: int = 0
+    errors: list = field(default_factory=list)
+    complete: bool = False
+    end_stream: tuple = None # ストリーミングの END に含まれる (信号変化の回数, 捨てた数)
+    # ストリーミングの場合は (通し番号, 基準時刻, 信号変化の回数, 捨てた数, 要素の列) の列
+    chunks: list = field(default_factory=list)
+
+def parse_frames(data, partial=False):
+    '''バイト列からフレームを切り出す。フレーム以外のバイト（テキスト出力など）は読み飛ばす。
+
+    (type, seq, payload) の列を返す。CRC が合わないフレームは捨てる。
+    partial が真なら、末尾の途中までのフレームはエラーにせず、その先頭の位置も返す。
+    '''
+    frames = []
+    errors = []
+    i = 0
+    while True:
+        i = data.find(MAGIC, i)
+        if i < 0:
+            i = max(len(data) - 1, 0)
+            break
+        if i + 6 > len(data):
+            break
+        ftype, seq, length = struct.unpack_from('<BBH', data, i + 2)
+        end = i + 6 + length + 2
+        if end > len(data):
+            if not partial:
+                errors.append(f'truncated frame at offset {i}')
+            break
+        payload = data[i + 6:end - 2]
+        crc, = struct.unpack_from('<H', data, end - 2)
+        if crc16(data[i + 2:end - 2]) != crc:
+            errors.append(f'CRC error at offset {i} (seq={seq})')
+            i += 1
+            continue
+        frames.append((ftype, seq, payload))
+        i = end
+    if partial:
+        return frames, errors, i
+    return frames, errors
+
+def build_capture(frames, errors):
+    cap = Capture(errors=errors)
+    prev_seq = None
+    for ftype, seq, payload in frames:
+        if ftype == FRAME_HEADER:
+            # 新しいダンプの開始
+            cap = Capture(errors=cap.errors)
+            prev_seq = None
+            (version, cap.baudrate, cap.rate, cap.start_tick, cap.last_tick,
+             cap.edges, sig_len) = struct.unpack_from('<BIIIIII', payload)
+            if version not in (1, 2, 3):
+                raise ValueError(f'Unsupported version: {version}')
+            if version >= 2:
+                cap.trig_tick, = struct.unpack_from('<I', payload, 25)
+            cap.sig_words = [None] * sig_len
+        if prev_seq is not None and seq != (prev_seq + 1) & 0xff:
+            cap.errors.append(f'{(seq - prev_seq - 1) & 0xff} frame(s) lost before seq={seq}')
+        prev_seq = seq
+        cap.frames += 1
+
+        if ftype == FRAME_SIG:
+            offset, = struct.unpack_from('<I', payload)
+            words = struct.unpack_from(f'<{(len(payload) - 4) // 2}H', payload, 4)
+            cap.sig_words[offset:offset + len(words)] = words
+        elif ftype == FRAME_MSG:
+            pos = 0
+            while pos < len(payload):
+                start_tick, addr, length = struct.unpack_from('<IBB', payload, pos)
+                pos += 6
+                cap.messages.append((start_tick, addr, bytes(payload[pos:pos + length])))
+                pos += length
+        elif ftype == FRAME_STREAM:
+            index, start_tick, edges, dropped = struct.unpack_from('<IIII', payload)
+            words = struct.unpack_from(f'<{(len(payload) - 16) // 2}H', payload, 16)
+            cap.chunks.append((index, start_tick, edges, dropped, words))
+        elif ftype == FRAME_END:
+            num, = struct.unpack_from('<H', payload)
+            if num != (cap.frames - 1) & 0xffff:
+                cap.errors.append(f'expected {num} frames before END, got {cap.frames - 1}')
+            if len(payload) >= 10:
+                cap.end_stream = struct.unpack_from('<II', payload, 2)
+            cap.complete = True
+    return cap
+
+def decode_stream_edges(cap):
+    '''BFRAME_STREAM の列から (時刻, 変化後の信号) の列を作る
+
+    各半分は先頭の基準時刻と信号変化の回数から単独で復号できるので、
+    欠落があってもその後の半分は正しい時刻で復号する。
+    '''
+    edges = []
+    next_index = 0
+    next_edges = None
+    prev_dropped = 0
+    for index, start_tick, n, dropped, words in cap.chunks:
+        if index != next_index:
+            cap.errors.append(f'{index - next_index} stream chunk(s) lost before #{index}')
+        if dropped != prev_dropped:
+            cap.errors.append(f'overrun: {dropped - prev_dropped} edges dropped by msmpdbg '
+                              f'before chunk #{index}')
+        elif next_edges is not None and n != next_edges:
+            cap.errors.append(f'{n - next_edges} edges missing before chunk #{index}')
+        if next_edges is None:
+            cap.start_tick = start_tick
+            if n == 1:
+                # 最初の立ち下がり
+                edges.append((start_tick, 0))
+        tick = start_tick
+        delta = 0
+        for w in words:
+            delta = (delta << SIG_DELTA_BITS) | (w & SIG_DELTA_MASK)
+            if w & SIG_DELTA_CONT:
+                continue
+            tick = (tick + delta) & 0xffffffff
+            # n 回目の信号変化の後の値は、n が奇数なら 0
+            n += 1
+            edges.append((tick, (n & 1) ^ 1))
+            delta = 0
+        next_index = index + 1
+        next_edges = n
+        prev_dropped = dropped
+    if cap.end_stream is not None and next_edges is not None:
+        end_edges, end_dropped = cap.end_stream
+        if end_dropped != prev_dropped:
+            cap.errors.append(f'overrun: {end_dropped - prev_dropped} edges dropped by msmpdbg '
+                              f'after the last chunk')
+        elif end_edges != next_edges:
+            cap.errors.append(f'{end_edges - next_edges} edges missing after the last chunk')
+    cap.edges = next_edges or 0
+    cap.trig_tick = None
+    return edges
+
+def decode_edges(cap):
+    '''sig_buf の差分列から (時刻, 変化後の信号) の列を作る'''
+    if cap.chunks:
+        return decode_stream_edges(cap)
+    if cap.edges == 0:
+        return []
+    if None in cap.sig_words:
+        cap.errors.append('some sig_buf words are missing; edges after the gap are dropped')
+        cap.sig_words = cap.sig_words[:cap.sig_words.index(None)]
+    edges = [(cap.start_tick, 0)]
+    tick = cap.start_tick
+    delta = 0
+    for w in cap.sig_words:
+        delta = (delta << SIG_DELTA_BITS) | (w & SIG_DELTA_MASK)
+        if w & SIG_DELTA_CONT:
+            continue
+        tick = (tick + delta) & 0xffffffff
+        edges.append((tick, len(edges) & 1))
+        delta = 0
+    return edges
+
+def decode_uart(edges, cap):
+    '''信号変化の列から UART のバイト列 (時刻, 値) を復元する'''
+    if not edges:
+        return []
+    bit_ticks = cap.rate / cap.baudrate
+    times = [t - cap.start_tick for t, _ in edges]
+
+    def level_at(t):
+        # t 以前で最後の信号変化の値。記録開始前はアイドル（1）
+        lo, hi = 0, len(times)
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if times[mid] <= t:
+                lo = mid + 1
+            else:
+                hi = mid
+        return 1 if lo == 0 else edges[lo - 1][1]
+
+    result = []
+    i = 0
+    while i < len(edges):
+        t0, sig = edges[i]
+        if sig != 0:
+            i += 1
+            continue
+        start = times[i]
+        value = 0
+        for bit in range(8):
+            value |= level_at(start + bit_ticks * (1.5 + bit)) << bit
+        if level_at(start + bit_ticks * 9.5) != 1:
+            cap.errors.append(f'framing error at tick {t0}')
+        result.append((t0, value))
+        # ストップビットの中央より後の最初の立ち下がりへ進む
+        stop = start + bit_ticks * 9.5
+        while i < len(edges) and times[i] < stop:
+            i += 1
+    return result
+
+def decode_msmp(uart_bytes):
+    '''UART のバイト列を MSMP メッセージ (時刻, addr, body) に区切る
+
+    msmp_proto.c の MSMPProcByte と同じく、LEN 以外の位置の 0 は TSM による強制復旧とみなす。
+    '''
+    msgs = []
+    state = 'ADDR'
+    cur = None
+    for t, c in uart_bytes:
+        if c == 0 and state != 'LEN':
+            msgs.append((t, None, b''))
+            state = 'ADDR'
+            continue
+        if state == 'ADDR':
+            cur = [t, c, 0, bytearray()]
+            state = 'LEN'
+        elif state == 'LEN':
+            cur[2] = c
+            if c == 0:
+                msgs.append((cur[0], cur[1], b''))
+                state = 'ADDR'
+            else:
+                state = 'BODY'
+        else:
+            cur[3].append(c)
+            if len(cur[3]) == cur[2]:
+                msgs.append((cur[0], cur[1], bytes(cur[3])))
+                state = 'ADDR'
+    if state != 'ADDR':
+        msgs.append((cur[0], cur[1], bytes(cur[3])))
+    return msgs
+
+def format_body(body):
+    return ''.join(chr(c) if 0x20 <= c <= 0x7e else f'\\x{c:02X}' for c in body)
+
+def format_msg(t, addr, body, cap):
+    sec = (t - cap.start_tick) / cap.rate
+    if addr is None:
+        return f'{sec:10.6f}s TSM reset'
+    return (f'{sec:10.6f}s addr={addr:02x} (dst={addr >> 4} src={addr & 15}) '
+            f'len={len(body)} body={format_body(body)}')
+
+def write_csv(path, edges, cap):
+    with open(path, 'w') as f:
+        f.write('time_s,tick,level\n')
+        for t, sig in edges:
+            f.write(f'{(t - cap.start_tick) / cap.rate:.9f},{t},{sig}\n')
+
+def write_vcd(path, edges, uart_bytes, cap):
+    # 1 tick を整数の ns で表せない場合もあるので、時刻は ns に丸める
+    def ns(t):
+        return round((t - cap.start_tick) * 1e9 / cap.rate)
+    changes = [(ns(t), 'r', f'{sig}!') for t, sig in edges]
+    changes += [(ns(t), 'b', f'b{c:08b} "') for t, c in uart_bytes]
+    if cap.trig_tick is not None and cap.trig_tick >= cap.start_tick:
+        changes += [(ns(cap.trig_tick), 't', '1#')]
+    changes.sort(key=lambda x: (x[0], x[1]))
+    with open(path, 'w') as f:
+        f.write('$timescale 1ns $end\n')
+        f.write('$scope module msmpdbg $end\n')
+        f.write('$var wire 1 ! rx $end\n')
+        f.write('$var wire 8 " byte $end\n')
+        f.write('$var wire 1 # trigger $end\n')
+        f.write('$upscope $end\n$enddefinitions $end\n')
+        f.write('#0\n$dumpvars\n1!\nbxxxxxxxx "\n0#\n$end\n')
+        prev = None
+        for t, _, v in changes:
+            if t != prev:
+                f.write(f'#{t}\n')
+                prev = t
+            f.write(v + '\n')
+
+def open_port(port):
+    fd = os.open(port, os.O_RDWR | os.O_NOCTTY)
+    attr = termios.tcgetattr(fd)
+    attr[0] = 0 # iflag
+    attr[1] = 0 # oflag
+    attr[2] = termios.CS8 | termios.CREAD | termios.CLOCAL # cflag
+    attr[3] = 0 # lflag
+    attr[4] = attr[5] = termios.B115200
+    attr[6][termios.VMIN] = 0
+    attr[6][termios.VTIME] = 1
+    termios.tcsetattr(fd, termios.TCSANOW, attr)
+    termios.tcflush(fd, termios.TCIOFLUSH)
+    return fd
+
+def read_port(port, timeout):
+    '''msmpdbg に "dump rec bin" を送り、END フレームまで受信する'''
+    fd = open_port(port)
+    try:
+        os.write(fd, b'dump rec bin\r')
+
+        data = bytearray()
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            chunk = os.read(fd, 4096)
+            if chunk:
+                data += chunk
+                deadline = time.monotonic() + timeout
+                frames, _ = parse_frames(data)
+                if frames and frames[-1][0] == FRAME_END:
+                    break
+        return bytes(data)
+    finally:
+        os.close(fd)
+
+def stream_port(port, save, duration, timeout):
+    '''msmpdbg に "stream rec" を送り、受信したバイト列を save へ書き続ける
+
+    duration 秒経つか Ctrl-C で "stop rec" を送り、END フレームまで受信する。
+    受信しながらフレームを検査し、欠落や msmpdbg 側のオーバーランを表示する。
+    '''
+    fd = open_port(port)
+    data = bytearray()
+    pending = bytearray() # まだフレームとして切り出していないバイト列
+    next_index = 0
+    dropped = 0
+    ended = False
+
+    def receive(f):
+        nonlocal pending, next_index, dropped, ended
+        chunk = os.read(fd, 4096)
+        if not chunk:
+            return False
+        f.write(chunk)
+        f.flush()
+        data.extend(chunk)
+        pending += chunk
+        frames, errors, pos = parse_frames(pending, partial=True)
+        del pending[:pos]
+        for e in errors:
+            print(f'\nError: {e}', file=sys.stderr)
+        for ftype, seq, payload in frames:
+            if ftype == FRAME_END:
+                ended = True
+            if ftype != FRAME_STREAM:
+                continue
+            index, _, edges, chunk_dropped = struct.unpack_from('<IIII', payload)
+            if index != next_index:
+                print(f'\nError: {index - next_index} chunk(s) lost before #{index}',
+                      file=sys.stderr)
+            if chunk_dropped != dropped:
+                print(f'\nOverrun: {chunk_dropped - dropped} edges dropped before #{index}',
+                      file=sys.stderr)
+            next_index = index + 1
+            dropped = chunk_dropped
+            print(f'\r{next_index} chunks, {edges} edges, {dropped} dropped',
+                  end='', file=sys.stderr)
+        return True
+
+    try:
+        with open(save, 'wb') as f:
+            os.write(fd, b'stream rec\r')
+            deadline = time.monotonic() + duration if duration else None
+            try:
+                while deadline is None or time.monotonic() < deadline:
+                    receive(f)
+            except KeyboardInterrupt:
+                pass
+            os.write(fd, b'stop rec\r')
+            deadline = time.monotonic() + timeout
+            while not ended and time.monotonic() < deadline:
+                if receive(f):
+                    deadline = time.monotonic() + timeout
+            print(file=sys.stderr)
+        return bytes(data)
+    finally:
+        os.close(fd)
+
+def main():
+    global verbose
+    parser = argparse.ArgumentParser(description='Decode binary capture of msmpdbg')
+    parser.add_argument('input', nargs='?', help='captured byte stream (default: stdin)')
+    parser.add_argument('--port', help='read from msmpdbg connected to this tty')
+    parser.add_argument('--timeout', type=float, default=2.0,
+                        help='seconds without data before giving up (with --port)')
+    parser.add_argument('--stream', action='store_true',
+                        help='stream the signal until Ctrl-C (with --port, requires --save)')
+    parser.add_argument('--duration', type=float,
+                        help='stop streaming after this many seconds (with --stream)')
+    parser.add_argument('--save', help='save the raw byte stream to this file')
+    parser.add_argument('--csv', help='write edges as CSV')
+    parser.add_argument('--vcd', help='write edges and decoded bytes as VCD')
+    parser.add_argument('--bytes', help='write decoded UART bytes as a raw byte stream '
+                        '(can be replayed by host/msmp-bench)')
+    parser.add_argument('-v', '--verbose', action='store_true')
+    args = parser.parse_args()
+    verbose = args.verbose
+
+    if args.stream:
+        if not args.port or not args.save:
+            parser.error('--stream requires --port and --save')
+        data = stream_port(args.port, args.save, args.duration, args.timeout)
+    elif args.port:
+        data = read_port(args.port, args.timeout)
+    elif args.input:
+        with open(args.input, 'rb') as f:
+            data = f.read()
+    else:
+        data = sys.stdin.buffer.read()
+    if args.save and not args.stream:
+        with open(args.save, 'wb') as f:
+            f.write(data)
+
+    frames, errors = parse_frames(data)
+    cap = build_capture(frames, errors)
+    if cap.rate == 0:
+        print('No header frame found', file=sys.stderr)
+        return 1
+
+    edges = decode_edges(cap)
+    uart_bytes = decode_uart(edges, cap)
+    print(f'{cap.frames} frames, {len(edges)} edges ({cap.edges} recorded), '
+          f'{cap.rate} ticks/s, {cap.baudrate} bps')
+    if cap.trig_tick is not None:
+        print(f'Triggered at {(cap.trig_tick - cap.start_tick) / cap.rate:.6f}s')
+    if verbose:
+        for t, c in uart_bytes:
+            print(f'  {(t - cap.start_tick) / cap.rate:10.6f}s {c:02x}')
+
+    print('Frames decoded from the signal:')
+    for t, addr, body in decode_msmp(uart_bytes):
+        print('  ' + format_msg(t, addr, body, cap))
+    print('Messages recorded by msmpdbg:')
+    for t, addr, body in cap.messages:
+        print('  ' + format_msg(t, addr, body, cap))
+
+    if args.csv:
+        write_csv(args.csv, edges, cap)
+    if args.vcd:
+        write_vcd(args.vcd, edges, uart_bytes, cap)
+    if args.bytes:
+        with open(args.bytes, 'wb') as f:
+            f.write(bytes(c for _, c in uart_bytes))
+
+    if not cap.complete:
+        cap.errors.append('END frame not received')
+    for e in cap.errors:
+        print(f'Error: {e}', file=sys.stderr)
+    return 1 if cap.errors else 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,93 @@
+/*
+ * msg_queue.c のストレステスト
+ *
+ * 生産者スレッドと消費者スレッドで同時にキューを操作し、
+ * 消費者が受信途中のメッセージや順序の乱れたメッセージを読まないことを確認する。
+ * 生産者は時々メッセージを書きかけで放棄し（TSM による強制復旧を模擬）、同じスロットに書き直す。
+ *
+ * 使い方: msg-queue-stress [メッセージ数]
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "msg_queue.h"
+
+#define QUEUE_LEN 4
+
+static struct Message slots[QUEUE_LEN];
+static struct MsgQueue queue;
+static uint32_t num_msgs = 500000;
+
+static uint8_t BodyByte(uint32_t seq, int i) {
+  return (seq * 7 + i) & 0xff;
+}
+
+static void *Producer(void *arg) {
+  unsigned seed = 1;
+  for (uint32_t seq = 0; seq < num_msgs; ) {
+    struct Message *msg = MsgQueueBeginWrite(&queue);
+    if (msg == NULL) {
+      sched_yield();
+      continue;
+    }
+    const uint8_t len = 1 + seq % 63;
+    msg->start_tick = seq;
+    msg->addr = seq & 0xff;
+    msg->len = len;
+    seed = seed * 1103515245 + 12345;
+    const bool abort_msg = (seed >> 16) % 16 == 0;
+    for (int i = 0; i < len; ++i) {
+      msg->body[i] = abort_msg ? 0xff : BodyByte(seq, i);
+      // 割り込みハンドラが 1 バイトずつ書く様子を模擬し、書き込み途中で時々消費者に切り替える
+      // （CPU が 1 つしかない環境でも書き込み途中の状態を消費者に見せるため）
+      if (i == len / 2 && (seed >> 20) % 4 == 0) {
+        sched_yield();
+      }
+    }
+    if (abort_msg) {
+      // 公開せずに放棄し、次の BeginWrite で同じスロットを使う
+      continue;
+    }
+    MsgQueueCommit(&queue);
+    ++seq;
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    num_msgs = strtoul(argv[1], NULL, 0);
+  }
+  MsgQueueInit(&queue, slots, QUEUE_LEN);
+
+  pthread_t producer;
+  pthread_create(&producer, NULL, Producer, NULL);
+
+  uint32_t errors = 0;
+  for (uint32_t seq = 0; seq < num_msgs; ) {
+    const struct Message *msg = MsgQueuePeek(&queue);
+    if (msg == NULL) {
+      sched_yield();
+      continue;
+    }
+    const uint8_t len = 1 + seq % 63;
+    bool ok = msg->start_tick == seq && msg->addr == (seq & 0xff) && msg->len == len;
+    for (int i = 0; ok && i < len; ++i) {
+      ok = msg->body[i] == BodyByte(seq, i);
+    }
+    if (!ok && errors++ < 10) {
+      printf("broken message: expected seq=%u, got start_tick=%u len=%u\n",
+             seq, msg->start_tick, msg->len);
+    }
+    MsgQueuePop(&queue);
+    ++seq;
+  }
+  pthread_join(producer, NULL);
+
+  printf("%u messages, %u errors, %u times the queue was full\n",
+         num_msgs, errors, queue.dropped);
+  return errors ? 1 : 0;
+}
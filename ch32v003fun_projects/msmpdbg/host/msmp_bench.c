@@ -0,0 +1,195 @@
+/*
+ * msmp_proto.c のベンチマーク
+ *
+ * 受信バイト列を MSMPProcByte に繰り返し与え、処理速度（バイト/秒）と
+ * 1 バイトあたりの処理時間（最小・平均・最大）を表示する。
+ *
+ * 使い方: msmp-bench [-n 繰り返し回数] [-a 自ホストのアドレス] [バイト列ファイル...]
+ *   バイト列ファイルは生のバイト列（decode-capture.py --bytes の出力など）。
+ *   ファイルを指定しない場合は、ユニキャスト・ブロードキャスト・TSM を混ぜた合成データを使う。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msmp_proto.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLE_UNIT "cycles"
+static inline uint64_t ReadCycles(void) {
+  _mm_lfence();
+  uint64_t c = __rdtsc();
+  _mm_lfence();
+  return c;
+}
+#else
+#define CYCLE_UNIT "ns"
+static inline uint64_t ReadCycles(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+#endif
+
+static uint64_t forwarded;
+
+static void Send(struct MSMPNode *node, uint8_t c) {
+  ++forwarded;
+}
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// 合成データを生成
+static uint8_t *MakeSyntheticStream(size_t *len) {
+  const size_t cap = 64 * 1024;
+  uint8_t *buf = malloc(cap);
+  size_t n = 0;
+  unsigned seed = 1;
+  while (n + 2 + 63 + 1 <= cap) {
+    seed = seed * 1103515245 + 12345;
+    const unsigned r = seed >> 16;
+    if (r % 50 == 0) {
+      buf[n++] = 0; // TSM
+      continue;
+    }
+    const uint8_t dst = 1 + r % 15; // 1..15（15 はブロードキャスト）
+    const uint8_t src = 1 + (r >> 4) % 14;
+    const uint8_t body_len = (r >> 8) % 64;
+    buf[n++] = (dst << 4) | src;
+    buf[n++] = body_len;
+    for (uint8_t i = 0; i < body_len; ++i) {
+      buf[n++] = 0x20 + (r + i) % 0x5f;
+    }
+  }
+  *len = n;
+  return buf;
+}
+
+static uint8_t *ReadFile(const char *path, size_t *len) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    exit(1);
+  }
+  size_t cap = 4096, n = 0;
+  uint8_t *buf = malloc(cap);
+  size_t r;
+  while ((r = fread(buf + n, 1, cap - n, f)) > 0) {
+    n += r;
+    if (n == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+  }
+  fclose(f);
+  *len = n;
+  return buf;
+}
+
+// 計測そのものにかかる時間
+static uint64_t MeasureOverhead(void) {
+  uint64_t min = UINT64_MAX;
+  for (int i = 0; i < 10000; ++i) {
+    uint64_t t0 = ReadCycles();
+    uint64_t t1 = ReadCycles();
+    if (t1 - t0 < min) {
+      min = t1 - t0;
+    }
+  }
+  return min;
+}
+
+static void Bench(const char *name, const uint8_t *stream, size_t len,
+                  int iterations, uint8_t my_addr, uint64_t overhead) {
+  struct MSMPNode node;
+  MSMPInitNode(&node, my_addr, Send);
+  forwarded = 0;
+
+  // スループット: 計測処理を挟まずに流す
+  const double start = Now();
+  for (int it = 0; it < iterations; ++it) {
+    for (size_t i = 0; i < len; ++i) {
+      MSMPStartBit(&node);
+      MSMPProcByte(&node, stream[i]);
+    }
+  }
+  const double elapsed = Now() - start;
+  const uint64_t total = (uint64_t)len * iterations;
+
+  // 1 バイトごとの処理時間
+  MSMPInitNode(&node, my_addr, Send);
+  uint64_t min = UINT64_MAX, max = 0, sum = 0;
+  size_t max_pos = 0;
+  for (size_t i = 0; i < len; ++i) {
+    MSMPStartBit(&node);
+    uint64_t t0 = ReadCycles();
+    MSMPProcByte(&node, stream[i]);
+    uint64_t t1 = ReadCycles();
+    uint64_t d = t1 - t0 > overhead ? t1 - t0 - overhead : 0;
+    sum += d;
+    if (d < min) {
+      min = d;
+    }
+    if (d > max) {
+      max = d;
+      max_pos = i;
+    }
+  }
+
+  printf("%s: %zu bytes x %d\n", name, len, iterations);
+  printf("  throughput: %.1f Mbytes/s (%.2f ns/byte)\n",
+         total / elapsed / 1e6, elapsed / total * 1e9);
+  printf("  per byte  : min %llu, avg %.1f, max %llu " CYCLE_UNIT
+         " (max at offset %zu)\n",
+         (unsigned long long)min, (double)sum / len,
+         (unsigned long long)max, max_pos);
+  printf("  forwarded : %llu bytes\n", (unsigned long long)forwarded);
+}
+
+int main(int argc, char **argv) {
+  int iterations = 1000;
+  uint8_t my_addr = 0x0E;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:a:")) != -1) {
+    switch (opt) {
+    case 'n':
+      iterations = atoi(optarg);
+      break;
+    case 'a':
+      my_addr = strtol(optarg, NULL, 0) & 15;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-n iterations] [-a my_addr] [stream files...]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  const uint64_t overhead = MeasureOverhead();
+  printf("timer overhead: %llu " CYCLE_UNIT " (subtracted)\n",
+         (unsigned long long)overhead);
+
+  if (optind == argc) {
+    size_t len;
+    uint8_t *stream = MakeSyntheticStream(&len);
+    Bench("synthetic", stream, len, iterations, my_addr, overhead);
+    free(stream);
+  }
+  for (int i = optind; i < argc; ++i) {
+    size_t len;
+    uint8_t *stream = ReadFile(argv[i], &len);
+    if (len > 0) {
+      Bench(argv[i], stream, len, iterations, my_addr, overhead);
+    }
+    free(stream);
+  }
+  return 0;
+}
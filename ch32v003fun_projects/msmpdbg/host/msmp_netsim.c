@@ -0,0 +1,633 @@
+/*
+ * MSMP ネットワークのシミュレータ
+ *
+ * N 個の仮想ノードをリング状につなぎ（ノード i の TX をノード i+1 の RX へ）、
+ * 各リンクを指定したボーレートの UART として離散事象シミュレーションする。
+ * 各ノードは msmp_proto.c の MSMPProcByte をそのまま使い、msmpdbg.c と同じく
+ * 受信したバイトを MSMPStatsByte で集計し、転送するバイトを送信キューへ積む。
+ *
+ * 各ノードはポアソン過程で自分のメッセージを送り、端から端までの遅延、
+ * リンクの使用率、送信キューの深さ、TSM による強制復旧の回数などを表示する。
+ * 送信期間の後は新たなメッセージを送らずにリンクが空くまで（最大 -D 秒）続け、
+ * 届かなかったメッセージを数える。
+ *
+ * 使い方: msmp-netsim [オプション]
+ *   -n ノード数（既定 14）
+ *   -b ボーレート（既定 9600）
+ *   -s 送信期間（秒、既定 10）
+ *   -D 送信期間の後にリンクが空くのを待つ最大時間（秒、既定 10）
+ *   -r 1 ノードが 1 秒あたりに送るメッセージ数（既定 1）
+ *   -l 本文の最大長（既定 16、0〜63）
+ *   -B ブロードキャストの割合（0〜1、既定 0.1）
+ *   -g 自分のメッセージのバイト間隔（マイクロ秒、既定 0）
+ *   -d 受信してから転送を始めるまでの遅延（マイクロ秒、既定 10）
+ *   -e リンクでバイトが化ける確率（既定 0）
+ *   -t ノード 0 が TSM を送る間隔（ミリ秒、既定 0 = 送らない）
+ *   -S 乱数の種（既定 1）
+ *
+ * アドレスはノード i に 1 + i % 14 を割り当てる。15 ノード以上ではアドレスが重複し、
+ * ユニキャストは下流で最初にアドレスが一致したノードが受け取り、
+ * ブロードキャストは送信元と同じアドレスのノードに着いたところで止まる。
+ *
+ * バイト化けが無いのにメッセージが化けたり届かなかったりしたら終了コード 1 を返す。
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msmp_proto.h"
+#include "msmp_stats.h"
+
+// 1 ノードの送信キューの長さ（バイト）
+#define TXQ_LEN 1024
+// 1 バイトのビット数（スタートビット、8 データビット、ストップビット）
+#define BITS_PER_BYTE 10
+// メッセージに付けない番号（TSM など）
+#define NO_MSG UINT32_MAX
+
+typedef uint64_t sim_time_t; // ナノ秒
+
+struct TxEntry {
+  uint8_t c;
+  uint32_t msg; // このバイトを含むメッセージの番号
+  sim_time_t ready; // これより前には送らない
+  sim_time_t gap; // 直前のバイトの送信完了からこれだけ空ける
+};
+
+struct SimNode {
+  struct MSMPNode msmp;
+  struct MSMPStats stats; // 時刻はマイクロ秒
+  size_t index;
+
+  // 送信キュー
+  struct TxEntry txq[TXQ_LEN];
+  size_t txq_head;
+  size_t txq_len;
+  size_t txq_max; // txq_len の最大値
+  bool tx_busy; // 1 バイト送信中
+  bool tx_waiting; // EV_TX_KICK を待っている
+  sim_time_t tx_free; // 直前のバイトの送信が終わった時刻
+  sim_time_t busy_ns; // 送信していた時間の合計
+
+  // 受信中のメッセージ
+  uint32_t rx_msg; // 受信中のバイトのメッセージ番号
+  uint32_t rx_first_msg; // アドレス部のメッセージ番号
+  uint8_t rx_buf[65];
+  size_t rx_len;
+  uint32_t pending_msgs; // 転送中のため送信を待っている自分のメッセージの数
+  uint32_t pending_tsm; // 同じく TSM の数
+};
+
+struct SimMsg {
+  sim_time_t created;
+  uint32_t src_node;
+  uint8_t addr;
+  uint8_t len;
+  bool done; // 宛先（ブロードキャストなら送信元）に着いた
+};
+
+enum EventType {
+  EV_RXNE, // 受信側で 1 バイト受信し終えた（ストップビットの中央）
+  EV_TX_DONE, // 送信側で 1 バイト送信し終えた
+  EV_TX_KICK, // バイト間隔を空け終えた
+  EV_GEN, // 自分のメッセージを送る
+  EV_TSM, // TSM を送る
+};
+
+struct Event {
+  sim_time_t t;
+  uint64_t seq; // 同時刻の事象は登録順に処理する
+  uint8_t type;
+  uint8_t c;
+  uint32_t node;
+  uint32_t msg;
+};
+
+// 設定
+static size_t num_nodes = 14;
+static uint32_t baudrate = 9600;
+static double gen_seconds = 10;
+static double drain_seconds = 10;
+static double msg_rate = 1;
+static int max_body = 16;
+static double broadcast_ratio = 0.1;
+static sim_time_t byte_gap_ns;
+static sim_time_t fwd_delay_ns = 10000;
+static double error_rate;
+static sim_time_t tsm_period_ns;
+
+static sim_time_t bit_ns;
+static sim_time_t now;
+static bool generating = true;
+static struct SimNode *nodes;
+
+static struct SimMsg *msgs;
+static size_t num_msgs, msgs_cap;
+
+// 事象の二分ヒープ
+static struct Event *heap;
+static size_t heap_len, heap_cap;
+static uint64_t event_seq;
+static uint64_t events_processed;
+
+// 結果
+static uint32_t *latencies_us; // 届いたユニキャストの遅延
+static size_t num_latencies, latencies_cap;
+static uint64_t latency_hops; // 届いたユニキャストのホップ数の合計
+static uint32_t unicast_sent, unicast_delivered, broadcast_sent, broadcast_returned;
+static uint64_t broadcast_reached; // ブロードキャストを受け取ったノード数の合計
+static uint32_t corrupted; // 内容が化けて届いたメッセージ
+static uint32_t txq_overflows; // 送信キューが満杯で捨てたバイト
+static uint32_t tsm_sent;
+static uint64_t bytes_corrupted;
+
+static uint32_t rng_state = 1;
+
+static uint32_t Rand(void) {
+  // xorshift32
+  uint32_t x = rng_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return rng_state = x;
+}
+
+static double RandUniform(void) {
+  return (Rand() + 0.5) / 4294967296.0;
+}
+
+static sim_time_t RandExp(double rate) {
+  return (sim_time_t)(-log(RandUniform()) / rate * 1e9);
+}
+
+static tick_t Micros(sim_time_t t) {
+  return (tick_t)(t / 1000);
+}
+
+static bool EventBefore(const struct Event *a, const struct Event *b) {
+  return a->t != b->t ? a->t < b->t : a->seq < b->seq;
+}
+
+static void Schedule(sim_time_t t, enum EventType type, size_t node, uint8_t c, uint32_t msg) {
+  if (heap_len == heap_cap) {
+    heap_cap = heap_cap ? heap_cap * 2 : 1024;
+    heap = realloc(heap, heap_cap * sizeof(*heap));
+  }
+  const struct Event ev = {t, event_seq++, type, c, node, msg};
+  size_t i = heap_len++;
+  while (i > 0 && EventBefore(&ev, heap + (i - 1) / 2)) {
+    heap[i] = heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  heap[i] = ev;
+}
+
+static struct Event PopEvent(void) {
+  const struct Event top = heap[0];
+  const struct Event last = heap[--heap_len];
+  size_t i = 0;
+  for (;;) {
+    size_t child = 2 * i + 1;
+    if (child >= heap_len) {
+      break;
+    }
+    if (child + 1 < heap_len && EventBefore(heap + child + 1, heap + child)) {
+      ++child;
+    }
+    if (!EventBefore(heap + child, &last)) {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
+  return top;
+}
+
+static uint8_t NodeAddr(size_t i) {
+  return 1 + i % 14;
+}
+
+/* メッセージ番号 msg の本文の i バイト目（0 は TSM になるので使わない） */
+static uint8_t BodyByte(uint32_t msg, size_t i) {
+  return 1 + (msg * 31 + i * 7) % 255;
+}
+
+static void TxKick(struct SimNode *n);
+
+static bool TxPush(struct SimNode *n, uint8_t c, uint32_t msg, sim_time_t ready, sim_time_t gap) {
+  if (n->txq_len == TXQ_LEN) {
+    ++txq_overflows;
+    return false;
+  }
+  n->txq[(n->txq_head + n->txq_len) % TXQ_LEN] = (struct TxEntry){c, msg, ready, gap};
+  if (++n->txq_len > n->txq_max) {
+    n->txq_max = n->txq_len;
+  }
+  return true;
+}
+
+/* 送信キューの先頭のバイトを送れるなら送り始める */
+static void TxKick(struct SimNode *n) {
+  if (n->tx_busy || n->tx_waiting || n->txq_len == 0) {
+    return;
+  }
+  const struct TxEntry e = n->txq[n->txq_head];
+  sim_time_t start = n->tx_free + e.gap;
+  if (start < e.ready) {
+    start = e.ready;
+  }
+  if (start > now) {
+    n->tx_waiting = true;
+    Schedule(start, EV_TX_KICK, n->index, 0, NO_MSG);
+    return;
+  }
+  n->txq_head = (n->txq_head + 1) % TXQ_LEN;
+  --n->txq_len;
+  n->tx_busy = true;
+  n->busy_ns += BITS_PER_BYTE * bit_ns;
+  Schedule(now + BITS_PER_BYTE * bit_ns, EV_TX_DONE, n->index, 0, NO_MSG);
+
+  // 受信側はスタートビットの立ち下がりを今検出し、ストップビットの中央でバイトを受け取る
+  struct SimNode *rx = nodes + (n->index + 1) % num_nodes;
+  if (MSMPStartBit(&rx->msmp)) {
+    MSMPStatsMsgStart(&rx->stats, Micros(now));
+  }
+  uint8_t c = e.c;
+  if (error_rate > 0 && RandUniform() < error_rate) {
+    c ^= 1 << (Rand() % 8);
+    ++bytes_corrupted;
+  }
+  Schedule(now + BITS_PER_BYTE * bit_ns - bit_ns / 2, EV_RXNE, rx->index, c, e.msg);
+}
+
+/* 自分のメッセージを送信キューへ積む */
+static void EnqueueOwnMessage(struct SimNode *n) {
+  if (num_msgs == msgs_cap) {
+    msgs_cap = msgs_cap ? msgs_cap * 2 : 4096;
+    msgs = realloc(msgs, msgs_cap * sizeof(*msgs));
+  }
+  const uint32_t id = num_msgs;
+  struct SimMsg *m = msgs + id;
+  const uint8_t src = NodeAddr(n->index);
+  uint8_t dst;
+  if (RandUniform() < broadcast_ratio) {
+    dst = MSMP_ADDR_BROADCAST;
+  } else {
+    // リング上に居る自分以外のアドレス
+    const size_t addrs = num_nodes < 14 ? num_nodes : 14;
+    if (addrs < 2) {
+      return;
+    }
+    do {
+      dst = 1 + Rand() % addrs;
+    } while (dst == src);
+  }
+  m->created = now;
+  m->src_node = n->index;
+  m->addr = (dst << 4) | src;
+  m->len = max_body > 0 ? Rand() % (max_body + 1) : 0;
+  m->done = false;
+  if (TXQ_LEN - n->txq_len < 2u + m->len) {
+    txq_overflows += 2 + m->len;
+    return;
+  }
+  ++num_msgs;
+  if (dst == MSMP_ADDR_BROADCAST) {
+    ++broadcast_sent;
+  } else {
+    ++unicast_sent;
+  }
+
+  TxPush(n, m->addr, id, now, 0);
+  TxPush(n, m->len, id, now, byte_gap_ns);
+  for (size_t i = 0; i < m->len; ++i) {
+    TxPush(n, BodyByte(id, i), id, now, byte_gap_ns);
+  }
+  TxKick(n);
+}
+
+/* 受信したメッセージを転送している途中なら真（自分のメッセージを割り込ませられない） */
+static bool MidForward(const struct SimNode *n) {
+  return n->msmp.forwarding && (n->msmp.state == MSTATE_LEN || n->msmp.state == MSTATE_BODY);
+}
+
+static void SendPending(struct SimNode *n) {
+  for (; n->pending_tsm > 0; --n->pending_tsm) {
+    TxPush(n, 0, NO_MSG, now, 0);
+    ++tsm_sent;
+  }
+  for (; n->pending_msgs > 0; --n->pending_msgs) {
+    EnqueueOwnMessage(n);
+  }
+  TxKick(n);
+}
+
+/* MSMPSendFunc: 転送するバイトを送信キューへ積む（msmpdbg.c の SendToMSMP に相当） */
+static void SimSend(struct MSMPNode *node, uint8_t c) {
+  struct SimNode *n = node->user;
+  if (node->state == MSTATE_LEN) {
+    MSMPStatsForward(&n->stats, Micros(now));
+  }
+  TxPush(n, c, n->rx_msg, now + fwd_delay_ns, 0);
+  TxKick(n);
+}
+
+/* MSMPRecordFunc: 統計を取り、受信中のメッセージの内容を覚える */
+static void SimRecord(struct MSMPNode *node, enum MSMPState state, uint8_t c) {
+  struct SimNode *n = node->user;
+  MSMPStatsByte(&n->stats, state, c, Micros(now));
+  if (state == MSTATE_ADDR) {
+    n->rx_len = 0;
+    n->rx_first_msg = n->rx_msg;
+  }
+  if (state != MSTATE_IDLE && n->rx_len < sizeof(n->rx_buf)) {
+    n->rx_buf[n->rx_len++] = c;
+  }
+}
+
+/* 受信し終えたメッセージの内容が送信したとおりなら真 */
+static bool CheckContent(const struct SimNode *n, uint32_t id) {
+  const struct SimMsg *m = msgs + id;
+  if (n->rx_len != 2u + m->len || n->rx_buf[0] != m->addr || n->rx_buf[1] != m->len) {
+    return false;
+  }
+  for (size_t i = 0; i < m->len; ++i) {
+    if (n->rx_buf[2 + i] != BodyByte(id, i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void MessageReceived(struct SimNode *n) {
+  const uint16_t flags = n->msmp.flags;
+  const uint32_t id = n->rx_first_msg;
+  if (id == NO_MSG || !(flags & (MFLAG_MSG_TO_ME | MFLAG_MY_BRDCAST | MFLAG_MSG_TO_FORWARD))) {
+    return;
+  }
+  struct SimMsg *m = msgs + id;
+  const bool ok = CheckContent(n, id);
+  if (flags & MFLAG_MSG_TO_ME) {
+    if (!ok) {
+      ++corrupted;
+    } else if (!m->done) {
+      m->done = true;
+      ++unicast_delivered;
+      if (num_latencies == latencies_cap) {
+        latencies_cap = latencies_cap ? latencies_cap * 2 : 4096;
+        latencies_us = realloc(latencies_us, latencies_cap * sizeof(*latencies_us));
+      }
+      latencies_us[num_latencies++] = (now - m->created) / 1000;
+      latency_hops += (n->index + num_nodes - m->src_node) % num_nodes;
+    }
+  } else if (flags & MFLAG_MY_BRDCAST) {
+    if (!ok) {
+      ++corrupted;
+    } else if (!m->done) {
+      m->done = true;
+      ++broadcast_returned;
+    }
+  } else if ((m->addr >> 4) == MSMP_ADDR_BROADCAST && ok) {
+    ++broadcast_reached;
+  }
+}
+
+static void OnRxne(struct SimNode *n, uint8_t c, uint32_t msg) {
+  const enum MSMPState before = n->msmp.state;
+  n->rx_msg = msg;
+  MSMPProcByte(&n->msmp, c);
+  const bool tsm = c == 0 && before != MSTATE_LEN;
+  if (n->msmp.state == MSTATE_IDLE) {
+    if (!tsm) {
+      MessageReceived(n);
+    }
+    n->msmp.flags = 0;
+  }
+  if (!MidForward(n) && (n->pending_msgs > 0 || n->pending_tsm > 0)) {
+    SendPending(n);
+  }
+}
+
+static void ProcEvent(const struct Event *ev) {
+  struct SimNode *n = nodes + ev->node;
+  switch (ev->type) {
+  case EV_RXNE:
+    OnRxne(n, ev->c, ev->msg);
+    break;
+  case EV_TX_DONE:
+    n->tx_busy = false;
+    n->tx_free = now;
+    TxKick(n);
+    break;
+  case EV_TX_KICK:
+    n->tx_waiting = false;
+    TxKick(n);
+    break;
+  case EV_GEN:
+    if (!generating) {
+      break;
+    }
+    ++n->pending_msgs;
+    if (!MidForward(n)) {
+      SendPending(n);
+    }
+    Schedule(now + RandExp(msg_rate), EV_GEN, n->index, 0, NO_MSG);
+    break;
+  case EV_TSM:
+    if (!generating) {
+      break;
+    }
+    ++n->pending_tsm;
+    if (!MidForward(n)) {
+      SendPending(n);
+    }
+    Schedule(now + tsm_period_ns, EV_TSM, n->index, 0, NO_MSG);
+    break;
+  }
+}
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int CompareU32(const void *a, const void *b) {
+  const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void PrintHist(const char *title, const uint32_t *hist) {
+  printf("%s (us):\n", title);
+  for (int i = 0; i < STATS_HIST_BINS; ++i) {
+    if (hist[i] == 0) {
+      continue;
+    }
+    const uint32_t lo = i == 0 ? 0 : 1u << (i - 1);
+    if (i == STATS_HIST_BINS - 1) {
+      printf("  %5u -      : %u\n", lo, hist[i]);
+    } else {
+      printf("  %5u - %5u: %u\n", lo, i == 0 ? 0 : (1u << i) - 1, hist[i]);
+    }
+  }
+}
+
+static void Report(double wall) {
+  const double sim = now * 1e-9;
+  printf("nodes: %zu, baudrate: %u bps, %.1f msgs/s per node\n", num_nodes, baudrate, msg_rate);
+  printf("simulated %.3f s in %.3f s (%.1fx real time, %.1f M events/s)\n",
+         sim, wall, sim / wall, events_processed / wall * 1e-6);
+
+  printf("unicast  : %u sent, %u delivered, %u lost\n",
+         unicast_sent, unicast_delivered, unicast_sent - unicast_delivered);
+  printf("broadcast: %u sent, %u returned to sender, reached %.1f nodes on average\n",
+         broadcast_sent, broadcast_returned,
+         broadcast_sent ? (double)broadcast_reached / broadcast_sent : 0.0);
+  printf("corrupted: %u messages (%llu bytes flipped on links), tsm sent: %u\n",
+         corrupted, (unsigned long long)bytes_corrupted, tsm_sent);
+  if (num_latencies > 0) {
+    qsort(latencies_us, num_latencies, sizeof(*latencies_us), CompareU32);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < num_latencies; ++i) {
+      sum += latencies_us[i];
+    }
+    printf("latency (ms): min %.2f, avg %.2f, p50 %.2f, p99 %.2f, max %.2f, %.2f per hop\n",
+           latencies_us[0] * 1e-3, (double)sum / num_latencies * 1e-3,
+           latencies_us[num_latencies / 2] * 1e-3,
+           latencies_us[num_latencies * 99 / 100] * 1e-3,
+           latencies_us[num_latencies - 1] * 1e-3,
+           latency_hops ? (double)sum / latency_hops * 1e-3 : 0.0);
+  }
+
+  double util_sum = 0, util_max = 0;
+  size_t util_max_node = 0, txq_max_node = 0;
+  uint32_t tsm_resets = 0;
+  uint32_t fwd_hist[STATS_HIST_BINS] = {0};
+  for (size_t i = 0; i < num_nodes; ++i) {
+    const struct SimNode *n = nodes + i;
+    const double util = now ? (double)n->busy_ns / now : 0;
+    util_sum += util;
+    if (util > util_max) {
+      util_max = util;
+      util_max_node = i;
+    }
+    if (n->txq_max > nodes[txq_max_node].txq_max) {
+      txq_max_node = i;
+    }
+    tsm_resets += n->stats.tsm_resets;
+    for (int b = 0; b < STATS_HIST_BINS; ++b) {
+      fwd_hist[b] += n->stats.fwd_hist[b];
+    }
+  }
+  printf("link utilization: avg %.1f%%, max %.1f%% (node %zu -> %zu)\n",
+         util_sum / num_nodes * 100, util_max * 100,
+         util_max_node, (util_max_node + 1) % num_nodes);
+  printf("tx queue: max %zu bytes (node %zu), %u bytes dropped\n",
+         nodes[txq_max_node].txq_max, txq_max_node, txq_overflows);
+  printf("tsm resets: %u (sum of all nodes)\n", tsm_resets);
+  PrintHist("Start bit to forward", fwd_hist);
+}
+
+static void Usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-n nodes] [-b baudrate] [-s seconds] [-D drain seconds]\n"
+          "  [-r msgs/s per node] [-l max body] [-B broadcast ratio] [-g byte gap us]\n"
+          "  [-d forward delay us] [-e byte error rate] [-t tsm period ms] [-S seed]\n", prog);
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "n:b:s:D:r:l:B:g:d:e:t:S:")) != -1) {
+    switch (opt) {
+    case 'n':
+      num_nodes = strtoul(optarg, NULL, 0);
+      break;
+    case 'b':
+      baudrate = strtoul(optarg, NULL, 0);
+      break;
+    case 's':
+      gen_seconds = atof(optarg);
+      break;
+    case 'D':
+      drain_seconds = atof(optarg);
+      break;
+    case 'r':
+      msg_rate = atof(optarg);
+      break;
+    case 'l':
+      max_body = atoi(optarg);
+      break;
+    case 'B':
+      broadcast_ratio = atof(optarg);
+      break;
+    case 'g':
+      byte_gap_ns = strtoull(optarg, NULL, 0) * 1000;
+      break;
+    case 'd':
+      fwd_delay_ns = strtoull(optarg, NULL, 0) * 1000;
+      break;
+    case 'e':
+      error_rate = atof(optarg);
+      break;
+    case 't':
+      tsm_period_ns = strtoull(optarg, NULL, 0) * 1000000;
+      break;
+    case 'S':
+      rng_state = strtoul(optarg, NULL, 0) | 1;
+      break;
+    default:
+      Usage(argv[0]);
+      return 1;
+    }
+  }
+  if (num_nodes < 2 || baudrate == 0 || msg_rate <= 0 || max_body < 0 || max_body > 63) {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  bit_ns = 1000000000ull / baudrate;
+  nodes = calloc(num_nodes, sizeof(*nodes));
+  for (size_t i = 0; i < num_nodes; ++i) {
+    struct SimNode *n = nodes + i;
+    n->index = i;
+    n->rx_msg = n->rx_first_msg = NO_MSG;
+    MSMPInitNode(&n->msmp, NodeAddr(i), SimSend);
+    n->msmp.record = SimRecord;
+    n->msmp.user = n;
+    MSMPStatsReset(&n->stats, 0);
+    Schedule(RandExp(msg_rate), EV_GEN, i, 0, NO_MSG);
+  }
+  if (tsm_period_ns > 0) {
+    Schedule(tsm_period_ns, EV_TSM, 0, 0, NO_MSG);
+  }
+
+  const sim_time_t gen_end = (sim_time_t)(gen_seconds * 1e9);
+  const sim_time_t sim_end = gen_end + (sim_time_t)(drain_seconds * 1e9);
+  const double wall_start = Now();
+  while (heap_len > 0) {
+    const struct Event ev = PopEvent();
+    if (ev.t > sim_end) {
+      break;
+    }
+    now = ev.t;
+    if (generating && now >= gen_end) {
+      generating = false;
+    }
+    ProcEvent(&ev);
+    ++events_processed;
+  }
+  Report(Now() - wall_start);
+
+  // バイト化けが無ければ、すべてのメッセージが化けずに届くはず
+  if (error_rate == 0 && tsm_period_ns == 0 &&
+      (corrupted > 0 || unicast_delivered != unicast_sent ||
+       (num_nodes <= 14 && broadcast_returned != broadcast_sent))) {
+    fprintf(stderr, "Error: messages were lost or corrupted without link errors\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,208 @@
+/*
+ * msmp_proto.c と msmp_stats.c のテスト
+ *
+ * 受信バイト列を MSMPProcByte に与え、転送されたバイト列・状態・フラグ・統計を確認する。
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "msmp_proto.h"
+#include "msmp_stats.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+    ++failures; \
+  } \
+} while (0)
+
+// 転送されたバイトを記録する出力先
+static uint8_t sent[256];
+static size_t sent_len;
+
+static void Send(struct MSMPNode *node, uint8_t c) {
+  sent[sent_len++] = c;
+}
+
+// 記録関数に渡された状態を記録する
+static enum MSMPState recorded[256];
+static size_t recorded_len;
+
+static void Record(struct MSMPNode *node, enum MSMPState state, uint8_t c) {
+  recorded[recorded_len++] = state;
+}
+
+static void Reset(struct MSMPNode *node, uint8_t my_addr) {
+  MSMPInitNode(node, my_addr, Send);
+  sent_len = 0;
+  recorded_len = 0;
+}
+
+// スタートビットの検出を模擬しながら 1 バイトずつ処理する
+static void Feed(struct MSMPNode *node, const uint8_t *bytes, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    MSMPStartBit(node);
+    MSMPProcByte(node, bytes[i]);
+  }
+}
+
+static void TestForwardUnicast(void) {
+  struct MSMPNode node;
+  Reset(&node, 0x0E);
+  const uint8_t msg[] = {0x21, 3, 'a', 'b', 'c'};
+  Feed(&node, msg, sizeof(msg));
+  CHECK(sent_len == sizeof(msg) && memcmp(sent, msg, sizeof(msg)) == 0);
+  CHECK(node.state == MSTATE_IDLE);
+  CHECK(node.flags == MFLAG_MSG_TO_FORWARD);
+  CHECK(node.forward_dst == 2);
+}
+
+static void TestMessageToMe(void) {
+  struct MSMPNode node;
+  Reset(&node, 0x0E);
+  const uint8_t msg[] = {0xE1, 2, 'h', 'i'};
+  Feed(&node, msg, sizeof(msg));
+  CHECK(sent_len == 0);
+  CHECK(node.state == MSTATE_IDLE);
+  CHECK(node.flags == MFLAG_MSG_TO_ME);
+}
+
+static void TestBroadcast(void) {
+  struct MSMPNode node;
+  Reset(&node, 0x0E);
+  const uint8_t other[] = {0xF1, 1, 'x'};
+  Feed(&node, other, sizeof(other));
+  CHECK(sent_len == sizeof(other));
+  CHECK(node.flags == MFLAG_MSG_TO_FORWARD);
+
+  Reset(&node, 0x0E);
+  const uint8_t mine[] = {0xFE, 1, 'x'};
+  Feed(&node, mine, sizeof(mine));
+  CHECK(sent_len == 0);
+  CHECK(node.flags == MFLAG_MY_BRDCAST);
+}
+
+static void TestZeroLength(void) {
+  struct MSMPNode node;
+  Reset(&node, 0x0E);
+  const uint8_t msg[] = {0x21, 0, 0x31, 1, 'z'};
+  // メッセージ長の 0 は TSM ではない
+  Feed(&node, msg, 2);
+  CHECK(node.state == MSTATE_IDLE);
+  Feed(&node, msg + 2, 3);
+  CHECK(node.state == MSTATE_IDLE);
+  CHECK((node.flags & MFLAG_TSM_RESET) == 0);
+  CHECK(sent_len == sizeof(msg));
+}
+
+static void TestTSMReset(void) {
+  struct MSMPNode node;
+  Reset(&node, 0x0E);
+  node.record = Record;
+  // 本文の途中で 0 を受信したら強制復旧
+  const uint8_t msg[] = {0x21, 5, 'a', 0};
+  Feed(&node, msg, sizeof(msg));
+  CHECK(node.state == MSTATE_IDLE);
+  CHECK(node.flags & MFLAG_TSM_RESET);
+  // 強制復旧も記録先へ通知される
+  CHECK(recorded_len == 4 && recorded[3] == MSTATE_IDLE);
+  // 転送中だったので 0 も転送される
+  CHECK(sent_len == sizeof(msg));
+}
+
+static void TestNoAutoForward(void) {
+  struct MSMPNode node;
+  Reset(&node, 0x0E);
+  node.enable_auto_forward = false;
+  const uint8_t msg[] = {0x21, 1, 'a'};
+  Feed(&node, msg, sizeof(msg));
+  CHECK(sent_len == 0);
+  CHECK(node.flags == MFLAG_MSG_TO_FORWARD);
+}
+
+static void TestRecordAndStartMissed(void) {
+  struct MSMPNode node;
+  Reset(&node, 0x0E);
+  node.record = Record;
+  const uint8_t msg[] = {0x21, 2, 'a', 'b'};
+  // MSMPStartBit を呼ばない
+  for (size_t i = 0; i < sizeof(msg); ++i) {
+    MSMPProcByte(&node, msg[i]);
+  }
+  CHECK(node.flags & MFLAG_START_MISSED);
+  CHECK(recorded_len == 4);
+  CHECK(recorded[0] == MSTATE_ADDR && recorded[1] == MSTATE_LEN);
+  CHECK(recorded[2] == MSTATE_BODY && recorded[3] == MSTATE_BODY);
+  CHECK(sent_len == sizeof(msg));
+}
+
+// 統計の集計先（1 バイトごとに 100 tick 進む時計を使う）
+static struct MSMPStats stats;
+static tick_t now;
+
+static void StatsRecord(struct MSMPNode *node, enum MSMPState state, uint8_t c) {
+  now += 100;
+  MSMPStatsByte(&stats, state, c, now);
+}
+
+static void StatsSend(struct MSMPNode *node, uint8_t c) {
+  MSMPStatsForward(&stats, now + 3);
+}
+
+static void TestStats(void) {
+  struct MSMPNode node;
+  MSMPInitNode(&node, 0x0E, StatsSend);
+  node.record = StatsRecord;
+  now = 1000;
+  MSMPStatsReset(&stats, now);
+
+  // 0x21: 転送する、0xE3: 自分宛て、TSM
+  const uint8_t msgs[][4] = {{0x21, 2, 'a', 'b'}, {0xE3, 1, 'x'}, {0x21, 5, 0}};
+  const size_t lens[] = {4, 3, 3};
+  for (size_t i = 0; i < 3; ++i) {
+    now += 10000; // メッセージ間の時間待ち
+    MSMPStartBit(&node);
+    MSMPStatsMsgStart(&stats, now);
+    for (size_t j = 0; j < lens[i]; ++j) {
+      MSMPProcByte(&node, msgs[i][j]);
+    }
+  }
+  CHECK(stats.bytes == 10);
+  CHECK(stats.msgs == 3);
+  CHECK(stats.tsm_resets == 1);
+  CHECK(stats.msgs_by_src[1] == 2 && stats.msgs_by_src[3] == 1);
+  CHECK(stats.msgs_by_dst[2] == 2 && stats.msgs_by_dst[14] == 1);
+  // TSM の 0 はどの送信元にも数えない
+  CHECK(stats.bytes_by_src[1] == 6 && stats.bytes_by_src[3] == 3);
+  // 転送開始はアドレス部を受信した直後（スタートビットから 100 + 3 tick）
+  CHECK(stats.forwarded_msgs == 2);
+  CHECK(stats.fwd_hist[MSMPStatsBin(103)] == 2);
+  // メッセージ内の間隔は 100 tick、メッセージ間は 10100 tick
+  CHECK(stats.gap_hist[MSMPStatsBin(100)] == 7);
+  CHECK(stats.gap_hist[MSMPStatsBin(10100)] == 2);
+
+  CHECK(MSMPStatsBin(0) == 0 && MSMPStatsBin(1) == 1 && MSMPStatsBin(2) == 2);
+  CHECK(MSMPStatsBin(3) == 2 && MSMPStatsBin(4) == 3);
+  CHECK(MSMPStatsBin(0xffffffff) == STATS_HIST_BINS - 1);
+}
+
+int main(void) {
+  TestForwardUnicast();
+  TestMessageToMe();
+  TestBroadcast();
+  TestZeroLength();
+  TestTSMReset();
+  TestNoAutoForward();
+  TestRecordAndStartMissed();
+  TestStats();
+
+  if (failures) {
+    printf("%d check(s) failed\n", failures);
+    return 1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}
@@ -0,0 +1,368 @@
+/*
+ * 割り込みハンドラの処理サイクル数のベンチマーク（rv32sim 上で実行する）
+ *
+ * msmpdbg.c をそのまま取り込み、合成した MSMP のバス通信を再生しながら各割り込みハンドラを呼び出して、
+ * mcycle の差から 1 回あたりの処理サイクル数の最小・平均・最大を求める。
+ * 最大値が予算（BENCH_MAX_BAUDRATE から決まる）を超えたハンドラがあれば終了コード 1 で終わる。
+ *
+ * rv32sim では周辺機能のレジスタはただのメモリなので、ハードウェアが行うフラグのセットや
+ * キャプチャ値の書き込みはこのファイルで代わりに行う。
+ * 記録は常にトリガ待ち（循環バッファ）で、決して成立しない本文パターンのトリガを SIG_TRIG_MAX 個設定し、
+ * 記録とトリガ判定が最も重くなる状態で測る。
+ */
+
+// msmpdbg.c の main は使わない（初期化はこのファイルで行う）
+#define main msmpdbg_main
+#include "msmpdbg.c"
+#undef main
+
+// 予算を決めるボーレート。1 ビットの間に信号変化の割り込みを処理し終える必要がある
+#ifndef BENCH_MAX_BAUDRATE
+#define BENCH_MAX_BAUDRATE 115200
+#endif
+// 再生するメッセージの数
+#ifndef BENCH_MSGS
+#define BENCH_MSGS 300
+#endif
+// この数のメッセージを受信するごとに、メッセージを 1 つ送信する
+#define BENCH_TX_EVERY 8
+
+// 1 ビットあたりの tick 数（sig_record_rate の初期値で再生する）
+#define BIT_TICKS SIG_RECORD_RATE_SCALE
+// 1 ビット・1 バイトの時間（クロック数）
+#define BIT_CYCLES (FUNCONF_SYSTEM_CORE_CLOCK / BENCH_MAX_BAUDRATE)
+#define BYTE_CYCLES (BIT_CYCLES * 10)
+
+#define STR_AGAIN(x) #x
+#define STR(x) STR_AGAIN(x)
+
+struct HandlerStat {
+  const char *name;
+  void (*handler)(void);
+  uint32_t budget; // 最大サイクル数の上限
+  uint32_t calls;
+  uint32_t min;
+  uint32_t max;
+  uint64_t sum;
+};
+
+enum {
+#if SIG_CAPTURE_EDGE
+  H_SIG_CC,
+  H_SIG_UP,
+#else
+  H_SIG_POLL,
+#endif
+  H_USART,
+  H_TX,
+  H_NUM,
+};
+
+static struct HandlerStat handler_stats[H_NUM] = {
+#if SIG_CAPTURE_EDGE
+  [H_SIG_CC] = {"TIM1_CC_IRQHandler", TIM1_CC_IRQHandler, BIT_CYCLES},
+  [H_SIG_UP] = {"TIM1_UP_IRQHandler", TIM1_UP_IRQHandler, BIT_CYCLES},
+#else
+  // 最短の周期（SIG_POLL_MIN_PERIOD クロック）で呼ばれても次の割り込みまでに終わる必要がある
+  [H_SIG_POLL] = {"TIM2_IRQHandler", TIM2_IRQHandler, SIG_POLL_MIN_PERIOD},
+#endif
+  // 次のバイトを受信し終えるまでに終わる必要がある
+  [H_USART] = {STR(MSMP_USART_IRQHandler), MSMP_USART_IRQHandler, BYTE_CYCLES},
+#if MSMP_TX_DMA
+  [H_TX] = {STR(MSMP_TX_DMA_IRQHandler), MSMP_TX_DMA_IRQHandler, BYTE_CYCLES},
+#else
+  [H_TX] = {"TIM3_IRQHandler", TIM3_IRQHandler, BYTE_CYCLES},
+#endif
+};
+
+// 呼び出しと計測自体にかかるサイクル数（空のハンドラで測る）
+static uint32_t call_overhead;
+
+/*
+ * rv32sim の ecall
+ */
+static void SimWrite(const char *s) {
+  register uint32_t a0 asm("a0") = 1;
+  register const char *a1 asm("a1") = s;
+  register uint32_t a2 asm("a2") = strlen(s);
+  register uint32_t a7 asm("a7") = 64;
+  asm volatile("ecall" : "+r"(a0) : "r"(a1), "r"(a2), "r"(a7) : "memory");
+}
+
+static void SimExit(int code) {
+  register uint32_t a0 asm("a0") = code;
+  register uint32_t a7 asm("a7") = 93;
+  asm volatile("ecall" : : "r"(a0), "r"(a7));
+  while (1);
+}
+
+// printf は msmpdbg.c の送信リングバッファへ書くので、結果の表示には使わない
+static void SimWriteUint(uint32_t v, int width) {
+  char buf[11];
+  char *p = buf + sizeof(buf);
+  *--p = '\0';
+  do {
+    *--p = '0' + v % 10;
+    v /= 10;
+    --width;
+  } while (v);
+  while (width-- > 0) {
+    *--p = ' ';
+  }
+  SimWrite(p);
+}
+
+static inline uint32_t ReadCycle(void) {
+  uint32_t c;
+  asm volatile("csrr %0, mcycle" : "=r"(c));
+  return c;
+}
+
+/*
+ * 割り込みの発生を模してハンドラを呼ぶ
+ *
+ * 戻り先を mepc に書いてハンドラへジャンプすれば、ハンドラの mret で戻ってくる。
+ * ハンドラは使うレジスタをすべて退避するので、壊れるのはここで使う t0 だけ。
+ */
+static inline void CallIRQ(void (*handler)(void)) {
+  asm volatile(
+    "la t0, 1f\n"
+    "csrw mepc, t0\n"
+    "jr %0\n"
+    "1:\n"
+    : : "r"(handler) : "t0", "memory");
+}
+
+void EmptyIRQHandler(void) __attribute__((interrupt));
+void EmptyIRQHandler(void) {
+}
+
+static uint32_t MeasureCall(void (*handler)(void)) {
+  const uint32_t start = ReadCycle();
+  CallIRQ(handler);
+  return ReadCycle() - start;
+}
+
+static void Measure(int h) {
+  struct HandlerStat *s = &handler_stats[h];
+  const uint32_t c = MeasureCall(s->handler) - call_overhead;
+  if (s->calls == 0 || c < s->min) {
+    s->min = c;
+  }
+  if (c > s->max) {
+    s->max = c;
+  }
+  s->sum += c;
+  ++s->calls;
+}
+
+/*
+ * 再生する信号
+ */
+// 現在の時刻（tick）
+static uint32_t bench_now;
+static bool rx_level = true;
+
+static void SetRxLevel(bool level) {
+  // MSMP の RX ピンは USART1・USART2 のどちらでも GPIOA
+  if (level) {
+    GPIOA->INDR |= 1u << (MSMP_RX_PIN & 15);
+  } else {
+    GPIOA->INDR &= ~(1u << (MSMP_RX_PIN & 15));
+  }
+  rx_level = level;
+}
+
+#if SIG_CAPTURE_EDGE
+/*
+ * TIM1 のハンドラを測る
+ *
+ * 実機の INTFR は rc_w0（0 を書いたビットだけ下り、1 を書いても立たない）だが、
+ * rv32sim はただのメモリとして扱う。`TIM1->INTFR = ~TIM_FLAG_Update` で他のフラグが
+ * 立たないよう、呼ぶ前の値との論理積に戻す。
+ */
+static void MeasureTIM1(int h) {
+  const uint32_t intfr = TIM1->INTFR;
+  Measure(h);
+  TIM1->INTFR &= intfr;
+}
+
+// 時刻を t まで進める。TIM1 がオーバーフローしたらアップデート割り込みを起こす
+static void AdvanceTo(uint32_t t) {
+  while ((bench_now ^ t) >> 16) {
+    bench_now = (bench_now | 0xffff) + 1;
+    TIM1->CNT = 0;
+    TIM1->INTFR |= TIM_FLAG_Update;
+    MeasureTIM1(H_SIG_UP);
+  }
+  bench_now = t;
+  TIM1->CNT = t & 0xffff;
+}
+
+// 時刻 t に RX ピンが level に変化した
+static void Edge(uint32_t t, bool level) {
+  AdvanceTo(t);
+  SetRxLevel(level);
+  if (level) {
+    TIM1->CH4CVR = t & 0xffff;
+    TIM1->INTFR |= TIM_FLAG_CC4;
+  } else {
+    TIM1->CH3CVR = t & 0xffff;
+    TIM1->INTFR |= TIM_FLAG_CC3;
+  }
+  MeasureTIM1(H_SIG_CC);
+  // 実機では CHxCVR を読むとフラグが下りる
+  TIM1->INTFR &= ~(TIM_FLAG_CC3 | TIM_FLAG_CC4);
+}
+#else
+// 時刻を t まで進める。1 tick ごとに TIM2 の割り込みで RX ピンを読む
+static void AdvanceTo(uint32_t t) {
+  while (bench_now != t) {
+    ++bench_now;
+    TIM2->INTFR |= TIM_FLAG_Update;
+    Measure(H_SIG_POLL);
+  }
+}
+
+static void Edge(uint32_t t, bool level) {
+  // 変化の直前までは元の値を読む
+  AdvanceTo(t - 1);
+  SetRxLevel(level);
+  AdvanceTo(t);
+}
+#endif
+
+// 1 ビットの隙間の後、1 バイトを 8n1 で受信する。ストップビットの後に 2 ビットの隙間を空ける
+static void RecvByte(uint8_t c) {
+  // スタートビット 0、データ 8 ビット（LSB から）、ストップビット 1
+  const uint16_t frame = (uint16_t)c << 1 | 0x200;
+  for (int i = 0; i < 10; ++i) {
+    const bool bit = (frame >> i) & 1;
+    if (bit != rx_level) {
+      Edge(bench_now + BIT_TICKS, bit);
+    } else {
+      AdvanceTo(bench_now + BIT_TICKS);
+    }
+  }
+  // ストップビットの中央で受信完了
+  AdvanceTo(bench_now + BIT_TICKS / 2);
+  MSMP_USART->DATAR = c;
+  MSMP_USART->STATR |= USART_FLAG_RXNE;
+  Measure(H_USART);
+  AdvanceTo(bench_now + BIT_TICKS / 2 + 2 * BIT_TICKS);
+}
+
+// メインループの代わりにメッセージを送信する
+static void Transmit(void) {
+  transmit_msg = &transmit_msg_default;
+  StartTransmit();
+#if MSMP_TX_DMA
+  // 最終バイトを書いたら DMA 転送完了割り込み。TIM3 は単発モードで止まる
+  DMA1->INTFR |= MSMP_TX_DMA_CTCIF;
+  Measure(H_TX);
+  TIM3->CTLR1 &= ~TIM_CEN;
+#else
+  for (int i = 0; i < TX_BUF_LEN + 2 && IsTransmitting(); ++i) {
+    TIM3->INTFR |= TIM_FLAG_Update;
+    Measure(H_TX);
+  }
+#endif
+}
+
+// msmp_bench.c と同じ生成規則で、ユニキャスト・ブロードキャスト・TSM を混ぜたメッセージを作る
+static size_t NextMessage(uint8_t *buf) {
+  static unsigned seed = 1;
+  seed = seed * 1103515245 + 12345;
+  const unsigned r = seed >> 16;
+  if (r % 50 == 0) {
+    buf[0] = 0; // TSM
+    return 1;
+  }
+  const uint8_t dst = 1 + r % 15; // 1..15（15 はブロードキャスト）
+  const uint8_t src = 1 + (r >> 4) % 14;
+  const uint8_t body_len = (r >> 8) % 64;
+  buf[0] = (dst << 4) | src;
+  buf[1] = body_len;
+  for (uint8_t i = 0; i < body_len; ++i) {
+    buf[2 + i] = 0x20 + (r + i) % 0x5f;
+  }
+  return 2 + body_len;
+}
+
+static void Init(void) {
+  MSMPStatsReset(&msmp_stats, 0);
+  MSMPInitNode(&msmp_node, 0x0E, SendToMSMP);
+  msmp_node.record = RecordMSMPByte;
+  MSMP_USART_Init();
+#if SIG_CAPTURE_EDGE
+  TIM1_InitForEdgeCapture();
+#else
+  TIM2_InitForPeriodicTimer(0, SIG_RECORD_TIM_PERIOD - 1);
+#endif
+  TIM3_InitForMSMPTimer();
+  ConfigureNode();
+
+  // 送信は常に終わっているものとする
+  MSMP_USART->STATR = USART_FLAG_TXE | USART_FLAG_TC;
+  SetRxLevel(1);
+  TIM1->INTFR = 0;
+  TIM1->CNT = 0;
+
+  // 本文は 0x20..0x7e なので 0xff のパターンには一致しない
+  struct SigTrigger trig = {.conds = TRIGC_DST | TRIGC_BODY, .dst = 15, .body_len = SIG_TRIG_BODY_MAX};
+  memset(trig.body, 0xff, sizeof(trig.body));
+  for (int i = 0; i < SIG_TRIG_MAX; ++i) {
+    AddSigTrigger(&trig);
+  }
+  ArmSigRecord();
+}
+
+int main(void) {
+  Init();
+
+  // 空のハンドラの呼び出しにかかる時間を差し引く
+  call_overhead = UINT32_MAX;
+  for (int i = 0; i < 4; ++i) {
+    const uint32_t c = MeasureCall(EmptyIRQHandler);
+    if (c < call_overhead) {
+      call_overhead = c;
+    }
+  }
+
+  uint8_t msg[2 + 63];
+  for (int i = 0; i < BENCH_MSGS; ++i) {
+    const size_t len = NextMessage(msg);
+    for (size_t j = 0; j < len; ++j) {
+      RecvByte(msg[j]);
+    }
+    // メッセージ間の隙間
+    AdvanceTo(bench_now + 20 * BIT_TICKS);
+    ConsumeMessages();
+    if (i % BENCH_TX_EVERY == BENCH_TX_EVERY - 1) {
+      Transmit();
+    }
+  }
+
+  SimWrite("handler                    calls    min    avg    max budget\n");
+  int result = 0;
+  for (int h = 0; h < H_NUM; ++h) {
+    const struct HandlerStat *s = &handler_stats[h];
+    SimWrite(s->name);
+    for (size_t i = strlen(s->name); i < 24; ++i) {
+      SimWrite(" ");
+    }
+    SimWriteUint(s->calls, 8);
+    SimWriteUint(s->min, 7);
+    SimWriteUint(s->calls ? s->sum / s->calls : 0, 7);
+    SimWriteUint(s->max, 7);
+    SimWriteUint(s->budget, 7);
+    if (s->max > s->budget) {
+      SimWrite("  OVER BUDGET");
+      result = 1;
+    }
+    SimWrite("\n");
+  }
+  SimWrite("(cycles, excluding the entry/exit of an empty handler; budgets for " STR(BENCH_MAX_BAUDRATE) " bps)\n");
+  SimExit(result);
+  return result;
+}
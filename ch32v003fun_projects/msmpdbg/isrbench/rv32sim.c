@@ -0,0 +1,610 @@
+/*
+ * isr-bench 用の RV32IMAC 命令セットシミュレータ（ホスト側）
+ *
+ * RISC-V 用にビルドした ELF を読み込んで実行し、命令ごとのサイクル数の目安を積算する。
+ * 積算したサイクル数はファームウェアから mcycle / cycle CSR で読める。
+ *
+ * 使い方: rv32sim [-l 最大サイクル数] <ELF ファイル>
+ *
+ * メモリマップ（CH32V203K8 相当）
+ *   0x00000000, 0x08000000  フラッシュ 64KB（同じ領域の別名）
+ *   0x20000000              SRAM 20KB
+ *   0x40000000              周辺機能のレジスタ（ただのメモリとして扱う）
+ *   0xE0000000              PFIC・SysTick（ただのメモリとして扱う）
+ * ELF の各セグメントは仮想アドレスへ直接読み込むので、スタートアップで .data を写す必要は無い。
+ *
+ * ecall（a7 で機能を選ぶ。番号は Linux のシステムコールに合わせた）
+ *   64: write(a0=fd, a1=buf, a2=len)  a0 が 1 なら標準出力、2 なら標準エラー出力へ書く
+ *   93: exit(a0=終了コード)
+ *
+ * A 拡張（lr.w / sc.w / amo*.w）はハートが 1 つだけの前提で実行する。sc.w は直前の lr.w と
+ * 同じアドレスなら必ず成功する。aq / rl ビットは無視する。
+ *
+ * 割り込みは発生させない。ファームウェアは mepc に戻り先を書いてハンドラへジャンプし、
+ * ハンドラの mret で戻ってくる（isr_bench.c の CallIRQ）。
+ */
+
+#include <elf.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * 命令ごとのサイクル数の目安
+ *
+ * QingKe V4（CH32V203）の 3 段パイプラインを想定した概算で、実機の値ではない。
+ * 分岐予測やフラッシュの待ち、割り込みの応答時間はモデル化していない。
+ * 絶対値よりも、変更前後の比較（回帰の検出）に使うこと。
+ */
+#define CYC_ALU      1 // 演算、分岐不成立
+#define CYC_LOAD     2 // ロード（次の命令で使うとパイプラインが止まる分を含む）
+#define CYC_STORE    1
+#define CYC_PERIPH   2 // 周辺機能のレジスタへのアクセスで追加（バスブリッジ経由）
+#define CYC_TAKEN    3 // 分岐成立、ジャンプ（パイプラインのやり直し）
+#define CYC_MUL      1
+#define CYC_DIV      17
+#define CYC_SYSTEM   3 // mret, ecall, CSR 操作
+
+struct Region {
+  uint32_t base;
+  uint32_t size;
+  bool periph;
+  uint8_t *mem;
+};
+
+static struct Region regions[] = {
+  {0x00000000, 64 * 1024, false, NULL},
+  {0x08000000, 64 * 1024, false, NULL}, // フラッシュの別名
+  {0x20000000, 20 * 1024, false, NULL},
+  {0x40000000, 0x30000, true, NULL},
+  {0xE0000000, 0x10000, true, NULL},
+};
+#define NUM_REGIONS (sizeof(regions) / sizeof(regions[0]))
+
+// CPU の状態
+static uint32_t x[32];
+static uint32_t pc;
+static uint64_t cycle;
+static uint64_t instret;
+static uint32_t csr[4096];
+// 直前の命令で周辺機能のレジスタへアクセスしたか
+static bool periph_access;
+// lr.w で予約したアドレス
+static bool reserved;
+static uint32_t reserved_addr;
+
+static void Fatal(const char *msg, uint32_t addr) {
+  fprintf(stderr, "rv32sim: %s (addr=0x%08x pc=0x%08x cycle=%llu)\n",
+          msg, addr, pc, (unsigned long long)cycle);
+  exit(2);
+}
+
+static uint8_t *Translate(uint32_t addr, uint32_t len) {
+  for (size_t i = 0; i < NUM_REGIONS; ++i) {
+    struct Region *r = &regions[i];
+    if (addr - r->base < r->size && len <= r->size - (addr - r->base)) {
+      periph_access |= r->periph;
+      return r->mem + (addr - r->base);
+    }
+  }
+  Fatal("access to unmapped address", addr);
+  return NULL;
+}
+
+static uint32_t Load(uint32_t addr, int len) {
+  const uint8_t *p = Translate(addr, len);
+  uint32_t v = 0;
+  for (int i = len - 1; i >= 0; --i) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+static void Store(uint32_t addr, int len, uint32_t v) {
+  uint8_t *p = Translate(addr, len);
+  for (int i = 0; i < len; ++i) {
+    p[i] = v >> (8 * i);
+  }
+}
+
+static void LoadELF(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    exit(1);
+  }
+  Elf32_Ehdr eh;
+  if (fread(&eh, sizeof(eh), 1, f) != 1 || memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0 ||
+      eh.e_ident[EI_CLASS] != ELFCLASS32 || eh.e_machine != EM_RISCV) {
+    fprintf(stderr, "%s: not a RV32 ELF file\n", path);
+    exit(1);
+  }
+  for (int i = 0; i < eh.e_phnum; ++i) {
+    Elf32_Phdr ph;
+    fseek(f, eh.e_phoff + i * eh.e_phentsize, SEEK_SET);
+    if (fread(&ph, sizeof(ph), 1, f) != 1) {
+      fprintf(stderr, "%s: broken program header\n", path);
+      exit(1);
+    }
+    if (ph.p_type != PT_LOAD || ph.p_memsz == 0) {
+      continue;
+    }
+    uint8_t *dst = Translate(ph.p_vaddr, ph.p_memsz);
+    fseek(f, ph.p_offset, SEEK_SET);
+    if (fread(dst, 1, ph.p_filesz, f) != ph.p_filesz) {
+      fprintf(stderr, "%s: broken segment\n", path);
+      exit(1);
+    }
+    memset(dst + ph.p_filesz, 0, ph.p_memsz - ph.p_filesz);
+  }
+  fclose(f);
+  pc = eh.e_entry;
+}
+
+/*
+ * 命令のデコード
+ *
+ * 32 ビット命令と圧縮命令を同じ形式（演算の種類とオペランド）に変換する。
+ */
+enum Op {
+  OP_ILLEGAL,
+  OP_LUI, OP_AUIPC, OP_JAL, OP_JALR,
+  OP_BEQ, OP_BNE, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU,
+  OP_LB, OP_LH, OP_LW, OP_LBU, OP_LHU, OP_SB, OP_SH, OP_SW,
+  OP_ADDI, OP_SLTI, OP_SLTIU, OP_XORI, OP_ORI, OP_ANDI, OP_SLLI, OP_SRLI, OP_SRAI,
+  OP_ADD, OP_SUB, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_SRA, OP_OR, OP_AND,
+  OP_MUL, OP_MULH, OP_MULHSU, OP_MULHU, OP_DIV, OP_DIVU, OP_REM, OP_REMU,
+  OP_LR, OP_SC, OP_AMOSWAP, OP_AMOADD, OP_AMOXOR, OP_AMOAND, OP_AMOOR,
+  OP_AMOMIN, OP_AMOMAX, OP_AMOMINU, OP_AMOMAXU,
+  OP_FENCE, OP_ECALL, OP_EBREAK, OP_MRET, OP_WFI,
+  OP_CSRRW, OP_CSRRS, OP_CSRRC, OP_CSRRWI, OP_CSRRSI, OP_CSRRCI,
+};
+
+struct Insn {
+  enum Op op;
+  uint8_t rd, rs1, rs2;
+  int32_t imm;
+  uint8_t len; // 命令長（バイト）
+};
+
+// v のビット [hi:lo] を取り出す
+#define BITS(v, hi, lo) (((v) >> (lo)) & ((1u << ((hi) - (lo) + 1)) - 1))
+
+static int32_t SignExtend(uint32_t v, int bits) {
+  return (int32_t)(v << (32 - bits)) >> (32 - bits);
+}
+
+static struct Insn Decode32(uint32_t w) {
+  struct Insn in = {OP_ILLEGAL, BITS(w, 11, 7), BITS(w, 19, 15), BITS(w, 24, 20), 0, 4};
+  const uint32_t f3 = BITS(w, 14, 12), f7 = BITS(w, 31, 25);
+  const int32_t imm_i = (int32_t)w >> 20;
+  const int32_t imm_s = ((int32_t)w >> 25 << 5) | BITS(w, 11, 7);
+  const int32_t imm_b = SignExtend((BITS(w, 31, 31) << 12) | (BITS(w, 7, 7) << 11)
+                                   | (BITS(w, 30, 25) << 5) | (BITS(w, 11, 8) << 1), 13);
+  const int32_t imm_j = SignExtend((BITS(w, 31, 31) << 20) | (BITS(w, 19, 12) << 12)
+                                   | (BITS(w, 20, 20) << 11) | (BITS(w, 30, 21) << 1), 21);
+  static const enum Op branch[8] = {OP_BEQ, OP_BNE, OP_ILLEGAL, OP_ILLEGAL,
+                                    OP_BLT, OP_BGE, OP_BLTU, OP_BGEU};
+  static const enum Op load[8] = {OP_LB, OP_LH, OP_LW, OP_ILLEGAL,
+                                  OP_LBU, OP_LHU, OP_ILLEGAL, OP_ILLEGAL};
+  static const enum Op store[8] = {OP_SB, OP_SH, OP_SW, OP_ILLEGAL,
+                                   OP_ILLEGAL, OP_ILLEGAL, OP_ILLEGAL, OP_ILLEGAL};
+  static const enum Op opimm[8] = {OP_ADDI, OP_SLLI, OP_SLTI, OP_SLTIU,
+                                   OP_XORI, OP_SRLI, OP_ORI, OP_ANDI};
+  static const enum Op op[8] = {OP_ADD, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_OR, OP_AND};
+  static const enum Op muldiv[8] = {OP_MUL, OP_MULH, OP_MULHSU, OP_MULHU,
+                                    OP_DIV, OP_DIVU, OP_REM, OP_REMU};
+  static const enum Op csrop[8] = {OP_ILLEGAL, OP_CSRRW, OP_CSRRS, OP_CSRRC,
+                                   OP_ILLEGAL, OP_CSRRWI, OP_CSRRSI, OP_CSRRCI};
+
+  switch (BITS(w, 6, 0)) {
+  case 0x37: in.op = OP_LUI; in.imm = w & 0xfffff000; break;
+  case 0x17: in.op = OP_AUIPC; in.imm = w & 0xfffff000; break;
+  case 0x6f: in.op = OP_JAL; in.imm = imm_j; break;
+  case 0x67: in.op = f3 == 0 ? OP_JALR : OP_ILLEGAL; in.imm = imm_i; break;
+  case 0x63: in.op = branch[f3]; in.imm = imm_b; break;
+  case 0x03: in.op = load[f3]; in.imm = imm_i; break;
+  case 0x23: in.op = store[f3]; in.imm = imm_s; break;
+  case 0x13:
+    in.op = opimm[f3];
+    in.imm = imm_i;
+    if (f3 == 1 || f3 == 5) {
+      in.imm = BITS(w, 24, 20);
+      if (f3 == 5 && f7 == 0x20) {
+        in.op = OP_SRAI;
+      } else if (f7 != 0) {
+        in.op = OP_ILLEGAL;
+      }
+    }
+    break;
+  case 0x33:
+    if (f7 == 0) {
+      in.op = op[f3];
+    } else if (f7 == 1) {
+      in.op = muldiv[f3];
+    } else if (f7 == 0x20 && f3 == 0) {
+      in.op = OP_SUB;
+    } else if (f7 == 0x20 && f3 == 5) {
+      in.op = OP_SRA;
+    }
+    break;
+  case 0x2f:
+    if (f3 == 2) {
+      switch (BITS(w, 31, 27)) {
+      case 0x02: in.op = in.rs2 == 0 ? OP_LR : OP_ILLEGAL; break;
+      case 0x03: in.op = OP_SC; break;
+      case 0x01: in.op = OP_AMOSWAP; break;
+      case 0x00: in.op = OP_AMOADD; break;
+      case 0x04: in.op = OP_AMOXOR; break;
+      case 0x0c: in.op = OP_AMOAND; break;
+      case 0x08: in.op = OP_AMOOR; break;
+      case 0x10: in.op = OP_AMOMIN; break;
+      case 0x14: in.op = OP_AMOMAX; break;
+      case 0x18: in.op = OP_AMOMINU; break;
+      case 0x1c: in.op = OP_AMOMAXU; break;
+      }
+    }
+    break;
+  case 0x0f: in.op = OP_FENCE; break;
+  case 0x73:
+    if (f3 == 0) {
+      switch (w) {
+      case 0x00000073: in.op = OP_ECALL; break;
+      case 0x00100073: in.op = OP_EBREAK; break;
+      case 0x30200073: in.op = OP_MRET; break;
+      case 0x10500073: in.op = OP_WFI; break;
+      }
+    } else {
+      in.op = csrop[f3];
+      in.imm = BITS(w, 31, 20); // CSR 番号
+    }
+    break;
+  }
+  return in;
+}
+
+static struct Insn Decode16(uint16_t h) {
+  struct Insn in = {OP_ILLEGAL, 0, 0, 0, 0, 2};
+  const uint32_t f3 = BITS(h, 15, 13);
+  const uint8_t r = BITS(h, 11, 7); // rd/rs1
+  const uint8_t r2 = BITS(h, 6, 2); // rs2
+  const uint8_t rp1 = 8 + BITS(h, 9, 7); // rs1'/rd'
+  const uint8_t rp2 = 8 + BITS(h, 4, 2); // rs2'/rd'
+  const int32_t imm6 = SignExtend((BITS(h, 12, 12) << 5) | BITS(h, 6, 2), 6);
+  const uint32_t uimm_lw = (BITS(h, 12, 10) << 3) | (BITS(h, 6, 6) << 2) | (BITS(h, 5, 5) << 6);
+  const int32_t imm_j = SignExtend((BITS(h, 12, 12) << 11) | (BITS(h, 11, 11) << 4)
+                                   | (BITS(h, 10, 9) << 8) | (BITS(h, 8, 8) << 10)
+                                   | (BITS(h, 7, 7) << 6) | (BITS(h, 6, 6) << 7)
+                                   | (BITS(h, 5, 3) << 1) | (BITS(h, 2, 2) << 5), 12);
+  const int32_t imm_b = SignExtend((BITS(h, 12, 12) << 8) | (BITS(h, 11, 10) << 3)
+                                   | (BITS(h, 6, 5) << 6) | (BITS(h, 4, 3) << 1)
+                                   | (BITS(h, 2, 2) << 5), 9);
+
+  switch (BITS(h, 1, 0) << 3 | f3) {
+  case 000: // C.ADDI4SPN
+    in.op = OP_ADDI;
+    in.rd = rp2;
+    in.rs1 = 2;
+    in.imm = (BITS(h, 12, 11) << 4) | (BITS(h, 10, 7) << 6) | (BITS(h, 6, 6) << 2)
+           | (BITS(h, 5, 5) << 3);
+    if (in.imm == 0) {
+      in.op = OP_ILLEGAL;
+    }
+    break;
+  case 002: // C.LW
+    in = (struct Insn){OP_LW, rp2, rp1, 0, uimm_lw, 2};
+    break;
+  case 006: // C.SW
+    in = (struct Insn){OP_SW, 0, rp1, rp2, uimm_lw, 2};
+    break;
+  case 010: // C.ADDI
+    in = (struct Insn){OP_ADDI, r, r, 0, imm6, 2};
+    break;
+  case 011: // C.JAL
+    in = (struct Insn){OP_JAL, 1, 0, 0, imm_j, 2};
+    break;
+  case 012: // C.LI
+    in = (struct Insn){OP_ADDI, r, 0, 0, imm6, 2};
+    break;
+  case 013:
+    if (r == 2) { // C.ADDI16SP
+      in = (struct Insn){OP_ADDI, 2, 2, 0,
+                         SignExtend((BITS(h, 12, 12) << 9) | (BITS(h, 6, 6) << 4)
+                                    | (BITS(h, 5, 5) << 6) | (BITS(h, 4, 3) << 7)
+                                    | (BITS(h, 2, 2) << 5), 10), 2};
+    } else { // C.LUI
+      in = (struct Insn){OP_LUI, r, 0, 0, (int32_t)((uint32_t)imm6 << 12), 2};
+    }
+    break;
+  case 014:
+    switch (BITS(h, 11, 10)) {
+    case 0: in = (struct Insn){OP_SRLI, rp1, rp1, 0, BITS(h, 6, 2), 2}; break;
+    case 1: in = (struct Insn){OP_SRAI, rp1, rp1, 0, BITS(h, 6, 2), 2}; break;
+    case 2: in = (struct Insn){OP_ANDI, rp1, rp1, 0, imm6, 2}; break;
+    case 3: {
+      static const enum Op ops[4] = {OP_SUB, OP_XOR, OP_OR, OP_AND};
+      if (BITS(h, 12, 12) == 0) {
+        in = (struct Insn){ops[BITS(h, 6, 5)], rp1, rp1, rp2, 0, 2};
+      }
+      break;
+    }
+    }
+    break;
+  case 015: // C.J
+    in = (struct Insn){OP_JAL, 0, 0, 0, imm_j, 2};
+    break;
+  case 016: // C.BEQZ
+    in = (struct Insn){OP_BEQ, 0, rp1, 0, imm_b, 2};
+    break;
+  case 017: // C.BNEZ
+    in = (struct Insn){OP_BNE, 0, rp1, 0, imm_b, 2};
+    break;
+  case 020: // C.SLLI
+    in = (struct Insn){OP_SLLI, r, r, 0, BITS(h, 6, 2), 2};
+    break;
+  case 022: // C.LWSP
+    in = (struct Insn){OP_LW, r, 2, 0,
+                       (BITS(h, 12, 12) << 5) | (BITS(h, 6, 4) << 2) | (BITS(h, 3, 2) << 6), 2};
+    break;
+  case 024:
+    if (BITS(h, 12, 12) == 0) {
+      if (r2 == 0) { // C.JR
+        in = (struct Insn){OP_JALR, 0, r, 0, 0, 2};
+      } else { // C.MV
+        in = (struct Insn){OP_ADD, r, 0, r2, 0, 2};
+      }
+    } else if (r == 0 && r2 == 0) { // C.EBREAK
+      in.op = OP_EBREAK;
+    } else if (r2 == 0) { // C.JALR
+      in = (struct Insn){OP_JALR, 1, r, 0, 0, 2};
+    } else { // C.ADD
+      in = (struct Insn){OP_ADD, r, r, r2, 0, 2};
+    }
+    break;
+  case 026: // C.SWSP
+    in = (struct Insn){OP_SW, 0, 2, r2, (BITS(h, 12, 9) << 2) | (BITS(h, 8, 7) << 6), 2};
+    break;
+  }
+  if (h == 0) {
+    in.op = OP_ILLEGAL;
+  }
+  return in;
+}
+
+static uint32_t ReadCSR(uint32_t n) {
+  switch (n) {
+  case 0xB00: case 0xC00: return cycle;
+  case 0xB80: case 0xC80: return cycle >> 32;
+  case 0xB02: case 0xC02: return instret;
+  case 0xB82: case 0xC82: return instret >> 32;
+  default: return csr[n];
+  }
+}
+
+static void WriteCSR(uint32_t n, uint32_t v) {
+  // カウンタへの書き込みは無視する
+  if ((n & 0xF7F) != 0xB00 && (n & 0xF7F) != 0xB02 && (n & 0xF00) != 0xC00) {
+    csr[n] = v;
+  }
+}
+
+// 1 命令実行し、消費したサイクル数を返す。ecall の exit で終了したら -1
+static int Step(int *exit_code) {
+  uint32_t w = Load(pc, 2);
+  struct Insn in;
+  if ((w & 3) == 3) {
+    w |= Load(pc + 2, 2) << 16;
+    in = Decode32(w);
+  } else {
+    in = Decode16(w);
+  }
+  periph_access = false;
+
+  const uint32_t a = x[in.rs1], b = x[in.rs2];
+  uint32_t next = pc + in.len;
+  uint32_t rd = 0;
+  bool write_rd = true;
+  int cyc = CYC_ALU;
+
+  switch (in.op) {
+  case OP_ILLEGAL:
+    Fatal("illegal instruction", w);
+    break;
+  case OP_LUI: rd = in.imm; break;
+  case OP_AUIPC: rd = pc + in.imm; break;
+  case OP_JAL: rd = next; next = pc + in.imm; cyc = CYC_TAKEN; break;
+  case OP_JALR: rd = next; next = (a + in.imm) & ~1u; cyc = CYC_TAKEN; break;
+  case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU: {
+    bool taken;
+    switch (in.op) {
+    case OP_BEQ: taken = a == b; break;
+    case OP_BNE: taken = a != b; break;
+    case OP_BLT: taken = (int32_t)a < (int32_t)b; break;
+    case OP_BGE: taken = (int32_t)a >= (int32_t)b; break;
+    case OP_BLTU: taken = a < b; break;
+    default: taken = a >= b; break;
+    }
+    if (taken) {
+      next = pc + in.imm;
+      cyc = CYC_TAKEN;
+    }
+    write_rd = false;
+    break;
+  }
+  case OP_LB: rd = (int8_t)Load(a + in.imm, 1); cyc = CYC_LOAD; break;
+  case OP_LH: rd = (int16_t)Load(a + in.imm, 2); cyc = CYC_LOAD; break;
+  case OP_LW: rd = Load(a + in.imm, 4); cyc = CYC_LOAD; break;
+  case OP_LBU: rd = Load(a + in.imm, 1); cyc = CYC_LOAD; break;
+  case OP_LHU: rd = Load(a + in.imm, 2); cyc = CYC_LOAD; break;
+  case OP_SB: Store(a + in.imm, 1, b); cyc = CYC_STORE; write_rd = false; break;
+  case OP_SH: Store(a + in.imm, 2, b); cyc = CYC_STORE; write_rd = false; break;
+  case OP_SW: Store(a + in.imm, 4, b); cyc = CYC_STORE; write_rd = false; break;
+  case OP_ADDI: rd = a + in.imm; break;
+  case OP_SLTI: rd = (int32_t)a < in.imm; break;
+  case OP_SLTIU: rd = a < (uint32_t)in.imm; break;
+  case OP_XORI: rd = a ^ in.imm; break;
+  case OP_ORI: rd = a | in.imm; break;
+  case OP_ANDI: rd = a & in.imm; break;
+  case OP_SLLI: rd = a << in.imm; break;
+  case OP_SRLI: rd = a >> in.imm; break;
+  case OP_SRAI: rd = (int32_t)a >> in.imm; break;
+  case OP_ADD: rd = a + b; break;
+  case OP_SUB: rd = a - b; break;
+  case OP_SLL: rd = a << (b & 31); break;
+  case OP_SLT: rd = (int32_t)a < (int32_t)b; break;
+  case OP_SLTU: rd = a < b; break;
+  case OP_XOR: rd = a ^ b; break;
+  case OP_SRL: rd = a >> (b & 31); break;
+  case OP_SRA: rd = (int32_t)a >> (b & 31); break;
+  case OP_OR: rd = a | b; break;
+  case OP_AND: rd = a & b; break;
+  case OP_MUL: rd = a * b; cyc = CYC_MUL; break;
+  case OP_MULH: rd = ((int64_t)(int32_t)a * (int32_t)b) >> 32; cyc = CYC_MUL; break;
+  case OP_MULHSU: rd = ((int64_t)(int32_t)a * (uint64_t)b) >> 32; cyc = CYC_MUL; break;
+  case OP_MULHU: rd = ((uint64_t)a * b) >> 32; cyc = CYC_MUL; break;
+  case OP_DIV:
+    rd = b == 0 ? 0xffffffff : (a == 0x80000000 && b == 0xffffffff) ? a
+       : (uint32_t)((int32_t)a / (int32_t)b);
+    cyc = CYC_DIV;
+    break;
+  case OP_DIVU: rd = b == 0 ? 0xffffffff : a / b; cyc = CYC_DIV; break;
+  case OP_REM:
+    rd = b == 0 ? a : (a == 0x80000000 && b == 0xffffffff) ? 0
+       : (uint32_t)((int32_t)a % (int32_t)b);
+    cyc = CYC_DIV;
+    break;
+  case OP_REMU: rd = b == 0 ? a : a % b; cyc = CYC_DIV; break;
+  case OP_LR:
+    if (a & 3) {
+      Fatal("misaligned lr.w", a);
+    }
+    rd = Load(a, 4);
+    reserved = true;
+    reserved_addr = a;
+    cyc = CYC_LOAD;
+    break;
+  case OP_SC:
+    if (a & 3) {
+      Fatal("misaligned sc.w", a);
+    }
+    rd = !(reserved && reserved_addr == a);
+    if (rd == 0) {
+      Store(a, 4, b);
+    }
+    reserved = false;
+    cyc = CYC_STORE;
+    break;
+  case OP_AMOSWAP: case OP_AMOADD: case OP_AMOXOR: case OP_AMOAND: case OP_AMOOR:
+  case OP_AMOMIN: case OP_AMOMAX: case OP_AMOMINU: case OP_AMOMAXU: {
+    if (a & 3) {
+      Fatal("misaligned amo", a);
+    }
+    const uint32_t m = Load(a, 4);
+    uint32_t v;
+    switch (in.op) {
+    case OP_AMOSWAP: v = b; break;
+    case OP_AMOADD: v = m + b; break;
+    case OP_AMOXOR: v = m ^ b; break;
+    case OP_AMOAND: v = m & b; break;
+    case OP_AMOOR: v = m | b; break;
+    case OP_AMOMIN: v = (int32_t)m < (int32_t)b ? m : b; break;
+    case OP_AMOMAX: v = (int32_t)m > (int32_t)b ? m : b; break;
+    case OP_AMOMINU: v = m < b ? m : b; break;
+    default: v = m > b ? m : b; break;
+    }
+    Store(a, 4, v);
+    rd = m;
+    cyc = CYC_LOAD + CYC_STORE;
+    break;
+  }
+  case OP_FENCE: case OP_WFI: write_rd = false; break;
+  case OP_ECALL:
+    write_rd = false;
+    cyc = CYC_SYSTEM;
+    switch (x[17]) {
+    case 64: {
+      const uint32_t len = x[12];
+      FILE *out = x[10] == 2 ? stderr : stdout;
+      fwrite(Translate(x[11], len), 1, len, out);
+      x[10] = len;
+      break;
+    }
+    case 93:
+      *exit_code = x[10];
+      return -1;
+    default:
+      Fatal("unknown ecall", x[17]);
+    }
+    break;
+  case OP_EBREAK:
+    Fatal("ebreak", pc);
+    break;
+  case OP_MRET:
+    next = csr[0x341]; // mepc
+    cyc = CYC_SYSTEM;
+    write_rd = false;
+    break;
+  case OP_CSRRW: case OP_CSRRS: case OP_CSRRC:
+  case OP_CSRRWI: case OP_CSRRSI: case OP_CSRRCI: {
+    const uint32_t n = in.imm;
+    const uint32_t src = in.op >= OP_CSRRWI ? in.rs1 : a;
+    rd = ReadCSR(n);
+    if (in.op == OP_CSRRW || in.op == OP_CSRRWI) {
+      WriteCSR(n, src);
+    } else if (in.rs1 != 0) {
+      WriteCSR(n, in.op == OP_CSRRS || in.op == OP_CSRRSI ? rd | src : rd & ~src);
+    }
+    cyc = CYC_SYSTEM;
+    break;
+  }
+  }
+
+  if (write_rd && in.rd != 0) {
+    x[in.rd] = rd;
+  }
+  if (periph_access) {
+    cyc += CYC_PERIPH;
+  }
+  pc = next;
+  return cyc;
+}
+
+int main(int argc, char **argv) {
+  uint64_t limit = 10000000000ull;
+  int opt;
+  while ((opt = getopt(argc, argv, "l:")) != -1) {
+    switch (opt) {
+    case 'l':
+      limit = strtoull(optarg, NULL, 0);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-l max_cycles] <elf>\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-l max_cycles] <elf>\n", argv[0]);
+    return 1;
+  }
+
+  for (size_t i = 0; i < NUM_REGIONS; ++i) {
+    regions[i].mem = calloc(1, regions[i].size);
+  }
+  regions[1].mem = regions[0].mem;
+  LoadELF(argv[optind]);
+
+  int exit_code = 0;
+  while (cycle < limit) {
+    const int cyc = Step(&exit_code);
+    if (cyc < 0) {
+      return exit_code;
+    }
+    cycle += cyc;
+    ++instret;
+  }
+  Fatal("cycle limit exceeded", 0);
+  return 2;
+}
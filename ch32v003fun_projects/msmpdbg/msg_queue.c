@@ -0,0 +1,45 @@
+#include "msg_queue.h"
+
+#include <stddef.h>
+
+// 相手側が更新するインデックスは acquire で読み、自分が更新するインデックスは release で書く。
+// これにより、スロットの中身の読み書きがインデックスの更新をまたいで並べ替えられない。
+#define LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static uint32_t Next(const struct MsgQueue *q, uint32_t i) {
+  return i + 1 == q->len ? 0 : i + 1;
+}
+
+void MsgQueueInit(struct MsgQueue *q, struct Message *slots, uint32_t len) {
+  q->slots = slots;
+  q->len = len;
+  q->head = 0;
+  q->tail = 0;
+  q->dropped = 0;
+}
+
+struct Message *MsgQueueBeginWrite(struct MsgQueue *q) {
+  const uint32_t head = q->head;
+  if (Next(q, head) == LOAD_ACQUIRE(&q->tail)) {
+    ++q->dropped;
+    return NULL;
+  }
+  return q->slots + head;
+}
+
+void MsgQueueCommit(struct MsgQueue *q) {
+  STORE_RELEASE(&q->head, Next(q, q->head));
+}
+
+const struct Message *MsgQueuePeek(struct MsgQueue *q) {
+  const uint32_t tail = q->tail;
+  if (tail == LOAD_ACQUIRE(&q->head)) {
+    return NULL;
+  }
+  return q->slots + tail;
+}
+
+void MsgQueuePop(struct MsgQueue *q) {
+  STORE_RELEASE(&q->tail, Next(q, q->tail));
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+/*
+ * 受信メッセージの SPSC（生産者 1、消費者 1）キュー
+ *
+ * 生産者（割り込みハンドラ）は MsgQueueBeginWrite で得たスロットに 1 バイトずつ書き込み、
+ * メッセージを受信し終えたら MsgQueueCommit で公開する。
+ * 公開前のスロットは消費者から見えないので、受信途中のメッセージを読むことはない。
+ * 受信途中で中断した（TSM で強制復旧した）場合は、次の MsgQueueBeginWrite で同じスロットを再利用する。
+ *
+ * 消費者（メインループ）は MsgQueuePeek で最も古いメッセージを読み、MsgQueuePop で解放する。
+ * どちらの側も割り込みを禁止する必要はない。
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "msmp_proto.h"
+
+struct MsgQueue {
+  struct Message *slots;
+  uint32_t len; // スロット数（キューに入るメッセージは最大 len - 1 個）
+  uint32_t head; // 次に公開するスロット（生産者のみが更新）
+  uint32_t tail; // 次に読むスロット（消費者のみが更新）
+  uint32_t dropped; // キューが満杯のため捨てたメッセージ数（生産者のみが更新）
+};
+
+void MsgQueueInit(struct MsgQueue *q, struct Message *slots, uint32_t len);
+
+/*
+ * 書き込み用のスロットを得る（生産者側）
+ *
+ * 前回得たスロットを公開せずに呼んだ場合は、同じスロットを返す。
+ * @return  キューが満杯なら NULL
+ */
+struct Message *MsgQueueBeginWrite(struct MsgQueue *q);
+/* MsgQueueBeginWrite で得たスロットを公開する（生産者側） */
+void MsgQueueCommit(struct MsgQueue *q);
+
+/*
+ * 最も古いメッセージを得る（消費者側）
+ *
+ * @return  キューが空なら NULL
+ */
+const struct Message *MsgQueuePeek(struct MsgQueue *q);
+/* MsgQueuePeek で得たメッセージを解放する（消費者側） */
+void MsgQueuePop(struct MsgQueue *q);
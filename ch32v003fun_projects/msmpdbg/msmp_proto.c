@@ -0,0 +1,119 @@
+#include "msmp_proto.h"
+
+#include <stddef.h>
+
+void MSMPInitNode(struct MSMPNode *node, uint8_t my_addr, MSMPSendFunc send) {
+  node->state = MSTATE_IDLE;
+  node->flags = 0;
+  node->my_addr = my_addr;
+  node->enable_auto_forward = true;
+  node->forwarding = false;
+  node->forward_dst = 0;
+  node->len = 0;
+  node->body_pos = 0;
+  node->send = send;
+  node->record = NULL;
+  node->user = NULL;
+}
+
+bool MSMPStartBit(struct MSMPNode *node) {
+  if (node->state != MSTATE_IDLE) {
+    return false;
+  }
+  node->state = MSTATE_ADDR;
+  return true;
+}
+
+bool MSMPIsToForward(const struct MSMPNode *node, uint8_t addr) {
+  uint8_t dst = addr >> 4;
+  uint8_t src = addr & 15;
+
+  if (dst == MSMP_ADDR_BROADCAST) {
+    // 送信者が自分ではないブロードキャストメッセージは転送する
+    return src != node->my_addr;
+  }
+
+  // 宛先が自分ではないユニキャストメッセージは転送する
+  return dst != node->my_addr;
+}
+
+void MSMPProcByte(struct MSMPNode *node, uint8_t c) {
+  // この関数は割り込みハンドラから呼ばれるので、長時間の処理はしない
+  if (c == 0 && node->state != MSTATE_LEN) {
+    // 整合性が失われているので、強制復旧
+    node->flags |= MFLAG_TSM_RESET;
+    node->state = MSTATE_IDLE;
+    if (node->record) {
+      node->record(node, MSTATE_IDLE, c);
+    }
+    if (node->forwarding) {
+      node->send(node, c);
+    }
+    return;
+  }
+  // 整合性は保たれているので、通常の処理を続ける
+
+  const enum MSMPState state = node->state;
+  if (node->record) {
+    node->record(node, state == MSTATE_IDLE ? MSTATE_ADDR : state, c);
+  }
+
+  switch (state) {
+  case MSTATE_IDLE:
+    // スタートビットの検知（MSMPStartBit）より先にバイトを受信した。
+    // 先頭バイトとして扱う。
+    node->flags |= MFLAG_START_MISSED;
+    /* fall through */
+  case MSTATE_ADDR:
+    node->state = MSTATE_LEN;
+    {
+      uint8_t dst = c >> 4;
+      uint8_t src = c & 15;
+      switch (dst) {
+      case 0x00: // 未使用アドレス
+        node->flags |= MFLAG_DST_ZERO;
+        break;
+      case MSMP_ADDR_BROADCAST:
+        if (src == node->my_addr) {
+          // 自分が送信したブロードキャストメッセージ
+          node->flags |= MFLAG_MY_BRDCAST;
+        }
+        break;
+      default: // ユニキャスト
+        if (dst == node->my_addr) {
+          node->flags |= MFLAG_MSG_TO_ME;
+        }
+        break;
+      }
+
+      if (MSMPIsToForward(node, c)) {
+        node->flags |= MFLAG_MSG_TO_FORWARD;
+        // 自動転送モードが有効であれば、受信したメッセージをそのまま転送
+        node->forwarding = node->enable_auto_forward;
+        node->forward_dst = dst;
+      } else {
+        node->forwarding = false;
+      }
+    }
+    break;
+  case MSTATE_LEN:
+    node->len = c;
+    node->body_pos = 0;
+    if (c > 0) {
+      node->state = MSTATE_BODY;
+    } else {
+      node->state = MSTATE_IDLE;
+    }
+    break;
+  case MSTATE_BODY:
+    if (++node->body_pos == node->len) {
+      // メッセージ受信完了
+      node->state = MSTATE_IDLE;
+    }
+    break;
+  }
+
+  if (node->forwarding) {
+    node->send(node, c);
+  }
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+/*
+ * MSMP プロトコルエンジン
+ *
+ * 受信した 1 バイトごとに MSMP の状態を進め、転送すべきバイトを出力先へ渡す。
+ * マイコンの周辺機能には依存しないので、ホスト（Linux）上でもコンパイルできる。
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef uint32_t tick_t;
+
+struct Message {
+  tick_t start_tick; // スタートビットを受信したときの時刻
+  tick_t fwd_tick; // 転送を開始した時刻（転送しなかったら start_tick と同じ）
+  union {
+    struct {
+      uint8_t addr;
+      uint8_t len;
+      uint8_t body[63];
+    };
+    uint8_t raw_msg[65];
+  } __attribute__((packed));
+};
+
+enum MSMPState {
+  MSTATE_IDLE, // 先頭バイトを待っている状態
+  MSTATE_ADDR, // 先頭バイトを受信中
+  MSTATE_LEN,  // メッセージ長を受信中
+  MSTATE_BODY, // メッセージボディを受信中
+};
+
+// MSMP 受信に関連する各種フラグ（struct MSMPNode の flags）
+#define MFLAG_MSG_TO_ME      0x0001
+#define MFLAG_MSG_TO_FORWARD 0x0002
+#define MFLAG_TSM_RESET      0x0004
+#define MFLAG_DST_ZERO       0x0008
+#define MFLAG_MY_BRDCAST     0x0010
+#define MFLAG_START_MISSED   0x0020 // スタートビットを検知する前にバイトを受信した
+
+#define MSMP_ADDR_BROADCAST 0x0F
+
+struct MSMPNode;
+
+/* 転送するバイトの出力先 */
+typedef void (*MSMPSendFunc)(struct MSMPNode *node, uint8_t c);
+/*
+ * 受信したバイトの記録先
+ *
+ * @param state  c を受信したときの状態（MSTATE_ADDR, MSTATE_LEN, MSTATE_BODY のいずれか）
+ *               TSM により強制復旧したときは MSTATE_IDLE（c は 0）
+ */
+typedef void (*MSMPRecordFunc)(struct MSMPNode *node, enum MSMPState state, uint8_t c);
+
+struct MSMPNode {
+  volatile enum MSMPState state;
+  volatile uint16_t flags;
+  uint8_t my_addr;
+  bool enable_auto_forward; // 真なら自分宛て以外のメッセージを自動で転送する
+  bool forwarding; // 受信中のメッセージを転送中なら真
+  uint8_t forward_dst; // 転送中のメッセージの宛先
+  uint8_t len; // 受信中のメッセージのメッセージ長
+  uint8_t body_pos; // 受信済みの本文のバイト数
+  MSMPSendFunc send;
+  MSMPRecordFunc record; // NULL なら記録しない
+  void *user; // 呼び出し側が自由に使える
+};
+
+/* ノードを初期化 */
+void MSMPInitNode(struct MSMPNode *node, uint8_t my_addr, MSMPSendFunc send);
+
+/*
+ * メッセージ先頭バイトのスタートビットを検出したときに呼ぶ
+ *
+ * @return  IDLE 状態だった（メッセージの先頭だった）なら真
+ */
+bool MSMPStartBit(struct MSMPNode *node);
+
+/* 転送すべきメッセージに対して真を返す */
+bool MSMPIsToForward(const struct MSMPNode *node, uint8_t addr);
+
+/* 受信した 1 バイトを処理 */
+void MSMPProcByte(struct MSMPNode *node, uint8_t c);
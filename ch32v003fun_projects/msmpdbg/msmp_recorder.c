@@ -3,59 +3,483 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include "msmpdbg.h"
 
-volatile struct Message msg_buf[MSG_BUF_LEN];
-volatile size_t msg_wpos; // msg の書き込み位置
-volatile size_t msg_body_wpos; // msg.body の書き込み位置
-volatile tick_t sig_buf[SIG_BUF_LEN];
+static struct Message msg_buf[MSG_BUF_LEN];
+struct MsgQueue msg_queue = {msg_buf, MSG_BUF_LEN};
+static struct Message *msg_writing; // 受信中のメッセージ（NULL ならキューが満杯で記録しない）
+static size_t msg_body_wpos; // msg_writing->body の書き込み位置
+// 受信済みメッセージの履歴（メインループのみが読み書きする）
+static struct Message msg_hist[MSG_HIST_LEN];
+static size_t msg_hist_num; // 履歴に入れたメッセージの総数
+volatile sig_delta_t sig_buf[SIG_BUF_LEN];
+volatile size_t sig_rpos;
 volatile size_t sig_wpos;
-volatile bool sig_record_mode;
+volatile size_t sig_len;
+volatile size_t sig_edges;
+volatile tick_t sig_start_tick;
+volatile tick_t sig_last_tick;
+volatile tick_t sig_trig_tick;
+volatile enum SigRecState sig_rec_state;
+volatile bool sig_trig_fired;
 volatile uint32_t sig_record_period_ticks = 2 * SIG_RECORD_RATE;
+volatile uint32_t sig_pretrig_ticks = SIG_RECORD_RATE / 10;
+struct SigTrigger sig_triggers[SIG_TRIG_MAX];
+size_t sig_trigger_num;
+static tick_t msg_start_tick; // 受信中のメッセージのスタートビットの時刻
+// 受信中のメッセージについて、まだ成立し得るトリガ（ビット i が sig_triggers[i] に対応）
+static uint8_t trig_alive;
+
+// ストリーミングでは sig_buf を 2 つの半分に分け、交互に書く
+#define SIG_STREAM_HALF_LEN (SIG_BUF_LEN / 2)
+struct SigStreamHalf {
+  tick_t start_tick; // 先頭の差分の基準時刻（直前の信号変化の時刻）
+  uint32_t edges; // 先頭までの信号変化の回数
+  uint32_t dropped; // 先頭までに捨てた信号変化の回数
+  size_t words; // 送る要素数
+};
+static struct SigStreamHalf stream_halves[2];
+// 書き終えた半分（割り込みハンドラが真にし、送り終えたらメインループが偽に戻す）
+static volatile bool stream_full[2];
+static size_t stream_next; // 次に送る半分
+static bool stream_sending; // stream_next を送信中
+static uint32_t stream_chunks; // 送った半分の数
+static enum ConOverflowPolicy stream_saved_policy;
+volatile uint32_t sig_stream_dropped;
+
+
+static inline size_t SigBufNext(size_t pos) {
+  return pos + 1 == SIG_BUF_LEN ? 0 : pos + 1;
+}
+
+/*
+ * sig_buf[*pos] から 1 つ分の差分を読み出し、*pos を進める
+ *
+ * @param left  未読の要素数（読んだ分だけ減らす）
+ * @return  読み出せたら真、差分の途中で left が 0 になったら偽
+ */
+static bool ReadSigDelta(size_t *pos, size_t *left, tick_t *delta) {
+  tick_t d = 0;
+  while (*left > 0) {
+    const sig_delta_t w = sig_buf[*pos];
+    *pos = SigBufNext(*pos);
+    --*left;
+    d = (d << SIG_DELTA_BITS) | (w & SIG_DELTA_MASK);
+    if ((w & SIG_DELTA_CONT) == 0) {
+      *delta = d;
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * 最も古い 2 つの信号変化（立ち下がりと立ち上がり）を捨てる
+ *
+ * 記録が立ち下がりから始まるように、必ず 2 つずつ捨てる。
+ * @param limit  捨てた後の記録の先頭がこの時刻より後になるなら捨てない
+ * @return  捨てたら真
+ */
+static bool DropOldestEdges(tick_t limit) {
+  if (sig_edges < 3) {
+    return false;
+  }
+  size_t pos = sig_rpos;
+  size_t left = sig_len;
+  tick_t d0, d1;
+  ReadSigDelta(&pos, &left, &d0);
+  ReadSigDelta(&pos, &left, &d1);
+  const tick_t new_start = sig_start_tick + d0 + d1;
+  if ((int32_t)(limit - new_start) < 0) {
+    return false;
+  }
+  sig_rpos = pos;
+  sig_len = left;
+  sig_start_tick = new_start;
+  sig_edges -= 2;
+  return true;
+}
+
+/*
+ * 差分を上位の桁から順に、継続フラグを付けて sig_buf[wpos] から書く
+ *
+ * @param shift  最上位の桁の位置
+ * @return  書き終えた次の位置
+ */
+static size_t WriteSigDelta(size_t wpos, tick_t delta, int shift) {
+  for (; shift > 0; shift -= SIG_DELTA_BITS) {
+    sig_buf[wpos] = SIG_DELTA_CONT | ((delta >> shift) & SIG_DELTA_MASK);
+    wpos = SigBufNext(wpos);
+  }
+  sig_buf[wpos] = delta & SIG_DELTA_MASK;
+  return SigBufNext(wpos);
+}
+
+/*
+ * ストリーミング中の信号変化の時刻を sig_buf へ追記
+ *
+ * 各半分を単独で復号できるよう、1 つの差分を半分の境界で分けない。
+ * 書き込む半分がまだ送信待ちなら、その信号変化は捨てて sig_stream_dropped に数える。
+ * 捨てても sig_last_tick と sig_edges は進めるので、次の半分の時刻と信号の値は正しい。
+ */
+static void PushStreamTick(tick_t t, tick_t delta, int shift, size_t words) {
+  size_t wpos = sig_wpos;
+  size_t h = wpos < SIG_STREAM_HALF_LEN ? 0 : 1;
+  const size_t end = (h + 1) * SIG_STREAM_HALF_LEN;
+  if (wpos != h * SIG_STREAM_HALF_LEN && wpos + words > end) {
+    // 収まらないので、残りを継続フラグ付きの 0 で埋めて次の半分へ移る
+    while (wpos < end) {
+      sig_buf[wpos++] = SIG_DELTA_CONT;
+    }
+    stream_halves[h].words = SIG_STREAM_HALF_LEN;
+    stream_full[h] = true;
+    h ^= 1;
+    wpos = h * SIG_STREAM_HALF_LEN;
+    sig_wpos = wpos;
+  }
+
+  if (wpos == h * SIG_STREAM_HALF_LEN) {
+    if (stream_full[h]) {
+      // 送信が追いついていない
+      ++sig_stream_dropped;
+      sig_last_tick = t;
+      ++sig_edges;
+      return;
+    }
+    struct SigStreamHalf *half = stream_halves + h;
+    half->start_tick = sig_last_tick;
+    half->edges = sig_edges;
+    half->dropped = sig_stream_dropped;
+  }
+
+  wpos = WriteSigDelta(wpos, delta, shift);
+  sig_last_tick = t;
+  ++sig_edges;
+  if (wpos == (h + 1) * SIG_STREAM_HALF_LEN || wpos == 0) {
+    stream_halves[h].words = SIG_STREAM_HALF_LEN;
+    stream_full[h] = true;
+    wpos = h == 0 ? SIG_STREAM_HALF_LEN : 0;
+  }
+  sig_wpos = wpos;
+}
+
+/*
+ * 信号変化の時刻を sig_buf へ追記
+ *
+ * 空きが無ければトリガ成立前の古い記録を捨てて空ける。
+ * @return  追記できたら真、トリガ成立後の記録で満杯なら偽
+ */
+static bool PushSigTick(tick_t t) {
+  tick_t delta = t - sig_last_tick;
+  // 15 ビットずつに分けたときの最上位の桁の位置
+  int shift = 0;
+  while (shift + SIG_DELTA_BITS < 32 && (delta >> (shift + SIG_DELTA_BITS)) != 0) {
+    shift += SIG_DELTA_BITS;
+  }
+  const size_t words = shift / SIG_DELTA_BITS + 1;
+
+  if (sig_rec_state == SREC_STREAMING) {
+    PushStreamTick(t, delta, shift, words);
+    return true;
+  }
+  if (sig_rec_state == SREC_TRIGGERED) {
+    // トリガ成立より sig_pretrig_ticks 以上前の記録を少しずつ捨てる
+    // （一度に捨てると割り込みハンドラが長くなるので、1 回の追記につき 2 組まで）
+    const tick_t limit = sig_trig_tick - sig_pretrig_ticks;
+    for (int i = 0; i < 2 && DropOldestEdges(limit); ++i);
+  }
+  while (sig_len + words > SIG_BUF_LEN) {
+    // トリガ成立前なら古い記録はいつでも捨ててよい
+    const tick_t limit = sig_rec_state == SREC_ARMED ? t : sig_trig_tick;
+    if (!DropOldestEdges(limit)) {
+      return false;
+    }
+  }
+
+  sig_wpos = WriteSigDelta(sig_wpos, delta, shift);
+  sig_len += words;
+  sig_last_tick = t;
+  ++sig_edges;
+  return true;
+}
 
 bool SenseSignal(tick_t tick, bool sig) {
   // メッセージ先頭バイトのスタートビットを検出
-  const bool msg_start = msmp_state == MSTATE_IDLE && !sig;
+  const bool msg_start = !sig && MSMPStartBit(&msmp_node);
   if (msg_start) {
-    msmp_state = MSTATE_ADDR;
-  }
-
-  if (sig_record_mode && sig_wpos < SIG_BUF_LEN) {
-    // sig_wpos == 0: sig == 0
-    // sig_wpos == 1: sig == 1
-    // sig_wpos == 2: sig == 0
-    // つまり sig_wpos が偶数 => sig == 0
-
-    if (sig_wpos == 0 && sig == 0) {
-      // スタートビットを受信した
-      sig_buf[sig_wpos++] = tick;
-    } else if (sig_wpos > 0 && sig_buf[0] + sig_record_period_ticks <= tick) {
-      // 記録開始後ある程度時間が経過したので記録を終わる
-      sig_record_mode = false;
-    } else if (sig_wpos > 0 && sig == (sig_wpos & 1)) {
+    msg_start_tick = tick;
+    MSMPStatsMsgStart(&msmp_stats, tick);
+  }
+
+  const enum SigRecState rec_state = sig_rec_state;
+  if (rec_state != SREC_STOPPED) {
+    // sig_edges == 1: sig == 0
+    // sig_edges == 2: sig == 1
+    // sig_edges == 3: sig == 0
+    // つまり sig_edges が奇数 => sig == 0
+
+    if (sig_edges == 0 && sig == 0) {
+      // 最初の立ち下がりを受信した
+      sig_start_tick = tick;
+      sig_last_tick = tick;
+      sig_edges = 1;
+      if (rec_state == SREC_TRIGGERED) {
+        // start rec では最初のスタートビットでトリガする
+        sig_trig_tick = tick;
+      }
+    } else if (sig_edges > 0 && rec_state == SREC_TRIGGERED &&
+               tick - sig_trig_tick >= sig_record_period_ticks) {
+      // トリガ成立後ある程度時間が経過したので記録を終わる
+      sig_rec_state = SREC_STOPPED;
+    } else if (sig_edges > 0 && sig == (sig_edges & 1)) {
       // 前回の信号と切り替わった
-      sig_buf[sig_wpos++] = tick;
+      if (!PushSigTick(tick)) {
+        // バッファが満杯になったので記録を終わる
+        sig_rec_state = SREC_STOPPED;
+      }
     }
   }
 
   return msg_start;
 }
 
+static void FinishSigStream(void);
+
+void ClearSigRecord(void) {
+  if (sig_rec_state == SREC_STREAMING) {
+    FinishSigStream();
+  }
+  sig_rec_state = SREC_STOPPED;
+  sig_rpos = 0;
+  sig_wpos = 0;
+  sig_len = 0;
+  sig_edges = 0;
+}
+
+void StartSigRecord(void) {
+  ClearSigRecord();
+  sig_rec_state = SREC_TRIGGERED;
+}
+
+void ArmSigRecord(void) {
+  ClearSigRecord();
+  trig_alive = 0;
+  sig_rec_state = SREC_ARMED;
+}
+
+void StopSigRecord(void) {
+  const enum SigRecState rec_state = sig_rec_state;
+  if (rec_state == SREC_STREAMING) {
+    FinishSigStream();
+    return;
+  }
+  sig_rec_state = SREC_STOPPED;
+  if (rec_state == SREC_ARMED) {
+    // トリガが成立しなかったので、最後の sig_pretrig_ticks だけ残す
+    sig_trig_tick = sig_last_tick;
+  }
+  if (sig_edges > 0) {
+    while (DropOldestEdges(sig_trig_tick - sig_pretrig_ticks));
+  }
+}
+
+bool AddSigTrigger(const struct SigTrigger *trig) {
+  if (sig_trigger_num >= SIG_TRIG_MAX) {
+    return false;
+  }
+  // 割り込みハンドラが書き換え途中の条件を読まないよう、記録を止めてから変更する
+  StopSigRecord();
+  sig_triggers[sig_trigger_num] = *trig;
+  ++sig_trigger_num;
+  return true;
+}
+
+void ClearSigTriggers(void) {
+  StopSigRecord();
+  sig_trigger_num = 0;
+}
+
+void PrintSigTriggers(void) {
+  const enum SigRecState rec_state = sig_rec_state;
+  printf("rec=%s edges=%u words=%u/%u pretrig=%lu posttrig=%lu ticks\r\n",
+         rec_state == SREC_STOPPED ? "stopped" :
+         rec_state == SREC_ARMED ? "armed" :
+         rec_state == SREC_TRIGGERED ? "triggered" : "streaming",
+         sig_edges, sig_len, SIG_BUF_LEN, sig_pretrig_ticks, sig_record_period_ticks);
+  if (rec_state == SREC_STREAMING || stream_chunks > 0) {
+    printf("stream: chunks=%lu dropped=%lu edges\r\n", stream_chunks, sig_stream_dropped);
+  }
+  for (size_t i = 0; i < sig_trigger_num; ++i) {
+    const struct SigTrigger *t = sig_triggers + i;
+    printf("[%u]", i);
+    if (t->conds == 0) {
+      printf(" any");
+    }
+    if (t->conds & TRIGC_TSM) {
+      printf(" tsm");
+    }
+    if (t->conds & TRIGC_DST) {
+      printf(" dst=%d", t->dst);
+    }
+    if (t->conds & TRIGC_SRC) {
+      printf(" src=%d", t->src);
+    }
+    if (t->conds & TRIGC_LEN) {
+      printf(" len=%d", t->len);
+    }
+    if (t->conds & TRIGC_BODY) {
+      printf(" body@%d=", t->body_off);
+      for (size_t j = 0; j < t->body_len; ++j) {
+        printf("%02x", t->body[j]);
+      }
+    }
+    printf("\r\n");
+  }
+}
+
+static void FireTrigger(tick_t t) {
+  sig_trig_tick = t;
+  sig_rec_state = SREC_TRIGGERED;
+  sig_trig_fired = true;
+}
+
+/*
+ * 受信した 1 バイトでトリガ条件を評価
+ *
+ * 割り込みハンドラから呼ばれる。各トリガの最後の条件を判定できるバイトを受信した時点で成立とする。
+ */
+static void EvalTriggers(const struct MSMPNode *node, enum MSMPState state, uint8_t c) {
+  if (sig_rec_state != SREC_ARMED || sig_edges == 0) {
+    return;
+  }
+  if (state == MSTATE_IDLE) {
+    // TSM による強制復旧
+    trig_alive = 0;
+    for (size_t i = 0; i < sig_trigger_num; ++i) {
+      if (sig_triggers[i].conds & TRIGC_TSM) {
+        // この時点で最後に記録した信号変化は TSM のストップビットの立ち上がりで、
+        // スタートビットから 9 ビット後
+        FireTrigger(sig_last_tick - 9 * sig_record_rate / msmp_baudrate);
+        return;
+      }
+    }
+    return;
+  }
+  if (state == MSTATE_ADDR) {
+    trig_alive = (1u << sig_trigger_num) - 1;
+  }
+
+  for (size_t i = 0; i < sig_trigger_num; ++i) {
+    const uint8_t bit = 1u << i;
+    if ((trig_alive & bit) == 0) {
+      continue;
+    }
+    const struct SigTrigger *t = sig_triggers + i;
+    bool match = true; // ここまでの条件を満たしている
+    bool last = false; // このバイトで最後の条件を判定した
+    switch (state) {
+    case MSTATE_ADDR:
+      match = (t->conds & TRIGC_TSM) == 0 &&
+              ((t->conds & TRIGC_DST) == 0 || (c >> 4) == t->dst) &&
+              ((t->conds & TRIGC_SRC) == 0 || (c & 15) == t->src);
+      last = (t->conds & (TRIGC_LEN | TRIGC_BODY)) == 0;
+      break;
+    case MSTATE_LEN:
+      match = ((t->conds & TRIGC_LEN) == 0 || c == t->len) &&
+              ((t->conds & TRIGC_BODY) == 0 || c >= t->body_off + t->body_len);
+      last = (t->conds & TRIGC_BODY) == 0;
+      break;
+    case MSTATE_BODY:
+      {
+        // body_off より前なら pos は大きな値になる
+        const size_t pos = (size_t)node->body_pos - t->body_off;
+        if (pos < t->body_len) {
+          match = c == t->body[pos];
+          last = pos == t->body_len - 1u;
+        }
+      }
+      break;
+    default:
+      break;
+    }
+    if (!match || last) {
+      trig_alive &= ~bit;
+    }
+    if (match && last) {
+      FireTrigger(msg_start_tick);
+      return;
+    }
+  }
+}
+
+void SigReaderInit(struct SigReader *r) {
+  r->rpos = sig_rpos;
+  r->left = sig_len;
+  r->tick = sig_start_tick;
+}
+
+bool SigReaderNext(struct SigReader *r) {
+  tick_t delta;
+  if (ReadSigDelta(&r->rpos, &r->left, &delta)) {
+    r->tick += delta;
+    return true;
+  }
+  return false;
+}
+
+uint32_t MeasureBitTicks(void) {
+  struct SigReader r;
+  SigReaderInit(&r);
+  tick_t prev = r.tick;
+  tick_t min_delta = UINT32_MAX;
+  while (SigReaderNext(&r)) {
+    const tick_t delta = r.tick - prev;
+    prev = r.tick;
+    if (delta > 0 && delta < min_delta) {
+      min_delta = delta;
+    }
+  }
+  if (min_delta == UINT32_MAX) {
+    return 0;
+  }
+
+  // 2 ビット以上の間隔を除いて平均する
+  uint32_t sum = 0, n = 0;
+  SigReaderInit(&r);
+  prev = r.tick;
+  while (SigReaderNext(&r)) {
+    const tick_t delta = r.tick - prev;
+    prev = r.tick;
+    if (delta > 0 && delta < min_delta + min_delta / 2) {
+      sum += delta;
+      ++n;
+    }
+  }
+  return (sum + n / 2) / n;
+}
+
 void PlotSignal(int tick_step) {
-  size_t sig_len = sig_wpos;
-  if (sig_len == 0) {
+  StopSigRecord();
+  if (sig_edges == 0) {
     return;
   }
   putchar('~');
-  size_t sig_i = 0;
-  tick_t end_tick = sig_buf[sig_len - 1];
+  struct SigReader r;
+  SigReaderInit(&r);
+  const tick_t start_tick = r.tick;
+  const tick_t end_tick = sig_last_tick;
+  // r.tick には常に「次の信号変化」の時刻が入っている
+  bool has_next = SigReaderNext(&r);
   bool sig = 0;
-  for (tick_t t = sig_buf[0]; t < end_tick; t += tick_step) {
+  for (tick_t t = start_tick; t < end_tick; t += tick_step) {
     // 1 ステップ内の信号変化を数える
     size_t sig_change_count = 0;
-    for (size_t j = sig_i + 1; j < sig_len && sig_buf[j] < t + tick_step; ++j) {
+    tick_t last_change_tick = t;
+    while (has_next && r.tick < t + tick_step) {
       ++sig_change_count;
-      ++sig_i;
+      last_change_tick = r.tick;
+      has_next = SigReaderNext(&r);
     }
 
     if (sig_change_count == 0) {
@@ -63,7 +487,7 @@ void PlotSignal(int tick_step) {
       putchar(sig ? '~' : '_');
     } else if (sig_change_count == 1) {
       // 1 ステップの間に 1 回信号が変化
-      const bool change_in_early = (sig_buf[sig_i] - t) < (tick_step / 4);
+      const bool change_in_early = (last_change_tick - t) < (tick_step / 4);
       if (change_in_early) {
         // 1 ステップの前半 1/4 で信号が変化
         putchar(sig ? '_' : '~');
@@ -78,9 +502,13 @@ void PlotSignal(int tick_step) {
     sig ^= sig_change_count & 1;
   }
   printf("\r\n");
+  if ((int32_t)(sig_trig_tick - start_tick) > 0) {
+    // トリガが成立したメッセージの先頭に印を付ける
+    printf("%*s^ trigger\r\n", (int)(1 + (sig_trig_tick - start_tick) / tick_step), "");
+  }
 
   putchar(' ');
-  size_t msg_bytes = (end_tick - sig_buf[0] + tick_step - 1) / tick_step / 10;
+  size_t msg_bytes = (end_tick - start_tick + tick_step - 1) / tick_step / 10;
   for (size_t i = 0; i < msg_bytes; ++i) {
     printf("S01234567P");
   }
@@ -104,6 +532,7 @@ void PlotSignal(int tick_step) {
 }
 
 void PrintRecState() {
+  const enum MSMPState msmp_state = msmp_node.state;
   printf("state=%s\r\n",
          msmp_state == MSTATE_IDLE ? "IDLE: Waiting addr byte" :
          msmp_state == MSTATE_ADDR ? "ADDR: Receiving addr byte" :
@@ -124,40 +553,301 @@ void PrintMsgBody(struct Message *msg) {
   }
 }
 
+size_t ConsumeMessages(void) {
+  size_t n = 0;
+  const struct Message *msg;
+  while ((msg = MsgQueuePeek(&msg_queue)) != NULL) {
+    msg_hist[msg_hist_num % MSG_HIST_LEN] = *msg;
+    ++msg_hist_num;
+    MsgQueuePop(&msg_queue);
+    ++n;
+  }
+  return n;
+}
+
+/* 新しい方から i 番目（0 が最新）の履歴を返す。無ければ NULL。 */
+static struct Message *GetMsgHist(size_t i) {
+  if (i >= MSG_HIST_LEN || i >= msg_hist_num) {
+    return NULL;
+  }
+  return msg_hist + (msg_hist_num - 1 - i) % MSG_HIST_LEN;
+}
+
 void DumpMessages(size_t msg_num) {
   PrintRecState();
-  size_t last_msg_i = msg_wpos;
-  //if (msmp_state == MSTATE_IDLE) {
-  //  last_msg_i = (last_msg_i - 1) % MSG_BUF_LEN;
-  //}
+  ConsumeMessages();
+  printf("received=%u dropped=%lu\r\n", msg_hist_num, msg_queue.dropped);
   for (size_t i = 0; i < msg_num; ++i) {
-    size_t msg_i = last_msg_i - i;
-    if (msg_i >= MSG_BUF_LEN) {
-      // 0 を超えたらオーバーフローする。そしたら補正。
-      msg_i += MSG_BUF_LEN;
-    }
-    printf("[%d] addr: %02x, len: %02x, body: ",
-           i, msg_buf[msg_i].addr, msg_buf[msg_i].len);
-    PrintMsgBody((struct Message*)msg_buf + msg_i);
+    struct Message *msg = GetMsgHist(i);
+    if (msg == NULL) {
+      break;
+    }
+    printf("[%d] addr: %02x, len: %02x, ", i, msg->addr, msg->len);
+    if (msg->fwd_tick != msg->start_tick) {
+      // このノードでの遅延（スタートビットを受信してから転送を始めるまで）
+      printf("hop: %lu ticks, ", msg->fwd_tick - msg->start_tick);
+    }
+    printf("body: ");
+    PrintMsgBody(msg);
     putchar('\r');
     putchar('\n');
   }
 }
 
 void RecordAddr(uint8_t addr) {
-  ++msg_wpos;
-  if (msg_wpos >= MSG_BUF_LEN) {
-    msg_wpos = 0;
-  }
+  // 前のメッセージが受信途中で終わっていたら、同じスロットを再利用する
+  msg_writing = MsgQueueBeginWrite(&msg_queue);
   msg_body_wpos = 0;
-  msg_buf[msg_wpos].addr = addr;
+  if (msg_writing) {
+    msg_writing->start_tick = msg_start_tick;
+    msg_writing->fwd_tick = msg_start_tick;
+    msg_writing->addr = addr;
+    msg_writing->len = 0;
+  }
+}
+
+static void CommitMessage(void) {
+  MsgQueueCommit(&msg_queue);
+  msg_writing = NULL;
 }
 
 void RecordLen(uint8_t len) {
-  msg_buf[msg_wpos].len = len;
+  if (msg_writing) {
+    msg_writing->len = len;
+    if (len == 0) {
+      CommitMessage();
+    }
+  }
+}
+
+void RecordBody(uint8_t c) {
+  if (msg_writing) {
+    if (msg_body_wpos < sizeof(msg_writing->body)) {
+      msg_writing->body[msg_body_wpos] = c;
+    }
+    if (++msg_body_wpos == msg_writing->len) {
+      CommitMessage();
+    }
+  }
+}
+
+void RecordForwardStart(tick_t t) {
+  if (msg_writing) {
+    msg_writing->fwd_tick = t;
+  }
+}
+
+void RecordMSMPByte(struct MSMPNode *node, enum MSMPState state, uint8_t c) {
+  MSMPStatsByte(&msmp_stats, state, c, GetTick());
+  EvalTriggers(node, state, c);
+  switch (state) {
+  case MSTATE_ADDR:
+    RecordAddr(c);
+    break;
+  case MSTATE_LEN:
+    RecordLen(c);
+    break;
+  case MSTATE_BODY:
+    RecordBody(c);
+    break;
+  default:
+    break;
+  }
+}
+
+static uint16_t Crc16(uint16_t crc, const uint8_t *p, size_t n) {
+  while (n--) {
+    crc ^= (uint16_t)*p++ << 8;
+    for (int i = 0; i < 8; ++i) {
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+static uint8_t *Put16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  return p + 2;
+}
+
+static uint8_t *Put32(uint8_t *p, uint32_t v) {
+  p = Put16(p, v);
+  return Put16(p, v >> 16);
+}
+
+static uint8_t bin_seq;
+static uint16_t bin_frames;
+
+/*
+ * payload の後に block を続けたフレームを送信
+ *
+ * block はリングバッファへ写さずに DMA で直接送る（ConWriteBlock を参照）。
+ */
+static void SendBinFrameBlock(uint8_t type, const uint8_t *payload, size_t len,
+                              const uint8_t *block, size_t block_len) {
+  uint8_t head[6] = {BIN_FRAME_MAGIC0, BIN_FRAME_MAGIC1, type, bin_seq++};
+  Put16(head + 4, len + block_len);
+  uint16_t crc = Crc16(0xffff, head + 2, 4);
+  crc = Crc16(crc, payload, len);
+  crc = Crc16(crc, block, block_len);
+  uint8_t tail[2];
+  Put16(tail, crc);
+
+  ConWrite((const char *)head, sizeof(head));
+  ConWrite((const char *)payload, len);
+  if (block_len > 0) {
+    ConWriteBlock(block, block_len);
+  }
+  ConWrite((const char *)tail, sizeof(tail));
+  ++bin_frames;
+}
+
+static void SendBinFrame(uint8_t type, const uint8_t *payload, size_t len) {
+  SendBinFrameBlock(type, payload, len, NULL, 0);
+}
+
+static void SendBinHeader(void) {
+  uint8_t payload[BIN_PAYLOAD_MAX];
+  uint8_t *p = payload;
+  *p++ = BIN_FRAME_VERSION;
+  p = Put32(p, msmp_baudrate);
+  p = Put32(p, sig_record_rate);
+  p = Put32(p, sig_start_tick);
+  p = Put32(p, sig_last_tick);
+  p = Put32(p, sig_edges);
+  p = Put32(p, sig_len);
+  p = Put32(p, sig_trig_tick);
+  SendBinFrame(BFRAME_HEADER, payload, p - payload);
+}
+
+static void SendBinEnd(bool stream) {
+  uint8_t payload[10];
+  uint8_t *p = Put16(payload, bin_frames);
+  if (stream) {
+    p = Put32(p, sig_edges);
+    p = Put32(p, sig_stream_dropped);
+  }
+  SendBinFrame(BFRAME_END, payload, p - payload);
+}
+
+void DumpRecordBinary(void) {
+  // フレームの欠落を防ぐため、送信リングバッファが満杯なら待つ
+  const enum ConOverflowPolicy policy = con_overflow_policy;
+  con_overflow_policy = CON_OVF_BLOCK;
+  bin_frames = 0;
+
+  StopSigRecord();
+  SendBinHeader();
+  uint8_t payload[BIN_PAYLOAD_MAX];
+  uint8_t *p;
+
+  // 最も古い要素から順に送る
+  const size_t words_per_frame = (BIN_PAYLOAD_MAX - 4) / sizeof(sig_delta_t);
+  size_t rpos = sig_rpos;
+  for (size_t i = 0; i < sig_len; i += words_per_frame) {
+    p = Put32(payload, i);
+    for (size_t j = i; j < sig_len && j < i + words_per_frame; ++j) {
+      p = Put16(p, sig_buf[rpos]);
+      rpos = SigBufNext(rpos);
+    }
+    SendBinFrame(BFRAME_SIG, payload, p - payload);
+  }
+
+  // 古いメッセージから順に送る
+  ConsumeMessages();
+  p = payload;
+  for (size_t i = MSG_HIST_LEN; i-- > 0; ) {
+    const struct Message *msg = GetMsgHist(i);
+    if (msg == NULL) {
+      continue;
+    }
+    const size_t len = msg->len < sizeof(msg->body) ? msg->len : sizeof(msg->body);
+    if (p + 6 + len > payload + BIN_PAYLOAD_MAX) {
+      SendBinFrame(BFRAME_MSG, payload, p - payload);
+      p = payload;
+    }
+    p = Put32(p, msg->start_tick);
+    *p++ = msg->addr;
+    *p++ = len;
+    memcpy(p, msg->body, len);
+    p += len;
+  }
+  if (p != payload) {
+    SendBinFrame(BFRAME_MSG, payload, p - payload);
+  }
+
+  SendBinEnd(false);
+
+  con_overflow_policy = policy;
+}
+
+void StartSigStream(void) {
+  ClearSigRecord();
+  stream_full[0] = stream_full[1] = false;
+  stream_next = 0;
+  stream_sending = false;
+  stream_chunks = 0;
+  sig_stream_dropped = 0;
+  // 送信リングバッファが満杯でもフレームを欠けさせない（StopSigRecord で元に戻す）
+  stream_saved_policy = con_overflow_policy;
+  con_overflow_policy = CON_OVF_BLOCK;
+
+  // ヘッダの時刻はストリーミングを始めた時刻にする
+  sig_start_tick = sig_last_tick = sig_trig_tick = GetTick();
+  bin_frames = 0;
+  SendBinHeader();
+  sig_rec_state = SREC_STREAMING;
 }
 
-bool RecordBody(uint8_t c) {
-  msg_buf[msg_wpos].body[msg_body_wpos++] = c;
-  return msg_body_wpos == msg_buf[msg_wpos].len;
+bool PumpSigStream(void) {
+  if (stream_sending) {
+    if (ConBlockBusy()) {
+      return false;
+    }
+    // 送り終えたので割り込みハンドラが再び書けるようにする
+    stream_full[stream_next] = false;
+    stream_next ^= 1;
+    stream_sending = false;
+  }
+  if (!stream_full[stream_next]) {
+    return false;
+  }
+
+  const struct SigStreamHalf *half = stream_halves + stream_next;
+  uint8_t payload[16];
+  uint8_t *p = Put32(payload, stream_chunks);
+  p = Put32(p, half->start_tick);
+  p = Put32(p, half->edges);
+  p = Put32(p, half->dropped);
+  // sig_buf はリトルエンディアンのまま送れる
+  const uint8_t *words = (const uint8_t *)(sig_buf + stream_next * SIG_STREAM_HALF_LEN);
+  SendBinFrameBlock(BFRAME_STREAM, payload, p - payload, words, half->words * sizeof(sig_delta_t));
+  ++stream_chunks;
+  stream_sending = true;
+  return true;
+}
+
+/* ストリーミングを止め、書きかけの半分まで送ってから BFRAME_END を送る */
+static void FinishSigStream(void) {
+  sig_rec_state = SREC_STOPPED;
+  const size_t wpos = sig_wpos;
+  const size_t h = wpos < SIG_STREAM_HALF_LEN ? 0 : 1;
+  if (wpos != h * SIG_STREAM_HALF_LEN) {
+    stream_halves[h].words = wpos - h * SIG_STREAM_HALF_LEN;
+    stream_full[h] = true;
+  }
+  while (stream_full[0] || stream_full[1]) {
+    if (!PumpSigStream()) {
+      __WFI();
+    }
+  }
+  SendBinEnd(true);
+  con_overflow_policy = stream_saved_policy;
+
+  // sig_buf は送信済みの断片なので、記録としては残さない
+  sig_rpos = 0;
+  sig_wpos = 0;
+  sig_len = 0;
+  sig_edges = 0;
 }
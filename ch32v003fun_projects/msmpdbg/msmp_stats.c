@@ -0,0 +1,67 @@
+#include "msmp_stats.h"
+
+#include <string.h>
+
+void MSMPStatsReset(struct MSMPStats *st, tick_t now) {
+  memset(st, 0, sizeof(*st));
+  st->start_tick = now;
+  st->cur_src = STATS_NO_SRC;
+}
+
+void MSMPStatsMsgStart(struct MSMPStats *st, tick_t start_tick) {
+  st->msg_start_tick = start_tick;
+}
+
+int MSMPStatsBin(tick_t t) {
+  if (t == 0) {
+    return 0;
+  }
+  const int bin = 32 - __builtin_clz(t);
+  return bin < STATS_HIST_BINS ? bin : STATS_HIST_BINS - 1;
+}
+
+void MSMPStatsByte(struct MSMPStats *st, enum MSMPState state, uint8_t c, tick_t now) {
+  // この関数は割り込みハンドラから呼ばれるので、ループを含む処理はしない
+  ++st->bytes;
+  if (st->has_last_byte) {
+    ++st->gap_hist[MSMPStatsBin(now - st->last_byte_tick)];
+  }
+  st->last_byte_tick = now;
+  st->has_last_byte = true;
+
+  switch (state) {
+  case MSTATE_IDLE:
+    // TSM による強制復旧
+    ++st->tsm_resets;
+    st->cur_src = STATS_NO_SRC;
+    st->fwd_pending = false;
+    return;
+  case MSTATE_ADDR:
+    ++st->msgs;
+    st->cur_src = c & 15;
+    ++st->msgs_by_src[c & 15];
+    ++st->msgs_by_dst[c >> 4];
+    st->fwd_pending = true;
+    break;
+  default:
+    break;
+  }
+  if (st->cur_src != STATS_NO_SRC) {
+    ++st->bytes_by_src[st->cur_src];
+  }
+}
+
+void MSMPStatsRelay(struct MSMPStats *st, bool msg_first, tick_t delay) {
+  if (msg_first) {
+    ++st->cut_through_msgs;
+  }
+  ++st->relay_hist[MSMPStatsBin(delay)];
+}
+
+void MSMPStatsForward(struct MSMPStats *st, tick_t now) {
+  if (st->fwd_pending) {
+    st->fwd_pending = false;
+    ++st->forwarded_msgs;
+    ++st->fwd_hist[MSMPStatsBin(now - st->msg_start_tick)];
+  }
+}
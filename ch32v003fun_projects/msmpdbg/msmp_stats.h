@@ -0,0 +1,67 @@
+#pragma once
+
+/*
+ * MSMP バスの統計
+ *
+ * 受信した 1 バイトごとに呼ばれ、定数時間で各種カウンタとヒストグラムを更新する。
+ * 時刻は呼び出し側が tick（sig_record_rate でカウントアップ）で与える。
+ * 周辺機能には依存しないので、ホスト（Linux）上でもコンパイルできる。
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "msmp_proto.h"
+
+// ヒストグラムのビン数
+// ビン 0 は 0 tick、ビン i（1 以上）は [2^(i-1), 2^i) tick、最後のビンはそれ以上すべて
+#define STATS_HIST_BINS 16
+
+struct MSMPStats {
+  tick_t start_tick; // 統計を取り始めた時刻
+  uint32_t bytes; // 受信したバイト数（TSM を含む）
+  uint32_t msgs; // 受信したメッセージ数（アドレス部を受信した回数）
+  uint32_t tsm_resets; // TSM により強制復旧した回数
+  uint32_t forwarded_msgs; // 転送したメッセージ数
+  uint32_t cut_through_msgs; // 転送したメッセージのうち、カットスルーで中継したもの
+  uint32_t msgs_by_src[16]; // 送信元アドレスごとのメッセージ数
+  uint32_t msgs_by_dst[16]; // 宛先アドレスごとのメッセージ数
+  uint32_t bytes_by_src[16]; // 送信元アドレスごとのバイト数（アドレス部から本文まで）
+  uint32_t gap_hist[STATS_HIST_BINS]; // 受信バイトの間隔
+  uint32_t fwd_hist[STATS_HIST_BINS]; // メッセージのスタートビットから転送開始までの時間
+  uint32_t relay_hist[STATS_HIST_BINS]; // カットスルー中継で RX の信号変化を TX に写すまでの時間
+
+  tick_t last_byte_tick; // 直前のバイトを受信した時刻
+  tick_t msg_start_tick; // 受信中のメッセージのスタートビットの時刻
+  uint8_t cur_src; // 受信中のメッセージの送信元（STATS_NO_SRC なら無し）
+  bool has_last_byte; // last_byte_tick が有効なら真
+  bool fwd_pending; // 受信中のメッセージの転送開始をまだ記録していなければ真
+};
+#define STATS_NO_SRC 0xFF
+
+/* 統計を 0 に戻す */
+void MSMPStatsReset(struct MSMPStats *st, tick_t now);
+
+/* メッセージ先頭のスタートビットを検出したときに呼ぶ */
+void MSMPStatsMsgStart(struct MSMPStats *st, tick_t start_tick);
+
+/*
+ * 受信した 1 バイトを集計
+ *
+ * @param state  MSMPRecordFunc と同じく c を受信したときの状態（TSM なら MSTATE_IDLE）
+ * @param now  c を受信した時刻
+ */
+void MSMPStatsByte(struct MSMPStats *st, enum MSMPState state, uint8_t c, tick_t now);
+
+/* 受信中のメッセージを転送するバイトを送信したときに呼ぶ */
+void MSMPStatsForward(struct MSMPStats *st, tick_t now);
+
+/*
+ * カットスルー中継で RX ピンの信号変化を TX ピンへ写したときに呼ぶ
+ *
+ * @param msg_first  メッセージの中継を始めた最初の信号変化なら真
+ * @param delay  信号変化を取り込んでから TX ピンへ写すまでの時間
+ */
+void MSMPStatsRelay(struct MSMPStats *st, bool msg_first, tick_t delay);
+
+/* 時間 t（tick）が入るヒストグラムのビン */
+int MSMPStatsBin(tick_t t);
@@ -10,11 +10,12 @@
 /********************
  重要なグローバル変数
  ********************/
-// 96KHz でタイマ割り込みでカウントアップする変数
+// 96KHz でカウントアップする変数
 volatile tick_t tick;
 volatile bool transmit_on_receive_mode = false;
-uint8_t msmp_my_addr = 0x0E;
-uint16_t transmit_period_ms = 20;
+uint16_t transmit_period_us = 20000;
+uint32_t msmp_baudrate = MSMP_BAUDRATE;
+uint32_t sig_record_rate = SIG_RECORD_RATE;
 struct Message transmit_msg_default = {
   .start_tick = 0, // 送信時は raw_msg の添え字として使用
   .addr = 0xFE,
@@ -23,105 +24,213 @@ struct Message transmit_msg_default = {
 };
 struct Message transmit_msg_alternative;
 struct Message *transmit_msg = &transmit_msg_default;
-volatile enum MSMPState msmp_state;
-uint16_t msmp_flags;
+struct MSMPNode msmp_node;
+struct MSMPStats msmp_stats;
 enum NodeMode node_mode = NMODE_NORMAL;
-bool enable_auto_forward = true;
-bool forwarding = false;
-uint8_t forward_dst = 0;
+bool cut_through_enabled = true;
 
-/* 転送すべきメッセージに対して真を返す */
-bool IsToForward(uint8_t addr) {
-  uint8_t dst = addr >> 4;
-  uint8_t src = addr & 15;
+#if MSMP_CUT_THROUGH
+enum CutThroughState {
+  CT_IDLE, // 中継していない
+  CT_ARMED, // アドレス部を USART で転送した。次のスタートビットから中継を始める
+  CT_RELAYING, // RX ピンの信号変化を TX ピンへ写している
+};
+static volatile enum CutThroughState cut_through;
+static bool relayed_sig; // 最後に TX ピンへ写したレベル
 
-  if (dst == 15) { // ブロードキャスト
-    // 送信者が自分ではないブロードキャストメッセージは転送する
-    return src != msmp_my_addr;
+/*
+ * カットスルー中継：RX ピンの信号変化を TX ピンへ写す
+ *
+ * アドレス部（宛先が分かるのは 1 バイト受信し終えた後）だけは USART で転送し、
+ * 2 バイト目以降は信号変化の割り込みで TX ピンを直接操作する。
+ * 1 バイト受信し終えるのを待たないので、ホップごとの遅延は割り込み応答時間程度になる。
+ *
+ * @param t  信号が変化した時刻（ポーリングでは標本化した時刻）
+ * @param sig  変化後の RX ピンの状態
+ */
+static void RelaySignal(tick_t t, bool sig) {
+  const enum CutThroughState ct = cut_through;
+  if (ct == CT_IDLE) {
+    return;
   }
+  bool first = false;
+  if (ct == CT_ARMED) {
+    if (sig) {
+      return;
+    }
+    if ((MSMP_USART->STATR & USART_FLAG_TC) == 0 || IsTransmitting()) {
+      // アドレス部の送信がまだ終わっていない（バイト間の隙間が無い）ので、このメッセージは中継しない
+      cut_through = CT_IDLE;
+      return;
+    }
+    // TX ピンを GPIO に切り替える（切り替え前に出力を 1 にしておき、グリッチを防ぐ）
+    funDigitalWrite(MSMP_TX_PIN, 1);
+    funPinMode(MSMP_TX_PIN, GPIO_CFGLR_OUT_10Mhz_OD);
+    cut_through = CT_RELAYING;
+    first = true;
+  } else if (sig == relayed_sig) {
+    // ポーリング（SIG_CAPTURE_EDGE=0）では変化の無いサンプルも来るので、レベルが変わったときだけ写す
+    return;
+  }
+  relayed_sig = sig;
+  funDigitalWrite(MSMP_TX_PIN, sig);
+  MSMPStatsRelay(&msmp_stats, first, GetTick() - t);
+}
 
-  // 宛先が自分ではないユニキャストメッセージは転送する
-  return dst != msmp_my_addr;
+/* メッセージの受信が終わったら、TX ピンを USART に戻す */
+static void EndCutThrough(void) {
+  if (cut_through == CT_RELAYING) {
+    funPinMode(MSMP_TX_PIN, GPIO_CFGLR_OUT_10Mhz_AF_OD);
+  }
+  cut_through = CT_IDLE;
 }
+#endif
 
-void ProcByte(uint8_t c) {
-  // この関数は割り込みハンドラから呼ばれるので、長時間の処理はしない
-  if (c == 0 && msmp_state != MSTATE_LEN) {
-    // 整合性が失われているので、強制復旧
-    msmp_flags |= MFLAG_TSM_RESET;
-    msmp_state = MSTATE_IDLE;
-    if (forwarding) {
-      MSMP_USART->DATAR = c;
-    }
+/* 転送するバイトを MSMP の USART へ送信 */
+static void SendToMSMP(struct MSMPNode *node, uint8_t c) {
+#if MSMP_CUT_THROUGH
+  if (cut_through == CT_RELAYING) {
+    // RelaySignal が中継済み
     return;
   }
-  // 整合性は保たれているので、通常の処理を続ける
-
-  switch (msmp_state) {
-  case MSTATE_IDLE:
-    // ここには来ないはず。IDLE のときにスタートビットを検知した直後に ADDR に進むはずだから。
-    printf("Error: must not happen\r\n");
-    while (1);
-    break;
-  case MSTATE_ADDR:
-    RecordAddr(c);
-    msmp_state = MSTATE_LEN;
-    {
-      uint8_t dst = c >> 4;
-      uint8_t src = c & 15;
-      switch (dst) {
-      case 0x00: // 未使用アドレス
-        msmp_flags |= MFLAG_DST_ZERO;
-        break;
-      case 0x0F: // ブロードキャスト
-        if (src == msmp_my_addr) {
-          // 自分が送信したブロードキャストメッセージ
-          msmp_flags |= MFLAG_MY_BRDCAST;
-        }
-        break;
-      default: // ユニキャスト
-        if (dst == msmp_my_addr) {
-          msmp_flags |= MFLAG_MSG_TO_ME;
-        }
-        break;
-      }
+  if (node->state == MSTATE_LEN && cut_through_enabled) {
+    // アドレス部を転送した。次のバイトからは中継を試みる
+    cut_through = CT_ARMED;
+  }
+#endif
+  MSMP_USART->DATAR = c;
+  if (node->state == MSTATE_LEN) {
+    const tick_t now = GetTick();
+    RecordForwardStart(now);
+    MSMPStatsForward(&msmp_stats, now);
+  }
+}
 
-      if (IsToForward(c)) {
-        msmp_flags |= MFLAG_MSG_TO_FORWARD;
-        // 自動転送モードが有効であれば、受信したメッセージをそのまま転送
-        forwarding = enable_auto_forward;
-        forward_dst = dst;
-      } else {
-        forwarding = false;
-      }
-    }
-    break;
-  case MSTATE_LEN:
-    RecordLen(c);
-    if (c > 0) {
-      msmp_state = MSTATE_BODY;
-    } else {
-      msmp_state = MSTATE_IDLE;
-    }
-    break;
-  case MSTATE_BODY:
-    if (RecordBody(c)) {
-      // メッセージ受信完了
-      msmp_state = MSTATE_IDLE;
+/*
+ * TIM1: 16 bit ADTM
+ * TIM2/3/4: 16 bit GDTM
+ */
+
+/*
+ * RX ピンの信号変化を処理
+ *
+ * @param t  信号が変化した時刻
+ * @param sig  変化後の RX ピンの状態
+ */
+static void ProcSignal(tick_t t, bool sig) {
+#if MSMP_CUT_THROUGH
+  // 遅延を減らすため、記録より先に中継する
+  RelaySignal(t, sig);
+#endif
+  if (SenseSignal(t, sig)) {
+    // メッセージ先頭のスタートビットを検出
+    if (!IsTransmitting() && transmit_on_receive_mode) {
+      transmit_msg = &transmit_msg_default;
+      StartTransmit();
     }
-    break;
   }
+}
+
+#if SIG_CAPTURE_EDGE
+/*
+ * TIM1 を RX ピン（PA10 = TIM1_CH3）の信号変化を記録するキャプチャタイマとして設定
+ *
+ * CH3 で立ち下がり、CH4（入力として TI3 を選択）で立ち上がりの時刻を取り込む。
+ * カウンタは sig_record_rate で進むフリーランカウンタとし、上位部分は tick で数える。
+ */
+void TIM1_InitForEdgeCapture(void) {
+  // TIM1 を有効化
+  RCC->APB2PCENR |= RCC_APB2Periph_TIM1;
+
+  // TIM1 をリセット
+  RCC->APB2PRSTR |= RCC_APB2Periph_TIM1;
+  RCC->APB2PRSTR &= ~RCC_APB2Periph_TIM1;
+
+  // 1 カウントが 1 tick になるようにする
+  TIM1->PSC = SIG_RECORD_TIM_PERIOD - 1;
+  TIM1->ATRLR = 0xffff;
+
+  // CH3: TI3 を入力、CH4: TI3 を入力
+  // ノイズ除去のため、同じ値を 8 クロック連続で読んだら確定とする
+  TIM1->CHCTLR2 = TIM_CC3S_0 | TIM_IC3F_0 | TIM_IC3F_1
+                | TIM_CC4S_1 | TIM_IC4F_0 | TIM_IC4F_1;
+  // CH3: 立ち下がりエッジ、CH4: 立ち上がりエッジ
+  TIM1->CCER = TIM_CC3E | TIM_CC3P | TIM_CC4E;
 
-  if (forwarding) {
-    MSMP_USART->DATAR = c;
+  // アップデートイベント（UG）を発生させ、プリロードを行う
+  TIM1->SWEVGR = TIM_PSCReloadMode_Immediate;
+  TIM1->INTFR = 0;
+
+  // 割り込み有効化
+  NVIC_EnableIRQ(TIM1_UP_IRQn);
+  NVIC_EnableIRQ(TIM1_CC_IRQn);
+  TIM1->DMAINTENR |= TIM_IT_Update | TIM_IT_CC3 | TIM_IT_CC4;
+
+  // カウンタを有効化
+  TIM1->CTLR1 |= TIM_CEN;
+}
+
+/*
+ * TIM1 オーバーフロー割り込みハンドラ
+ */
+void TIM1_UP_IRQHandler(void) __attribute__((interrupt));
+void TIM1_UP_IRQHandler(void) {
+  // 割り込みフラグをクリア
+  TIM1->INTFR = ~TIM_FLAG_Update;
+  tick += 0x10000;
+}
+
+/*
+ * キャプチャ値を 32 ビットの時刻に変換
+ */
+static tick_t CaptureToTick(uint16_t ccr) {
+  tick_t base = tick;
+  if ((TIM1->INTFR & TIM_FLAG_Update) && ccr < 0x8000) {
+    // オーバーフロー直後に取り込まれたが、まだ tick に反映されていない
+    base += 0x10000;
   }
+  return base + ccr;
+}
+
+tick_t GetTick(void) {
+  tick_t hi, t;
+  do {
+    // 読んでいる間に TIM1_UP_IRQHandler が tick を進めたら読み直す
+    hi = tick;
+    t = CaptureToTick(TIM1->CNT);
+  } while (hi != tick);
+  return t;
 }
 
 /*
- * TIM1: 16 bit ADTM
- * TIM2/3/4: 16 bit GDTM
+ * TIM1 キャプチャ割り込みハンドラ
  */
+void TIM1_CC_IRQHandler(void) __attribute__((interrupt));
+void TIM1_CC_IRQHandler(void) {
+  uint32_t intfr = TIM1->INTFR;
+  const bool fall = intfr & TIM_FLAG_CC3;
+  const bool rise = intfr & TIM_FLAG_CC4;
+  // CHxCVR を読むと割り込みフラグもクリアされる
+  const uint16_t fall_ccr = fall ? TIM1->CH3CVR : 0;
+  const uint16_t rise_ccr = rise ? TIM1->CH4CVR : 0;
 
+  if (fall && rise) {
+    // 割り込みが遅れて両方のエッジが溜まっていたら、古い方から処理する
+    const uint16_t cnt = TIM1->CNT;
+    if ((uint16_t)(cnt - fall_ccr) > (uint16_t)(cnt - rise_ccr)) {
+      ProcSignal(CaptureToTick(fall_ccr), 0);
+      ProcSignal(CaptureToTick(rise_ccr), 1);
+    } else {
+      ProcSignal(CaptureToTick(rise_ccr), 1);
+      ProcSignal(CaptureToTick(fall_ccr), 0);
+    }
+  } else if (fall) {
+    ProcSignal(CaptureToTick(fall_ccr), 0);
+  } else if (rise) {
+    ProcSignal(CaptureToTick(rise_ccr), 1);
+  }
+}
+#else
 /*
  * TIM2 を周期タイマとして設定
  *
@@ -159,27 +268,50 @@ void TIM2_IRQHandler(void) {
   // 割り込みフラグをクリア
   TIM2->INTFR &= ~TIM_FLAG_Update;
   ++tick;
-  if (SenseSignal(tick, funDigitalRead(MSMP_RX_PIN))) {
-    // メッセージ先頭のスタートビットを検出
-    if (!IsTransmitting() && transmit_on_receive_mode) {
-      transmit_msg = &transmit_msg_default;
-      StartTransmit();
-    }
+  ProcSignal(tick, funDigitalRead(MSMP_RX_PIN));
+}
+
+tick_t GetTick(void) {
+  return tick;
+}
+#endif
+
+/*
+ * 信号記録のサンプリングレートを変更
+ *
+ * タイマの分周比は整数なので、実際のレートは rate に最も近い FUNCONF_SYSTEM_CORE_CLOCK の約数になる。
+ * tick の単位が変わるので、呼び出し側で記録済みの信号などを捨てること。
+ */
+static void SetSigRecordRate(uint32_t rate) {
+  uint32_t div = (FUNCONF_SYSTEM_CORE_CLOCK + rate / 2) / rate;
+#if SIG_CAPTURE_EDGE
+  const uint32_t div_min = 1;
+#else
+  const uint32_t div_min = SIG_POLL_MIN_PERIOD;
+#endif
+  if (div < div_min) {
+    div = div_min;
+  } else if (div > 0x10000) {
+    div = 0x10000;
   }
+  sig_record_rate = FUNCONF_SYSTEM_CORE_CLOCK / div;
+#if SIG_CAPTURE_EDGE
+  TIM1->PSC = div - 1;
+  // 分周比を即座に反映する（カウンタは 0 に戻る）。UG で立つフラグで tick を進めないよう消す
+  TIM1->SWEVGR = TIM_PSCReloadMode_Immediate;
+  TIM1->INTFR = ~TIM_FLAG_Update;
+#else
+  TIM2->ATRLR = div - 1;
+#endif
 }
 
 /* 
- * TIM3 の周期を現在の transmit_period_ms に更新
+ * TIM3 の周期を現在の transmit_period_us に更新
  */
 void TIM3_UpdatePeriod(void) {
-  // TIM3 の周期
-#if (FUNCONF_SYSTEM_CORE_CLOCK / 1000) < UINT16_MAX
-  TIM3->PSC = FUNCONF_SYSTEM_CORE_CLOCK / 1000; // 1ms
-  TIM3->ATRLR = transmit_period_ms - 1;
-#else
-  TIM3->PSC = FUNCONF_SYSTEM_CORE_CLOCK / 5000; // 0.2ms
-  TIM3->ATRLR = transmit_period_ms * 5 - 1;
-#endif
+  // TIM3 の周期（1 カウント 1us）
+  TIM3->PSC = FUNCONF_SYSTEM_CORE_CLOCK / 1000000 - 1;
+  TIM3->ATRLR = transmit_period_us - 1;
 
   // アップデートイベント（UG）を発生させ、プリロードを行う
   TIM3->SWEVGR = TIM_PSCReloadMode_Immediate;
@@ -199,9 +331,21 @@ void TIM3_InitForMSMPTimer() {
   // 周期を設定
   TIM3_UpdatePeriod();
 
+#if MSMP_TX_DMA
+  // DMA を有効化
+  RCC->AHBPCENR |= RCC_AHBPeriph_DMA1;
+
+  // メモリから USART のデータレジスタへ 1 バイトずつ転送し、全て送ったら割り込み
+  MSMP_TX_DMA_CH->CFGR = 0;
+  MSMP_TX_DMA_CH->PADDR = (uint32_t)&MSMP_USART->DATAR;
+  MSMP_TX_DMA_CH->CFGR = DMA_CFGR1_DIR | DMA_CFGR1_MINC | DMA_CFGR1_TCIE
+                       | DMA_CFGR1_PL_1;
+  NVIC_EnableIRQ(MSMP_TX_DMA_IRQn);
+#else
   // 割り込み有効化
   NVIC_EnableIRQ(TIM3_IRQn);
   TIM3->DMAINTENR |= TIM_IT_Update;
+#endif
 }
 
 void TIM3_Start(void) {
@@ -211,6 +355,13 @@ void TIM3_Start(void) {
   // 周期を更新
   TIM3_UpdatePeriod();
 
+#if MSMP_TX_DMA
+  // 最終バイトの送信後に止めるため TIM3_StartLastPeriod で単発モードにしている
+  TIM3->CTLR1 &= ~TIM_OPM;
+  // UG によるアップデートイベントで DMA が起動しないよう、周期の更新後に許可する
+  TIM3->DMAINTENR |= TIM_UDE;
+#endif
+
   // カウンタを有効化
   TIM3->CTLR1 |= TIM_CEN;
 }
@@ -220,6 +371,25 @@ void TIM3_Stop(void) {
   TIM3->CTLR1 &= ~TIM_CEN;
 }
 
+#if MSMP_TX_DMA
+/*
+ * MSMP 送信 DMA 割り込みハンドラ
+ *
+ * 最終バイトを USART へ書いたときに呼ばれる。
+ */
+void MSMP_TX_DMA_IRQHandler(void) __attribute__((interrupt));
+void MSMP_TX_DMA_IRQHandler(void) {
+  // 割り込みフラグをクリア
+  DMA1->INTFCR = MSMP_TX_DMA_CTCIF;
+  MSMP_TX_DMA_CH->CFGR &= ~DMA_CFGR1_EN;
+  TIM3->DMAINTENR &= ~TIM_UDE;
+
+  // 最終バイト送信後に 1 周期待つことで、連続送信時にも適切な間隔を確保
+  // 単発モードにすると、次のアップデートイベントで TIM3 が自動的に止まる
+  transmit_msg->start_tick = 0;
+  TIM3->CTLR1 |= TIM_OPM;
+}
+#else
 /*
  * TIM3 割り込みハンドラ
  */
@@ -244,6 +414,7 @@ void TIM3_IRQHandler(void) {
     TIM3_Stop();
   }
 }
+#endif
 
 /*
  * USART を MSMP 用に初期化
@@ -275,12 +446,64 @@ void MSMP_USART_Init() {
   MSMP_USART->CTLR2 = USART_StopBits_1;
 
   // ボーレートを設定
-  MSMP_USART->BRR = (MSMP_PCLOCK + MSMP_BAUDRATE/2) / MSMP_BAUDRATE;
+  MSMP_USART->BRR = (MSMP_PCLOCK + msmp_baudrate/2) / msmp_baudrate;
 
   // USART1 を有効化
   MSMP_USART->CTLR1 |= CTLR1_UE_Set;
 }
 
+// トリガ前後の記録期間（ミリ秒）。サンプリングレートを変えたら tick に換算し直す
+static uint32_t pretrig_ms = 100;
+static uint32_t posttrig_ms = 2000;
+
+// サンプリングレート rate での 1 ミリ秒あたりの tick 数（1kHz 未満では 1 とみなす）
+static uint32_t TicksPerMs(uint32_t rate) {
+  const uint32_t n = rate / 1000;
+  return n ? n : 1;
+}
+
+/*
+ * サンプリングレート rate での記録期間の上限（ミリ秒）
+ *
+ * 記録側は時刻の差（tick - sig_trig_tick など）で期間を比べるので、tick に換算した期間は
+ * tick_t の範囲の半分に収める。
+ */
+static uint32_t MaxRecordMs(uint32_t rate) {
+  return ((tick_t)-1 / 2) / TicksPerMs(rate);
+}
+
+static void UpdateSigRecordPeriods(void) {
+  // サンプリングレートを上げると上限が下がるので、収まらない期間は上限にする
+  const uint32_t max_ms = MaxRecordMs(sig_record_rate);
+  if (pretrig_ms > max_ms) {
+    pretrig_ms = max_ms;
+  }
+  if (posttrig_ms > max_ms) {
+    posttrig_ms = max_ms;
+  }
+  sig_pretrig_ticks = pretrig_ms * TicksPerMs(sig_record_rate);
+  sig_record_period_ticks = posttrig_ms * TicksPerMs(sig_record_rate);
+}
+
+void SetMSMPBaudrate(uint32_t baud) {
+  // 送信中のバイトを壊さないよう、送信が終わってから変える
+  while (IsTransmitting() || (MSMP_USART->STATR & USART_FLAG_TC) == 0);
+  msmp_baudrate = baud;
+  MSMP_USART->BRR = (MSMP_PCLOCK + baud/2) / baud;
+
+  SetSigRecordRate(baud * SIG_RECORD_RATE_SCALE);
+  ClearSigRecord();
+  UpdateSigRecordPeriods();
+  MSMPStatsReset(&msmp_stats, GetTick());
+
+  // 送信間隔は 1 バイト（10 ビット）より短くできない
+  const uint32_t min_period_us = 11 * 1000000 / baud + 1;
+  if (transmit_period_us < min_period_us) {
+    transmit_period_us = min_period_us;
+    TIM3_UpdatePeriod();
+  }
+}
+
 /*
  * MSMP USART 割り込みハンドラ
  */
@@ -289,7 +512,12 @@ void MSMP_USART_IRQHandler(void) {
   if (MSMP_USART->STATR & USART_FLAG_RXNE) {
     uint8_t recv_data = MSMP_USART->DATAR;
     MSMP_USART->STATR &= ~USART_FLAG_RXNE; // 受信割り込みフラグをクリア
-    ProcByte(recv_data);
+    MSMPProcByte(&msmp_node, recv_data);
+#if MSMP_CUT_THROUGH
+    if (msmp_node.state == MSTATE_IDLE) {
+      EndCutThrough();
+    }
+#endif
   }
 }
 
@@ -325,6 +553,14 @@ void CMD_USART_Init() {
   // ボーレートを設定
   CMD_USART->BRR = (CMD_PCLOCK + 115200/2) / 115200;
 
+  // 送信は DMA で行う
+  RCC->AHBPCENR |= RCC_AHBPeriph_DMA1;
+  CON_TX_DMA_CH->CFGR = 0;
+  CON_TX_DMA_CH->PADDR = (uint32_t)&CMD_USART->DATAR;
+  CON_TX_DMA_CH->CFGR = DMA_CFGR1_DIR | DMA_CFGR1_MINC | DMA_CFGR1_TCIE;
+  NVIC_EnableIRQ(CON_TX_DMA_IRQn);
+  CMD_USART->CTLR3 = USART_DMAReq_Tx;
+
   // USART1 を有効化
   CMD_USART->CTLR1 |= CTLR1_UE_Set;
 }
@@ -332,6 +568,12 @@ void CMD_USART_Init() {
 void StartTransmit(void) {
   transmit_msg->start_tick = 0;
   MSMP_USART->DATAR = transmit_msg->raw_msg[transmit_msg->start_tick++];
+#if MSMP_TX_DMA
+  // 2 バイト目以降は TIM3 の周期ごとに DMA で送る
+  MSMP_TX_DMA_CH->MADDR = (uint32_t)(transmit_msg->raw_msg + 1);
+  MSMP_TX_DMA_CH->CNTR = transmit_msg->len + 1;
+  MSMP_TX_DMA_CH->CFGR |= DMA_CFGR1_EN;
+#endif
   TIM3_Start();
 }
 
@@ -340,121 +582,654 @@ bool IsTransmitting(void) {
 }
 
 void ConfigureNode(void) {
-  enable_auto_forward = node_mode == NMODE_NORMAL;
+  msmp_node.enable_auto_forward = node_mode == NMODE_NORMAL;
 }
 
-void ProcCommand(char *cmd) {
-  if (strcmp(cmd, "status") == 0) {
-    printf("Node address : %d\r\n", msmp_my_addr);
-    printf("Tx address   : %d\r\n", transmit_msg_default.addr >> 4);
-    printf("Tx body      : ");
-    PrintMsgBody(&transmit_msg_default);
-    printf("\r\n");
-    printf("Tx on rx mode: %d\r\n", transmit_on_receive_mode);
-    printf("Node mode    : %s\r\n", node_mode == NMODE_NORMAL ? "normal" : "debug");
-    printf("Receive state: ");
-    PrintRecState();
-  } else if (strcmp(cmd, "start rec") == 0) {
-    sig_wpos = 0;
-    sig_record_mode = true;
-  } else if (strcmp(cmd, "dump rec") == 0) {
-    PlotSignal(10);
-  } else if (strcmp(cmd, "dump msg") == 0) {
-    DumpMessages(3);
-  } else if (strncmp(cmd, "set addr ", 9) == 0) {
-    msmp_my_addr = strtol(cmd + 9, NULL, 0);
-    transmit_msg_default.addr = (transmit_msg_default.addr & 0xF0) | msmp_my_addr;
-    printf("New address: %d\r\n", msmp_my_addr);
-  } else if (strcmp(cmd, "enable txonrx") == 0) {
-    transmit_on_receive_mode = true;
-  } else if (strcmp(cmd, "disable txonrx") == 0) {
-    transmit_on_receive_mode = false;
-  } else if (strncmp(cmd, "set txaddr ", 11) == 0) {
-    uint8_t txaddr = strtol(cmd + 11, NULL, 0) & 15;
-    transmit_msg_default.addr = (txaddr << 4) | msmp_my_addr;
-  } else if (strncmp(cmd, "set txbody ", 11) == 0) {
-    char *body = cmd + 11;
-    transmit_msg_default.len = strlen(body);
-    memcpy(transmit_msg_default.body, body, transmit_msg_default.len);
-  } else if (strcmp(cmd, "send") == 0) {
-    while (IsTransmitting()) {
-      // 前のメッセージの送信が終わるまで待つ
-      __WFI();
+/* "\\xHH" 形式のエスケープを含む文字列を buf へ変換し、バイト数を返す（収まらなければ size + 1） */
+static size_t ParseEscapedBytes(const char *s, uint8_t *buf, size_t size) {
+  size_t n = 0;
+  while (*s && n < size) {
+    if (s[0] == '\\' && s[1] == 'x') {
+      char hex[3] = {s[2], s[2] ? s[3] : '\0', '\0'};
+      buf[n++] = strtol(hex, NULL, 16);
+      s += 2 + strlen(hex);
+    } else {
+      buf[n++] = *s++;
+    }
+  }
+  return *s ? size + 1 : n;
+}
+
+/*
+ * "dst=3 src=14 len=5 body@2=AB" の形式のトリガ条件を解析
+ *
+ * @return  解析できたら真
+ */
+static bool ParseSigTrigger(char *s, struct SigTrigger *trig) {
+  memset(trig, 0, sizeof(*trig));
+  for (char *tok = strtok(s, " "); tok; tok = strtok(NULL, " ")) {
+    char *val = strchr(tok, '=');
+    if (val) {
+      *val++ = '\0';
     }
-    transmit_msg = &transmit_msg_default;
-    StartTransmit();
-  } else if (strncmp(cmd, "set mode ", 9) == 0) {
-    const char *mode = cmd + 9;
-    if (strcmp(mode, "debug") == 0) {
-      node_mode = NMODE_DEBUG;
-      printf("Node mode: debug\r\n");
-    } else if (strcmp(mode, "normal") == 0) {
-      node_mode = NMODE_NORMAL;
-      printf("Node mode: normal\r\n");
+    if (strcmp(tok, "any") == 0) {
+      // 条件無し
+    } else if (strcmp(tok, "tsm") == 0) {
+      trig->conds |= TRIGC_TSM;
+    } else if (val && strcmp(tok, "dst") == 0) {
+      trig->conds |= TRIGC_DST;
+      trig->dst = strtol(val, NULL, 0) & 15;
+    } else if (val && strcmp(tok, "src") == 0) {
+      trig->conds |= TRIGC_SRC;
+      trig->src = strtol(val, NULL, 0) & 15;
+    } else if (val && strcmp(tok, "len") == 0) {
+      trig->conds |= TRIGC_LEN;
+      trig->len = strtol(val, NULL, 0);
+    } else if (val && strncmp(tok, "body", 4) == 0 && (tok[4] == '\0' || tok[4] == '@')) {
+      // body=<パターン> または body@<位置>=<パターン>
+      trig->conds |= TRIGC_BODY;
+      trig->body_off = tok[4] == '@' ? strtol(tok + 5, NULL, 0) : 0;
+      trig->body_len = ParseEscapedBytes(val, trig->body, SIG_TRIG_BODY_MAX);
+      if (trig->body_len == 0 || trig->body_len > SIG_TRIG_BODY_MAX) {
+        printf("Body pattern must be 1 to %d bytes\r\n", SIG_TRIG_BODY_MAX);
+        return false;
+      }
     } else {
-      printf("Unknown mode: '%s'\r\n", mode);
+      printf("Unknown condition: '%s'\r\n", tok);
+      return false;
     }
-    // node_mode の変更を反映する
-    ConfigureNode();
-  } else if (strncmp(cmd, "send ", 5) == 0) {
+  }
+  if ((trig->conds & TRIGC_TSM) && trig->conds != TRIGC_TSM) {
+    printf("'tsm' cannot be combined with other conditions\r\n");
+    return false;
+  }
+  return true;
+}
+
+/*
+ * コマンドの実装
+ *
+ * args はコマンド名の後の引数（無ければ空文字列）。
+ */
+static void CmdStatus(char *args) {
+  printf("Node address : %d\r\n", msmp_node.my_addr);
+  printf("Baudrate     : %lu bps (sampling %lu Hz)\r\n", msmp_baudrate, sig_record_rate);
+  printf("Tx period    : %u us\r\n", transmit_period_us);
+  printf("Tx address   : %d\r\n", transmit_msg_default.addr >> 4);
+  printf("Tx body      : ");
+  PrintMsgBody(&transmit_msg_default);
+  printf("\r\n");
+  printf("Tx on rx mode: %d\r\n", transmit_on_receive_mode);
+  printf("Node mode    : %s\r\n", node_mode == NMODE_NORMAL ? "normal" : "debug");
+  printf("Cut-through  : %s\r\n", cut_through_enabled ? "on" : "off");
+  printf("Con overflow : %s (dropped %lu bytes)\r\n",
+         con_overflow_policy == CON_OVF_DROP ? "drop" : "block",
+         con_tx_dropped);
+  printf("Receive state: ");
+  PrintRecState();
+  printf("Signal record: ");
+  PrintSigTriggers();
+}
+
+static void CmdStartRec(char *args) {
+  StartSigRecord();
+}
+
+static void CmdArmRec(char *args) {
+  if (sig_trigger_num == 0) {
+    printf("No trigger. Add one by 'trig add'.\r\n");
+  } else {
+    ArmSigRecord();
+  }
+}
+
+static void CmdStopRec(char *args) {
+  StopSigRecord();
+}
+
+static void CmdStreamRec(char *args) {
+  StartSigStream();
+}
+
+static void CmdTrig(char *args) {
+  PrintSigTriggers();
+}
+
+static void CmdTrigAdd(char *args) {
+  struct SigTrigger trig;
+  if (ParseSigTrigger(args, &trig) && !AddSigTrigger(&trig)) {
+    printf("Too many triggers (max %d)\r\n", SIG_TRIG_MAX);
+  }
+}
+
+static void CmdTrigClear(char *args) {
+  ClearSigTriggers();
+}
+
+/*
+ * 記録期間（ミリ秒）の引数を読む
+ *
+ * @param rate  その期間を記録するときのサンプリングレート
+ * @return  0 から MaxRecordMs(rate) までなら true。範囲外ならエラーを表示して false
+ */
+static bool ParseRecordMs(char *args, uint32_t rate, uint32_t *ms) {
+  const long v = strtol(args, NULL, 0);
+  const uint32_t max_ms = MaxRecordMs(rate);
+  if (v < 0 || max_ms < (unsigned long)v) {
+    printf("Period must be 0 to %lu ms\r\n", max_ms);
+    return false;
+  }
+  *ms = v;
+  return true;
+}
+
+static void CmdSetPretrig(char *args) {
+  if (ParseRecordMs(args, sig_record_rate, &pretrig_ms)) {
+    UpdateSigRecordPeriods();
+  }
+}
+
+static void CmdSetPosttrig(char *args) {
+  if (ParseRecordMs(args, sig_record_rate, &posttrig_ms)) {
+    UpdateSigRecordPeriods();
+  }
+}
+
+static void CmdSetBaud(char *args) {
+  const uint32_t baud = strtoul(args, NULL, 0);
+  if (baud < 1200 || MSMP_PCLOCK / 16 < baud) {
+    printf("Baudrate must be 1200 to %lu\r\n", (uint32_t)(MSMP_PCLOCK / 16));
+    return;
+  }
+  SetMSMPBaudrate(baud);
+  printf("Baudrate: %lu bps, sampling rate: %lu Hz\r\n", msmp_baudrate, sig_record_rate);
+}
+
+static void CmdSetTxPeriod(char *args) {
+  const uint32_t us = strtoul(args, NULL, 0);
+  const uint32_t min_us = 11 * 1000000 / msmp_baudrate + 1;
+  if (us < min_us || UINT16_MAX < us) {
+    printf("Period must be %lu to %u us\r\n", min_us, UINT16_MAX);
+    return;
+  }
+  while (IsTransmitting()) {
+    // 送信中に周期を変えると、送信中のバイトの間隔が崩れる
+    __WFI();
+  }
+  transmit_period_us = us;
+  TIM3_UpdatePeriod();
+}
+
+// autobaud で選ぶ標準的なボーレート
+static const uint32_t standard_baudrates[] = {
+  1200, 2400, 4800, 9600, 14400, 19200, 38400, 57600, 115200, 230400, 460800, 921600,
+};
+
+static void CmdAutobaud(char *args) {
+#if SIG_CAPTURE_EDGE
+  // 最高の分解能（1 tick = 1 クロック）で信号変化を記録するので、待ち時間もそのレートで
+  // tick_t の半分に収まらなければならない。記録中の信号を捨てる前に確かめる
+  uint32_t timeout_ms = 3000;
+  if (args[0] && !ParseRecordMs(args, FUNCONF_SYSTEM_CORE_CLOCK, &timeout_ms)) {
+    return;
+  }
+  const uint32_t old_baud = msmp_baudrate;
+
+  SetSigRecordRate(FUNCONF_SYSTEM_CORE_CLOCK);
+  StartSigRecord();
+  const uint32_t timeout = timeout_ms * TicksPerMs(sig_record_rate);
+  sig_record_period_ticks = timeout;
+  const tick_t start = GetTick();
+  printf("Waiting for %d edges...\r\n", AUTOBAUD_EDGES);
+  while (sig_edges < AUTOBAUD_EDGES && GetTick() - start < timeout) {
+    if (CMD_USART->STATR & USART_FLAG_RXNE) {
+      // キー入力で中断
+      break;
+    }
+    // TIM1 のオーバーフロー割り込みで少なくとも 1.4ms ごとに起きる
+    __WFI();
+  }
+  StopSigRecord();
+
+  const uint32_t bit_ticks = MeasureBitTicks();
+  const uint32_t measured = bit_ticks ? (sig_record_rate + bit_ticks / 2) / bit_ticks : 0;
+  uint32_t baud = old_baud;
+  for (size_t i = 0; i < sizeof(standard_baudrates) / sizeof(standard_baudrates[0]); ++i) {
+    // 誤差 4% 以内なら採用（UART が受信できる誤差の目安）
+    const uint32_t b = standard_baudrates[i];
+    const uint32_t err = measured > b ? measured - b : b - measured;
+    if (err * 25 <= b) {
+      baud = b;
+      break;
+    }
+  }
+  SetMSMPBaudrate(baud);
+  printf("Edges: %u, measured: %lu bps, baudrate: %lu bps%s\r\n",
+         sig_edges, measured, msmp_baudrate, baud == old_baud ? " (unchanged)" : "");
+#else
+  printf("autobaud requires SIG_CAPTURE_EDGE\r\n");
+#endif
+}
+
+static void CmdDumpRecBin(char *args) {
+  DumpRecordBinary();
+}
+
+static void CmdDumpRec(char *args) {
+  // 1 文字が 1 ビット
+  PlotSignal((sig_record_rate + msmp_baudrate / 2) / msmp_baudrate);
+}
+
+static void CmdDumpMsg(char *args) {
+  DumpMessages(3);
+}
+
+static void CmdSetAddr(char *args) {
+  msmp_node.my_addr = strtol(args, NULL, 0);
+  transmit_msg_default.addr = (transmit_msg_default.addr & 0xF0) | msmp_node.my_addr;
+  printf("New address: %d\r\n", msmp_node.my_addr);
+}
+
+static void CmdEnableTxOnRx(char *args) {
+  transmit_on_receive_mode = true;
+}
+
+static void CmdDisableTxOnRx(char *args) {
+  transmit_on_receive_mode = false;
+}
+
+static void CmdSetTxAddr(char *args) {
+  uint8_t txaddr = strtol(args, NULL, 0) & 15;
+  transmit_msg_default.addr = (txaddr << 4) | msmp_node.my_addr;
+}
+
+static void CmdSetTxBody(char *args) {
+  transmit_msg_default.len = strlen(args);
+  memcpy(transmit_msg_default.body, args, transmit_msg_default.len);
+}
+
+static void CmdSetCutThrough(char *args) {
+  if (strcmp(args, "on") == 0) {
+    cut_through_enabled = true;
+  } else if (strcmp(args, "off") == 0) {
+    cut_through_enabled = false;
+  } else {
+    printf("Unknown value: '%s'\r\n", args);
+  }
+}
+
+static void CmdSetMode(char *args) {
+  if (strcmp(args, "debug") == 0) {
+    node_mode = NMODE_DEBUG;
+    printf("Node mode: debug\r\n");
+  } else if (strcmp(args, "normal") == 0) {
+    node_mode = NMODE_NORMAL;
+    printf("Node mode: normal\r\n");
+  } else {
+    printf("Unknown mode: '%s'\r\n", args);
+  }
+  // node_mode の変更を反映する
+  ConfigureNode();
+}
+
+static void CmdSetConOvf(char *args) {
+  if (strcmp(args, "drop") == 0) {
+    con_overflow_policy = CON_OVF_DROP;
+  } else if (strcmp(args, "block") == 0) {
+    con_overflow_policy = CON_OVF_BLOCK;
+  } else {
+    printf("Unknown policy: '%s'\r\n", args);
+  }
+}
+
+static void CmdSend(char *args) {
+  struct Message *msg = &transmit_msg_default;
+  if (args[0] != '\0') {
     // 送信先アドレスとメッセージボディを指定して送信
-    if (strcmp(cmd + 5, "tsm") == 0) {
-      transmit_msg_alternative.addr = 0xF0 | msmp_my_addr;
+    if (strcmp(args, "tsm") == 0) {
+      transmit_msg_alternative.addr = 0xF0 | msmp_node.my_addr;
       transmit_msg_alternative.len = 0;
     } else {
       char *endp = NULL;
-      uint8_t addr = strtol(cmd + 5, &endp, 0);
+      uint8_t addr = strtol(args, &endp, 0);
       char *body = NULL;
       if (endp && *endp == ' ') {
         body = endp + 1;
       } else {
         body = (char*)transmit_msg_default.body;
       }
-      transmit_msg_alternative.addr = (addr << 4) | msmp_my_addr;
+      transmit_msg_alternative.addr = (addr << 4) | msmp_node.my_addr;
       transmit_msg_alternative.len = strlen(body);
       memcpy(transmit_msg_alternative.body, body, transmit_msg_alternative.len);
     }
-    while (IsTransmitting()) {
-      // 前のメッセージの送信が終わるまで待つ
-      __WFI();
+    msg = &transmit_msg_alternative;
+  }
+  while (IsTransmitting()) {
+    // 前のメッセージの送信が終わるまで待つ
+    __WFI();
+  }
+  transmit_msg = msg;
+  StartTransmit();
+}
+
+static void PrintHist(const char *title, const uint32_t *hist) {
+  printf("%s (ticks):\r\n", title);
+  for (int i = 0; i < STATS_HIST_BINS; ++i) {
+    if (hist[i] == 0) {
+      continue;
+    }
+    const uint32_t lo = i == 0 ? 0 : 1u << (i - 1);
+    if (i == 0) {
+      printf("  %5lu        : %lu\r\n", lo, hist[i]);
+    } else if (i == STATS_HIST_BINS - 1) {
+      printf("  %5lu -      : %lu\r\n", lo, hist[i]);
+    } else {
+      printf("  %5lu - %5lu: %lu\r\n", lo, (1ul << i) - 1, hist[i]);
+    }
+  }
+}
+
+static void CmdStats(char *args) {
+  // 割り込みハンドラが更新中でも表示が大きく崩れないよう、写しを取ってから表示する
+  const struct MSMPStats st = msmp_stats;
+  const uint32_t elapsed_ds = (GetTick() - st.start_tick) / (sig_record_rate / 10); // 0.1 秒単位
+  const uint32_t bps = elapsed_ds ? st.bytes * 10 / elapsed_ds : 0;
+  printf("elapsed=%lu.%lus bytes=%lu (%lu B/s, %lu%% of %lu bps) msgs=%lu fwd=%lu tsm=%lu\r\n",
+         elapsed_ds / 10, elapsed_ds % 10, st.bytes, bps, bps * 10 * 100 / msmp_baudrate,
+         msmp_baudrate, st.msgs, st.forwarded_msgs, st.tsm_resets);
+  printf("1 tick = %lu ns\r\n", 1000000000ul / sig_record_rate);
+  printf("addr   src msgs   dst msgs  src bytes  src B/s\r\n");
+  for (int a = 0; a < 16; ++a) {
+    if (st.msgs_by_src[a] == 0 && st.msgs_by_dst[a] == 0) {
+      continue;
+    }
+    printf("%4d %10lu %10lu %10lu %8lu\r\n", a, st.msgs_by_src[a], st.msgs_by_dst[a],
+           st.bytes_by_src[a], elapsed_ds ? st.bytes_by_src[a] * 10 / elapsed_ds : 0);
+  }
+  PrintHist("Inter-byte gap", st.gap_hist);
+  PrintHist("Start bit to forward", st.fwd_hist);
+  printf("cut-through msgs=%lu\r\n", st.cut_through_msgs);
+  PrintHist("Cut-through relay delay", st.relay_hist);
+}
+
+static void CmdStatsReset(char *args) {
+  MSMPStatsReset(&msmp_stats, GetTick());
+}
+
+static void CmdHelp(char *args);
+
+struct Command {
+  const char *name; // コマンド名（空白を含んでよい）
+  void (*func)(char *args);
+  const char *args; // 引数の説明。NULL なら引数を取らない
+  const char *help;
+};
+
+// コマンド表（name の strcmp 順に並べること。起動時に CheckCommandTable で確認する）
+static const struct Command commands[] = {
+  {"arm rec",        CmdArmRec,        NULL, "Start recording RX signal and wait for a trigger."},
+  {"autobaud",       CmdAutobaud,      "[<timeout ms>]", "Measure the baudrate of the bus and switch to it."},
+  {"disable txonrx", CmdDisableTxOnRx, NULL, "Disable transmit on receive mode."},
+  {"dump msg",       CmdDumpMsg,       NULL, "Dump the received messages."},
+  {"dump rec",       CmdDumpRec,       NULL, "Dump the recorded signal."},
+  {"dump rec bin",   CmdDumpRecBin,    NULL, "Dump the recorded signal and messages in binary."},
+  {"enable txonrx",  CmdEnableTxOnRx,  NULL, "Enable transmit on receive mode."},
+  {"help",           CmdHelp,          NULL, "Show this help."},
+  {"send",           CmdSend,          "[<addr> [<body>] | tsm]",
+   "Send the default message, the given message or a TSM message."},
+  {"set addr",       CmdSetAddr,       "<addr>", "Set the address of this node."},
+  {"set baud",       CmdSetBaud,       "<bps>", "Set the baudrate of MSMP."},
+  {"set conovf",     CmdSetConOvf,     "drop | block", "Set console overflow policy."},
+  {"set cutthrough", CmdSetCutThrough, "on | off", "Relay bits of a forwarded message without waiting for whole bytes."},
+  {"set mode",       CmdSetMode,       "debug | normal", "Set mode."},
+  {"set posttrig",   CmdSetPosttrig,   "<ms>", "Set how long the signal is recorded after a trigger."},
+  {"set pretrig",    CmdSetPretrig,    "<ms>", "Set how long the signal before a trigger is kept."},
+  {"set txaddr",     CmdSetTxAddr,     "<addr>", "Set the dst address of a message to be sent."},
+  {"set txbody",     CmdSetTxBody,     "<body>", "Set the body of a message to be sent."},
+  {"set txperiod",   CmdSetTxPeriod,   "<us>", "Set the interval of bytes to be sent."},
+  {"start rec",      CmdStartRec,      NULL, "Start recording RX signal from the next start bit."},
+  {"stats",          CmdStats,         NULL, "Show bus statistics and latency histograms."},
+  {"stats reset",    CmdStatsReset,    NULL, "Reset bus statistics."},
+  {"status",         CmdStatus,        NULL, "Show current settings and status."},
+  {"stop rec",       CmdStopRec,       NULL, "Stop recording (or streaming)."},
+  {"stream rec",     CmdStreamRec,     NULL, "Stream RX signal in binary until 'stop rec'."},
+  {"trig",           CmdTrig,          NULL, "Show triggers and the recording state."},
+  {"trig add",       CmdTrigAdd,       "<cond>...",
+   "Add a trigger. All conditions must match.\r\n"
+   "  cond = any | tsm | dst=<addr> | src=<addr> | len=<len> | body[@<pos>]=<bytes>"},
+  {"trig clear",     CmdTrigClear,     NULL, "Remove all triggers."},
+};
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+// コマンド名に含まれる単語の最大数
+#define CMD_NAME_WORDS_MAX 3
+
+static void CmdHelp(char *args) {
+  printf("Commands:\r\n"
+         "!!: Re-run the last line.\r\n"
+         "<cmd>; <cmd>; ...: Run commands in order.\r\n");
+  for (size_t i = 0; i < NUM_COMMANDS; ++i) {
+    const struct Command *c = commands + i;
+    printf("%s%s%s: %s\r\n", c->name, c->args ? " " : "", c->args ? c->args : "", c->help);
+  }
+}
+
+/* コマンド表が二分探索できる順に並んでいることを確認 */
+static void CheckCommandTable(void) {
+  for (size_t i = 1; i < NUM_COMMANDS; ++i) {
+    if (strcmp(commands[i - 1].name, commands[i].name) >= 0) {
+      printf("Error: commands[] is not sorted at '%s'\r\n", commands[i].name);
     }
-    transmit_msg = &transmit_msg_alternative;
-    StartTransmit();
-  } else if (strcmp(cmd, "help") == 0) {
-    printf("Commands:\r\n"
-           "help: Show this help.\r\n"
-           "!!: Re-run the last command.\r\n"
-           "status: Show current settings and status.\r\n"
-           "start rec: Start recording RX signal.\r\n"
-           "dump rec: Dump the recorded signal.\r\n"
-           "dump msg: Dump the received messages.\r\n"
-           "set addr <addr>: Set the address of this node.\r\n"
-           "enable txonrx: Enable transmit on receive mode.\r\n"
-           "disable txonrx: Disable transmit on receive mode.\r\n"
-           "set txaddr <addr>: Set the dst address of a message to be sent.\r\n"
-           "set txbody <body>: Set the body of a message to be sent.\r\n"
-           "set mode <mode>: Set mode. mode = debug | normal\r\n"
-           "send: Send the default message to node set by 'set txaddr'.\r\n"
-           "send <addr> <body>: Send the given message.\r\n"
-           "send tsm: Send a TSM message.\r\n");
+  }
+}
+
+/* 先頭 len 文字がコマンド名に一致する要素を二分探索する。無ければ NULL */
+static const struct Command *FindCommand(const char *cmd, size_t len) {
+  size_t lo = 0, hi = NUM_COMMANDS;
+  while (lo < hi) {
+    const size_t mid = (lo + hi) / 2;
+    const char *name = commands[mid].name;
+    int r = strncmp(cmd, name, len);
+    if (r == 0 && name[len] != '\0') {
+      r = -1; // cmd の先頭 len 文字は name より短い
+    }
+    if (r == 0) {
+      return commands + mid;
+    } else if (r < 0) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * 1 つのコマンドを実行
+ *
+ * コマンド名は単語の区切りで最長一致させる（"dump rec bin" は "dump rec" より優先）。
+ * 単語数が CMD_NAME_WORDS_MAX 以下の候補を長い方から二分探索するので、表の大きさによらず高々数回の探索で済む。
+ */
+void ProcCommand(char *cmd) {
+  size_t ends[CMD_NAME_WORDS_MAX]; // 候補となるコマンド名の終わりの位置
+  size_t num_ends = 0;
+  for (size_t i = 0; num_ends < CMD_NAME_WORDS_MAX; ++i) {
+    if (cmd[i] == ' ' || cmd[i] == '\0') {
+      ends[num_ends++] = i;
+    }
+    if (cmd[i] == '\0') {
+      break;
+    }
+  }
+
+  while (num_ends > 0) {
+    const size_t len = ends[--num_ends];
+    const struct Command *c = FindCommand(cmd, len);
+    if (c == NULL) {
+      continue;
+    }
+    char *args = cmd + len;
+    if (*args == ' ') {
+      ++args;
+    }
+    if (c->args == NULL && *args != '\0') {
+      printf("'%s' takes no arguments\r\n", c->name);
+    } else {
+      c->func(args);
+    }
+    return;
+  }
+  printf("Unknown command: '%s'\r\n", cmd);
+}
+
+/*
+ * 1 行分のコマンドを実行
+ *
+ * ';' で区切られた複数のコマンドを順に実行する（前後の空白は無視する）。
+ */
+void ProcCommandLine(char *line) {
+  char *next = line;
+  while (next) {
+    char *cmd = next;
+    next = strchr(cmd, ';');
+    if (next) {
+      *next++ = '\0';
+    }
+    while (*cmd == ' ') {
+      ++cmd;
+    }
+    char *end = cmd + strlen(cmd);
+    while (end > cmd && end[-1] == ' ') {
+      *--end = '\0';
+    }
+    if (*cmd) {
+      ProcCommand(cmd);
+    }
+  }
+}
+
+/****************************************
+ デバッガ操作用 USART の送信リングバッファ
+ ****************************************/
+#define CON_TX_BUF_MASK (CON_TX_BUF_SIZE - 1)
+static char con_tx_buf[CON_TX_BUF_SIZE];
+static volatile size_t con_tx_head; // 書き込み位置（メインループのみが更新）
+static volatile size_t con_tx_tail; // DMA 転送開始位置（DMA 割り込みのみが更新）
+static volatile size_t con_tx_dma_len; // DMA 転送中のバイト数（0 なら DMA は停止中）
+static volatile bool con_tx_block; // ConWriteBlock の転送中なら真（con_tx_tail は進めない）
+enum ConOverflowPolicy con_overflow_policy = CON_OVF_BLOCK;
+volatile uint32_t con_tx_dropped;
+
+/*
+ * DMA が停止中なら、リングバッファに溜まっている連続領域の送信を開始
+ *
+ * DMA 割り込みハンドラ、または DMA 割り込みを禁止した状態で呼ぶこと。
+ */
+static void ConStartTxDMA(void) {
+  if (con_tx_dma_len != 0) {
+    return;
+  }
+  const size_t head = con_tx_head;
+  const size_t tail = con_tx_tail;
+  if (head == tail) {
+    return;
+  }
+  // リングの末尾で折り返す場合は、末尾までを先に送る
+  const size_t len = tail < head ? head - tail : CON_TX_BUF_SIZE - tail;
+  con_tx_dma_len = len;
+  CON_TX_DMA_CH->MADDR = (uint32_t)(con_tx_buf + tail);
+  CON_TX_DMA_CH->CNTR = len;
+  CON_TX_DMA_CH->CFGR |= DMA_CFGR1_EN;
+}
+
+/*
+ * デバッガ操作用 USART 送信 DMA 割り込みハンドラ
+ */
+void CON_TX_DMA_IRQHandler(void) __attribute__((interrupt));
+void CON_TX_DMA_IRQHandler(void) {
+  // 割り込みフラグをクリア
+  DMA1->INTFCR = CON_TX_DMA_CTCIF;
+  CON_TX_DMA_CH->CFGR &= ~DMA_CFGR1_EN;
+  if (con_tx_block) {
+    con_tx_block = false;
   } else {
-    printf("Unknown command: '%s'\r\n", cmd);
+    con_tx_tail = (con_tx_tail + con_tx_dma_len) & CON_TX_BUF_MASK;
+  }
+  con_tx_dma_len = 0;
+  ConStartTxDMA();
+}
+
+static void ConKickTx(void) {
+  NVIC_DisableIRQ(CON_TX_DMA_IRQn);
+  ConStartTxDMA();
+  NVIC_EnableIRQ(CON_TX_DMA_IRQn);
+}
+
+/* リングバッファへ 1 バイト積む。積めたら真。 */
+static bool ConPush(char c) {
+  const size_t head = con_tx_head;
+  const size_t next = (head + 1) & CON_TX_BUF_MASK;
+  while (next == con_tx_tail) {
+    if (con_overflow_policy == CON_OVF_DROP) {
+      ++con_tx_dropped;
+      return false;
+    }
+    // 満杯なので、積んである分の送信を開始して空きを待つ
+    ConKickTx();
+    __WFI();
+  }
+  con_tx_buf[head] = c;
+  con_tx_head = next;
+  return true;
+}
+
+size_t ConWrite(const char *buf, size_t size) {
+  size_t n = 0;
+  for (size_t i = 0; i < size; i++) {
+    n += ConPush(buf[i]);
+  }
+  ConKickTx();
+  return n;
+}
+
+void ConFlush(void) {
+  while (con_tx_head != con_tx_tail) {
+    ConKickTx();
+    __WFI();
+  }
+}
+
+void ConWriteBlock(const void *buf, size_t size) {
+  // リングバッファの分や前の ConWriteBlock の転送が終わるのを待つ
+  ConFlush();
+  while (con_tx_dma_len != 0) {
+    __WFI();
   }
+  if (size == 0) {
+    return;
+  }
+  NVIC_DisableIRQ(CON_TX_DMA_IRQn);
+  con_tx_block = true;
+  con_tx_dma_len = size;
+  CON_TX_DMA_CH->MADDR = (uint32_t)buf;
+  CON_TX_DMA_CH->CNTR = size;
+  CON_TX_DMA_CH->CFGR |= DMA_CFGR1_EN;
+  NVIC_EnableIRQ(CON_TX_DMA_IRQn);
+}
+
+bool ConBlockBusy(void) {
+  return con_tx_block;
 }
 
 // For debug writing to the UART.
 int _write(int fd, const char *buf, int size) {
-  for(int i = 0; i < size; i++){
-    while( !(CMD_USART->STATR & USART_FLAG_TC));
-    CMD_USART->DATAR = *buf++;
-  }
+  ConWrite(buf, size);
   return size;
 }
 
 // single char to UART
 int putchar(int c) {
-  while( !(CMD_USART->STATR & USART_FLAG_TC));
-  CMD_USART->DATAR = c;
+  char ch = c;
+  ConWrite(&ch, 1);
   return 1;
 }
 
@@ -477,56 +1252,68 @@ int main() {
          (rcc_cfgr0 & RCC_PPRE1) >> 8,
          (rcc_cfgr0 & RCC_PPRE2) >> 11);
 
+  MSMPStatsReset(&msmp_stats, 0);
+  MSMPInitNode(&msmp_node, 0x0E, SendToMSMP);
+  msmp_node.record = RecordMSMPByte;
   MSMP_USART_Init();
 
+#if SIG_CAPTURE_EDGE
+  TIM1_InitForEdgeCapture();
+#else
   TIM2_InitForPeriodicTimer(0, SIG_RECORD_TIM_PERIOD - 1); // 48MHz / 96KHz = 500
+#endif
   TIM3_InitForMSMPTimer();
 
   ConfigureNode();
 
-  char cmd[64], cmd_prev[2];
+  CheckCommandTable();
+
+  // cmd は ProcCommandLine が書き換えるので、"!!" 用の cmd_prev には実行前に写しておく
+  char cmd[CMD_LINE_LEN], cmd_prev[CMD_LINE_LEN] = "";
   size_t cmd_i = 0;
 
   while (1) {
+    ConsumeMessages();
+    PumpSigStream();
     if (CMD_USART->STATR & USART_FLAG_RXNE) {
       uint8_t c = CMD_USART->DATAR;
       if (c == '\r' || c == '\n') {
         putchar('\r');
         putchar('\n');
         if (cmd_i > 0) {
-          if (cmd_i == 2 && strncmp(cmd, "!!", 2) == 0) {
-            cmd[0] = cmd_prev[0];
-            cmd[1] = cmd_prev[1];
-            cmd_i = 0;
-            ProcCommand(cmd);
+          cmd[cmd_i] = '\0';
+          cmd_i = 0;
+          if (strcmp(cmd, "!!") == 0) {
+            strcpy(cmd, cmd_prev);
           } else {
-            cmd[cmd_i] = '\0';
-            cmd_i = 0;
-            // "!!" での再実行に備え、cmd の先頭 2 文字だけ保存しておく
-            cmd_prev[0] = cmd[0];
-            cmd_prev[1] = cmd[1];
-
-            ProcCommand(cmd);
+            strcpy(cmd_prev, cmd);
           }
+          ProcCommandLine(cmd);
         }
       } else if (c == '\b' || c == 0x7f) {
         if (cmd_i > 0) {
           --cmd_i;
           putchar('\b');
         }
-      } else {
+      } else if (cmd_i < sizeof(cmd) - 1) {
         cmd[cmd_i++] = c;
         putchar(c);
       }
-    } else if (msmp_flags & MFLAG_MSG_TO_ME) {
-      msmp_flags &= ~MFLAG_MSG_TO_ME;
+    } else if (msmp_node.flags & MFLAG_MSG_TO_ME) {
+      msmp_node.flags &= ~MFLAG_MSG_TO_ME;
       printf("A msg to me is being received.\r\n");
-    } else if (msmp_flags & MFLAG_MSG_TO_FORWARD) {
-      msmp_flags &= ~MFLAG_MSG_TO_FORWARD;
-      printf("A msg to forward is being received. dst=%d\r\n", forward_dst);
-    } else if (msmp_flags & MFLAG_TSM_RESET) {
-      msmp_flags &= ~MFLAG_TSM_RESET;
+    } else if (msmp_node.flags & MFLAG_MSG_TO_FORWARD) {
+      msmp_node.flags &= ~MFLAG_MSG_TO_FORWARD;
+      printf("A msg to forward is being received. dst=%d\r\n", msmp_node.forward_dst);
+    } else if (msmp_node.flags & MFLAG_TSM_RESET) {
+      msmp_node.flags &= ~MFLAG_TSM_RESET;
       printf("Forced reset by a TSM.\r\n");
+    } else if (msmp_node.flags & MFLAG_START_MISSED) {
+      msmp_node.flags &= ~MFLAG_START_MISSED;
+      printf("Error: a byte was received before its start bit was detected.\r\n");
+    } else if (sig_trig_fired) {
+      sig_trig_fired = false;
+      printf("Triggered.\r\n");
     } else {
       __WFI();
     }
@@ -1,24 +1,56 @@
 #include <stddef.h>
 #include <stdint.h>
+#include "msmp_proto.h"
+#include "msmp_stats.h"
+#include "msg_queue.h"
 
 /********
  各種設定
  ********/
-// MSMP のボーレート
+// MSMP のボーレートの初期値（set baud で変更できる）
 #define MSMP_BAUDRATE 9600
-// 信号記録のサンプリングレート
+// 信号記録のサンプリングレート（時刻の分解能）の初期値
+// 実行時はボーレートの SIG_RECORD_RATE_SCALE 倍に近い値（sig_record_rate）になる
+// SIG_CAPTURE_EDGE が 1 なら、大きくしても割り込み頻度は変わらない
 #define SIG_RECORD_RATE_SCALE 10
 #define SIG_RECORD_RATE (MSMP_BAUDRATE * SIG_RECORD_RATE_SCALE) // 96KHz
-// メッセージ受信バッファサイズ（バイト）
-#define MSG_BUF_SIZE 1024 // 1KB
+// 信号記録の方式
+// 1: TIM1 のインプットキャプチャで信号変化の時刻を取り込む（信号変化時のみ割り込み）
+// 0: TIM2 の周期割り込みで RX ピンをポーリングする（SIG_RECORD_RATE で割り込み）
+#define SIG_CAPTURE_EDGE 1
+// SIG_CAPTURE_EDGE が 0 の場合の TIM2 の最小周期（クロック数）
+// 割り込みハンドラの処理時間より短くはできないので、高いボーレートではサンプリングレートがこれで制限される
+#define SIG_POLL_MIN_PERIOD 400
+// autobaud でボーレートを推定するのに使う信号変化の数
+#define AUTOBAUD_EDGES 64
+// メッセージ受信キューのサイズ（バイト）
+#define MSG_BUF_SIZE 512
+// 受信済みメッセージの履歴の数（dump msg で表示する）
+#define MSG_HIST_LEN 4
 // 信号記録バッファサイズ（バイト）
-#define SIG_BUF_SIZE (17*1024)
+#define SIG_BUF_SIZE (16*1024)
+// 同時に設定できるトリガ条件の数（8 以下）
+#define SIG_TRIG_MAX 4
+// トリガ条件の本文パターンの最大長（バイト）
+#define SIG_TRIG_BODY_MAX 8
 // MSMP 通信に用いる USART コンポーネントの番号（USARTn）
 #define MSMP_USART_NUM 1
 // MSMP 送信メッセージバッファサイズ（バイト）
 #define TX_BUF_LEN 65
+// 転送の方式
+// 1: アドレス部で転送を決めた後は、RX ピンの信号変化を TX ピンへそのまま中継する（カットスルー）
+// 0: 1 バイト受信し終えるごとに USART で送信する（ストアアンドフォワード）
+#define MSMP_CUT_THROUGH 1
+// MSMP 送信の方式
+// 1: TIM3 のアップデートイベントで DMA を起動し、1 バイトずつ USART へ書く（メッセージ毎に割り込み 1 回）
+// 0: TIM3 の割り込みハンドラで 1 バイトずつ USART へ書く（バイト毎に割り込み 1 回）
+#define MSMP_TX_DMA 1
 // デバッガ操作に用いる USART コンポーネントの番号
 #define CMD_USART_NUM 2
+// デバッガ操作の 1 行の最大長（';' で区切って複数のコマンドを書ける）
+#define CMD_LINE_LEN 128
+// デバッガ操作用 USART の送信リングバッファサイズ（バイト、2 の冪）
+#define CON_TX_BUF_SIZE 1024
 // USART のピン
 #define USART1_TX_PIN PA9
 #define USART1_RX_PIN PA10
@@ -28,12 +60,20 @@
 /************************
  設定値から導出される定数
  ************************/
+// TIM3 のアップデートイベントに対応する DMA チャンネル
+#define MSMP_TX_DMA_CH DMA1_Channel3
+#define MSMP_TX_DMA_IRQn DMA1_Channel3_IRQn
+#define MSMP_TX_DMA_IRQHandler DMA1_Channel3_IRQHandler
+#define MSMP_TX_DMA_CTCIF DMA_CTCIF3
 // 信号記録の周期
 #define SIG_RECORD_TIM_PERIOD (FUNCONF_SYSTEM_CORE_CLOCK / SIG_RECORD_RATE)
-// メッセージ受信バッファの要素数
+#if SIG_CAPTURE_EDGE && MSMP_USART_NUM != 1
+#error "SIG_CAPTURE_EDGE requires the RX pin of USART1 (PA10 = TIM1_CH3)"
+#endif
+// メッセージ受信キューの要素数
 #define MSG_BUF_LEN (MSG_BUF_SIZE / sizeof(struct Message))
 // 信号記録バッファの要素数
-#define SIG_BUF_LEN (SIG_BUF_SIZE / sizeof(tick_t))
+#define SIG_BUF_LEN (SIG_BUF_SIZE / sizeof(sig_delta_t))
 
 // USART 関連マクロの定義補助
 #define CONCAT_USART_AGAIN(num, postfix) USART ## num ## postfix
@@ -55,26 +95,63 @@
 #define CMD_USART_IRQHandler CMD_USART_ID(_IRQHandler)
 #define CMD_TX_PIN CMD_USART_ID(_TX_PIN)
 #define CMD_RX_PIN CMD_USART_ID(_RX_PIN)
+// デバッガ操作用 USART の送信に用いる DMA チャンネル
+#if CMD_USART_NUM == 1
+#define CON_TX_DMA_CH DMA1_Channel4
+#define CON_TX_DMA_IRQn DMA1_Channel4_IRQn
+#define CON_TX_DMA_IRQHandler DMA1_Channel4_IRQHandler
+#define CON_TX_DMA_CTCIF DMA_CTCIF4
+#else
+#define CON_TX_DMA_CH DMA1_Channel7
+#define CON_TX_DMA_IRQn DMA1_Channel7_IRQn
+#define CON_TX_DMA_IRQHandler DMA1_Channel7_IRQHandler
+#define CON_TX_DMA_CTCIF DMA_CTCIF7
+#endif
 
-typedef uint32_t tick_t;
-
-struct Message {
-  tick_t start_tick; // スタートビットを受信したときの時刻
-  union {
-    struct {
-      uint8_t addr;
-      uint8_t len;
-      uint8_t body[63];
-    };
-    uint8_t raw_msg[65];
-  } __attribute__((packed));
+/* 信号記録バッファの 1 要素
+ *
+ * 直前の信号変化からの経過時間（tick 単位）を記録する。
+ * 最上位ビットは継続フラグで、1 なら次の要素に続きがある。
+ * 15 ビットで表せない経過時間は上位の 15 ビットから順に複数要素に分けて記録する。
+ */
+typedef uint16_t sig_delta_t;
+#define SIG_DELTA_CONT 0x8000u
+#define SIG_DELTA_MASK 0x7fffu
+#define SIG_DELTA_BITS 15
+
+enum ConOverflowPolicy {
+  CON_OVF_DROP, // 送信リングバッファが満杯なら捨てる
+  CON_OVF_BLOCK, // 送信リングバッファに空きができるまで待つ
+};
+
+// 信号記録の状態
+enum SigRecState {
+  SREC_STOPPED, // 記録していない
+  SREC_ARMED, // トリガ待ち。sig_buf を循環バッファとして使い、満杯なら古い記録から捨てる
+  SREC_TRIGGERED, // トリガ成立後。sig_record_period_ticks が経過するか満杯になるまで記録する
+  SREC_STREAMING, // stream rec。sig_buf を半分ずつ書き、書き終えた半分をデバッガ操作用 USART へ送り続ける
 };
 
-enum MSMPState {
-  MSTATE_IDLE, // 先頭バイトを待っている状態
-  MSTATE_ADDR, // 先頭バイトを受信中
-  MSTATE_LEN,  // メッセージ長を受信中
-  MSTATE_BODY, // メッセージボディを受信中
+// struct SigTrigger の conds
+#define TRIGC_DST  0x01 // 宛先アドレスが dst に一致
+#define TRIGC_SRC  0x02 // 送信元アドレスが src に一致
+#define TRIGC_LEN  0x04 // メッセージ長が len に一致
+#define TRIGC_BODY 0x08 // 本文の body_off バイト目からが body に一致
+#define TRIGC_TSM  0x10 // TSM による強制復旧（他の条件とは組み合わせない）
+
+/* トリガ条件
+ *
+ * conds で指定した条件をすべて満たすメッセージを受信したらトリガが成立する。
+ * conds が 0 なら任意のメッセージで成立する。
+ */
+struct SigTrigger {
+  uint8_t conds;
+  uint8_t dst;
+  uint8_t src;
+  uint8_t len;
+  uint8_t body_off;
+  uint8_t body_len;
+  uint8_t body[SIG_TRIG_BODY_MAX];
 };
 
 enum NodeMode {
@@ -85,37 +162,85 @@ enum NodeMode {
 /*************
  * msmpdbg.c *
  *************/
-// 送受信同時デバッグモード
+// 現在時刻（sig_record_rate でカウントアップ）
+// SIG_CAPTURE_EDGE が 1 の場合は TIM1 のオーバーフローごとに 0x10000 ずつ増える上位部分のみを保持する
 extern volatile tick_t tick;
+// 送受信同時デバッグモード
 extern volatile bool transmit_on_receive_mode;
-extern uint8_t msmp_my_addr;
+// このノードの MSMP プロトコルエンジン（msmp_node.my_addr が自ホストのアドレス）
+extern struct MSMPNode msmp_node;
+// MSMP バスの統計（stats コマンドで表示）
+extern struct MSMPStats msmp_stats;
 extern struct Message *transmit_msg;
-extern uint16_t transmit_period_ms;
+extern uint16_t transmit_period_us; // 送信するバイトの間隔（マイクロ秒）
+// 現在の MSMP のボーレートと信号記録のサンプリングレート（Hz）
+extern uint32_t msmp_baudrate;
+extern uint32_t sig_record_rate;
+
+// 真ならカットスルー中継を行う（MSMP_CUT_THROUGH が 1 の場合のみ有効）
+extern bool cut_through_enabled;
+
+/* 現在時刻を返す（割り込みハンドラからも呼べる） */
+tick_t GetTick(void);
+
+/*
+ * MSMP のボーレートを変更
+ *
+ * USART の分周比と信号記録のサンプリングレートを変え、記録済みの信号と統計は捨てる。
+ */
+void SetMSMPBaudrate(uint32_t baud);
 
 /* MSMP ターゲットにメッセージ送信開始 */
 void StartTransmit(void);
 bool IsTransmitting(void);
 
-/* 受信された 1 バイトを処理 */
-void ProcByte(uint8_t c);
+// デバッガ操作用 USART の送信リングバッファ
+extern enum ConOverflowPolicy con_overflow_policy;
+extern volatile uint32_t con_tx_dropped; // 満杯のため捨てたバイト数
+
+/*
+ * デバッガ操作用 USART へバイト列を送信
+ *
+ * 送信リングバッファに積むだけで、実際の送信は DMA が行う。
+ * @return  リングバッファに積んだバイト数
+ */
+size_t ConWrite(const char *buf, size_t size);
+/* 送信リングバッファが空になるまで待つ */
+void ConFlush(void);
+/*
+ * リングバッファを介さず、buf を直接 DMA でデバッガ操作用 USART へ送信
+ *
+ * 先にリングバッファへ積んだ分を送り終えてから転送を始め、完了を待たずに戻る。
+ * 転送中にリングバッファへ積んだバイト列は buf の後に送られる。
+ * ConBlockBusy() が偽になるまで buf を書き換えないこと。
+ */
+void ConWriteBlock(const void *buf, size_t size);
+/* ConWriteBlock の転送中なら真 */
+bool ConBlockBusy(void);
 
 /*******************
  * msmp_recorder.c *
  *******************/
-extern volatile enum MSMPState msmp_state;
-// 受信信号の 0/1 が切り替わった時刻のリスト
-// sig[0] はスタートビットの受信時刻、sig[1] はその次に信号が 1 になった時刻
-extern volatile tick_t sig_buf[SIG_BUF_LEN];
-extern volatile size_t sig_wpos;
-extern volatile bool sig_record_mode; // 真なら信号を記録する
-extern volatile uint32_t sig_record_period_ticks; // 信号を記録する期間
-
-extern uint16_t msmp_flags;
-#define MFLAG_MSG_TO_ME      0x0001
-#define MFLAG_MSG_TO_FORWARD 0x0002
-#define MFLAG_TSM_RESET      0x0004
-#define MFLAG_DST_ZERO       0x0008
-#define MFLAG_MY_BRDCAST     0x0010
+// 受信信号の 0/1 が切り替わった時刻の差分の循環バッファ
+// 最初の変化（立ち下がり）の時刻は sig_start_tick に記録し、
+// sig_buf[sig_rpos] からはその次に信号が 1 になった時刻からの差分を記録する
+extern volatile sig_delta_t sig_buf[SIG_BUF_LEN];
+extern volatile size_t sig_rpos; // 最も古い要素の位置
+extern volatile size_t sig_wpos; // 次に書き込む位置
+extern volatile size_t sig_len; // 使用中の要素数
+extern volatile size_t sig_edges; // 記録した信号変化の回数（最初の立ち下がりを含む）
+extern volatile tick_t sig_start_tick; // 最初の立ち下がりの時刻
+extern volatile tick_t sig_last_tick; // 最後に信号が変化した時刻
+extern volatile tick_t sig_trig_tick; // トリガが成立したメッセージのスタートビットの時刻
+extern volatile enum SigRecState sig_rec_state;
+extern volatile bool sig_trig_fired; // トリガが成立したら真（メインループが偽に戻す）
+extern volatile uint32_t sig_record_period_ticks; // トリガ成立後に信号を記録する期間
+extern volatile uint32_t sig_pretrig_ticks; // トリガ成立前の記録を残す期間
+// トリガ条件（いずれかが成立すればトリガする）
+extern struct SigTrigger sig_triggers[SIG_TRIG_MAX];
+extern size_t sig_trigger_num;
+// ストリーミング中に送信が追いつかず捨てた信号変化の数
+extern volatile uint32_t sig_stream_dropped;
 
 /* RX ピンの状態を入力
  *
@@ -125,24 +250,126 @@ extern uint16_t msmp_flags;
  */
 bool SenseSignal(tick_t tick, bool sig);
 
-/* 記録された信号をグラフ化して表示 */
-void PlotSignal();
+/* 信号の記録を最初からやり直す（次のスタートビットでトリガする） */
+void StartSigRecord(void);
+/* トリガ条件を待つ記録を開始（トリガ成立前の信号も sig_pretrig_ticks まで残す） */
+void ArmSigRecord(void);
+/*
+ * 記録を止め、sig_pretrig_ticks より前の記録を捨てる（記録を読み出す前に呼ぶ）
+ *
+ * ストリーミング中なら、書きかけの半分まで送り終えてから BFRAME_END を送る。
+ */
+void StopSigRecord(void);
+/*
+ * ストリーミングを開始
+ *
+ * BFRAME_HEADER を送った後、sig_buf の半分が埋まるごとに BFRAME_STREAM で送る。
+ * 送信が追いつかない間の信号変化は捨て、sig_stream_dropped に数える。
+ * StopSigRecord で止めるまで続ける。
+ */
+void StartSigStream(void);
+/*
+ * 書き終えた sig_buf の半分を送信（メインループから呼ぶ）
+ *
+ * @return  送信を始めたら真
+ */
+bool PumpSigStream(void);
+/*
+ * トリガ条件を追加
+ *
+ * @return  追加できたら真、SIG_TRIG_MAX 個に達していたら偽
+ */
+bool AddSigTrigger(const struct SigTrigger *trig);
+/* トリガ条件をすべて削除 */
+void ClearSigTriggers(void);
+/* トリガ条件と記録の状態を表示 */
+void PrintSigTriggers(void);
+
+// sig_buf を古い方から順に読み出すための状態
+struct SigReader {
+  size_t rpos; // sig_buf の読み出し位置
+  size_t left; // 未読の要素数
+  tick_t tick; // 直前に読み出した信号変化の時刻
+};
+
+/* sig_buf の読み出しを開始（r->tick は最初の立ち下がりの時刻になる） */
+void SigReaderInit(struct SigReader *r);
+/*
+ * 次の信号変化の時刻を読み出す
+ *
+ * @return  読み出せたら真、記録の末尾に達していたら偽
+ */
+bool SigReaderNext(struct SigReader *r);
+
+/* 記録された信号をグラフ化して表示（1 文字が tick_step tick） */
+void PlotSignal(int tick_step);
+/* 記録された信号を消去（サンプリングレートを変えたときに呼ぶ） */
+void ClearSigRecord(void);
+/*
+ * 記録された信号変化の間隔から 1 ビットの長さを推定
+ *
+ * 最短の間隔を 1 ビットとみなし、その 1.5 倍未満の間隔を平均する。
+ * @return  1 ビットの tick 数、信号変化が足りなければ 0
+ */
+uint32_t MeasureBitTicks(void);
 
 /* 受信メッセージのアドレス部を記録 */
 void RecordAddr(uint8_t addr);
 /* 受信メッセージのメッセージ長を記録 */
 void RecordLen(uint8_t len);
-/*
- * 受信メッセージの本文を記録
- *
- * @param c  受信した 1 バイト
- * @return  真ならメッセージ受信完了
- */
-bool RecordBody(uint8_t c);
-/* 現在の msmp_state の名前と説明を表示 */
+/* 受信メッセージの本文を記録 */
+void RecordBody(uint8_t c);
+/* 受信中のメッセージの転送を開始した時刻を記録 */
+void RecordForwardStart(tick_t t);
+/* msmp_node.record に設定する記録関数（状態に応じて RecordAddr/Len/Body を呼び、トリガ条件の評価と統計の更新を行う） */
+void RecordMSMPByte(struct MSMPNode *node, enum MSMPState state, uint8_t c);
+/* 現在の msmp_node.state の名前と説明を表示 */
 void PrintRecState();
 /* メッセージの本文を表示 */
 void PrintMsgBody(struct Message *msg);
 
+// 受信メッセージのキュー（生産者は RecordAddr/Len/Body、消費者は ConsumeMessages）
+extern struct MsgQueue msg_queue;
+/*
+ * 受信し終えたメッセージをキューから取り出し、履歴へ移す（メインループから呼ぶ）
+ *
+ * @return  取り出したメッセージ数
+ */
+size_t ConsumeMessages(void);
 /* 記録されたメッセージを表示 */
 void DumpMessages(size_t msg_num);
+
+/*
+ * 記録された信号とメッセージをバイナリ形式で送信
+ *
+ * フレーム形式（数値はリトルエンディアン）:
+ *   magic (0xA5 0x5A), type (1B), seq (1B), payload 長 (2B), payload, CRC16 (2B)
+ * CRC16 は CCITT（多項式 0x1021、初期値 0xFFFF）で、type から payload の末尾までを対象とする。
+ * 各 type の payload は enum BinFrameType を参照。
+ */
+void DumpRecordBinary(void);
+
+#define BIN_FRAME_MAGIC0 0xA5
+#define BIN_FRAME_MAGIC1 0x5A
+#define BIN_FRAME_VERSION 3
+// payload の最大長（バイト、BFRAME_STREAM を除く）
+#define BIN_PAYLOAD_MAX 240
+
+enum BinFrameType {
+  // version (1B), msmp_baudrate (4B), sig_record_rate (4B),
+  // sig_start_tick (4B), sig_last_tick (4B), sig_edges (4B), sig_len (4B),
+  // sig_trig_tick (4B, version 2 以降)
+  BFRAME_HEADER = 1,
+  // 最も古い要素からの位置 (4B), sig_buf の要素 (2B) の列
+  BFRAME_SIG = 2,
+  // メッセージの列。各メッセージは start_tick (4B), addr (1B), len (1B), body (len B)
+  BFRAME_MSG = 3,
+  // END より前に送ったフレーム数 (2B、65536 以上なら下位 16 ビット)
+  // ストリーミングでは続けて信号変化の回数 (4B), 捨てた信号変化の回数 (4B)
+  BFRAME_END = 4,
+  // ストリーミングで送る sig_buf の半分（version 3 以降）
+  // 半分の通し番号 (4B), 先頭の差分の基準時刻 (4B), それまでの信号変化の回数 (4B),
+  // それまでに捨てた信号変化の回数 (4B), sig_buf の要素 (2B) の列
+  // 各半分は単独で復号できる。末尾の継続フラグ付きの要素は詰め物なので無視する。
+  BFRAME_STREAM = 5,
+};
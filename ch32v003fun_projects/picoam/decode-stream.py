@@ -0,0 +1,267 @@
+#!/usr/bin/python3
+
+'''picoam の "s" コマンド（ADC のバイナリストリーミング）の出力をデコードする
+
+使い方:
+    # picoam に直接接続して 10 秒間取り込む（--duration を省くと Ctrl-C まで）
+    $ ./decode-stream.py --port /dev/ttyUSB0 --duration 10 --save adc.bin --csv adc.csv
+    # 保存しておいたバイト列をデコードする
+    $ ./decode-stream.py adc.bin --csv adc.csv
+
+フレーム形式は picoam.c の CmdAdcStream の前のコメントを参照。
+各サンプルの時刻は、前後のフレームの先頭サンプルの時刻から補間して求める。
+'''
+
+import argparse
+from dataclasses import dataclass, field
+import os
+import struct
+import sys
+import termios
+import time
+
+MAGIC = b'\xA5\x5A'
+FRAME_HEADER = 1
+FRAME_SAMPLES = 2
+
+INVALID_SAMPLE = -2048
+
+def crc16(data, crc=0xffff):
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xffff
+    return crc
+
+def parse_frames(data, partial=False):
+    '''バイト列からフレームを切り出す。フレーム以外のバイトは読み飛ばす。
+
+    (type, seq, payload) の列を返す。CRC が合わないフレームは捨てる。
+    partial が真なら、末尾の途中までのフレームはエラーにせず、その先頭の位置も返す。
+    '''
+    frames = []
+    errors = []
+    i = 0
+    while True:
+        i = data.find(MAGIC, i)
+        if i < 0:
+            i = max(len(data) - 1, 0)
+            break
+        if i + 6 > len(data):
+            break
+        ftype, seq, length = struct.unpack_from('<BBH', data, i + 2)
+        end = i + 6 + length + 2
+        if end > len(data):
+            if not partial:
+                errors.append(f'truncated frame at offset {i}')
+            break
+        crc, = struct.unpack_from('<H', data, end - 2)
+        if crc16(data[i + 2:end - 2]) != crc:
+            errors.append(f'CRC error at offset {i} (seq={seq})')
+            i += 1
+            continue
+        frames.append((ftype, seq, bytes(data[i + 6:end - 2])))
+        i = end
+    if partial:
+        return frames, errors, i
+    return frames, errors
+
+def unpack_samples(payload):
+    '''3 バイトに詰めた 12 ビット値 2 つずつを符号付き整数の列に戻す'''
+    samples = []
+    for i in range(0, len(payload) - 2, 3):
+        b0, b1, b2 = payload[i:i + 3]
+        for v in (b0 | (b1 & 0x0f) << 8, b1 >> 4 | b2 << 4):
+            samples.append(v - 0x1000 if v & 0x800 else v)
+    return samples
+
+@dataclass
+class Stream:
+    tick_hz: int = 0
+    samples_per_frame: int = 0
+    i2c_clkrate: int = 0
+    # (フレーム番号, 先頭サンプルの時刻（巻き戻りを補正したもの）, サンプル列) の列
+    chunks: list = field(default_factory=list)
+    lost_frames: int = 0
+    errors: list = field(default_factory=list)
+
+def parse_header(payload):
+    version, tick_hz, spf, clkrate = struct.unpack_from('<BIHI', payload)
+    if version != 1:
+        raise ValueError(f'Unsupported version: {version}')
+    return tick_hz, spf, clkrate
+
+def build_stream(frames, errors):
+    st = Stream(errors=errors)
+    last_tick = None
+    for ftype, seq, payload in frames:
+        if ftype == FRAME_HEADER:
+            # 新しいストリーミングの開始
+            st = Stream(errors=st.errors)
+            st.tick_hz, st.samples_per_frame, st.i2c_clkrate = parse_header(payload)
+            last_tick = None
+        elif ftype == FRAME_SAMPLES:
+            if st.tick_hz == 0:
+                st.errors.append('sample frame before header')
+                continue
+            index, tick = struct.unpack_from('<II', payload)
+            if last_tick is not None:
+                # SysTick は 32 ビットで巻き戻るので、前のフレームからの差で積み上げる
+                tick = last_tick + ((tick - last_tick) & 0xffffffff)
+            last_tick = tick
+            if st.chunks:
+                gap = index - st.chunks[-1][0] - 1
+                if gap < 0:
+                    st.errors.append(f'frame number went back to {index}')
+                elif gap > 0:
+                    st.lost_frames += gap
+                    st.errors.append(f'{gap} frame(s) lost before #{index}')
+            st.chunks.append((index, tick, unpack_samples(payload[8:])))
+    return st
+
+def sample_times(st):
+    '''(時刻 [秒], 値) の列を返す。時刻は最初のサンプルを 0 とする。'''
+    if not st.chunks:
+        return []
+    # 最後のフレームは次が無いので、全体の平均の間隔を使う
+    first_index, first_tick, _ = st.chunks[0]
+    last_index, last_tick, _ = st.chunks[-1]
+    if last_index > first_index:
+        mean_dt = (last_tick - first_tick) / ((last_index - first_index) * st.samples_per_frame)
+    else:
+        mean_dt = 0
+    out = []
+    for i, (index, tick, samples) in enumerate(st.chunks):
+        if i + 1 < len(st.chunks):
+            next_index, next_tick, _ = st.chunks[i + 1]
+            dt = (next_tick - tick) / ((next_index - index) * st.samples_per_frame)
+        else:
+            dt = mean_dt
+        for k, v in enumerate(samples):
+            out.append(((tick - first_tick + k * dt) / st.tick_hz, v))
+    return out
+
+def open_port(port):
+    fd = os.open(port, os.O_RDWR | os.O_NOCTTY)
+    attr = termios.tcgetattr(fd)
+    attr[0] = 0 # iflag
+    attr[1] = 0 # oflag
+    attr[2] = termios.CS8 | termios.CREAD | termios.CLOCAL # cflag
+    attr[3] = 0 # lflag
+    attr[4] = attr[5] = termios.B115200
+    attr[6][termios.VMIN] = 0
+    attr[6][termios.VTIME] = 1
+    termios.tcsetattr(fd, termios.TCSANOW, attr)
+    termios.tcflush(fd, termios.TCIOFLUSH)
+    return fd
+
+def stream_port(port, duration, timeout):
+    '''picoam に "s" を送って受信し続ける
+
+    duration 秒経つか Ctrl-C で改行を送って止め、データが途切れるまで受信する。
+    受信しながらフレームを検査し、欠落を表示する。
+    '''
+    fd = open_port(port)
+    data = bytearray()
+    pending = bytearray() # まだフレームとして切り出していないバイト列
+    next_index = None
+    samples = 0
+
+    def receive():
+        nonlocal pending, next_index, samples
+        chunk = os.read(fd, 4096)
+        if not chunk:
+            return False
+        data.extend(chunk)
+        pending += chunk
+        frames, errors, pos = parse_frames(pending, partial=True)
+        del pending[:pos]
+        for e in errors:
+            print(f'\nError: {e}', file=sys.stderr)
+        for ftype, seq, payload in frames:
+            if ftype == FRAME_HEADER:
+                next_index = 0
+            if ftype != FRAME_SAMPLES:
+                continue
+            index, = struct.unpack_from('<I', payload)
+            if next_index is not None and index != next_index:
+                print(f'\nError: {index - next_index} frame(s) lost before #{index}',
+                      file=sys.stderr)
+            next_index = index + 1
+            samples += (len(payload) - 8) // 3 * 2
+            print(f'\r{next_index} frames, {samples} samples', end='', file=sys.stderr)
+        return True
+
+    try:
+        os.write(fd, b's\n')
+        start = time.monotonic()
+        try:
+            while duration is None or time.monotonic() - start < duration:
+                receive()
+        except KeyboardInterrupt:
+            pass
+        os.write(fd, b'\n')
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            if receive():
+                deadline = time.monotonic() + timeout
+        print(file=sys.stderr)
+        return bytes(data)
+    finally:
+        os.close(fd)
+
+def write_csv(path, samples):
+    with open(path, 'w') as f:
+        f.write('time,value\n')
+        for t, v in samples:
+            f.write(f'{t:.7f},{"" if v == INVALID_SAMPLE else v}\n')
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode binary ADC stream of picoam')
+    parser.add_argument('input', nargs='?', help='captured byte stream (default: stdin)')
+    parser.add_argument('--port', help='stream from picoam connected to this tty')
+    parser.add_argument('--duration', type=float,
+                        help='stop streaming after this many seconds (with --port)')
+    parser.add_argument('--timeout', type=float, default=1.0,
+                        help='seconds without data before giving up after stopping (with --port)')
+    parser.add_argument('--save', help='save the raw byte stream to this file')
+    parser.add_argument('--csv', help='write samples as CSV (time in seconds, value)')
+    args = parser.parse_args()
+
+    if args.port:
+        data = stream_port(args.port, args.duration, args.timeout)
+    elif args.input:
+        with open(args.input, 'rb') as f:
+            data = f.read()
+    else:
+        data = sys.stdin.buffer.read()
+    if args.save:
+        with open(args.save, 'wb') as f:
+            f.write(data)
+
+    frames, errors = parse_frames(data, partial=bool(args.port))[:2]
+    st = build_stream(frames, errors)
+    if st.tick_hz == 0:
+        print('No header frame found', file=sys.stderr)
+        return 1
+
+    samples = sample_times(st)
+    invalid = sum(1 for _, v in samples if v == INVALID_SAMPLE)
+    print(f'{len(st.chunks)} frames, {len(samples)} samples ({invalid} invalid), '
+          f'{st.lost_frames} frame(s) lost')
+    first_index, first_tick, _ = st.chunks[0] if st.chunks else (0, 0, None)
+    last_index, last_tick, _ = st.chunks[-1] if st.chunks else (0, 0, None)
+    if last_tick > first_tick:
+        rate = (last_index - first_index) * st.samples_per_frame * st.tick_hz / (last_tick - first_tick)
+        print(f'{rate:.1f} samples/s, I2C {st.i2c_clkrate} Hz, {st.tick_hz} ticks/s')
+
+    if args.csv:
+        write_csv(args.csv, samples)
+
+    for e in st.errors:
+        print(f'Error: {e}', file=sys.stderr)
+    return 1 if st.errors else 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -3,5 +3,16 @@
 
 #define CH32V003           1
 
-#endif
+// I2C 通信速度（I2C モジュールのクロック周波数より低くなければならない）
+#define I2C_CLKRATE 100000
+
+// I2C モジュールのクロック周波数（2～36MHz で、通信速度より高くなければならない）
+#define I2C_PRERATE 2000000
+
+// 高速クロックの際に 36% デューティにする場合にコメントを外す（デフォルトは 33%）
+//#define I2C_DUTY_16_9
 
+// I2C 転送が進まないとみなしてバスを回復するまでの時間（ミリ秒）
+#define I2C_TIMEOUT_MS 10
+
+#endif
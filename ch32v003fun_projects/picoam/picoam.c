@@ -1,21 +1,28 @@
 #include "ch32fun.h"
+#include "i2c_master.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 // ADC デバイスのアドレス
 #define I2C_ADDR 0x18
 
-// I2C 通信速度（I2C モジュールのクロック周波数より低くなければならない）
-#define I2C_CLKRATE 100000
+// CmdAdcMulti のサンプリング周期（ミリ秒）
+#define ADC_MULTI_PERIOD_MS 2
 
-// I2C モジュールのクロック周波数（2～36MHz で、通信速度より高くなければならない）
-#define I2C_PRERATE 2000000
+// CmdAdcFilter のサンプリング周期（マイクロ秒）と、間引き率の上限
+#define ADC_FILTER_PERIOD_US 1000
+#define ADC_FILTER_N_MAX 4096
 
-// 高速クロックの際に 36% デューティにする場合にコメントを外す（デフォルトは 33%）
-//#define I2C_DUTY_16_9
+// CmdAdcCapture のサンプリング周期（マイクロ秒）の既定値と範囲、記録リングの長さ（2 の冪）
+#define CAPTURE_PERIOD_US 2000
+#define CAPTURE_PERIOD_MIN_US 500
+#define CAPTURE_PERIOD_MAX_US 65536
+#define CAPTURE_RING_LEN 32
 
-// I2C タイムアウト回数
-#define TIMEOUT_MAX 1000000
+// CmdAdcStream の 1 フレームあたりのサンプル数（偶数）と、送信待ちにできるフレーム数
+#define STREAM_SAMPLES 64
+#define STREAM_FRAMES 3
 
 // UART 通信速度
 #define UART_BAUD_RATE 115200
@@ -23,167 +30,53 @@
 // UART の 1 ビットあたりのクロック数
 #define UART_BIT_TICKS (FUNCONF_SYSTEM_CORE_CLOCK / UART_BAUD_RATE)
 
-void I2cSetup(void) {
-  uint16_t tempreg;
-
-  // GPIOC と I2C を有効化
-  RCC->APB2PCENR |= RCC_APB2Periph_GPIOC;
-  RCC->APB1PCENR |= RCC_APB1Periph_I2C1;
-
-  // SDA=PC1, 10MHz Output, alt func, open-drain
-  GPIOC->CFGLR &= ~(0xf<<(4*1));
-  GPIOC->CFGLR |= (GPIO_Speed_10MHz | GPIO_CNF_OUT_OD_AF)<<(4*1);
-
-  // SCL=PC2, 10MHz Output, alt func, open-drain
-  GPIOC->CFGLR &= ~(0xf<<(4*2));
-  GPIOC->CFGLR |= (GPIO_Speed_10MHz | GPIO_CNF_OUT_OD_AF)<<(4*2);
-
-  // I2C1 をリセット
-  RCC->APB1PRSTR |= RCC_APB1Periph_I2C1;
-  RCC->APB1PRSTR &= ~RCC_APB1Periph_I2C1;
-
-  // I2C モジュールのクロックを設定
-  I2C1->CTLR2 = (FUNCONF_SYSTEM_CORE_CLOCK/I2C_PRERATE) & I2C_CTLR2_FREQ;
-
-  // I2C 通信速度を設定
-#if (I2C_CLKRATE <= 100000)
-  // 標準モード（<=100kHz）
-  tempreg = (FUNCONF_SYSTEM_CORE_CLOCK/(2*I2C_CLKRATE)) & I2C_CKCFGR_CCR;
-#else
-  // 高速モード（>100kHz）
-#  ifdef I2C_DUTY_16_9
-  tempreg = (FUNCONF_SYSTEM_CORE_CLOCK/(25*I2C_CLKRATE)) & I2C_CKCFGR_CCR;
-  tempreg |= I2C_CKCFGR_DUTY;
-#  else
-  // 33.3% duty cycle
-  tempreg = (FUNCONF_SYSTEM_CORE_CLOCK/(3*I2C_CLKRATE)) & I2C_CKCFGR_CCR;
-#  endif
-  tempreg |= I2C_CKCFGR_FS;
-#endif
-  I2C1->CKCFGR = tempreg;
-
-  // I2C1 モジュールを有効化
-  I2C1->CTLR1 |= I2C_CTLR1_PE;
-
-  // ACK 応答を有効化（PE=1 にした後に設定しなければならない）
-  I2C1->CTLR1 |= I2C_CTLR1_ACK;
-}
-
-// I2C エラー定義
-enum I2cErrors {
-  I2CERR_NOT_BUSY,
-  I2CERR_MASTER_MODE,
-  I2CERR_TRANSMIT_MODE,
-  I2CERR_TX_EMPTY,
-  I2CERR_BYTE_TRANSMITTED,
-  I2CERR_BYTE_RECEIVED,
-  I2CERR_RECEIVE_MODE,
-};
-char *i2c_error_strings[] = {
-  "not busy",
-  "master mode",
-  "transmit mode",
-  "tx empty",
-  "byte transmitted",
-  "byte received",
-  "receive mode",
-};
-
-// I2C エラー表示
-int I2cError(enum I2cErrors err) {
-  printf("I2cError: timeout waiting for %s\n\r", i2c_error_strings[err]);
-  I2cSetup(); // I2C をリセット
+// UART 送信に USART1 の TX 端子（PD5）を使う場合にコメントを外す。
+// デフォルトは TIM1 の割り込みで PC4 をソフト制御する（送るものが無い間はタイマを止める）。
+// USART1 の他の端子割り当て（AFIO の再配置）は RX 端子（PD6）も動くので使えない。
+//#define UART_TX_HW
+
+// UART 送信待ちのキュー（UART_TX_QUEUE_LEN は 2 の冪）
+// メインループが uart_tx_head に積み、割り込みハンドラが uart_tx_tail から取り出す
+#define UART_TX_QUEUE_LEN 64
+static uint8_t uart_tx_queue[UART_TX_QUEUE_LEN];
+static volatile uint8_t uart_tx_head;
+static volatile uint8_t uart_tx_tail;
+
+// キューから 1 バイト取り出す（割り込みハンドラから呼ぶ）
+// @return  取り出せたら 1、空なら 0
+static int UartTxPop(uint8_t *c) {
+  const uint8_t tail = uart_tx_tail;
+  if (tail == uart_tx_head) {
+    return 0;
+  }
+  *c = uart_tx_queue[tail];
+  uart_tx_tail = (tail + 1) & (UART_TX_QUEUE_LEN - 1);
   return 1;
 }
 
-uint32_t I2cReadStatus() {
-  // STAR1 を STAR2 より先に読み出す必要がある
-  uint32_t status = I2C1->STAR1;
-  status |= I2C1->STAR2 << 16;
-  return status;
-}
-
-// 最後に発生したイベントが引数で指定されたものであれば真を返す。
-int I2cCheckEvent(uint32_t event) {
-  return (I2cReadStatus() & event) == event;
-}
-
-// ビジー状態が終わるのを待つ。
-int I2cWaitBusy() {
-  int timeout = TIMEOUT_MAX;
-  while ((I2C1->STAR2 & I2C_STAR2_BUSY) && timeout--);
-  return timeout;
-}
-
-// イベント成立を待つ。成立時のタイムアウト値を返す。
-int I2cWaitEvent(uint32_t event) {
-  int timeout = TIMEOUT_MAX;
-  while((!I2cCheckEvent(event)) && timeout--);
-  return timeout;
-}
+#ifdef UART_TX_HW
 
-// I2C バスへパケットを送る（割り込みを使わずブロッキングモード）
-int I2cSend(uint8_t addr, uint8_t *data, uint8_t sz) {
-  if (I2cWaitBusy() == -1) {
-    return I2cError(I2CERR_NOT_BUSY);
+void USART1_IRQHandler(void) __attribute__((interrupt));
+void USART1_IRQHandler(void) {
+  uint8_t c;
+  if ((USART1->STATR & USART_STATR_TXE) == 0) {
+    return;
   }
-
-  // スタートビットを送る
-  I2C1->CTLR1 |= I2C_CTLR1_START;
-  if (I2cWaitEvent(I2C_EVENT_MASTER_MODE_SELECT) == -1) {
-    return I2cError(I2CERR_MASTER_MODE);
+  if (UartTxPop(&c)) {
+    USART1->DATAR = c;
+  } else {
+    // 送るものが無くなったら、次に積まれるまで TXE 割り込みを止める
+    USART1->CTLR1 &= ~USART_CTLR1_TXEIE;
   }
-
-  // 7 ビットアドレスと write フラグを送る
-  I2C1->DATAR = addr<<1;
-  if (I2cWaitEvent(I2C_EVENT_MASTER_TRANSMITTER_MODE_SELECTED) == -1) {
-    return I2cError(I2CERR_TRANSMIT_MODE);
-  }
-
-  // 1 バイトずつ送信
-  while (sz--) {
-    I2C1->DATAR = *data++;
-    if (I2cWaitEvent(I2C_EVENT_MASTER_BYTE_TRANSMITTED) == -1) {
-      return I2cError(I2CERR_BYTE_TRANSMITTED);
-    }
-  }
-
-  // ストップビットを送る
-  I2C1->CTLR1 |= I2C_CTLR1_STOP;
-  return 0;
 }
 
-// I2C バスからパケットを受け取る（割り込みを使わずブロッキングモード）
-uint8_t I2cRecv(uint8_t addr, uint8_t *data, uint8_t sz) {
-  if (I2cWaitBusy() == -1) {
-    return I2cError(I2CERR_NOT_BUSY);
-  }
-
-  // スタートビットを送る
-  I2C1->CTLR1 |= I2C_CTLR1_START;
-  if (I2cWaitEvent(I2C_EVENT_MASTER_MODE_SELECT) == -1) {
-    return I2cError(I2CERR_MASTER_MODE);
-  }
-
-  // 7 ビットアドレスと read フラグを送る
-  I2C1->DATAR = addr<<1 | 1;
-  if (I2cWaitEvent(I2C_EVENT_MASTER_RECEIVER_MODE_SELECTED) == -1) {
-    return I2cError(I2CERR_RECEIVE_MODE);
-  }
-
-  // 1 バイトずつ受信
-  while (sz--) {
-    if (I2cWaitEvent(I2C_EVENT_MASTER_BYTE_RECEIVED) == -1) {
-      return I2cError(I2CERR_BYTE_RECEIVED);
-    }
-    *data++ = I2C1->DATAR;
-  }
-
-  // ストップビットを送る
-  I2C1->CTLR1 |= I2C_CTLR1_STOP;
-  return 0;
+// 送信割り込みを起こす（キューに積んだ後に呼ぶ）
+static void UartTxKick(void) {
+  USART1->CTLR1 |= USART_CTLR1_TXEIE;
 }
 
+#else
+
 #define UART_WRITE_TX(x) do { GPIOC->BSHR = 0x0010 << ((x) ? 0 : 16); } while (0)
 #define UART_PHASE_START 10
 
@@ -196,14 +89,18 @@ void TIM1_UP_IRQHandler(void) {
   // 割り込みフラグをクリア
   TIM1->INTFR = ~TIM_EventSource_Update;
 
-  if (tim1_phase == UART_PHASE_START) { // スタートビット
-    UART_WRITE_TX(0);
-    tim1_phase--;
-  } else if (tim1_phase == 1) { // ストップビット
+  if (tim1_phase == 1) { // ストップビット
     UART_WRITE_TX(1);
     tim1_phase--;
-  } else if (tim1_phase == 0) { // 待機状態では 1 を出す
-    UART_WRITE_TX(1);
+  } else if (tim1_phase == 0) { // ストップビットを出し終えた
+    uint8_t c;
+    if (UartTxPop(&c)) { // 次のバイトのスタートビット
+      UART_WRITE_TX(0);
+      tim1_buf = c;
+      tim1_phase = UART_PHASE_START - 1;
+    } else { // 送るものが無ければ、次に積まれるまでタイマを止める（出力は 1 のまま）
+      TIM1->CTLR1 &= ~TIM_CEN;
+    }
   } else { // データビット
     UART_WRITE_TX(tim1_buf & 1);
     tim1_buf >>= 1;
@@ -230,22 +127,40 @@ void UartSetupTim() {
   TIM1->DMAINTENR = TIM_EventSource_Update;
   NVIC_EnableIRQ(TIM1_UP_IRQn);
 
-  // タイマを始動
+  // タイマは送るものが積まれたときに始動する
+}
+
+// 止まっていればタイマを始動する（キューに積んだ後に呼ぶ）
+// 始動から 1 ビット時間後の割り込みでスタートビットを出す
+static void UartTxKick(void) {
   TIM1->CTLR1 |= TIM_CEN;
 }
 
+#endif
+
 void UartSetup() {
   // UART と、UART が必要とする IO ポートを有効化
   RCC->APB2PCENR |= RCC_APB2Periph_GPIOC | RCC_APB2Periph_GPIOD | RCC_APB2Periph_USART1;
 
+#ifdef UART_TX_HW
+  // PD5(UTX): Push-Pull, 10MHz Output, alt func
+  GPIOD->CFGLR &= ~(0xf<<(4*5));
+  GPIOD->CFGLR |= (GPIO_Speed_10MHz | GPIO_CNF_OUT_PP_AF)<<(4*5);
+#else
   // 送信端子として PD5(UTX) の代わりに PC4 を使う
   // Push-Pull, 10MHz Output, PC4
   GPIOC->CFGLR &= ~(0xf<<(4*4));
   GPIOC->CFGLR |= (GPIO_Speed_10MHz | GPIO_CNF_OUT_PP)<<(4*4);
+  GPIOC->BSHR = 0x0010; // 待機状態では 1 を出す
+#endif
 
   // データ 8 ビット、ストップ 1 ビット、パリティ無し。
+#ifdef UART_TX_HW
+  USART1->CTLR1 = USART_WordLength_8b | USART_Parity_No | USART_Mode_Rx | USART_Mode_Tx;
+#else
   // RX モードのみ有効化（TX は使わず、ソフトで実装）。
   USART1->CTLR1 = USART_WordLength_8b | USART_Parity_No | USART_Mode_Rx;
+#endif
   USART1->CTLR2 = USART_StopBits_1;
   USART1->CTLR3 = USART_HardwareFlowControl_None;
 
@@ -254,14 +169,26 @@ void UartSetup() {
   // UART 機能を開始
   USART1->CTLR1 |= CTLR1_UE_Set;
 
+#ifdef UART_TX_HW
+  NVIC_EnableIRQ(USART1_IRQn);
+#else
   UartSetupTim();
+#endif
 }
 
-// UART へ 1 バイト送信
+// 送信キューの空き（バイト数）
+int UartTxSpace() {
+  return (uart_tx_tail - uart_tx_head - 1) & (UART_TX_QUEUE_LEN - 1);
+}
+
+// UART へ 1 バイト送信（キューが満杯なら空くまで待つ）
 void UartPutChar(char c) {
-  while (tim1_phase != 0);
-  tim1_buf = c;
-  tim1_phase = UART_PHASE_START;
+  const uint8_t head = uart_tx_head;
+  const uint8_t next = (head + 1) & (UART_TX_QUEUE_LEN - 1);
+  while (next == uart_tx_tail);
+  uart_tx_queue[head] = c;
+  uart_tx_head = next;
+  UartTxKick();
 }
 
 // UART へバイト列を送信
@@ -272,20 +199,575 @@ int UartWrite(const char *buf, size_t size) {
   return size;
 }
 
-// I2C バスを介して ADC から 12 ビット値を受信
-int16_t AdcRead() {
+// ADC の読み出し要求
+struct AdcReq {
+  struct I2cReq i2c;
   uint8_t data[2];
-  I2cRecv(I2C_ADDR, data, 2);
-  uint16_t adc_raw = (data[0] << 4) | ((data[1] >> 4) & 0xf);
+  uint32_t tick; // AdcStampDone を使うと、完了時の SysTick->CNT が入る
+};
+
+// 完了時刻を記録する完了通知（AdcStartRead の done に渡す）
+void AdcStampDone(struct I2cReq *req) {
+  ((struct AdcReq *)req)->tick = SysTick->CNT;
+}
+
+// I2C バスを介した ADC の読み出しを開始（done は完了時に割り込みハンドラから呼ばれる）
+int AdcStartRead(struct AdcReq *r, I2cDoneFunc done) {
+  r->i2c.addr = I2C_ADDR;
+  r->i2c.wlen = 0;
+  r->i2c.rlen = 2;
+  r->i2c.rdata = r->data;
+  r->i2c.done = done;
+  return I2cSubmit(&r->i2c);
+}
+
+// 読み出しの完了を待つ（エラーなら表示する）
+// @return  正常に完了したら 0、エラーなら 1
+int AdcWait(struct AdcReq *r) {
+  if (I2cWait(&r->i2c)) {
+    printf("I2cError: %s\n\r", I2cErrorString(r->i2c.err));
+    return 1;
+  }
+  return 0;
+}
+
+// 読み出した 2 バイトを符号付き 12 ビット値に変換
+int16_t AdcValue(const struct AdcReq *r) {
+  uint16_t adc_raw = (r->data[0] << 4) | ((r->data[1] >> 4) & 0xf);
   return adc_raw & 0x800 ? adc_raw | 0xf000 : adc_raw;
 }
 
+// I2C バスを介して ADC から 12 ビット値を受信
+int16_t AdcRead() {
+  struct AdcReq r;
+  AdcStartRead(&r, NULL);
+  AdcWait(&r);
+  return AdcValue(&r);
+}
+
+/*
+ * 測定値の処理段
+ *
+ * サンプルを 1 つずつ FilterPush に入れ、n サンプルごとに 1 つの結果を出す。
+ * 計算はすべて固定小数点で、平均などは 1/100 LSB 単位で求める。
+ *   FILTER_RAW:  間引かず、そのまま出す（n は 1）
+ *   FILTER_BOX:  n サンプルの単純平均（1 <= n <= ADC_FILTER_N_MAX）
+ *   FILTER_CIC:  CIC_ORDER 次の CIC デシメーション（n は 2 の冪で 2^CIC_SHIFT_MAX 以下）。
+ *                積分器は 32 ビットで回り込んでよく、利得 n^CIC_ORDER はシフトで正規化する。
+ *                最初の CIC_ORDER 個の出力は過渡応答を含む。
+ *   FILTER_STAT: n サンプルの最小、最大、平均、RMS（1 <= n <= ADC_FILTER_N_MAX）
+ */
+#define CIC_ORDER 2
+#define CIC_SHIFT_MAX 10 // 12 ビット入力 + CIC_ORDER * CIC_SHIFT_MAX が 32 ビットに収まること
+
+enum FilterMode {
+  FILTER_RAW,
+  FILTER_BOX,
+  FILTER_CIC,
+  FILTER_STAT,
+};
+const char *filter_mode_names[] = {
+  "raw",
+  "box",
+  "cic",
+  "stat",
+};
+
+struct Filter {
+  enum FilterMode mode;
+  uint16_t n;        // 間引き率
+  uint8_t cic_shift; // log2(n)
+  uint16_t count;    // 今の区間に入れたサンプル数
+  int32_t sum;
+  uint64_t sum_sq;
+  int16_t min, max;
+  uint32_t integ[CIC_ORDER]; // CIC の積分器
+  uint32_t comb[CIC_ORDER];  // CIC の微分器の 1 つ前の入力
+  // 区間が終わったときの結果
+  int32_t out;       // FILTER_RAW はそのままの値、それ以外は 1/100 LSB 単位の平均
+  int16_t out_min, out_max;
+  int32_t out_rms;   // 1/100 LSB 単位
+};
+
+// 処理段を初期化する
+// @return  正常なら 0、n が mode に合わなければ 1
+int FilterSetup(struct Filter *f, enum FilterMode mode, uint32_t n) {
+  memset(f, 0, sizeof(*f));
+  f->mode = mode;
+  if (mode == FILTER_RAW) {
+    f->n = 1;
+    return 0;
+  }
+  if (n < 1 || n > ADC_FILTER_N_MAX) {
+    return 1;
+  }
+  f->n = n;
+  if (mode == FILTER_CIC) {
+    while ((1u << f->cic_shift) < n) {
+      f->cic_shift++;
+    }
+    if ((1u << f->cic_shift) != n || f->cic_shift > CIC_SHIFT_MAX) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// 整数の平方根（切り捨て）
+static uint32_t Isqrt64(uint64_t x) {
+  uint64_t r = 0;
+  uint64_t bit = (uint64_t)1 << 62;
+  while (bit > x) {
+    bit >>= 2;
+  }
+  while (bit != 0) {
+    if (x >= r + bit) {
+      x -= r + bit;
+      r = (r >> 1) + bit;
+    } else {
+      r >>= 1;
+    }
+    bit >>= 2;
+  }
+  return r;
+}
+
+// サンプルを 1 つ入れる
+// @return  区間が終わって f->out などに結果が入ったら 1
+int FilterPush(struct Filter *f, int16_t x) {
+  if (f->mode == FILTER_CIC) {
+    uint32_t v = x;
+    for (int i = 0; i < CIC_ORDER; i++) {
+      f->integ[i] += v;
+      v = f->integ[i];
+    }
+    if (++f->count < f->n) {
+      return 0;
+    }
+    for (int i = 0; i < CIC_ORDER; i++) {
+      const uint32_t prev = f->comb[i];
+      f->comb[i] = v;
+      v -= prev;
+    }
+    f->out = ((int64_t)(int32_t)v * 100) >> (CIC_ORDER * f->cic_shift);
+    f->count = 0;
+    return 1;
+  }
+
+  if (f->count == 0) {
+    f->sum = 0;
+    f->sum_sq = 0;
+    f->min = x;
+    f->max = x;
+  }
+  f->sum += x;
+  f->sum_sq += (int32_t)x * x;
+  if (x < f->min) {
+    f->min = x;
+  }
+  if (x > f->max) {
+    f->max = x;
+  }
+  if (++f->count < f->n) {
+    return 0;
+  }
+  if (f->mode == FILTER_RAW) {
+    f->out = x;
+  } else {
+    f->out = f->sum * 100 / f->n;
+    f->out_min = f->min;
+    f->out_max = f->max;
+    if (f->mode == FILTER_STAT) {
+      f->out_rms = Isqrt64(f->sum_sq * 10000 / f->n);
+    }
+  }
+  f->count = 0;
+  return 1;
+}
+
+// 1/100 単位の値を小数点付きで書く
+static int FormatCenti(char *s, size_t size, int32_t v) {
+  const uint32_t u = v < 0 ? -(uint32_t)v : v;
+  return snprintf(s, size, "%s%lu.%02lu", v < 0 ? "-" : "",
+                  (unsigned long)(u / 100), (unsigned long)(u % 100));
+}
+
+// 区間の結果を 1 行のテキストにする（stat は min max mean rms をタブ区切りで並べる）
+int FilterFormat(const struct Filter *f, char *s, size_t size) {
+  if (f->mode == FILTER_RAW) {
+    return snprintf(s, size, "%ld", (long)f->out);
+  }
+  if (f->mode != FILTER_STAT) {
+    return FormatCenti(s, size, f->out);
+  }
+  int len = snprintf(s, size, "%d\t%d\t", f->out_min, f->out_max);
+  len += FormatCenti(s + len, size - len, f->out);
+  s[len++] = '\t';
+  len += FormatCenti(s + len, size - len, f->out_rms);
+  return len;
+}
+
 void CmdAdcMulti(int n) {
   char s[64];
+  // 2 つの要求を交互に使い、i 番目を UART へ送っている間に i+1 番目を読み出す
+  struct AdcReq reqs[2];
+  uint32_t next = SysTick->CNT + Ticks_from_Ms(ADC_MULTI_PERIOD_MS);
+  while ((int32_t)(SysTick->CNT - next) < 0);
+  AdcStartRead(&reqs[0], NULL);
   for (int i = 0; i < n; i++) {
-    Delay_Ms(2);
-    int len = snprintf(s, sizeof(s), "%d\t%d\n", i, AdcRead());	
+    struct AdcReq *cur = &reqs[i & 1];
+    AdcWait(cur);
+    if (i + 1 < n) {
+      // 読み出しの開始時刻を一定の周期にそろえる
+      next += Ticks_from_Ms(ADC_MULTI_PERIOD_MS);
+      while ((int32_t)(SysTick->CNT - next) < 0);
+      AdcStartRead(&reqs[(i + 1) & 1], NULL);
+    }
+    int len = snprintf(s, sizeof(s), "%d\t%d\n", i, AdcValue(cur));
+    UartWrite(s, len);
+  }
+}
+
+/*
+ * UART から何か受信するまで、ADC_FILTER_PERIOD_US 周期で読んだ値を処理段に通し、結果を送る
+ *
+ * 結果は "番号<TAB>値" の行で、n サンプルに 1 行になる。
+ * 読み出しに失敗したサンプルは処理段に入れない。
+ */
+void CmdAdcFilter(enum FilterMode mode, uint32_t n) {
+  char s[64];
+  struct Filter f;
+  if (FilterSetup(&f, mode, n)) {
+    int len = snprintf(s, sizeof(s), "invalid n for %s: %lu\n", filter_mode_names[mode], (unsigned long)n);
+    UartWrite(s, len);
+    return;
+  }
+
+  struct AdcReq reqs[2];
+  uint8_t cur = 0;
+  uint32_t out_index = 0;
+  uint32_t next = SysTick->CNT + Ticks_from_Us(ADC_FILTER_PERIOD_US);
+  while ((int32_t)(SysTick->CNT - next) < 0);
+  AdcStartRead(&reqs[0], NULL);
+  while ((USART1->STATR & USART_STATR_RXNE) == 0) {
+    // 次の読み出しを周期にそろえて始めてから、今の読み出しを処理する
+    struct AdcReq *r = &reqs[cur];
+    const int err = AdcWait(r);
+    next += Ticks_from_Us(ADC_FILTER_PERIOD_US);
+    while ((int32_t)(SysTick->CNT - next) < 0);
+    AdcStartRead(&reqs[cur ^ 1], NULL);
+    cur ^= 1;
+    if (err == 0 && FilterPush(&f, AdcValue(r))) {
+      int len = snprintf(s, sizeof(s), "%lu\t", (unsigned long)out_index++);
+      len += FilterFormat(&f, s + len, sizeof(s) - len - 1);
+      s[len++] = '\n';
+      UartWrite(s, len);
+    }
+  }
+  (void)USART1->DATAR;
+  AdcWait(&reqs[cur]);
+}
+
+// "f <mode> [n]" の引数を解釈して CmdAdcFilter を呼ぶ
+void CmdAdcFilterArgs(char *args) {
+  char s[64];
+  char *mode_name = strtok(args, " ");
+  char *n_str = strtok(NULL, " ");
+  for (int mode = 0; mode_name && mode < sizeof(filter_mode_names) / sizeof(filter_mode_names[0]); mode++) {
+    if (strcmp(mode_name, filter_mode_names[mode]) == 0) {
+      CmdAdcFilter(mode, n_str ? strtoul(n_str, NULL, 0) : 1);
+      return;
+    }
+  }
+  int len = snprintf(s, sizeof(s), "usage: f raw|box|cic|stat [n]\n");
+  UartWrite(s, len);
+}
+
+// CmdAdcCapture が記録するサンプル
+struct CaptureSample {
+  uint32_t tick; // 読み出しを始めた SysTick->CNT
+  int16_t value;
+};
+
+// TIM2 割り込みと I2C 割り込みが capture_head に積み、メインループが capture_tail から取り出す
+static struct CaptureSample capture_ring[CAPTURE_RING_LEN];
+static volatile uint8_t capture_head;
+static volatile uint8_t capture_tail;
+static struct AdcReq capture_req;
+static volatile uint32_t capture_tick;     // 読み出し中のサンプルの開始時刻
+static volatile uint32_t capture_overruns; // 前の読み出しが終わっておらず見送った周期の数
+static volatile uint32_t capture_dropped;  // リングが一杯で捨てたサンプル数
+static volatile uint32_t capture_errors;   // 読み出しに失敗したサンプル数
+
+// 読み出しが終わったらリングに積む（I2C 割り込みハンドラから呼ばれる）
+static void CaptureReadDone(struct I2cReq *req) {
+  if (req->status != I2CREQ_DONE) {
+    capture_errors++;
+    return;
+  }
+  const uint8_t head = capture_head;
+  const uint8_t next = (head + 1) & (CAPTURE_RING_LEN - 1);
+  if (next == capture_tail) {
+    capture_dropped++;
+    return;
+  }
+  capture_ring[head].tick = capture_tick;
+  capture_ring[head].value = AdcValue(&capture_req);
+  capture_head = next;
+}
+
+// 周期ごとに読み出しを始める
+void TIM2_IRQHandler(void) __attribute__((interrupt));
+void TIM2_IRQHandler(void) {
+  TIM2->INTFR = ~TIM_UIF;
+  const enum I2cReqStatus status = capture_req.i2c.status;
+  if (status == I2CREQ_QUEUED || status == I2CREQ_BUSY) {
+    capture_overruns++;
+    return;
+  }
+  capture_tick = SysTick->CNT;
+  AdcStartRead(&capture_req, CaptureReadDone);
+}
+
+// TIM2 を 1MHz で数え、period_us ごとに割り込むよう設定して始動する
+static void CaptureStartTim(uint32_t period_us) {
+  RCC->APB1PCENR |= RCC_APB1Periph_TIM2;
+  RCC->APB1PRSTR |= RCC_APB1Periph_TIM2;
+  RCC->APB1PRSTR &= ~RCC_APB1Periph_TIM2;
+
+  TIM2->PSC = FUNCONF_SYSTEM_CORE_CLOCK / 1000000 - 1;
+  TIM2->ATRLR = period_us - 1;
+  TIM2->SWEVGR = TIM_EventSource_Update; // プリスケーラを反映させる
+  TIM2->INTFR = ~TIM_UIF;
+  TIM2->DMAINTENR = TIM_EventSource_Update;
+  NVIC_EnableIRQ(TIM2_IRQn);
+  TIM2->CTLR1 |= TIM_CEN;
+}
+
+static void CaptureStopTim(void) {
+  TIM2->CTLR1 &= ~TIM_CEN;
+  NVIC_DisableIRQ(TIM2_IRQn);
+}
+
+/*
+ * UART から何か受信するまで、TIM2 で period_us ごとに ADC を読み、時刻付きで送る
+ *
+ * 読み出しは TIM2 割り込みで始めるので、メインループの処理時間に周期が左右されない。
+ * 結果は RAM のリングに溜め、メインループが "最初のサンプルからの SysTick 数<TAB>値" の行にして送る。
+ * 最後に "# サンプル数 見送った周期 捨てた数 エラー数" の行を送る。
+ * 1 行は最大 17 バイトなので、UART の帯域から周期は 2ms 程度までにすること。
+ */
+void CmdAdcCapture(uint32_t period_us) {
+  char s[64];
+  if (period_us < CAPTURE_PERIOD_MIN_US || period_us > CAPTURE_PERIOD_MAX_US) {
+    int len = snprintf(s, sizeof(s), "period must be %d..%d us\n",
+                       CAPTURE_PERIOD_MIN_US, CAPTURE_PERIOD_MAX_US);
     UartWrite(s, len);
+    return;
+  }
+
+  capture_head = capture_tail = 0;
+  capture_overruns = capture_dropped = capture_errors = 0;
+  capture_req.i2c.status = I2CREQ_DONE;
+  CaptureStartTim(period_us);
+
+  uint32_t samples = 0, first_tick = 0;
+  int stopping = 0;
+  while (1) {
+    if (!stopping && (USART1->STATR & USART_STATR_RXNE) != 0) {
+      (void)USART1->DATAR;
+      CaptureStopTim();
+      stopping = 1;
+    }
+
+    // 応答が無ければバスを回復する（TIM2 割り込みが積むのと競合しないよう止めておく）
+    NVIC_DisableIRQ(TIM2_IRQn);
+    I2cPoll();
+    if (!stopping) {
+      NVIC_EnableIRQ(TIM2_IRQn);
+    }
+
+    const enum I2cReqStatus status = capture_req.i2c.status;
+
+    const uint8_t tail = capture_tail;
+    if (tail == capture_head) {
+      if (stopping && status != I2CREQ_QUEUED && status != I2CREQ_BUSY) {
+        break;
+      }
+      continue;
+    }
+    const struct CaptureSample sample = capture_ring[tail];
+    capture_tail = (tail + 1) & (CAPTURE_RING_LEN - 1);
+    if (samples++ == 0) {
+      first_tick = sample.tick;
+    }
+    int len = snprintf(s, sizeof(s), "%lu\t%d\n",
+                       (unsigned long)(sample.tick - first_tick), sample.value);
+    UartWrite(s, len);
+  }
+
+  int len = snprintf(s, sizeof(s), "# %lu %lu %lu %lu\n", (unsigned long)samples,
+                     (unsigned long)capture_overruns, (unsigned long)capture_dropped,
+                     (unsigned long)capture_errors);
+  UartWrite(s, len);
+}
+
+/*
+ * ストリーミングのフレーム形式（msmpdbg の dump rec bin と同じ外枠）
+ *   magic (0xA5 0x5A), type (1B), seq (1B), payload 長 (2B), payload, CRC16 (2B)
+ * CRC16 は CCITT（多項式 0x1021、初期値 0xFFFF）で、type から payload の末尾までを対象とする。
+ * 数値はすべてリトルエンディアン。
+ *
+ * HEADER: version (1B), SysTick の周波数 (4B), 1 フレームのサンプル数 (2B), I2C 通信速度 (4B)
+ * SAMPLES: フレーム番号 (4B), 先頭サンプルの時刻 (4B), サンプル列
+ *   サンプル列は 12 ビット値 2 つを 3 バイトに詰めたもの（a[7:0], a[11:8] | b[3:0] << 4, b[11:4]）。
+ *   読み出しに失敗したサンプルは -2048 (0x800) になる。
+ *   送信が追いつかずに捨てたフレームも番号を消費するので、受信側は番号の飛びで欠落を検出できる。
+ *   seq はフレーム番号の下位 8 ビット。
+ */
+#define STREAM_MAGIC0 0xA5
+#define STREAM_MAGIC1 0x5A
+#define STREAM_VERSION 1
+#define STREAM_INVALID_SAMPLE (-2048)
+
+enum StreamFrameType {
+  SFRAME_HEADER = 1,
+  SFRAME_SAMPLES = 2,
+};
+
+// 外枠 6 バイト、フレーム番号と時刻 8 バイト、サンプル列、CRC16 2 バイト
+#define STREAM_FRAME_MAX (6 + 8 + STREAM_SAMPLES * 3 / 2 + 2)
+
+struct StreamFrame {
+  uint8_t len; // buf の有効なバイト数
+  uint8_t buf[STREAM_FRAME_MAX];
+};
+
+uint16_t Crc16(const uint8_t *data, size_t len) {
+  uint16_t crc = 0xffff;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= data[i] << 8;
+    for (int b = 0; b < 8; b++) {
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+static uint8_t *PutU16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  return p + 2;
+}
+
+static uint8_t *PutU32(uint8_t *p, uint32_t v) {
+  p = PutU16(p, v);
+  return PutU16(p, v >> 16);
+}
+
+// 外枠を付けて f を完成させる（payload は f->buf + 6 から payload_len バイト書いてあること）
+static void StreamSeal(struct StreamFrame *f, enum StreamFrameType type, uint8_t seq,
+                       uint16_t payload_len) {
+  f->buf[0] = STREAM_MAGIC0;
+  f->buf[1] = STREAM_MAGIC1;
+  f->buf[2] = type;
+  f->buf[3] = seq;
+  PutU16(f->buf + 4, payload_len);
+  PutU16(f->buf + 6 + payload_len, Crc16(f->buf + 2, 4 + payload_len));
+  f->len = 6 + payload_len + 2;
+}
+
+// サンプル列を詰めて SAMPLES フレームを作る
+static void StreamPackSamples(struct StreamFrame *f, uint32_t index, uint32_t start_tick,
+                              const int16_t *samples) {
+  uint8_t *p = PutU32(f->buf + 6, index);
+  p = PutU32(p, start_tick);
+  for (int i = 0; i < STREAM_SAMPLES; i += 2) {
+    const uint16_t a = samples[i] & 0xfff;
+    const uint16_t b = samples[i + 1] & 0xfff;
+    *p++ = a;
+    *p++ = (a >> 8) | (b << 4);
+    *p++ = b >> 4;
+  }
+  StreamSeal(f, SFRAME_SAMPLES, index, p - (f->buf + 6));
+}
+
+/*
+ * UART から何か受信するまで、ADC を最高速度で読み続けてバイナリで送る
+ *
+ * 2 つの読み出し要求を常にキューに積んでおき、I2C バスを休ませない。
+ * 一方が完了すると割り込みハンドラがすぐ他方を始めるので、メインループはその間に
+ * 値を取り出して積み直し、合間に UART へ 1 バイトずつ（待たずに）送る。
+ */
+void CmdAdcStream() {
+  static struct StreamFrame frames[STREAM_FRAMES];
+  uint8_t f_head = 0, f_count = 0, tx_pos = 0;
+  int16_t samples[STREAM_SAMPLES];
+  uint8_t n = 0;
+  uint32_t frame_no = 0, start_tick = 0;
+
+  // ヘッダは待ちながら送ってよい
+  uint8_t *p = frames[0].buf + 6;
+  *p++ = STREAM_VERSION;
+  p = PutU32(p, Ticks_from_Ms(1000));
+  p = PutU16(p, STREAM_SAMPLES);
+  p = PutU32(p, I2C_CLKRATE);
+  StreamSeal(&frames[0], SFRAME_HEADER, 0, p - (frames[0].buf + 6));
+  UartWrite((const char *)frames[0].buf, frames[0].len);
+
+  struct AdcReq reqs[2];
+  uint8_t cur = 0;
+  AdcStartRead(&reqs[0], AdcStampDone);
+  AdcStartRead(&reqs[1], AdcStampDone);
+
+  while ((USART1->STATR & USART_STATR_RXNE) == 0) {
+    struct AdcReq *r = &reqs[cur];
+    const enum I2cReqStatus status = r->i2c.status;
+    if (status == I2CREQ_DONE || status == I2CREQ_ERROR) {
+      if (status == I2CREQ_DONE) {
+        samples[n] = AdcValue(r);
+      } else {
+        samples[n] = STREAM_INVALID_SAMPLE;
+        r->tick = SysTick->CNT;
+      }
+      if (n == 0) {
+        start_tick = r->tick;
+      }
+      n++;
+      AdcStartRead(r, AdcStampDone);
+      cur ^= 1;
+
+      if (n == STREAM_SAMPLES) {
+        if (f_count < STREAM_FRAMES) {
+          StreamPackSamples(&frames[(f_head + f_count) % STREAM_FRAMES], frame_no, start_tick, samples);
+          f_count++;
+        }
+        // 送信待ちが一杯なら、このフレームは捨てる（番号は進める）
+        frame_no++;
+        n = 0;
+      }
+    } else {
+      // 応答が無ければバスを回復する。止まっていた要求だけがエラーで終わる
+      I2cPoll();
+    }
+
+    if (f_count > 0 && UartTxSpace() > 0) {
+      struct StreamFrame *f = &frames[f_head];
+      UartPutChar(f->buf[tx_pos++]);
+      if (tx_pos == f->len) {
+        tx_pos = 0;
+        f_head = (f_head + 1) % STREAM_FRAMES;
+        f_count--;
+      }
+    }
+  }
+  (void)USART1->DATAR;
+
+  // 読み出し中の要求を終わらせ、送りかけのフレームは最後まで送る
+  AdcWait(&reqs[cur]);
+  AdcWait(&reqs[cur ^ 1]);
+  if (f_count > 0) {
+    UartWrite((const char *)frames[f_head].buf + tx_pos, frames[f_head].len - tx_pos);
   }
 }
 
@@ -319,6 +801,14 @@ int main() {
       CmdAdcOnce();
     } else if (strcmp(cmd, "r1000") == 0) {
       CmdAdcMulti(1000);
+    } else if (strncmp(cmd, "f ", 2) == 0) {
+      CmdAdcFilterArgs(cmd + 2);
+    } else if (strcmp(cmd, "t") == 0) {
+      CmdAdcCapture(CAPTURE_PERIOD_US);
+    } else if (strncmp(cmd, "t ", 2) == 0) {
+      CmdAdcCapture(strtoul(cmd + 2, NULL, 0));
+    } else if (strcmp(cmd, "s") == 0) {
+      CmdAdcStream();
     } else if (strcmp(cmd, "rc") == 0) {
       while (1) {
         CmdAdcOnce();
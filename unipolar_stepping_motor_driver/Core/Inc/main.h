@@ -50,6 +50,9 @@ extern "C" {
 /* USER CODE END EM */
 
 /* Exported functions prototypes ---------------------------------------------*/
+
+void HAL_TIM_MspPostInit(TIM_HandleTypeDef *htim);
+
 void Error_Handler(void);
 
 /* USER CODE BEGIN EFP */
@@ -75,6 +78,8 @@ void   MX_GPIO_Init(void);
 void   MX_USART2_UART_Init(void);
 void   MX_TIM3_Init(void);
 void   MX_TIM4_Init(void);
+void   MX_TIM6_Init(void);
+void   MX_TIM7_Init(void);
 /* USER CODE BEGIN Private defines */
 
 /* USER CODE END Private defines */
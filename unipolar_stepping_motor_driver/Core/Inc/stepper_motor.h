@@ -0,0 +1,152 @@
+/*
+ * stepper_motor.h
+ *
+ * ユニポーラステッピングモータの駆動と、加減速の計画
+ *
+ * 動作（セグメント）をモータごとのキューに積むと、プランナ（PlanMotors）がステップ間隔を
+ * 前もって計算し、ステップ間隔のキューに溜める。タイマ割り込み（StepMotor）は、そこから
+ * 次の間隔を 1 つ取り出してコイルの電流を 1 ステップ進めるだけにする。
+ *
+ * プランナは PendSV 割り込み（最低優先度）で動く。StepMotor と、セグメントを積む関数が
+ * PendSV を要求するので、main から直接呼ぶ必要は無い。
+ *
+ * コイルの各相は PWM（TIM3/TIM4 の CH1..4）で駆動する。1 ステップごとに電気角を進め、
+ * 正弦波のテーブルから引いたデューティ比を比較レジスタに書くので、相の電流は
+ * 1 フルステップを 2..STEPPER_MAX_MICROSTEP 分割した階段状の sin/cos になる。
+ *
+ * 協調動作（MoveMotors）は、両方のモータを 1 つのタイマ（TIM6 の StepCoordinated）で進める。
+ * ステップ数の多い方（主軸）の速度プロファイルを計画し、もう一方は主軸のステップに合わせて
+ * Bresenham の方法で進めるので、速度の比が常に移動量の比に保たれる。
+ *
+ * ステップ間隔は平方根を使わない漸化式で求める（D. Austin, "Generate stepper-motor speed
+ * profiles in real time" の c(n+1) = c(n) - 2c(n) / (4n + 1) を、加速度が 1 ステップごとに
+ * 変わってもよい形に直したもの）。加速度一定なら台形、加加速度（jerk）を制限すれば S 字の
+ * 速度プロファイルになる。
+ *
+ * 単位
+ *   ステップ  StepMotor の 1 回の呼び出し（SetMicrostep で設定した 1 マイクロステップ。
+ *             既定はハーフステップ）
+ *   速度      ステップ/秒、加速度はステップ/秒^2、加加速度はステップ/秒^3
+ *             （協調動作では主軸のもの）
+ *   間隔      タイマのカウント数（STEPPER_TIMER_HZ）
+ */
+
+#ifndef INC_STEPPER_MOTOR_H_
+#define INC_STEPPER_MOTOR_H_
+
+#include <stdint.h>
+
+// ステップタイマ（TIM6/TIM7）のカウント周波数
+#define STEPPER_TIMER_HZ 1000000
+
+// 静止状態から脱調せずに起動・停止できる速度（加減速はここから始まり、ここで終わる）
+#define STEPPER_START_SPEED 100
+
+// ステップ間隔の最小値（StepMotor の処理時間より十分長くすること）
+#define STEPPER_MIN_INTERVAL 20
+
+// 止まっている間のタイマの ARR 値（1ms）
+#define STEPPER_IDLE_ARR 999
+
+// 加速度の上限（固定小数点の計算があふれないように）
+#define STEPPER_MAX_ACCEL 1000000
+
+// 加加速度の上限（これより大きいと、1 ステップで加速度が上限まで変わる台形とほぼ同じ）
+#define STEPPER_MAX_JERK 100000000
+
+// セグメントのキューの長さ（2 の冪。積めるのは SEGMENT_QUEUE_LEN - 1 個）
+#define SEGMENT_QUEUE_LEN 8
+
+// ステップ間隔のキューの長さ（2 の冪）
+// 新しいセグメントは、キューに計算済みのステップの後から効くので、長すぎると反応が遅れる
+#define STEP_QUEUE_LEN 16
+
+// コイルの PWM タイマ（TIM3/TIM4）の ARR 値（main.c の MX_TIM3_Init、MX_TIM4_Init と合わせる）
+// 80MHz / (3999 + 1) = 20kHz
+#define STEPPER_PWM_ARR 3999
+
+// 1 フルステップの分割数の最大値（正弦波のテーブルの細かさ。2 の冪）
+#define STEPPER_MAX_MICROSTEP 32
+
+// 分割数の既定値（2 ならハーフステップ）
+#define STEPPER_DEFAULT_MICROSTEP 2
+
+#define NUM_MOTORS 2
+
+/*
+ * 各相の端子（GPIOB のピン番号）を設定する（HAL_Init より前に呼んでよい）
+ *
+ * 端子は 4 本とも同じ PWM タイマのチャネル（TIM3 なら PB4, PB5, PB0, PB1、
+ * TIM4 なら PB6..PB9）であること。
+ * @return  設定できたら 0、PWM を出せない端子なら 1
+ */
+int InitMotor(int motor, int a1, int a2, int b1, int b2);
+
+/*
+ * 1 フルステップの分割数 div（2, 4, .., STEPPER_MAX_MICROSTEP）を設定する
+ *
+ * 速度などの単位（ステップ）が変わるので、止まっている間に設定すること。
+ * @return  設定できたら 0、div が不正か、動作が残っていれば 1
+ */
+int SetMicrostep(int motor, int div);
+
+/*
+ * steps ステップ（符号が向き）移動するセグメントを積む
+ *
+ * 最高速度 speed まで加速度 accel で加速し、止まるか次のセグメントの速度まで減速して終わる。
+ * jerk が 0 なら台形、正なら加速度を jerk で増減させる S 字の速度プロファイルになる。
+ * 次のセグメントが同じ向きなら、止まらずにつなぐ。
+ * @return  積めたら 0、キューが満杯か、協調動作が残っていれば 1
+ */
+int MoveMotor(int motor, int32_t steps, uint32_t speed, uint32_t accel, uint32_t jerk);
+
+/*
+ * 向き dir（1 か -1）に速度 speed で回り続けるセグメントを積む
+ *
+ * 次のセグメントが積まれるまで回り続ける。speed が 0 なら減速して止まる。
+ * @return  積めたら 0、キューが満杯か、協調動作が残っていれば 1
+ */
+int RunMotor(int motor, int dir, uint32_t speed, uint32_t accel, uint32_t jerk);
+
+/*
+ * 全モータをそろえて steps[i] ステップずつ（符号が向き）移動するセグメントを積む
+ *
+ * speed、accel、jerk は移動量の最も大きいモータについての値。
+ * 続けて積んだ協調動作は、全モータの向きが同じなら止まらずにつなぐ。
+ * 個別の動作（MoveMotor、RunMotor）とは混ぜられない。MotorBusy で終わりを待つこと。
+ * @return  積めたら 0、キューが満杯か、個別の動作が残っていれば 1
+ */
+int MoveMotors(const int32_t steps[NUM_MOTORS], uint32_t speed, uint32_t accel, uint32_t jerk);
+
+// SetMotorDirection で設定した向きに、台形の加速で回り始める
+void StartMotor(int motor, uint32_t speed, uint32_t accel);
+// 減速度 decel で止める
+void StopMotor(int motor, uint32_t decel);
+// StartMotor の向き（1 か -1）を設定する
+void SetMotorDirection(int motor, int dir);
+
+// 積んだセグメント（協調動作を含む）が残っているか、回っている間は 1
+int MotorBusy(int motor);
+
+/*
+ * 1 ステップ進める（ステップタイマの割り込みから呼ぶ）
+ *
+ * @return  次のステップまでのタイマの ARR 値。止まっていれば 0
+ *          （協調動作中は、何もせずに STEPPER_IDLE_ARR）
+ */
+uint16_t StepMotor(int motor);
+
+/*
+ * 協調動作を 1 ステップ進める（TIM6 の割り込みから、StepMotor より先に呼ぶ）
+ *
+ * @return  次のステップまでのタイマの ARR 値。協調動作が無ければ 0
+ */
+uint16_t StepCoordinated(void);
+
+// 全相の電流を切る
+void PowerOffMotor(int motor);
+
+// ステップ間隔のキューを埋める（PendSV_Handler から呼ぶ）
+void PlanMotors(void);
+
+#endif /* INC_STEPPER_MOTOR_H_ */
@@ -17,6 +17,8 @@
 
 extern TIM_HandleTypeDef htim3;
 extern TIM_HandleTypeDef htim4;
+extern TIM_HandleTypeDef htim6;
+extern TIM_HandleTypeDef htim7;
 extern UART_HandleTypeDef huart2;
 
 void SystemClock_Config(void);
@@ -30,14 +32,13 @@ void SystemClock_Config(void);
 #define MOTOR_R 0
 #define MOTOR_L 1
 
-unsigned int mcrowne_isqrt(unsigned long val);
-unsigned julery_isqrt(unsigned long val);
-uint32_t julery_isqrt64(uint64_t val);
-//#define ISQRT mcrowne_isqrt
-
 void HAL_TIM_PeriodElapsedCallback (TIM_HandleTypeDef *htim) {
-  if (htim->Instance == htim3.Instance) {
-    uint16_t new_arr = StepMotor(MOTOR_R);
+  if (htim->Instance == htim6.Instance) {
+    // 協調動作（MoveMotors）は TIM6 だけで両方のモータを進める
+    uint16_t new_arr = StepCoordinated();
+    if (new_arr == 0) {
+      new_arr = StepMotor(MOTOR_R);
+    }
     if (new_arr == 0) {
       PowerOffMotor(MOTOR_R);
       // 停止時の制御周期を 1ms とする
@@ -45,7 +46,7 @@ void HAL_TIM_PeriodElapsedCallback (TIM_HandleTypeDef *htim) {
     } else {
       __HAL_TIM_SET_AUTORELOAD(htim, new_arr);
     }
-  } else if (htim->Instance == htim4.Instance) {
+  } else if (htim->Instance == htim7.Instance) {
     uint16_t new_arr = StepMotor(MOTOR_L);
     if (new_arr == 0) {
       PowerOffMotor(MOTOR_L);
@@ -58,6 +59,9 @@ void HAL_TIM_PeriodElapsedCallback (TIM_HandleTypeDef *htim) {
 }
 
 /*
+ * 各相は PWM で駆動する（TIM3 が Motor1、TIM4 が Motor2）
+ * ステップのタイミングは TIM6 が Motor1、TIM7 が Motor2
+ *
  * PB4: Motor1 A1
  * PB5: Motor1 A2
  * PB0: Motor1 B1
@@ -78,17 +82,27 @@ int main(void) {
   /* Configure the system clock */
   SystemClock_Config();
 
+  // 加減速のプランナ（PendSV）はステップタイマの割り込みより低い優先度で動かす
+  HAL_NVIC_SetPriority(PendSV_IRQn, 15, 0);
+
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
   MX_USART2_UART_Init();
   MX_TIM3_Init();
   MX_TIM4_Init();
+  MX_TIM6_Init();
+  MX_TIM7_Init();
   DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
 
   HAL_GPIO_WritePin(GPIOC, GPIO_PIN_9, 0);  // パラレル制御
 
-  HAL_TIM_Base_Start_IT(&htim3);
-  HAL_TIM_Base_Start_IT(&htim4);
+  const uint32_t channels[4] = {TIM_CHANNEL_1, TIM_CHANNEL_2, TIM_CHANNEL_3, TIM_CHANNEL_4};
+  for (int i = 0; i < 4; i++) {
+    HAL_TIM_PWM_Start(&htim3, channels[i]);
+    HAL_TIM_PWM_Start(&htim4, channels[i]);
+  }
+  HAL_TIM_Base_Start_IT(&htim6);
+  HAL_TIM_Base_Start_IT(&htim7);
 
   int dir = 1;
   while (1) {
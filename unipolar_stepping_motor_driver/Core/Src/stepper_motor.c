@@ -0,0 +1,585 @@
+/*
+ * stepper_motor.c
+ *
+ * ユニポーラステッピングモータの駆動と、加減速の計画（stepper_motor.h 参照）
+ */
+
+#include "stepper_motor.h"
+#include "main.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 1/4 周期の正弦波 sin(k * 90° / STEPPER_MAX_MICROSTEP) * 32768（k = 0..STEPPER_MAX_MICROSTEP）
+static const uint16_t kQuarterSine[STEPPER_MAX_MICROSTEP + 1] = {
+      0,  1608,  3212,  4808,  6393,  7962,  9512, 11039,
+  12540, 14010, 15447, 16846, 18205, 19520, 20788, 22006,
+  23170, 24279, 25330, 26320, 27246, 28106, 28899, 29622,
+  30274, 30853, 31357, 31786, 32138, 32413, 32610, 32729,
+  32768,
+};
+
+// 電気角 1 周（4 フルステップ）を何分割するか
+#define MICROSTEP_CYCLE (4 * STEPPER_MAX_MICROSTEP)
+
+// 起動・停止時のステップ間隔（Q16.16）。ARR は 16 ビットなので STEPPER_START_SPEED は 16 以上
+#define START_INTERVAL16 ((uint32_t)(((uint64_t)STEPPER_TIMER_HZ << 16) / STEPPER_START_SPEED))
+#define MIN_INTERVAL16 ((uint32_t)STEPPER_MIN_INTERVAL << 16)
+
+// 漸化式で使うタイマ周波数の 2 乗
+#define TIMER_HZ_SQ ((int64_t)STEPPER_TIMER_HZ * STEPPER_TIMER_HZ)
+
+/*
+ * 協調動作では、ステップ数の多い方（主軸）の速度プロファイルを計画し、各モータは
+ * 主軸の 1 ステップごとに Bresenham の方法で進めるかどうかを決める。
+ * 個別の動作では axis_steps と dir の [0] だけを使う。
+ */
+struct MotionSegment {
+  uint32_t steps; // 主軸の移動量（0 なら次のセグメントが積まれるまで回り続ける）
+  uint32_t axis_steps[NUM_MOTORS]; // 各モータの移動量
+  int8_t dir[NUM_MOTORS];
+  uint32_t speed; // 最高速度（回り続けるセグメントで 0 なら止まる）
+  uint32_t accel;
+  uint32_t jerk;  // 0 なら台形
+};
+
+// ステップ割り込みが 1 回に取り出すもの
+struct StepCmd {
+  uint16_t arr;
+  int8_t dir[NUM_MOTORS]; // 0 ならそのモータは進めない
+};
+
+// 1 つのタイマで進めるステップ列の計画
+struct Planner {
+  uint8_t axes; // 進めるモータの数（個別の動作なら 1）
+
+  // main が seg_head に積み、プランナが seg_tail から取り出す
+  struct MotionSegment segs[SEGMENT_QUEUE_LEN];
+  volatile uint8_t seg_head;
+  volatile uint8_t seg_tail;
+
+  // プランナが step_head に積み、ステップ割り込みが step_tail から取り出す
+  struct StepCmd steps[STEP_QUEUE_LEN];
+  volatile uint8_t step_head;
+  volatile uint8_t step_tail;
+
+  // 以下はプランナの状態
+  volatile uint32_t c16; // 次のステップまでの間隔（Q16.16）。0 なら止まっている
+  int32_t a8;           // 加速度（Q24.8）
+  int8_t dir[NUM_MOTORS];
+  uint8_t loaded;       // segs[seg_tail] を left と bres に読み込んだ
+  uint8_t braking;      // segs[seg_tail] の終わりに向けて減速を始めた
+  uint16_t frac;        // 間隔の小数部の繰り越し
+  uint32_t left;
+  uint32_t bres[NUM_MOTORS]; // Bresenham の誤差の累積
+};
+
+struct Motor {
+  TIM_TypeDef *tim;           // コイルの PWM タイマ
+  volatile uint32_t *ccr[4];  // 各相（A1, B1, A2, B2）の比較レジスタ
+  uint8_t pos;                // 電気角（1 周 MICROSTEP_CYCLE）
+  uint8_t stride;             // 1 ステップで進める pos
+  int8_t run_dir;             // StartMotor の向き
+  struct Planner plan;
+};
+
+static struct Motor motors[NUM_MOTORS];
+static struct Planner coord = {.axes = NUM_MOTORS};
+
+/*
+ * 電気角ごとの cos の正の部分を、比較レジスタの値にしたもの
+ *
+ * 相 i（A1, B1, A2, B2 の順）は電気角が 90° ずつずれているので、どの相も
+ * duty_table[(pos - i * STEPPER_MAX_MICROSTEP) % MICROSTEP_CYCLE] で引ける。
+ */
+static uint16_t duty_table[MICROSTEP_CYCLE];
+
+static void InitDutyTable(void) {
+  for (int i = 0; i < MICROSTEP_CYCLE; i++) {
+    const int k = i % STEPPER_MAX_MICROSTEP;
+    uint32_t s;
+    switch (i / STEPPER_MAX_MICROSTEP) {
+    case 0: s = kQuarterSine[STEPPER_MAX_MICROSTEP - k]; break; // cos(θ) = sin(90° - θ)
+    case 3: s = kQuarterSine[k]; break;                         // cos(270° + x) = sin(x)
+    default: s = 0; break;                                      // 負の半周は反対側の相が受け持つ
+    }
+    // s = 32768 のとき ARR + 1 になり、PWM1 モードで常に High になる
+    duty_table[i] = (s * (STEPPER_PWM_ARR + 1)) >> 15;
+  }
+}
+
+// GPIOB の端子を出力にできる PWM タイマ（AF2）のチャネル
+static volatile uint32_t *PinCcr(int pin, TIM_TypeDef **tim) {
+  switch (pin) {
+  case 4: *tim = TIM3; return &TIM3->CCR1;
+  case 5: *tim = TIM3; return &TIM3->CCR2;
+  case 0: *tim = TIM3; return &TIM3->CCR3;
+  case 1: *tim = TIM3; return &TIM3->CCR4;
+  case 6: *tim = TIM4; return &TIM4->CCR1;
+  case 7: *tim = TIM4; return &TIM4->CCR2;
+  case 8: *tim = TIM4; return &TIM4->CCR3;
+  case 9: *tim = TIM4; return &TIM4->CCR4;
+  default: return NULL;
+  }
+}
+
+int InitMotor(int motor, int a1, int a2, int b1, int b2) {
+  struct Motor *m = &motors[motor];
+  const int pins[4] = {a1, b1, a2, b2};
+  TIM_TypeDef *tim[4];
+  for (int i = 0; i < 4; i++) {
+    m->ccr[i] = PinCcr(pins[i], &tim[i]);
+    if (m->ccr[i] == NULL || tim[i] != tim[0]) {
+      return 1;
+    }
+  }
+  InitDutyTable();
+  m->tim = tim[0];
+  m->pos = 0;
+  m->stride = STEPPER_MAX_MICROSTEP / STEPPER_DEFAULT_MICROSTEP;
+  m->run_dir = 1;
+  m->plan.axes = 1;
+  return 0;
+}
+
+int SetMicrostep(int motor, int div) {
+  if (div < 2 || div > STEPPER_MAX_MICROSTEP || (div & (div - 1)) != 0) {
+    return 1;
+  }
+  if (MotorBusy(motor)) {
+    return 1;
+  }
+  motors[motor].stride = STEPPER_MAX_MICROSTEP / div;
+  return 0;
+}
+
+/*
+ * 電気角 pos の電流にする
+ *
+ * 比較レジスタはプリロードされ、PWM 周期の切れ目（更新イベント）で効く。4 相の書き換えの途中で
+ * 更新イベントが来ると 1 周期だけ新旧の値が混ざるので、書き換えの間は UDIS で更新を止める。
+ */
+static void Energize(struct Motor *m) {
+  m->tim->CR1 |= TIM_CR1_UDIS;
+  for (int i = 0; i < 4; i++) {
+    *m->ccr[i] = duty_table[(m->pos - i * STEPPER_MAX_MICROSTEP) & (MICROSTEP_CYCLE - 1)];
+  }
+  m->tim->CR1 &= ~TIM_CR1_UDIS;
+}
+
+void PowerOffMotor(int motor) {
+  struct Motor *m = &motors[motor];
+  for (int i = 0; i < 4; i++) {
+    *m->ccr[i] = 0;
+  }
+}
+
+static int PlannerBusy(const struct Planner *p) {
+  return p->seg_head != p->seg_tail || p->step_head != p->step_tail || p->c16 != 0;
+}
+
+// 次のステップを取り出す。空なら 0 を返す
+static int PopStep(struct Planner *p, struct StepCmd *s) {
+  const uint8_t tail = p->step_tail;
+  if (tail == p->step_head) {
+    return 0;
+  }
+  *s = p->steps[tail];
+  p->step_tail = (tail + 1) & (STEP_QUEUE_LEN - 1);
+  // 半分まで減ったらプランナに埋めてもらう
+  if (((p->step_head - p->step_tail) & (STEP_QUEUE_LEN - 1)) == STEP_QUEUE_LEN / 2) {
+    SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+  }
+  return 1;
+}
+
+// 電気角を 1 ステップ（1 マイクロステップ）進める
+static void Advance(struct Motor *m, int8_t dir) {
+  m->pos = (m->pos + dir * m->stride) & (MICROSTEP_CYCLE - 1);
+  Energize(m);
+}
+
+uint16_t StepMotor(int motor) {
+  struct Motor *m = &motors[motor];
+  struct StepCmd s;
+  if (!PopStep(&m->plan, &s)) {
+    // 協調動作中は StepCoordinated が進めるので、励磁を切らせない
+    return PlannerBusy(&coord) ? STEPPER_IDLE_ARR : 0;
+  }
+  Advance(m, s.dir[0]);
+  return s.arr;
+}
+
+uint16_t StepCoordinated(void) {
+  struct StepCmd s;
+  if (!PopStep(&coord, &s)) {
+    return 0;
+  }
+  for (int i = 0; i < NUM_MOTORS; i++) {
+    if (s.dir[i]) {
+      Advance(&motors[i], s.dir[i]);
+    }
+  }
+  return s.arr;
+}
+
+static int PushSegment(struct Planner *p, const struct MotionSegment *seg) {
+  const uint8_t head = p->seg_head;
+  const uint8_t next = (head + 1) & (SEGMENT_QUEUE_LEN - 1);
+  if (next == p->seg_tail) {
+    return 1;
+  }
+  p->segs[head] = *seg;
+  __DMB();
+  p->seg_head = next;
+  SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+  return 0;
+}
+
+static uint32_t ClampSpeed(uint32_t speed) {
+  if (speed < STEPPER_START_SPEED) {
+    return STEPPER_START_SPEED;
+  }
+  if (speed > STEPPER_TIMER_HZ / STEPPER_MIN_INTERVAL) {
+    return STEPPER_TIMER_HZ / STEPPER_MIN_INTERVAL;
+  }
+  return speed;
+}
+
+static uint32_t ClampAccel(uint32_t accel) {
+  if (accel == 0) {
+    return 1;
+  }
+  return accel > STEPPER_MAX_ACCEL ? STEPPER_MAX_ACCEL : accel;
+}
+
+static uint32_t ClampJerk(uint32_t jerk) {
+  return jerk > STEPPER_MAX_JERK ? STEPPER_MAX_JERK : jerk;
+}
+
+int MoveMotor(int motor, int32_t steps, uint32_t speed, uint32_t accel, uint32_t jerk) {
+  if (steps == 0) {
+    return 0;
+  }
+  if (PlannerBusy(&coord)) {
+    return 1;
+  }
+  struct MotionSegment seg = {
+    .steps = steps < 0 ? -steps : steps,
+    .axis_steps = {steps < 0 ? -steps : steps},
+    .dir = {steps < 0 ? -1 : 1},
+    .speed = ClampSpeed(speed),
+    .accel = ClampAccel(accel),
+    .jerk = ClampJerk(jerk),
+  };
+  return PushSegment(&motors[motor].plan, &seg);
+}
+
+int RunMotor(int motor, int dir, uint32_t speed, uint32_t accel, uint32_t jerk) {
+  if (PlannerBusy(&coord)) {
+    return 1;
+  }
+  struct MotionSegment seg = {
+    .steps = 0,
+    .dir = {dir < 0 ? -1 : 1},
+    .speed = speed ? ClampSpeed(speed) : 0,
+    .accel = ClampAccel(accel),
+    .jerk = ClampJerk(jerk),
+  };
+  return PushSegment(&motors[motor].plan, &seg);
+}
+
+int MoveMotors(const int32_t steps[NUM_MOTORS], uint32_t speed, uint32_t accel, uint32_t jerk) {
+  struct MotionSegment seg = {
+    .speed = ClampSpeed(speed),
+    .accel = ClampAccel(accel),
+    .jerk = ClampJerk(jerk),
+  };
+  for (int i = 0; i < NUM_MOTORS; i++) {
+    if (PlannerBusy(&motors[i].plan)) {
+      return 1;
+    }
+    seg.axis_steps[i] = steps[i] < 0 ? -steps[i] : steps[i];
+    seg.dir[i] = steps[i] < 0 ? -1 : 1;
+    if (seg.axis_steps[i] > seg.steps) {
+      seg.steps = seg.axis_steps[i];
+    }
+  }
+  if (seg.steps == 0) {
+    return 0;
+  }
+  return PushSegment(&coord, &seg);
+}
+
+void StartMotor(int motor, uint32_t speed, uint32_t accel) {
+  RunMotor(motor, motors[motor].run_dir, speed, accel, 0);
+}
+
+void StopMotor(int motor, uint32_t decel) {
+  RunMotor(motor, motors[motor].run_dir, 0, decel, 0);
+}
+
+void SetMotorDirection(int motor, int dir) {
+  motors[motor].run_dir = dir < 0 ? -1 : 1;
+}
+
+int MotorBusy(int motor) {
+  return PlannerBusy(&motors[motor].plan) || PlannerBusy(&coord);
+}
+
+/*************************
+ * プランナ（PendSV で動く）
+ *************************/
+
+static const struct MotionSegment *NextSegment(const struct Planner *p) {
+  const uint8_t next = (p->seg_tail + 1) & (SEGMENT_QUEUE_LEN - 1);
+  return next == p->seg_head ? NULL : &p->segs[next];
+}
+
+static void PopSegment(struct Planner *p) {
+  p->seg_tail = (p->seg_tail + 1) & (SEGMENT_QUEUE_LEN - 1);
+  p->loaded = 0;
+  p->braking = 0;
+}
+
+static uint32_t Speed(uint32_t c16) {
+  return ((uint32_t)STEPPER_TIMER_HZ << 8) / (c16 >> 8);
+}
+
+/*
+ * 今の速度から v_end まで減速するのに要るステップ数（多めに見積もる）
+ *
+ * 台形なら (v^2 - v_end^2) / 2A。S 字では加速度を 0 に戻す分と、減速度を A まで上げ下げする分
+ * （(v + v_end) A / 2j）を足す。速度差が小さく A まで届かない場合も、相加相乗平均の関係から
+ * この式は実際より大きくなる。
+ */
+static uint32_t StopSteps(const struct Planner *p, const struct MotionSegment *seg, uint32_t v_end) {
+  uint64_t v = Speed(p->c16);
+  if (v_end < STEPPER_START_SPEED) {
+    v_end = STEPPER_START_SPEED;
+  }
+  uint64_t d = 1;
+  if (seg->jerk && p->a8 > 0) {
+    const uint64_t a = p->a8 >> 8;
+    d += v * a / seg->jerk;
+    v += a * a / (2 * seg->jerk);
+  }
+  if (v <= v_end) {
+    return d;
+  }
+  d += (v * v - (uint64_t)v_end * v_end) / (2 * seg->accel);
+  if (seg->jerk) {
+    d += (v + v_end) * seg->accel / (2 * seg->jerk);
+  }
+  return d > UINT32_MAX ? UINT32_MAX : d;
+}
+
+// 速度 target に向けて加速度 p->a8 を決める
+static void UpdateAccel(struct Planner *p, const struct MotionSegment *seg, uint32_t target) {
+  const int32_t err = (int32_t)target - (int32_t)Speed(p->c16);
+  const int32_t a_max8 = seg->accel << 8;
+  if (seg->jerk == 0) {
+    p->a8 = err > 0 ? a_max8 : err < 0 ? -a_max8 : 0;
+    return;
+  }
+
+  // 1 ステップの間の加速度の変化 j * c / f と、今の加速度を 0 に戻す間に変わる速度 a^2 / 2j
+  // （どちらも加速度の上限で頭打ちにしてから int32_t に収める）
+  const uint64_t da = (uint64_t)seg->jerk * p->c16 / ((uint32_t)STEPPER_TIMER_HZ << 8);
+  const int32_t da8 = da > (uint64_t)a_max8 ? a_max8 : (int32_t)da;
+  const int64_t v_ramp64 = ((int64_t)p->a8 * p->a8 / (2 * (int64_t)seg->jerk)) >> 16;
+  const int32_t v_ramp = v_ramp64 > INT32_MAX ? INT32_MAX : (int32_t)v_ramp64;
+  if (err > 0) {
+    if (p->a8 > 0 && err <= v_ramp) {
+      p->a8 = p->a8 > da8 ? p->a8 - da8 : 0;
+    } else {
+      p->a8 = p->a8 + da8 < a_max8 ? p->a8 + da8 : a_max8;
+    }
+  } else if (err < 0) {
+    if (p->a8 < 0 && -err <= v_ramp) {
+      p->a8 = p->a8 < -da8 ? p->a8 + da8 : 0;
+    } else {
+      p->a8 = p->a8 - da8 > -a_max8 ? p->a8 - da8 : -a_max8;
+    }
+  } else if (p->a8 > 0) {
+    p->a8 = p->a8 > da8 ? p->a8 - da8 : 0;
+  } else {
+    p->a8 = p->a8 < -da8 ? p->a8 + da8 : 0;
+  }
+}
+
+/*
+ * 加速度 a8 で 1 ステップ進んだ後の間隔
+ *
+ * 1 ステップで v'^2 = v^2 + 2a なので、正確には c' = c / sqrt(1 + 2q)（q = a c^2 / f^2）。
+ * Austin の漸化式 c' = c - 2c / (4n + 1) は、n = 1 / 2q を代入すると c' = c - 2c q / (2 + q) で、
+ * これは q の 2 次の項で誤差を持ち、減速の終わりで遅れが溜まる。ここでは同じく割り算 1 回で済む
+ * パデ近似 c' = c - 2c q / (2 + 3q) を使う（誤差は q の 3 次）。n を数えないので、
+ * 加速度がステップごとに変わってもよい。
+ * q を ±1/2（n = ±1 相当）に制限して、近似が成り立たない低速での急な加減速を抑える。
+ */
+static uint32_t NextInterval(uint32_t c16, int32_t a8) {
+  // 高速では 1 ステップの変化が小さいので、c は小数部 4 ビットまで使う
+  const int64_t c4 = c16 >> 12;
+  int64_t ac2 = ((((int64_t)a8 * c4) >> 8) * c4) >> 8;
+  if (ac2 > TIMER_HZ_SQ / 2) {
+    ac2 = TIMER_HZ_SQ / 2;
+  } else if (ac2 < -TIMER_HZ_SQ / 2) {
+    ac2 = -TIMER_HZ_SQ / 2;
+  }
+  const int64_t r20 = (2 * ac2 << 20) / (2 * TIMER_HZ_SQ + 3 * ac2);
+  return c16 - (((int64_t)c16 * r20) >> 20);
+}
+
+static int SameDirection(const struct Planner *p, const int8_t *a, const int8_t *b) {
+  for (int i = 0; i < p->axes; i++) {
+    if (a[i] != b[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// seg が NULL なら、全モータを p->dir の向きに 1 ステップ進める（逆転前の減速）
+static void PushStep(struct Planner *p, const struct MotionSegment *seg) {
+  const uint32_t c = p->c16 + p->frac;
+  p->frac = c & 0xffff;
+  struct StepCmd *s = &p->steps[p->step_head];
+  s->arr = (c >> 16) - 1;
+  for (int i = 0; i < p->axes; i++) {
+    s->dir[i] = p->dir[i];
+    if (seg && seg->steps != 0) {
+      // 主軸の 1 ステップごとに axis_steps / steps ずつ進める
+      p->bres[i] += seg->axis_steps[i];
+      if (p->bres[i] >= seg->steps) {
+        p->bres[i] -= seg->steps;
+      } else {
+        s->dir[i] = 0;
+      }
+    }
+  }
+  __DMB();
+  p->step_head = (p->step_head + 1) & (STEP_QUEUE_LEN - 1);
+}
+
+// 1 ステップ分を計画してキューに積む。何もすることが無ければ 0 を返す
+static int PlanStep(struct Planner *p) {
+  const struct MotionSegment *seg;
+  uint32_t target; // 目標速度（0 なら止まる）
+  uint32_t v_end = 0;
+  int reversing; // 逆向きのセグメントに移る前の減速中
+  while (1) {
+    if (p->seg_tail == p->seg_head) {
+      p->c16 = 0;
+      return 0;
+    }
+    seg = &p->segs[p->seg_tail];
+    const struct MotionSegment *next = NextSegment(p);
+    // 今の向きで止まるまでのステップは seg の移動量に数えないので、止まってから読み込む
+    reversing = p->c16 != 0 && !SameDirection(p, p->dir, seg->dir);
+    if (!p->loaded && !reversing) {
+      p->left = seg->steps;
+      for (int i = 0; i < p->axes; i++) {
+        p->bres[i] = seg->steps / 2;
+      }
+      p->loaded = 1;
+    }
+
+    if (reversing) {
+      target = 0;
+    } else if (seg->steps == 0) {
+      if (next) {
+        PopSegment(p);
+        continue;
+      }
+      target = seg->speed;
+      if (target == 0 && p->c16 == 0) {
+        PopSegment(p);
+        continue;
+      }
+    } else {
+      if (p->left == 0) {
+        PopSegment(p);
+        continue;
+      }
+      if (next && SameDirection(p, next->dir, seg->dir) && next->speed != 0) {
+        v_end = next->speed < seg->speed ? next->speed : seg->speed;
+      }
+      target = seg->speed;
+      if (p->c16 != 0 && !p->braking && p->left <= StopSteps(p, seg, v_end)) {
+        p->braking = 1;
+      }
+      if (p->braking) {
+        target = v_end > STEPPER_START_SPEED ? v_end : STEPPER_START_SPEED;
+      }
+    }
+    break;
+  }
+
+  if (p->c16 == 0) {
+    for (int i = 0; i < p->axes; i++) {
+      p->dir[i] = seg->dir[i];
+    }
+    p->c16 = START_INTERVAL16;
+    p->a8 = 0;
+    p->frac = 0;
+  }
+  if (reversing) {
+    PushStep(p, NULL);
+  } else {
+    PushStep(p, seg);
+    if (seg->steps != 0) {
+      p->left--;
+    }
+  }
+
+  // 次のステップまでの間隔を決める
+  if ((target == 0 && Speed(p->c16) <= STEPPER_START_SPEED)
+      || (!reversing && seg->steps != 0 && p->left == 0 && v_end == 0)) {
+    p->c16 = 0;
+    p->a8 = 0;
+    return 1;
+  }
+  const uint32_t t = target > STEPPER_START_SPEED ? target : STEPPER_START_SPEED;
+  const uint32_t c_target = (((uint32_t)STEPPER_TIMER_HZ << 8) / t) << 8;
+  UpdateAccel(p, seg, t);
+  if (p->braking && (seg->jerk == 0 || p->a8 <= -(int32_t)(seg->accel << 8))) {
+    // 近似と整数化の誤差で減速が遅れないよう、残りのステップ数でちょうど t になる減速度にする。
+    // S 字では、減速度が上限まで立ち上がっている間だけ、足りない分を強める
+    const uint64_t v = Speed(p->c16);
+    if (v > t) {
+      uint64_t need8 = ((v * v - (uint64_t)t * t) << 8) / (2 * p->left);
+      if (need8 > (uint64_t)STEPPER_MAX_ACCEL << 9) {
+        need8 = (uint64_t)STEPPER_MAX_ACCEL << 9;
+      }
+      if (seg->jerk == 0 || -(int32_t)need8 < p->a8) {
+        p->a8 = -(int32_t)need8;
+      }
+    }
+  }
+  uint32_t c16 = NextInterval(p->c16, p->a8);
+  // 目標の間隔を越えたら合わせる。S 字では減速を始めてもしばらく加速度が正のままなので、
+  // 加速度の符号ではなく、目標が今の間隔のどちら側にあるかで判断する
+  if ((p->c16 > c_target && c16 <= c_target) || (p->c16 < c_target && c16 >= c_target)) {
+    c16 = c_target;
+    p->a8 = 0;
+  }
+  if (c16 < MIN_INTERVAL16) {
+    c16 = MIN_INTERVAL16;
+  } else if (c16 > START_INTERVAL16) {
+    c16 = START_INTERVAL16;
+  }
+  p->c16 = c16;
+  return 1;
+}
+
+static void FillSteps(struct Planner *p) {
+  while (((p->step_head + 1) & (STEP_QUEUE_LEN - 1)) != p->step_tail && PlanStep(p));
+}
+
+void PlanMotors(void) {
+  for (int i = 0; i < NUM_MOTORS; i++) {
+    FillSteps(&motors[i].plan);
+  }
+  FillSteps(&coord);
+}
@@ -0,0 +1,32 @@
+/*
+ * ホストで stepper_motor.c をビルドするための main.h の代わり
+ *
+ * stepper_motor.c が触るレジスタだけを、ただの変数として用意する。
+ */
+
+#ifndef HOST_MAIN_H_
+#define HOST_MAIN_H_
+
+#include <stdint.h>
+
+typedef struct {
+  volatile uint32_t ICSR;
+} SCB_Type;
+
+typedef struct {
+  volatile uint32_t CR1, CCR1, CCR2, CCR3, CCR4;
+} TIM_TypeDef;
+
+extern SCB_Type mock_scb;
+extern TIM_TypeDef mock_tim3, mock_tim4;
+
+#define SCB (&mock_scb)
+#define TIM3 (&mock_tim3)
+#define TIM4 (&mock_tim4)
+
+#define SCB_ICSR_PENDSVSET_Msk (1u << 28)
+#define TIM_CR1_UDIS (1u << 1)
+
+#define __DMB() __asm__ volatile("" ::: "memory")
+
+#endif /* HOST_MAIN_H_ */
@@ -0,0 +1,272 @@
+/*
+ * stepper_motor.c のプランナのテスト
+ *
+ * ステップタイマの割り込み（StepMotor、StepCoordinated）と PendSV（PlanMotors）を順に呼んで
+ * 動作を最後まで進め、ステップ数、最高速度、終わりの速度、所要時間を確かめる。
+ * 速度は StepMotor が返した ARR 値から求める（1 ステップの間隔の逆数）。
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "stepper_motor.h"
+
+SCB_Type mock_scb;
+TIM_TypeDef mock_tim3, mock_tim4;
+
+static int failures;
+static int verbose;
+
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+    ++failures; \
+  } \
+} while (0)
+
+struct Run {
+  uint32_t steps;
+  double peak;      // 最高速度（ステップ/秒）
+  double end;       // 最後のステップの後の間隔から求めた速度
+  double min_mid;   // 最初と最後の 1/10 を除いた区間の最低速度
+  double seconds;   // 所要時間
+  uint32_t forward;  // モータ 0 が正の向きに進んだステップ数
+  uint32_t backward; // モータ 0 が負の向きに進んだステップ数
+};
+
+// モータ 0 の電気角（1 周 4 * STEPPER_MAX_MICROSTEP）。TIM3 の比較レジスタから読み取る
+static int last_angle;
+
+static int MotorAngle(void) {
+  const double a = (double)mock_tim3.CCR1 - mock_tim3.CCR2; // A1 - A2
+  const double b = (double)mock_tim3.CCR3 - mock_tim3.CCR4; // B1 - B2
+  const int cycle = 4 * STEPPER_MAX_MICROSTEP;
+  return ((int)lround(atan2(b, a) / (2 * M_PI) * cycle) + cycle) % cycle;
+}
+
+// 電気角の変化からモータ 0 の進んだ向きを数える（1 ステップは 1/4 周より小さいので向きが分かる）
+static void TrackMotor(struct Run *r) {
+  const int cycle = 4 * STEPPER_MAX_MICROSTEP;
+  const int angle = MotorAngle();
+  int d = (angle - last_angle + cycle) % cycle;
+  if (d >= cycle / 2) {
+    d -= cycle;
+  }
+  last_angle = angle;
+  if (d > 0) {
+    r->forward++;
+  } else if (d < 0) {
+    r->backward++;
+  }
+}
+
+// 要求された PendSV を実行する
+static void PendSV(void) {
+  if (mock_scb.ICSR & SCB_ICSR_PENDSVSET_Msk) {
+    mock_scb.ICSR = 0;
+    PlanMotors();
+  }
+}
+
+static void Reset(void) {
+  InitMotor(0, 4, 5, 0, 1);
+  InitMotor(1, 6, 7, 9, 8);
+  PowerOffMotor(0);
+  PowerOffMotor(1);
+  last_angle = 0;
+}
+
+// 回り続けている間に、StepMotor(0) を n 回呼ぶ
+static struct Run Steps(uint32_t n) {
+  struct Run r = {0};
+  PendSV();
+  for (uint32_t i = 0; i < n; i++) {
+    if (StepMotor(0)) {
+      r.steps++;
+      TrackMotor(&r);
+    }
+    PendSV();
+  }
+  return r;
+}
+
+/*
+ * 積んだ動作を止まるまで進める
+ * coordinated なら StepCoordinated、そうでなければ StepMotor(0) を割り込みとして呼ぶ。
+ * expect_steps は min_mid を測る区間を決めるためのもの。
+ */
+static struct Run Finish(int coordinated, uint32_t expect_steps) {
+  struct Run r = {.min_mid = 1e9};
+  uint16_t *arrs = malloc(sizeof(uint16_t) * (expect_steps + 1));
+  PendSV();
+  for (long guard = 0; guard < 10000000; guard++) {
+    const uint16_t arr = coordinated ? StepCoordinated() : StepMotor(0);
+    PendSV();
+    if (arr == 0) {
+      if (!MotorBusy(0)) {
+        break;
+      }
+      continue;
+    }
+    const double v = (double)STEPPER_TIMER_HZ / (arr + 1);
+    if (r.steps <= expect_steps) {
+      arrs[r.steps] = arr;
+    }
+    r.steps++;
+    TrackMotor(&r);
+    r.seconds += 1.0 / v;
+    if (v > r.peak) {
+      r.peak = v;
+    }
+    r.end = v;
+  }
+  const uint32_t n = r.steps < expect_steps ? r.steps : expect_steps;
+  for (uint32_t i = n / 10; i < n - n / 10; i++) {
+    const double v = (double)STEPPER_TIMER_HZ / (arrs[i] + 1);
+    if (v < r.min_mid) {
+      r.min_mid = v;
+    }
+  }
+  free(arrs);
+  if (verbose) {
+    printf("  steps=%u peak=%.0f end=%.0f min_mid=%.0f time=%.2fs\n",
+           r.steps, r.peak, r.end, r.min_mid, r.seconds);
+  }
+  return r;
+}
+
+// 止まってから次を始めたときの速度の上限（起動速度 + 近似の誤差）
+#define END_SPEED_MAX (STEPPER_START_SPEED * 1.1)
+
+// 台形: 最高速度に届かない移動と、届く移動
+static void TestTrapezoid(void) {
+  Reset();
+  CHECK(MoveMotor(0, 20000, 20000, 1000, 0) == 0);
+  struct Run r = Finish(0, 20000);
+  CHECK(r.steps == 20000);
+  // v = sqrt(2 * 1000 * 10000) ≒ 4472
+  CHECK(r.peak > 4300 && r.peak < 4600);
+  CHECK(r.end <= END_SPEED_MAX);
+  CHECK(r.seconds < 10);
+
+  CHECK(MoveMotor(0, 40000, 2000, 1000, 0) == 0);
+  r = Finish(0, 40000);
+  CHECK(r.steps == 40000);
+  CHECK(r.peak > 1990 && r.peak < 2010);
+  CHECK(r.end <= END_SPEED_MAX);
+}
+
+// S 字: 台形より少し遅いが、減速の始めに速度が飛ばないこと
+static void TestSCurve(void) {
+  Reset();
+  CHECK(MoveMotor(0, 20000, 20000, 1000, 100000) == 0);
+  struct Run r = Finish(0, 20000);
+  CHECK(r.steps == 20000);
+  CHECK(r.peak > 3500 && r.peak < 4600);
+  CHECK(r.min_mid > 1000);
+  CHECK(r.end <= END_SPEED_MAX);
+  CHECK(r.seconds < 12);
+
+  CHECK(MoveMotor(0, 40000, 2000, 1000, 2000) == 0);
+  r = Finish(0, 40000);
+  CHECK(r.steps == 40000);
+  CHECK(r.peak > 1990 && r.peak < 2010);
+  CHECK(r.end <= END_SPEED_MAX);
+}
+
+// 加加速度が大きすぎても、台形と同じように加減速すること
+static void TestHugeJerk(void) {
+  Reset();
+  CHECK(MoveMotor(0, 20000, 20000, 1000, 1000000000) == 0);
+  struct Run r = Finish(0, 20000);
+  CHECK(r.steps == 20000);
+  CHECK(r.peak > 4300 && r.peak < 4600);
+  CHECK(r.end <= END_SPEED_MAX);
+
+  // 加速度も上限だと、低速では漸化式の制限で減速しきれない。台形と同程度に止まればよい
+  CHECK(MoveMotor(0, 20000, 20000, STEPPER_MAX_ACCEL, 0) == 0);
+  const struct Run trapezoid = Finish(0, 20000);
+  CHECK(MoveMotor(0, 20000, 20000, STEPPER_MAX_ACCEL, UINT32_MAX) == 0);
+  r = Finish(0, 20000);
+  CHECK(r.steps == 20000);
+  CHECK(r.peak > 19900);
+  CHECK(r.end <= 2 * trapezoid.end);
+}
+
+// 同じ向きのセグメントは止まらずにつなぐ
+static void TestBlend(void) {
+  for (uint32_t jerk = 0; jerk <= 20000; jerk += 20000) {
+    Reset();
+    CHECK(MoveMotor(0, 5000, 2000, 2000, jerk) == 0);
+    CHECK(MoveMotor(0, 5000, 1000, 2000, jerk) == 0);
+    struct Run r = Finish(0, 10000);
+    CHECK(r.steps == 10000);
+    CHECK(r.forward == 10000);
+    CHECK(r.peak > 1990 && r.peak < 2010);
+    CHECK(r.min_mid > 900);
+    CHECK(r.end <= END_SPEED_MAX);
+  }
+}
+
+/*
+ * 回っているときに逆向きの移動を積むと、今の向きで止まってから移動量だけ戻る
+ * （止まるまでのステップは移動量に数えない）
+ */
+static void TestReverse(void) {
+  Reset();
+  CHECK(RunMotor(0, 1, 1000, 1000, 0) == 0);
+  struct Run r = Steps(3000);
+  CHECK(r.forward == 3000 && r.backward == 0);
+  CHECK(MoveMotor(0, -5000, 1000, 1000, 0) == 0);
+  r = Finish(0, 5500);
+  // 1000 ステップ/秒から 1000 ステップ/秒^2 で止まるには約 500 ステップ
+  CHECK(r.forward > 400 && r.forward < 600);
+  CHECK(r.backward == 5000);
+  CHECK(r.end <= END_SPEED_MAX);
+
+  // StopMotor の後でも同じ（止まるまでの減速は、次に積んだ移動の加速度と加加速度で行う）
+  Reset();
+  SetMotorDirection(0, 1);
+  StartMotor(0, 1000, 1000);
+  Steps(3000);
+  StopMotor(0, 1000);
+  CHECK(MoveMotor(0, -5000, 1000, 1000, 2000) == 0);
+  r = Finish(0, 5800);
+  // S 字なので (1000 + 100) * 1000 / (2 * 2000) ≒ 275 ステップ長い
+  CHECK(r.forward > 700 && r.forward < 850);
+  CHECK(r.backward == 5000);
+  CHECK(r.end <= END_SPEED_MAX);
+}
+
+// 協調動作: 主軸のステップ数だけ進み、主軸の速度プロファイルになる
+static void TestCoordinated(void) {
+  Reset();
+  const int32_t steps[NUM_MOTORS] = {3000, -1000};
+  CHECK(MoveMotors(steps, 1500, 3000, 0) == 0);
+  CHECK(MoveMotor(0, 10, 100, 100, 0) == 1);
+  struct Run r = Finish(1, 3000);
+  CHECK(r.steps == 3000);
+  CHECK(r.peak > 1490 && r.peak < 1510);
+  CHECK(r.end <= END_SPEED_MAX);
+  CHECK(!MotorBusy(0) && !MotorBusy(1));
+}
+
+int main(int argc, char **argv) {
+  verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+  TestTrapezoid();
+  TestSCurve();
+  TestHugeJerk();
+  TestBlend();
+  TestReverse();
+  TestCoordinated();
+
+  if (failures) {
+    printf("%d failure(s)\n", failures);
+    return 1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}